@@ -0,0 +1,247 @@
+#include "./admit.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+
+/*
+ * A command takes a slot without a lock while one is free and nobody waits.
+ * Otherwise it takes gate.mutex and joins the line, in which only the head
+ * tries for a slot, so slots go in order of arrival. A command leaving its
+ * slot decrements running before it reads queued, and a waiter increments
+ * queued before it reads running (both sequentially consistent), so either
+ * the leaver sees the waiter and wakes the head, or the waiter sees the slot
+ * free. Waiters cannot be cancelled, as they are on the line by address, but
+ * the deadline bounds their wait.
+ */
+
+#define ADMIT_QUEUE_PER_SLOT 4
+#define ADMIT_WAIT_MS 50
+
+typedef struct waiter {
+    pthread_cond_t cond;
+    struct waiter *prev;
+    struct waiter *next;
+} waiter_t;
+
+static int max_sessions;
+static int slots;
+static int max_queue;
+static uint64_t max_wait;  // ns
+static pthread_condattr_t monotonic;
+
+static struct {
+    int running;
+    int queued;
+    unsigned long admitted;
+    uint64_t service;  // moving average of a command's time in a slot, ns
+    pthread_mutex_t mutex;
+    waiter_t *head;
+    waiter_t *tail;
+} gate = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static struct {
+    int sessions;
+    unsigned long refused;
+    unsigned long waited;
+    uint64_t wait_ns;
+    uint64_t wait_max;
+    unsigned long shed_full;
+    unsigned long shed_late;
+    unsigned long paused;
+} stats;
+
+static __thread uint64_t entered;  // when this thread's command took its slot
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void admit_init(int sessions, int nslots, int queue, int wait_ms) {
+    max_sessions = sessions;
+    slots = nslots;
+    max_queue = queue > 0 ? queue : nslots * ADMIT_QUEUE_PER_SLOT;
+    max_wait = (uint64_t)(wait_ms > 0 ? wait_ms : ADMIT_WAIT_MS) * 1000000;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+}
+
+int admit_session(void) {
+    int n = __atomic_add_fetch(&stats.sessions, 1, __ATOMIC_RELAXED);
+    if (max_sessions > 0 && n > max_sessions) {
+        __atomic_sub_fetch(&stats.sessions, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.refused, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+void admit_session_end(void) {
+    __atomic_sub_fetch(&stats.sessions, 1, __ATOMIC_RELAXED);
+}
+
+void admit_refuse(int fd) {
+    static const char busy[] = ADMIT_BUSY "\n";
+    char drain[BUFLEN];
+    if (write(fd, busy, sizeof(busy) - 1) >= 0) {
+        // closing with unread input would reset the connection, and the
+        // client might lose the answer; take what it has sent so far
+        shutdown(fd, SHUT_WR);
+        while (recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+        }
+    }
+    if (close(fd) < 0) perror("close");
+}
+
+static int take_slot(void) {
+    int r = __atomic_load_n(&gate.running, __ATOMIC_RELAXED);
+    while (r < slots) {
+        if (__atomic_compare_exchange_n(&gate.running, &r, r + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// joins the line for a slot at time arrival; returns 0 with a slot, or -1
+static int wait_slot(uint64_t arrival) {
+    waiter_t w;
+    int ret = -1, oldstate;
+
+    pthread_mutex_lock(&gate.mutex);
+    int q = gate.queued;
+    uint64_t expect =
+        (q + 1) * __atomic_load_n(&gate.service, __ATOMIC_RELAXED) / slots;
+    if (q >= max_queue || expect > max_wait) {
+        pthread_mutex_unlock(&gate.mutex);
+        __atomic_add_fetch(&stats.shed_full, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_cond_init(&w.cond, &monotonic);
+    w.prev = gate.tail;
+    w.next = NULL;
+    if (gate.tail != NULL) {
+        gate.tail->next = &w;
+    } else {
+        gate.head = &w;
+    }
+    gate.tail = &w;
+    __atomic_store_n(&gate.queued, q + 1, __ATOMIC_SEQ_CST);
+
+    uint64_t d = arrival + max_wait;
+    struct timespec deadline = {d / 1000000000ULL, d % 1000000000ULL};
+    while (1) {
+        if (gate.head == &w && take_slot()) {
+            ret = 0;
+            break;
+        }
+        if (pthread_cond_timedwait(&w.cond, &gate.mutex, &deadline) ==
+            ETIMEDOUT) {
+            break;
+        }
+    }
+
+    // leave the line, and let the next in it try for a slot
+    if (w.prev != NULL) {
+        w.prev->next = w.next;
+    } else {
+        gate.head = w.next;
+    }
+    if (w.next != NULL) {
+        w.next->prev = w.prev;
+    } else {
+        gate.tail = w.prev;
+    }
+    __atomic_store_n(&gate.queued, gate.queued - 1, __ATOMIC_SEQ_CST);
+    if (gate.head != NULL) pthread_cond_signal(&gate.head->cond);
+    pthread_mutex_unlock(&gate.mutex);
+    pthread_cond_destroy(&w.cond);
+    pthread_setcancelstate(oldstate, NULL);
+
+    uint64_t now = now_ns();
+    if (ret < 0) {
+        __atomic_add_fetch(&stats.shed_late, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    entered = now;
+    __atomic_add_fetch(&gate.admitted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.waited, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.wait_ns, now - arrival, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&stats.wait_max, __ATOMIC_RELAXED);
+    while (now - arrival > max &&
+           !__atomic_compare_exchange_n(&stats.wait_max, &max, now - arrival, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return 0;
+}
+
+int admit_enter(void) {
+    if (slots == 0) return 0;
+    uint64_t now = now_ns();
+    if (__atomic_load_n(&gate.queued, __ATOMIC_SEQ_CST) == 0 && take_slot()) {
+        entered = now;
+        __atomic_add_fetch(&gate.admitted, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return wait_slot(now);
+}
+
+void admit_exit(void) {
+    if (slots == 0) return;
+    // an average over the last eight or so commands; racy updates only
+    // lose a sample
+    uint64_t t = now_ns() - entered;
+    uint64_t s = __atomic_load_n(&gate.service, __ATOMIC_RELAXED);
+    __atomic_store_n(&gate.service, s - s / 8 + t / 8, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&gate.running, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&gate.queued, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&gate.mutex);
+        if (gate.head != NULL) pthread_cond_signal(&gate.head->cond);
+        pthread_mutex_unlock(&gate.mutex);
+    }
+}
+
+void admit_paused(void) {
+    __atomic_add_fetch(&stats.paused, 1, __ATOMIC_RELAXED);
+}
+
+void admit_report(FILE *out) {
+    int sessions = __atomic_load_n(&stats.sessions, __ATOMIC_RELAXED);
+    if (max_sessions > 0) {
+        fprintf(out, "sessions: %d of %d, %lu refused\n", sessions,
+                max_sessions,
+                __atomic_load_n(&stats.refused, __ATOMIC_RELAXED));
+    } else {
+        fprintf(out, "sessions: %d, no limit\n", sessions);
+    }
+    if (slots == 0) {
+        fprintf(out, "execution slots off\n");
+    } else {
+        unsigned long waited = __atomic_load_n(&stats.waited, __ATOMIC_RELAXED);
+        uint64_t wait_ns = __atomic_load_n(&stats.wait_ns, __ATOMIC_RELAXED);
+        fprintf(out,
+                "slots: %d of %d running, %d waiting (at most %d, for %lu ms), "
+                "service %.1f us\n",
+                __atomic_load_n(&gate.running, __ATOMIC_RELAXED), slots,
+                __atomic_load_n(&gate.queued, __ATOMIC_RELAXED), max_queue,
+                (unsigned long)(max_wait / 1000000),
+                __atomic_load_n(&gate.service, __ATOMIC_RELAXED) / 1e3);
+        fprintf(out,
+                "commands: %lu admitted, %lu after waiting (avg %.1f us, max "
+                "%.1f us), %lu shed on arrival, %lu shed after waiting\n",
+                __atomic_load_n(&gate.admitted, __ATOMIC_RELAXED), waited,
+                waited ? (double)wait_ns / waited / 1e3 : 0.0,
+                __atomic_load_n(&stats.wait_max, __ATOMIC_RELAXED) / 1e3,
+                __atomic_load_n(&stats.shed_full, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats.shed_late, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "reads paused for full pipelines: %lu\n",
+            __atomic_load_n(&stats.paused, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,63 @@
+#ifndef ADMIT_H_
+#define ADMIT_H_
+
+#include <stdio.h>
+
+/*
+ * Admission control for overload. The server runs a thread per connection,
+ * so its queues are threads: a connection is refused outright past the
+ * session limit, and a command runs only in one of a fixed number of
+ * execution slots. A command that finds no slot free joins a bounded FIFO of
+ * waiting threads; it is answered "busy" instead of run if the line is full,
+ * if the wait it can expect (from the recent service time per slot) is past
+ * the deadline, or once it has actually waited that long. Every command thus
+ * either starts within the deadline or is shed at once, and the time a
+ * client waits for its answer stays bounded however much load is offered.
+ */
+
+// the response to a command or connection that was shed
+#define ADMIT_BUSY "busy"
+
+/**
+ * admit_init() sets the limits; 0 leaves one off. sessions limits concurrent
+ * connections, slots the commands running at once, queue the commands
+ * waiting for a slot (by default 4 per slot) and wait_ms how long one may
+ * wait (by default 50).
+ */
+void admit_init(int sessions, int slots, int queue, int wait_ms);
+
+/**
+ * admit_session() counts a new connection and returns 0, or returns -1 if
+ * there are already as many as allowed. admit_session_end() uncounts one
+ * that was admitted.
+ */
+int admit_session(void);
+void admit_session_end(void);
+
+/**
+ * admit_refuse() sends ADMIT_BUSY on the socket fd of a connection that was
+ * not admitted, and closes it.
+ */
+void admit_refuse(int fd);
+
+/**
+ * admit_enter() waits for an execution slot and returns 0, or returns -1 if
+ * the command is to be shed. admit_exit() gives the slot back once the
+ * command is done.
+ */
+int admit_enter(void);
+void admit_exit(void);
+
+/**
+ * admit_paused() counts a connection whose reads were paused because it had
+ * too many commands waiting; see comm_pipeline().
+ */
+void admit_paused(void);
+
+/**
+ * admit_report() prints the limits, the current load and how many
+ * connections and commands were admitted, queued and shed.
+ */
+void admit_report(FILE *out);
+
+#endif  // ADMIT_H_
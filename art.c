@@ -0,0 +1,836 @@
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./engine.h"
+#include "./epoch.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Adaptive radix tree (Leis et al.) with optimistic lock coupling. Keys are
+ * the name bytes including the terminating '\0', so no key is a prefix of
+ * another. Inner nodes come in four sizes and grow as children are added;
+ * each stores its compressed path (up to ART_PREFIX bytes of it, with the
+ * full length) and leaves hang off whichever node first tells them apart.
+ *
+ * Readers never write shared memory: they remember each node's version, read
+ * it, and check the version again before trusting what they read, restarting
+ * from the root if it changed. Writers lock only the node they modify (and
+ * its parent when the node is replaced). Replaced nodes and removed leaves go
+ * through the epoch reclaimer.
+ */
+
+#define ART_PREFIX 8
+
+// version word: bit 0 obsolete, bit 1 locked, the rest a counter
+#define OBSOLETE 1
+#define LOCKED 2
+
+typedef enum art_type { node4, node16, node48, node256 } art_type_t;
+
+typedef struct art_node {
+    uint64_t version;
+    uint8_t type;
+    uint16_t count;
+    uint32_t prefix_len;
+    uint8_t prefix[ART_PREFIX];
+} art_node_t;
+
+typedef struct art_node4 {
+    art_node_t h;
+    uint8_t keys[4];
+    art_node_t *children[4];
+} art_node4_t;
+
+typedef struct art_node16 {
+    art_node_t h;
+    uint8_t keys[16];
+    art_node_t *children[16];
+} art_node16_t;
+
+typedef struct art_node48 {
+    art_node_t h;
+    uint8_t index[256];  // slot + 1, or 0 if there is no child
+    art_node_t *children[48];
+} art_node48_t;
+
+typedef struct art_node256 {
+    art_node_t h;
+    art_node_t *children[256];
+} art_node256_t;
+
+// leaves are immutable; they are tagged in child pointers by the low bit
+typedef struct art_leaf {
+    uint16_t key_len;  // including the terminating '\0'
+    char *value;
+    char key[];
+} art_leaf_t;
+
+#define IS_LEAF(p) (((uintptr_t)(p)) & 1)
+#define LEAF(p) ((art_leaf_t *)(((uintptr_t)(p)) & ~(uintptr_t)1))
+#define MAKE_LEAF(l) ((art_node_t *)(((uintptr_t)(l)) | 1))
+
+static const int capacity[] = {4, 16, 48, 256};
+
+/* Optimistic lock coupling */
+
+static uint64_t await_unlocked(art_node_t *n) {
+    uint64_t v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+    while (v & LOCKED) {
+        sched_yield();
+        v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+    }
+    return v;
+}
+
+static uint64_t read_lock(art_node_t *n, int *restart) {
+    uint64_t v = await_unlocked(n);
+    if (v & OBSOLETE) *restart = 1;
+    return v;
+}
+
+// checks that nothing read from n since read_lock returned v was changed
+static void read_unlock(art_node_t *n, uint64_t v, int *restart) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (v != __atomic_load_n(&n->version, __ATOMIC_RELAXED)) *restart = 1;
+}
+
+static void upgrade(art_node_t *n, uint64_t v, int *restart) {
+    if (!__atomic_compare_exchange_n(&n->version, &v, v + LOCKED, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        *restart = 1;
+    }
+}
+
+static void write_lock(art_node_t *n, int *restart) {
+    while (1) {
+        uint64_t v = read_lock(n, restart);
+        if (*restart) return;
+        if (__atomic_compare_exchange_n(&n->version, &v, v + LOCKED, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+static void write_unlock(art_node_t *n) {
+    __atomic_fetch_add(&n->version, LOCKED, __ATOMIC_RELEASE);
+}
+
+static void write_unlock_obsolete(art_node_t *n) {
+    __atomic_fetch_add(&n->version, LOCKED + OBSOLETE, __ATOMIC_RELEASE);
+}
+
+/* Nodes */
+
+static art_node_t *node_new(art_type_t type) {
+    static const size_t sizes[] = {sizeof(art_node4_t), sizeof(art_node16_t),
+                                   sizeof(art_node48_t), sizeof(art_node256_t)};
+    art_node_t *n = calloc(1, sizes[type]);
+    if (n == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    n->type = type;
+    return n;
+}
+
+static art_leaf_t *leaf_new(char *name, char *value) {
+    size_t key_len = strlen(name) + 1;
+    size_t val_len = strlen(value) + 1;
+    art_leaf_t *l = malloc(sizeof(art_leaf_t) + key_len + val_len);
+    if (l == NULL) return NULL;
+    l->key_len = key_len;
+    memcpy(l->key, name, key_len);
+    l->value = l->key + key_len;
+    memcpy(l->value, value, val_len);
+    return l;
+}
+
+static int leaf_matches(art_leaf_t *l, const uint8_t *key, int key_len) {
+    return l->key_len == key_len && memcmp(l->key, key, key_len) == 0;
+}
+
+static art_node_t *load_child(art_node_t **slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+static art_node_t *find_child(art_node_t *n, uint8_t b) {
+    int count = __atomic_load_n(&n->count, __ATOMIC_RELAXED);
+    switch (n->type) {
+        case node4: {
+            art_node4_t *n4 = (art_node4_t *)n;
+            if (count > 4) count = 4;
+            for (int i = 0; i < count; i++) {
+                if (n4->keys[i] == b) return load_child(&n4->children[i]);
+            }
+            return NULL;
+        }
+        case node16: {
+            art_node16_t *n16 = (art_node16_t *)n;
+            if (count > 16) count = 16;
+#ifdef __SSE2__
+            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)b),
+                                         _mm_loadu_si128((__m128i *)n16->keys));
+            unsigned mask = _mm_movemask_epi8(cmp) & ((1u << count) - 1);
+            if (mask) return load_child(&n16->children[__builtin_ctz(mask)]);
+#else
+            for (int i = 0; i < count; i++) {
+                if (n16->keys[i] == b) return load_child(&n16->children[i]);
+            }
+#endif
+            return NULL;
+        }
+        case node48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            int idx = __atomic_load_n(&n48->index[b], __ATOMIC_RELAXED);
+            if (idx == 0 || idx > 48) return NULL;
+            return load_child(&n48->children[idx - 1]);
+        }
+        default: {
+            art_node256_t *n256 = (art_node256_t *)n;
+            return load_child(&n256->children[b]);
+        }
+    }
+}
+
+// n is write-locked and not full
+static void add_child(art_node_t *n, uint8_t b, art_node_t *child) {
+    if (n->type == node4 || n->type == node16) {
+        uint8_t *keys = n->type == node4 ? ((art_node4_t *)n)->keys
+                                         : ((art_node16_t *)n)->keys;
+        art_node_t **children = n->type == node4
+                                    ? ((art_node4_t *)n)->children
+                                    : ((art_node16_t *)n)->children;
+        int pos = 0;
+        while (pos < n->count && keys[pos] < b) pos++;
+        memmove(keys + pos + 1, keys + pos, n->count - pos);
+        memmove(children + pos + 1, children + pos,
+                (n->count - pos) * sizeof(art_node_t *));
+        keys[pos] = b;
+        __atomic_store_n(&children[pos], child, __ATOMIC_RELEASE);
+    } else if (n->type == node48) {
+        art_node48_t *n48 = (art_node48_t *)n;
+        int slot = 0;
+        while (n48->children[slot] != NULL) slot++;
+        __atomic_store_n(&n48->children[slot], child, __ATOMIC_RELEASE);
+        __atomic_store_n(&n48->index[b], slot + 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&((art_node256_t *)n)->children[b], child,
+                         __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&n->count, n->count + 1, __ATOMIC_RELEASE);
+}
+
+// returns the slot holding the child for b; n is write-locked
+static art_node_t **child_slot(art_node_t *n, uint8_t b) {
+    switch (n->type) {
+        case node4:
+        case node16: {
+            uint8_t *keys = n->type == node4 ? ((art_node4_t *)n)->keys
+                                             : ((art_node16_t *)n)->keys;
+            art_node_t **children = n->type == node4
+                                        ? ((art_node4_t *)n)->children
+                                        : ((art_node16_t *)n)->children;
+            for (int i = 0; i < n->count; i++) {
+                if (keys[i] == b) return &children[i];
+            }
+            return NULL;
+        }
+        case node48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            return n48->index[b] ? &n48->children[n48->index[b] - 1] : NULL;
+        }
+        default:
+            return &((art_node256_t *)n)->children[b];
+    }
+}
+
+static void change_child(art_node_t *n, uint8_t b, art_node_t *child) {
+    __atomic_store_n(child_slot(n, b), child, __ATOMIC_RELEASE);
+}
+
+static void remove_child(art_node_t *n, uint8_t b) {
+    if (n->type == node4 || n->type == node16) {
+        uint8_t *keys = n->type == node4 ? ((art_node4_t *)n)->keys
+                                         : ((art_node16_t *)n)->keys;
+        art_node_t **children = n->type == node4
+                                    ? ((art_node4_t *)n)->children
+                                    : ((art_node16_t *)n)->children;
+        int pos = 0;
+        while (keys[pos] != b) pos++;
+        memmove(keys + pos, keys + pos + 1, n->count - pos - 1);
+        memmove(children + pos, children + pos + 1,
+                (n->count - pos - 1) * sizeof(art_node_t *));
+    } else if (n->type == node48) {
+        art_node48_t *n48 = (art_node48_t *)n;
+        __atomic_store_n(&n48->children[n48->index[b] - 1], NULL,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&n48->index[b], 0, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&((art_node256_t *)n)->children[b], NULL,
+                         __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&n->count, n->count - 1, __ATOMIC_RELEASE);
+}
+
+// Copies the children of n and their key bytes out in key order and returns
+// how many there are. n is locked, or the caller validates its version after.
+static int children_sorted(art_node_t *n, uint8_t *keys_out,
+                           art_node_t **kids_out) {
+    int nk = 0;
+    int count = __atomic_load_n(&n->count, __ATOMIC_RELAXED);
+    switch (n->type) {
+        case node4:
+        case node16: {
+            uint8_t *keys = n->type == node4 ? ((art_node4_t *)n)->keys
+                                             : ((art_node16_t *)n)->keys;
+            art_node_t **children = n->type == node4
+                                        ? ((art_node4_t *)n)->children
+                                        : ((art_node16_t *)n)->children;
+            if (count > capacity[n->type]) count = capacity[n->type];
+            for (int i = 0; i < count; i++) {
+                keys_out[nk] = keys[i];
+                kids_out[nk++] = load_child(&children[i]);
+            }
+            break;
+        }
+        case node48: {
+            art_node48_t *n48 = (art_node48_t *)n;
+            for (int b = 0; b < 256; b++) {
+                int idx = __atomic_load_n(&n48->index[b], __ATOMIC_RELAXED);
+                if (idx != 0 && idx <= 48) {
+                    art_node_t *c = load_child(&n48->children[idx - 1]);
+                    if (c != NULL) {
+                        keys_out[nk] = b;
+                        kids_out[nk++] = c;
+                    }
+                }
+            }
+            break;
+        }
+        default: {
+            art_node256_t *n256 = (art_node256_t *)n;
+            for (int b = 0; b < 256; b++) {
+                art_node_t *c = load_child(&n256->children[b]);
+                if (c != NULL) {
+                    keys_out[nk] = b;
+                    kids_out[nk++] = c;
+                }
+            }
+        }
+    }
+    return nk;
+}
+
+// copies n (write-locked and full) into the next larger node type
+static art_node_t *grow(art_node_t *n) {
+    uint8_t keys[256];
+    art_node_t *kids[256];
+    art_node_t *big = node_new(n->type + 1);
+    big->prefix_len = n->prefix_len;
+    memcpy(big->prefix, n->prefix, ART_PREFIX);
+    int nk = children_sorted(n, keys, kids);
+    for (int i = 0; i < nk; i++) {
+        add_child(big, keys[i], kids[i]);
+    }
+    return big;
+}
+
+// prepends the prefix of parent and the key byte b leading to n onto the
+// prefix of n, for when parent is collapsed into n
+static void add_prefix_before(art_node_t *n, art_node_t *parent, uint8_t b) {
+    uint32_t copy = parent->prefix_len + 1;
+    if (copy > ART_PREFIX) copy = ART_PREFIX;
+    uint32_t keep = n->prefix_len < ART_PREFIX - copy ? n->prefix_len
+                                                      : ART_PREFIX - copy;
+    memmove(n->prefix + copy, n->prefix, keep);
+    memcpy(n->prefix, parent->prefix,
+           parent->prefix_len < copy ? parent->prefix_len : copy);
+    if (parent->prefix_len < ART_PREFIX) n->prefix[copy - 1] = b;
+    n->prefix_len += parent->prefix_len + 1;
+}
+
+// descends to any leaf below n, to recover prefix bytes that were not stored
+static art_leaf_t *any_leaf(art_node_t *n, int *restart) {
+    uint8_t keys[256];
+    art_node_t *kids[256];
+    while (1) {
+        uint64_t v = read_lock(n, restart);
+        if (*restart) return NULL;
+        int nk = children_sorted(n, keys, kids);
+        read_unlock(n, v, restart);
+        if (*restart) return NULL;
+        if (nk == 0) {
+            *restart = 1;
+            return NULL;
+        }
+        if (IS_LEAF(kids[0])) return LEAF(kids[0]);
+        n = kids[0];
+    }
+}
+
+// Optimistic prefix check for lookups: compares the stored prefix bytes and
+// skips the rest (the leaf comparison catches a mismatch there). Returns 0 on
+// a mismatch; otherwise advances *depth past the prefix and returns 1.
+static int check_prefix(art_node_t *n, const uint8_t *key, int key_len,
+                        int *depth) {
+    uint32_t plen = __atomic_load_n(&n->prefix_len, __ATOMIC_RELAXED);
+    if (plen == 0) return 1;
+    if (*depth + plen >= (uint32_t)key_len) return 0;
+    uint32_t stored = plen < ART_PREFIX ? plen : ART_PREFIX;
+    for (uint32_t i = 0; i < stored; i++) {
+        if (n->prefix[i] != key[*depth + i]) return 0;
+    }
+    *depth += plen;
+    return 1;
+}
+
+// Exact prefix check for inserts. Returns 1 on a mismatch, setting
+// *nonmatch to the prefix byte that differs and remaining to the prefix
+// bytes after it. *level is advanced to the mismatch or past the prefix.
+static int check_prefix_pessimistic(art_node_t *n, const uint8_t *key,
+                                    int key_len, int *level, uint8_t *nonmatch,
+                                    uint8_t *remaining, int *restart) {
+    uint32_t plen = __atomic_load_n(&n->prefix_len, __ATOMIC_RELAXED);
+    if (plen == 0) return 0;
+    int prev = *level;
+    art_leaf_t *l = NULL;
+    for (uint32_t i = 0; i < plen; i++) {
+        if (i == ART_PREFIX) {
+            if ((l = any_leaf(n, restart)) == NULL) return 0;
+        }
+        if (*level >= key_len || (l != NULL && *level >= l->key_len)) {
+            *restart = 1;  // inconsistent read
+            return 0;
+        }
+        uint8_t cur = i >= ART_PREFIX ? (uint8_t)l->key[*level] : n->prefix[i];
+        if (cur != key[*level]) {
+            *nonmatch = cur;
+            if (plen > ART_PREFIX) {
+                if (l == NULL && (l = any_leaf(n, restart)) == NULL) return 0;
+                uint32_t rem = plen - (*level - prev) - 1;
+                if (rem > ART_PREFIX) rem = ART_PREFIX;
+                if (*level + 1 + rem > l->key_len) {
+                    *restart = 1;
+                    return 0;
+                }
+                memcpy(remaining, l->key + *level + 1, rem);
+            } else {
+                memcpy(remaining, n->prefix + i + 1, plen - i - 1);
+            }
+            return 1;
+        }
+        (*level)++;
+    }
+    return 0;
+}
+
+/* Tree operations; callers are inside an epoch */
+
+static art_leaf_t *art_lookup(art_node_t *root, const uint8_t *key,
+                              int key_len) {
+    int restart;
+retry:
+    restart = 0;
+    art_node_t *node = root;
+    int depth = 0;
+    uint64_t v = read_lock(node, &restart);
+    if (restart) goto retry;
+    while (1) {
+        if (!check_prefix(node, key, key_len, &depth)) {
+            read_unlock(node, v, &restart);
+            if (restart) goto retry;
+            return NULL;
+        }
+        art_node_t *child = find_child(node, key[depth]);
+        read_unlock(node, v, &restart);
+        if (restart) goto retry;
+        if (child == NULL) return NULL;
+        if (IS_LEAF(child)) {
+            art_leaf_t *l = LEAF(child);
+            return leaf_matches(l, key, key_len) ? l : NULL;
+        }
+        depth++;
+        uint64_t cv = read_lock(child, &restart);
+        if (restart) goto retry;
+        read_unlock(node, v, &restart);
+        if (restart) goto retry;
+        node = child;
+        v = cv;
+    }
+}
+
+// returns 1 if leaf was inserted, 0 if its key was already present
+static int art_insert(art_node_t *root, const uint8_t *key, int key_len,
+                      art_leaf_t *leaf) {
+    int restart;
+retry:
+    restart = 0;
+    art_node_t *node = NULL;
+    art_node_t *next = root;
+    art_node_t *parent = NULL;
+    uint8_t parent_key = 0;
+    uint8_t node_key = 0;
+    uint64_t parent_v = 0;
+    int depth = 0;
+
+    while (1) {
+        parent = node;
+        parent_key = node_key;
+        node = next;
+        uint64_t v = read_lock(node, &restart);
+        if (restart) goto retry;
+
+        int level = depth;
+        uint8_t nonmatch = 0;
+        uint8_t remaining[ART_PREFIX];
+        int mismatch = check_prefix_pessimistic(node, key, key_len, &level,
+                                                &nonmatch, remaining, &restart);
+        if (restart) goto retry;
+        if (mismatch) {
+            // split the compressed path with a new node4 above node
+            upgrade(parent, parent_v, &restart);
+            if (restart) goto retry;
+            upgrade(node, v, &restart);
+            if (restart) {
+                write_unlock(parent);
+                goto retry;
+            }
+            art_node_t *n4 = node_new(node4);
+            n4->prefix_len = level - depth;
+            memcpy(n4->prefix, node->prefix,
+                   n4->prefix_len < ART_PREFIX ? n4->prefix_len : ART_PREFIX);
+            add_child(n4, key[level], MAKE_LEAF(leaf));
+            add_child(n4, nonmatch, node);
+            change_child(parent, parent_key, n4);
+            write_unlock(parent);
+
+            uint32_t plen = node->prefix_len - (level - depth + 1);
+            memcpy(node->prefix, remaining,
+                   plen < ART_PREFIX ? plen : ART_PREFIX);
+            node->prefix_len = plen;
+            write_unlock(node);
+            return 1;
+        }
+
+        depth = level;
+        node_key = key[depth];
+        next = find_child(node, node_key);
+        read_unlock(node, v, &restart);
+        if (restart) goto retry;
+
+        if (next == NULL) {
+            if (node->count < capacity[node->type]) {
+                upgrade(node, v, &restart);
+                if (restart) goto retry;
+                if (parent != NULL) {
+                    read_unlock(parent, parent_v, &restart);
+                    if (restart) {
+                        write_unlock(node);
+                        goto retry;
+                    }
+                }
+                add_child(node, node_key, MAKE_LEAF(leaf));
+                write_unlock(node);
+                return 1;
+            }
+            // full: replace node with a larger copy (the root never fills)
+            upgrade(parent, parent_v, &restart);
+            if (restart) goto retry;
+            upgrade(node, v, &restart);
+            if (restart) {
+                write_unlock(parent);
+                goto retry;
+            }
+            art_node_t *big = grow(node);
+            add_child(big, node_key, MAKE_LEAF(leaf));
+            change_child(parent, parent_key, big);
+            write_unlock(parent);
+            write_unlock_obsolete(node);
+            epoch_retire(node, free);
+            return 1;
+        }
+
+        if (parent != NULL) {
+            read_unlock(parent, parent_v, &restart);
+            if (restart) goto retry;
+        }
+
+        if (IS_LEAF(next)) {
+            upgrade(node, v, &restart);
+            if (restart) goto retry;
+            art_leaf_t *existing = LEAF(next);
+            if (leaf_matches(existing, key, key_len)) {
+                write_unlock(node);
+                return 0;
+            }
+            // both keys now live below a node4 holding their common bytes
+            int plen = 0;
+            while (existing->key[depth + 1 + plen] == key[depth + 1 + plen]) {
+                plen++;
+            }
+            art_node_t *n4 = node_new(node4);
+            n4->prefix_len = plen;
+            memcpy(n4->prefix, key + depth + 1,
+                   plen < ART_PREFIX ? plen : ART_PREFIX);
+            add_child(n4, key[depth + 1 + plen], MAKE_LEAF(leaf));
+            add_child(n4, existing->key[depth + 1 + plen], next);
+            change_child(node, node_key, n4);
+            write_unlock(node);
+            return 1;
+        }
+        depth++;
+        parent_v = v;
+    }
+}
+
+// returns 1 if the key was removed, 0 if it was not present
+static int art_delete(art_node_t *root, const uint8_t *key, int key_len) {
+    int restart;
+retry:
+    restart = 0;
+    art_node_t *node = NULL;
+    art_node_t *next = root;
+    art_node_t *parent = NULL;
+    uint8_t parent_key = 0;
+    uint8_t node_key = 0;
+    uint64_t parent_v = 0;
+    int depth = 0;
+
+    while (1) {
+        parent = node;
+        parent_key = node_key;
+        node = next;
+        uint64_t v = read_lock(node, &restart);
+        if (restart) goto retry;
+
+        if (!check_prefix(node, key, key_len, &depth)) {
+            read_unlock(node, v, &restart);
+            if (restart) goto retry;
+            return 0;
+        }
+        node_key = key[depth];
+        next = find_child(node, node_key);
+        read_unlock(node, v, &restart);
+        if (restart) goto retry;
+        if (next == NULL) return 0;
+
+        if (IS_LEAF(next)) {
+            art_leaf_t *l = LEAF(next);
+            if (!leaf_matches(l, key, key_len)) return 0;
+
+            if (parent != NULL && node->count == 2) {
+                // node would be left with one child: put that child in its
+                // place so that inner nodes always have at least two
+                upgrade(parent, parent_v, &restart);
+                if (restart) goto retry;
+                upgrade(node, v, &restart);
+                if (restart) {
+                    write_unlock(parent);
+                    goto retry;
+                }
+                uint8_t keys[2];
+                art_node_t *kids[2];
+                children_sorted(node, keys, kids);
+                int o = keys[0] == node_key ? 1 : 0;
+                if (!IS_LEAF(kids[o])) {
+                    write_lock(kids[o], &restart);
+                    if (restart) {
+                        write_unlock(node);
+                        write_unlock(parent);
+                        goto retry;
+                    }
+                    add_prefix_before(kids[o], node, keys[o]);
+                    change_child(parent, parent_key, kids[o]);
+                    write_unlock(kids[o]);
+                } else {
+                    change_child(parent, parent_key, kids[o]);
+                }
+                write_unlock(parent);
+                write_unlock_obsolete(node);
+                epoch_retire(node, free);
+                epoch_retire(l, free);
+                return 1;
+            }
+
+            upgrade(node, v, &restart);
+            if (restart) goto retry;
+            if (parent != NULL) {
+                read_unlock(parent, parent_v, &restart);
+                if (restart) {
+                    write_unlock(node);
+                    goto retry;
+                }
+            }
+            remove_child(node, node_key);
+            write_unlock(node);
+            epoch_retire(l, free);
+            return 1;
+        }
+        depth++;
+        parent_v = v;
+    }
+}
+
+// If the key is present, swaps in a new leaf with the value fn makes from the
+// old one while holding only the leaf's parent, stores fn's verdict in *ret
+// and returns 1; returns 0 if the key is absent.
+static int art_replace(art_node_t *root, const uint8_t *key, int key_len,
+                       db_update_fn fn, void *arg, int *ret) {
+    char value[DB_UPDATE_LEN];
+    int restart;
+retry:
+    restart = 0;
+    art_node_t *node = root;
+    int depth = 0;
+    uint64_t v = read_lock(node, &restart);
+    if (restart) goto retry;
+    while (1) {
+        if (!check_prefix(node, key, key_len, &depth)) {
+            read_unlock(node, v, &restart);
+            if (restart) goto retry;
+            return 0;
+        }
+        art_node_t *child = find_child(node, key[depth]);
+        read_unlock(node, v, &restart);
+        if (restart) goto retry;
+        if (child == NULL) return 0;
+        if (IS_LEAF(child)) {
+            art_leaf_t *l = LEAF(child);
+            if (!leaf_matches(l, key, key_len)) return 0;
+            // the leaf cannot be unlinked or replaced while node is locked
+            upgrade(node, v, &restart);
+            if (restart) goto retry;
+            art_leaf_t *nl = NULL;
+            *ret = fn(l->value, value, sizeof(value), arg);
+            if (*ret && (nl = leaf_new(l->key, value)) == NULL) *ret = 0;
+            if (nl != NULL) change_child(node, key[depth], MAKE_LEAF(nl));
+            write_unlock(node);
+            if (nl != NULL) epoch_retire(l, free);
+            return 1;
+        }
+        depth++;
+        uint64_t cv = read_lock(child, &restart);
+        if (restart) goto retry;
+        read_unlock(node, v, &restart);
+        if (restart) goto retry;
+        node = child;
+        v = cv;
+    }
+}
+
+/* Engine interface */
+
+static void *art_open(void) { return node_new(node256); }
+
+static int art_query(void *store, char *name, char *result, int len) {
+    epoch_enter();
+    art_leaf_t *l =
+        art_lookup((art_node_t *)store, (uint8_t *)name, strlen(name) + 1);
+    int n = l != NULL ? snprintf(result, len, "%s", l->value) + 1 : 0;
+    epoch_exit();
+    return n;
+}
+
+static int art_add(void *store, char *name, char *value) {
+    art_leaf_t *l = leaf_new(name, value);
+    if (l == NULL) return 0;
+    epoch_enter();
+    int ret = art_insert((art_node_t *)store, (uint8_t *)l->key, l->key_len, l);
+    epoch_exit();
+    if (!ret) free(l);
+    return ret;
+}
+
+static int art_remove(void *store, char *name) {
+    epoch_enter();
+    int ret =
+        art_delete((art_node_t *)store, (uint8_t *)name, strlen(name) + 1);
+    epoch_exit();
+    return ret;
+}
+
+// Leaves are immutable, since readers do not lock them; an update replaces
+// the whole leaf.
+static int art_update(void *store, char *name, db_update_fn fn, void *arg) {
+    char value[DB_UPDATE_LEN];
+    int key_len = strlen(name) + 1;
+    int ret;
+
+    while (1) {
+        epoch_enter();
+        int found =
+            art_replace((art_node_t *)store, (uint8_t *)name, key_len, fn, arg,
+                        &ret);
+        epoch_exit();
+        if (found) return ret;
+        if (!fn(NULL, value, sizeof(value), arg)) return 0;
+        if (art_add(store, name, value)) return 1;
+        // added concurrently; replace that one
+    }
+}
+
+// In-order walk. Each node's children are read consistently, but the walk
+// as a whole is not a point-in-time snapshot of a tree under modification.
+static void art_scan_recurs(art_node_t *n, db_scan_fn fn, void *arg) {
+    uint8_t keys[256];
+    art_node_t *kids[256];
+    int nk;
+    uint64_t v;
+    do {
+        v = await_unlocked(n);
+        nk = children_sorted(n, keys, kids);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (v != __atomic_load_n(&n->version, __ATOMIC_RELAXED));
+
+    for (int i = 0; i < nk; i++) {
+        if (IS_LEAF(kids[i])) {
+            art_leaf_t *l = LEAF(kids[i]);
+            fn(l->key, l->value, arg);
+        } else {
+            art_scan_recurs(kids[i], fn, arg);
+        }
+    }
+}
+
+static void art_scan(void *store, db_scan_fn fn, void *arg) {
+    epoch_enter();
+    art_scan_recurs((art_node_t *)store, fn, arg);
+    epoch_exit();
+}
+
+static void print_entry(const char *name, const char *value, void *arg) {
+    fprintf((FILE *)arg, "%s %s\n", name, value);
+}
+
+static void art_print(void *store, FILE *out) {
+    fprintf(out, "(art)\n");
+    art_scan(store, print_entry, out);
+}
+
+static void art_free_recurs(art_node_t *n) {
+    uint8_t keys[256];
+    art_node_t *kids[256];
+    int nk = children_sorted(n, keys, kids);
+    for (int i = 0; i < nk; i++) {
+        if (IS_LEAF(kids[i])) {
+            free(LEAF(kids[i]));
+        } else {
+            art_free_recurs(kids[i]);
+        }
+    }
+    free(n);
+}
+
+static void art_cleanup(void *store) {
+    art_free_recurs((art_node_t *)store);
+    epoch_barrier();
+}
+
+const db_engine_t art_engine = {"art",      art_open,   art_query,
+                                art_add,    art_remove, art_update,
+                                art_scan,   art_print,  art_cleanup};
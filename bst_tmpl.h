@@ -0,0 +1,686 @@
+/*
+ * Binary search tree engine "template". Each inclusion generates one
+ * specialized copy of the BST from db.c, with its policies fixed at compile
+ * time so that no locking or allocation decision is made at run time.
+ * Define before including:
+ *
+ *   BST_NAME    identifier prefix; defines the db_engine_t BST_NAME_engine
+ *   BST_ENGINE  engine name for db_init(), e.g. "bst-fixed-rwlock"
+ *   BST_LOCK    BST_LOCK_NONE      no locking; one client at a time only
+ *               BST_LOCK_RWLOCK    hand-over-hand rwlocks, as in db.c
+ *               BST_LOCK_OPTIMISTIC  lock-free readers validated by a
+ *                                  sequence count; writers serialized
+ *   BST_KEYLEN  0 for heap-allocated names and values, or the size of the
+ *               fixed buffers they are stored in inside each node. Longer
+ *               names or values are refused by add.
+ *   BST_ALLOC   BST_ALLOC_MALLOC or BST_ALLOC_POOL (nodes carved from
+ *               chunks and recycled through a free list)
+ *   BST_VALUE   BST_VALUE_INLINE (the default) to keep values in the nodes,
+ *               or BST_VALUE_LOG to keep only a reference to a record in a
+ *               value log (vlog.h), so the tree holds just keys. Needs
+ *               BST_LOCK_RWLOCK and heap names.
+ *
+ * The policy macros are undefined again at the end of this file.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+#include "./engine.h"
+#include "./epoch.h"
+#include "./simd.h"
+#include "./vlog.h"
+
+#ifndef BST_TMPL_COMMON_
+#define BST_TMPL_COMMON_
+
+#define BST_LOCK_NONE 0
+#define BST_LOCK_RWLOCK 1
+#define BST_LOCK_OPTIMISTIC 2
+
+#define BST_ALLOC_MALLOC 0
+#define BST_ALLOC_POOL 1
+
+#define BST_VALUE_INLINE 0
+#define BST_VALUE_LOG 1
+
+#define BST_POOL_CHUNK 1024
+
+#define BST_CAT_(a, b) a##_##b
+#define BST_CAT(a, b) BST_CAT_(a, b)
+
+#endif  // BST_TMPL_COMMON_
+
+#if BST_LOCK == BST_LOCK_OPTIMISTIC && !BST_KEYLEN
+#error "optimistic readers need fixed-width names and values"
+#endif
+
+#ifndef BST_VALUE
+#define BST_VALUE BST_VALUE_INLINE
+#endif
+#if BST_VALUE == BST_VALUE_LOG && (BST_LOCK != BST_LOCK_RWLOCK || BST_KEYLEN)
+#error "the value log's collector needs per-node rwlocks and heap names"
+#endif
+
+#define FN(f) BST_CAT(BST_NAME, f)
+#define NODE FN(node)
+#define STORE FN(store)
+#define CHUNK FN(chunk)
+
+typedef struct NODE {
+#if BST_KEYLEN
+    char name[BST_KEYLEN];
+    char value[BST_KEYLEN];
+#elif BST_VALUE == BST_VALUE_LOG
+    char *name;
+    vlog_ref_t value;
+#else
+    char *name;
+    char *value;
+#endif
+    size_t name_len;
+    struct NODE *lchild;
+    struct NODE *rchild;
+#if BST_LOCK == BST_LOCK_RWLOCK
+    pthread_rwlock_t lock;
+#endif
+} NODE;
+
+typedef struct STORE {
+    NODE head;  // sentinel with the empty name; the tree hangs off rchild
+#if BST_VALUE == BST_VALUE_LOG
+    vlog_t *log;
+#endif
+#if BST_LOCK == BST_LOCK_OPTIMISTIC
+    pthread_mutex_t wlock;  // serializes writers
+    unsigned long seq;      // odd while a writer restructures the tree
+#endif
+} STORE;
+
+/* Locking policy */
+
+static inline void FN(rdlock)(NODE *n) {
+#if BST_LOCK == BST_LOCK_RWLOCK
+    int err = pthread_rwlock_rdlock(&n->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+#endif
+}
+
+static inline void FN(wrlock)(NODE *n) {
+#if BST_LOCK == BST_LOCK_RWLOCK
+    int err = pthread_rwlock_wrlock(&n->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+#endif
+}
+
+static inline void FN(unlock)(NODE *n) {
+#if BST_LOCK == BST_LOCK_RWLOCK
+    int err = pthread_rwlock_unlock(&n->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+#endif
+}
+
+#if BST_LOCK == BST_LOCK_OPTIMISTIC
+static inline void FN(writer_begin)(STORE *st) {
+    int err = pthread_mutex_lock(&st->wlock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void FN(writer_end)(STORE *st) {
+    int err = pthread_mutex_unlock(&st->wlock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// brackets a change that readers must not see half done
+static inline void FN(seq_begin)(STORE *st) {
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void FN(seq_end)(STORE *st) {
+    __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long FN(read_begin)(STORE *st) {
+    unsigned long s;
+    while ((s = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    return s;
+}
+
+static inline int FN(read_valid)(STORE *st, unsigned long s) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&st->seq, __ATOMIC_RELAXED) == s;
+}
+#else
+static inline void FN(writer_begin)(STORE *st) {}
+static inline void FN(writer_end)(STORE *st) {}
+static inline void FN(seq_begin)(STORE *st) {}
+static inline void FN(seq_end)(STORE *st) {}
+#endif
+
+// child pointers are read without locks by optimistic readers
+#define GET(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define SET(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Allocation policy */
+
+#if BST_ALLOC == BST_ALLOC_POOL
+typedef struct CHUNK {
+    struct CHUNK *next;
+    NODE nodes[BST_POOL_CHUNK];
+} CHUNK;
+
+// one pool per variant, shared by its stores; chunks are kept for reuse
+static NODE *FN(pool_free);
+static CHUNK *FN(pool_chunks);
+#if BST_LOCK != BST_LOCK_NONE
+static pthread_mutex_t FN(pool_lock) = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static NODE *FN(node_alloc)(void) {
+#if BST_LOCK != BST_LOCK_NONE
+    pthread_mutex_lock(&FN(pool_lock));
+#endif
+    if (FN(pool_free) == NULL) {
+        CHUNK *c = malloc(sizeof(CHUNK));
+        if (c == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        c->next = FN(pool_chunks);
+        FN(pool_chunks) = c;
+        for (int i = 0; i < BST_POOL_CHUNK; i++) {
+            c->nodes[i].lchild = FN(pool_free);
+            FN(pool_free) = &c->nodes[i];
+        }
+    }
+    NODE *n = FN(pool_free);
+    FN(pool_free) = n->lchild;
+#if BST_LOCK != BST_LOCK_NONE
+    pthread_mutex_unlock(&FN(pool_lock));
+#endif
+    return n;
+}
+
+static void FN(node_release)(NODE *n) {
+#if BST_LOCK != BST_LOCK_NONE
+    pthread_mutex_lock(&FN(pool_lock));
+#endif
+    n->lchild = FN(pool_free);
+    FN(pool_free) = n;
+#if BST_LOCK != BST_LOCK_NONE
+    pthread_mutex_unlock(&FN(pool_lock));
+#endif
+}
+#else
+static NODE *FN(node_alloc)(void) { return malloc(sizeof(NODE)); }
+
+static void FN(node_release)(NODE *n) { free(n); }
+#endif
+
+/* Key and value storage */
+
+// stores s (len bytes) in *dst; returns -1 if it does not fit
+#if BST_KEYLEN
+static inline int FN(set_str)(char *dst, const char *s, size_t len) {
+    if (len >= BST_KEYLEN) return -1;
+    memcpy(dst, s, len + 1);
+    return 0;
+}
+#define SET_STR(dst, s, len) FN(set_str)(dst, s, len)
+#else
+static inline int FN(set_str)(char **dst, const char *s, size_t len) {
+    // reuse the old buffer when the new string fits
+    if (*dst != NULL && strlen(*dst) >= len) {
+        memcpy(*dst, s, len + 1);
+        return 0;
+    }
+    char *p = malloc(len + 1);
+    if (p == NULL) return -1;
+    memcpy(p, s, len + 1);
+    free(*dst);
+    *dst = p;
+    return 0;
+}
+#define SET_STR(dst, s, len) FN(set_str)(&(dst), s, len)
+#endif
+
+#if BST_VALUE == BST_VALUE_LOG
+#define VALUE(n) vlog_value((n)->value, NULL)
+
+// appends value to the log and moves n over to it; -1 if it does not fit
+static inline int FN(set_value)(STORE *st, NODE *n, const char *value) {
+    vlog_ref_t ref;
+    if (vlog_append(st->log, n->name, value, &ref) != 0) return -1;
+    vlog_free(n->value);
+    n->value = ref;
+    return 0;
+}
+#else
+#define VALUE(n) ((n)->value)
+
+static inline int FN(set_value)(STORE *st, NODE *n, const char *value) {
+    return SET_STR(n->value, value, strlen(value));
+}
+#endif
+
+static NODE *FN(node_new)(STORE *st, const char *name, size_t name_len,
+                          const char *value) {
+    NODE *n = FN(node_alloc)();
+    if (n == NULL) return NULL;
+#if BST_VALUE == BST_VALUE_LOG
+    n->name = NULL;
+    n->value = VLOG_NONE;
+#elif !BST_KEYLEN
+    n->name = NULL;
+    n->value = NULL;
+#endif
+    if (SET_STR(n->name, name, name_len) != 0 ||
+        FN(set_value)(st, n, value) != 0) {
+#if !BST_KEYLEN
+        free(n->name);
+#endif
+        FN(node_release)(n);
+        return NULL;
+    }
+    n->name_len = name_len;
+    n->lchild = NULL;
+    n->rchild = NULL;
+#if BST_LOCK == BST_LOCK_RWLOCK
+    int err = pthread_rwlock_init(&n->lock, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_init");
+    }
+#endif
+    return n;
+}
+
+static void FN(node_free)(void *arg) {
+    NODE *n = (NODE *)arg;
+#if BST_LOCK == BST_LOCK_RWLOCK
+    pthread_rwlock_destroy(&n->lock);
+#endif
+#if BST_VALUE == BST_VALUE_LOG
+    free(n->name);
+    vlog_free(n->value);
+#elif !BST_KEYLEN
+    free(n->name);
+    free(n->value);
+#endif
+    FN(node_release)(n);
+}
+
+// frees a node that has been unlinked from the tree
+static inline void FN(node_drop)(NODE *n) {
+#if BST_LOCK == BST_LOCK_OPTIMISTIC
+    epoch_retire(n, FN(node_free));
+#else
+    FN(unlock)(n);
+    FN(node_free)(n);
+#endif
+}
+
+/* Tree operations */
+
+// Same contract as search() in db.c: parent is locked by the caller, the
+// target (if found) is returned locked, and the parent is stored in
+// *parentpp still locked, or unlocked if parentpp is NULL. write is 0 to
+// read-lock the path, 1 to write-lock it, or 2 to read-lock the path but
+// return the target write-locked. It is a constant at every call site, so
+// the lock choice is folded away.
+static inline NODE *FN(search)(const char *name, size_t len, NODE *parent,
+                               NODE **parentpp, int write) {
+    NODE *result;
+    while (1) {
+        NODE *next =
+            key_cmp(name, len, parent->name, parent->name_len) < 0
+                ? GET(parent->lchild)
+                : GET(parent->rchild);
+        if (next == NULL) {
+            result = NULL;
+            break;
+        }
+        if (write == 1)
+            FN(wrlock)(next);
+        else
+            FN(rdlock)(next);
+        if (key_cmp(name, len, next->name, next->name_len) == 0) {
+            if (write == 2) {
+                // the read-locked parent keeps next from being unlinked
+                FN(unlock)(next);
+                FN(wrlock)(next);
+            }
+            result = next;
+            break;
+        }
+        FN(unlock)(parent);
+        parent = next;
+    }
+    if (parentpp != NULL) {
+        *parentpp = parent;
+    } else {
+        FN(unlock)(parent);
+    }
+    return result;
+}
+
+#if BST_VALUE == BST_VALUE_LOG
+// called by the log's collector: rewrites name's value elsewhere in the log
+// if its node still refers to the record about to be dropped
+static int FN(relocate)(void *store, const char *name, vlog_ref_t ref) {
+    STORE *st = (STORE *)store;
+    int ret = 0;
+    FN(rdlock)(&st->head);
+    NODE *target = FN(search)(name, strlen(name), &st->head, NULL, 2);
+    if (target == NULL) return 0;
+    if (target->value == ref) ret = FN(set_value)(st, target, VALUE(target));
+    FN(unlock)(target);
+    return ret;
+}
+#endif
+
+static void *FN(open)(void) {
+    STORE *st = calloc(1, sizeof(STORE));
+    if (st == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+#if BST_LOCK == BST_LOCK_RWLOCK
+    int err = pthread_rwlock_init(&st->head.lock, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_init");
+    }
+#elif BST_LOCK == BST_LOCK_OPTIMISTIC
+    int err = pthread_mutex_init(&st->wlock, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_init");
+    }
+#endif
+#if BST_VALUE == BST_VALUE_LOG
+    if ((st->head.name = strdup("")) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    st->log = vlog_open(FN(relocate), st);
+#elif !BST_KEYLEN
+    if ((st->head.name = strdup("")) == NULL ||
+        (st->head.value = strdup("")) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+#endif
+    return st;
+}
+
+static int FN(query)(void *store, char *name, char *result, int len) {
+    STORE *st = (STORE *)store;
+    size_t name_len = strlen(name);
+#if BST_LOCK == BST_LOCK_OPTIMISTIC
+    char value[BST_KEYLEN];
+    NODE *target;
+    unsigned long s;
+    epoch_enter();
+    do {
+        s = FN(read_begin)(st);
+        target = FN(search)(name, name_len, &st->head, NULL, 0);
+        if (target != NULL) {
+            // the buffer may be mid-rewrite; never run past its end
+            size_t vlen = strnlen(target->value, BST_KEYLEN - 1);
+            memcpy(value, target->value, vlen);
+            value[vlen] = '\0';
+        }
+    } while (!FN(read_valid)(st, s));
+    epoch_exit();
+    if (target == NULL) return 0;
+    return snprintf(result, len, "%s", value) + 1;
+#else
+    FN(rdlock)(&st->head);
+    NODE *target = FN(search)(name, name_len, &st->head, NULL, 0);
+    if (target == NULL) return 0;
+    int n = snprintf(result, len, "%s", VALUE(target));
+    FN(unlock)(target);
+    return n + 1;
+#endif
+}
+
+static int FN(add)(void *store, char *name, char *value) {
+    STORE *st = (STORE *)store;
+    size_t name_len = strlen(name);
+    NODE *parent;
+    NODE *target;
+    NODE *newnode;
+
+    FN(writer_begin)(st);
+    FN(wrlock)(&st->head);
+    if ((target = FN(search)(name, name_len, &st->head, &parent, 1)) != NULL) {
+        FN(unlock)(target);
+        FN(unlock)(parent);
+        FN(writer_end)(st);
+        return 0;
+    }
+
+    if ((newnode = FN(node_new)(st, name, name_len, value)) == NULL) {
+        FN(unlock)(parent);
+        FN(writer_end)(st);
+        return 0;
+    }
+    if (key_cmp(name, name_len, parent->name, parent->name_len) < 0)
+        SET(parent->lchild, newnode);
+    else
+        SET(parent->rchild, newnode);
+    FN(unlock)(parent);
+    FN(writer_end)(st);
+    return 1;
+}
+
+static int FN(remove)(void *store, char *name) {
+    STORE *st = (STORE *)store;
+    NODE *parent;
+    NODE *dnode;
+
+    FN(writer_begin)(st);
+    FN(wrlock)(&st->head);
+    if ((dnode = FN(search)(name, strlen(name), &st->head, &parent, 1)) ==
+        NULL) {
+        FN(unlock)(parent);
+        FN(writer_end)(st);
+        return 0;
+    }
+
+    FN(seq_begin)(st);
+    int left = key_cmp(dnode->name, dnode->name_len, parent->name,
+                       parent->name_len) < 0;
+    if (dnode->rchild == NULL || dnode->lchild == NULL) {
+        // replace the parent's pointer with the only child, if any
+        NODE *child = dnode->rchild == NULL ? dnode->lchild : dnode->rchild;
+        if (left)
+            SET(parent->lchild, child);
+        else
+            SET(parent->rchild, child);
+        FN(seq_end)(st);
+        FN(unlock)(parent);
+        FN(node_drop)(dnode);
+    } else {
+        // move the smallest node of the right subtree into dnode's place
+        NODE *next = dnode->rchild;
+        NODE **pnext = &dnode->rchild;
+        FN(wrlock)(next);
+        while (next->lchild != NULL) {
+            NODE *nextl = next->lchild;
+            FN(wrlock)(nextl);
+            pnext = &next->lchild;
+            FN(unlock)(next);
+            next = nextl;
+        }
+#if BST_KEYLEN
+        memcpy(dnode->name, next->name, next->name_len + 1);
+        memcpy(dnode->value, next->value, BST_KEYLEN);
+#else
+        // swap the strings so that next frees dnode's old ones
+        char *tmp = dnode->name;
+        dnode->name = next->name;
+        next->name = tmp;
+        __typeof__(dnode->value) tmpv = dnode->value;
+        dnode->value = next->value;
+        next->value = tmpv;
+#endif
+        dnode->name_len = next->name_len;
+        SET(*pnext, next->rchild);
+        FN(seq_end)(st);
+        FN(node_drop)(next);
+        FN(unlock)(dnode);
+        FN(unlock)(parent);
+    }
+    FN(writer_end)(st);
+    return 1;
+}
+
+// Like bst_update in db.c: the value is rewritten in its node, under that
+// node's write lock alone (optimistic readers are fenced by the sequence
+// count instead).
+static int FN(update)(void *store, char *name, db_update_fn fn, void *arg) {
+    STORE *st = (STORE *)store;
+    size_t name_len = strlen(name);
+    char value[DB_UPDATE_LEN];
+
+    while (1) {
+        FN(writer_begin)(st);
+        FN(rdlock)(&st->head);
+        NODE *target = FN(search)(name, name_len, &st->head, NULL, 2);
+        if (target != NULL) {
+            int ret = fn(VALUE(target), value, sizeof(value), arg);
+            if (ret) {
+                FN(seq_begin)(st);
+                if (FN(set_value)(st, target, value) != 0) ret = 0;
+                FN(seq_end)(st);
+            }
+            FN(unlock)(target);
+            FN(writer_end)(st);
+            return ret;
+        }
+        FN(writer_end)(st);
+        if (!fn(NULL, value, sizeof(value), arg)) return 0;
+        if (FN(add)(store, name, value)) return 1;
+    }
+}
+
+// in-order, like bst_scan_recurs in db.c
+static void FN(scan_recurs)(NODE *node, int lvl, db_scan_fn fn, void *arg) {
+    NODE *left = node->lchild;
+    NODE *right = node->rchild;
+    if (left != NULL) {
+        FN(rdlock)(left);
+        FN(scan_recurs)(left, lvl + 1, fn, arg);
+    }
+    if (lvl > 0) fn(node->name, VALUE(node), arg);
+    if (right != NULL) {
+        FN(rdlock)(right);
+        FN(scan_recurs)(right, lvl + 1, fn, arg);
+    }
+    FN(unlock)(node);
+}
+
+static void FN(scan)(void *store, db_scan_fn fn, void *arg) {
+    STORE *st = (STORE *)store;
+    FN(writer_begin)(st);
+    FN(rdlock)(&st->head);
+    FN(scan_recurs)(&st->head, 0, fn, arg);
+    FN(writer_end)(st);
+}
+
+// pre-order, with the same layout as db_print_recurs in db.c
+static void FN(print_recurs)(NODE *node, int lvl, FILE *out) {
+    for (int i = 0; i < lvl; i++) {
+        fprintf(out, " ");
+    }
+    if (node == NULL) {
+        fprintf(out, "(null)\n");
+        return;
+    }
+    if (lvl == 0) {
+        fprintf(out, "(root)\n");
+    } else {
+        fprintf(out, "%s %s\n", node->name, VALUE(node));
+    }
+
+    NODE *left = node->lchild;
+    NODE *right = node->rchild;
+    if (left != NULL) FN(rdlock)(left);
+    if (right != NULL) FN(rdlock)(right);
+    FN(print_recurs)(left, lvl + 1, out);
+    FN(print_recurs)(right, lvl + 1, out);
+    FN(unlock)(node);
+}
+
+static void FN(print)(void *store, FILE *out) {
+    STORE *st = (STORE *)store;
+    FN(writer_begin)(st);
+    FN(rdlock)(&st->head);
+    FN(print_recurs)(&st->head, 0, out);
+    FN(writer_end)(st);
+}
+
+static void FN(cleanup_recurs)(NODE *node) {
+    if (node == NULL) return;
+    FN(cleanup_recurs)(node->lchild);
+    FN(cleanup_recurs)(node->rchild);
+#if BST_VALUE == BST_VALUE_LOG
+    node->value = VLOG_NONE;  // the log is gone already
+#endif
+    FN(node_free)(node);
+}
+
+static void FN(cleanup)(void *store) {
+    STORE *st = (STORE *)store;
+#if BST_VALUE == BST_VALUE_LOG
+    vlog_close(st->log);  // first, so the collector stops using the tree
+#endif
+    FN(cleanup_recurs)(st->head.lchild);
+    FN(cleanup_recurs)(st->head.rchild);
+#if BST_LOCK == BST_LOCK_RWLOCK
+    pthread_rwlock_destroy(&st->head.lock);
+#elif BST_LOCK == BST_LOCK_OPTIMISTIC
+    pthread_mutex_destroy(&st->wlock);
+    epoch_barrier();
+#endif
+#if BST_VALUE == BST_VALUE_LOG
+    free(st->head.name);
+#elif !BST_KEYLEN
+    free(st->head.name);
+    free(st->head.value);
+#endif
+    free(st);
+}
+
+const db_engine_t FN(engine) = {BST_ENGINE, FN(open),   FN(query),
+                                FN(add),    FN(remove), FN(update),
+                                FN(scan),   FN(print),  FN(cleanup)};
+
+#undef FN
+#undef NODE
+#undef STORE
+#undef CHUNK
+#undef GET
+#undef SET
+#undef SET_STR
+#undef VALUE
+#undef BST_NAME
+#undef BST_ENGINE
+#undef BST_LOCK
+#undef BST_KEYLEN
+#undef BST_ALLOC
+#undef BST_VALUE
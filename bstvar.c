@@ -0,0 +1,45 @@
+/*
+ * Specialized builds of the BST, generated from bst_tmpl.h. Each is a
+ * separate storage engine selectable with db_init() / the server's -e option.
+ */
+
+// the general case: heap strings and per-node rwlocks, like "bst"
+#define BST_NAME bst_rwlock
+#define BST_ENGINE "bst-rwlock"
+#define BST_LOCK BST_LOCK_RWLOCK
+#define BST_KEYLEN 0
+#define BST_ALLOC BST_ALLOC_MALLOC
+#include "./bst_tmpl.h"
+
+// fixed-width names and values stored inline in pooled nodes
+#define BST_NAME bst_fixed_rwlock
+#define BST_ENGINE "bst-fixed-rwlock"
+#define BST_LOCK BST_LOCK_RWLOCK
+#define BST_KEYLEN 32
+#define BST_ALLOC BST_ALLOC_POOL
+#include "./bst_tmpl.h"
+
+// read-mostly: readers take no locks at all
+#define BST_NAME bst_fixed_optimistic
+#define BST_ENGINE "bst-fixed-optimistic"
+#define BST_LOCK BST_LOCK_OPTIMISTIC
+#define BST_KEYLEN 32
+#define BST_ALLOC BST_ALLOC_POOL
+#include "./bst_tmpl.h"
+
+// single client, e.g. bulk loads: no locking
+#define BST_NAME bst_nolock
+#define BST_ENGINE "bst-nolock"
+#define BST_LOCK BST_LOCK_NONE
+#define BST_KEYLEN 0
+#define BST_ALLOC BST_ALLOC_POOL
+#include "./bst_tmpl.h"
+
+// values in a log beside the tree (WiscKey), which keeps only the keys
+#define BST_NAME bst_vlog
+#define BST_ENGINE "bst-vlog"
+#define BST_LOCK BST_LOCK_RWLOCK
+#define BST_KEYLEN 0
+#define BST_ALLOC BST_ALLOC_POOL
+#define BST_VALUE BST_VALUE_LOG
+#include "./bst_tmpl.h"
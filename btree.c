@@ -0,0 +1,734 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./engine.h"
+#include "./simd.h"
+
+/*
+ * B+tree kept in a file of BT_PAGE-byte pages and cached in a buffer pool.
+ * Page 0 describes the file and page 1 is always the root. When the root
+ * splits, its contents move to two new pages and it becomes their parent, so
+ * nobody ever has to find the root through a pointer that can change.
+ *
+ * Every page is slotted. A header is followed by an array of 16-bit cell
+ * offsets in key order, and the cells are packed from the end of the page
+ * downwards. A leaf cell is key length, value length, key, value. An inner
+ * cell is key length, child page, key. The child holds the keys >= that key,
+ * and the header's link is the child for keys below the first one. In a leaf
+ * the link is the next leaf, which scans follow.
+ *
+ * The pool is an array of frames. Each has a page number, a pin count, a
+ * clock reference bit and a latch (a rwlock). A pool mutex protects the page
+ * table and the pinning. A page is pinned while in use and latched while
+ * read or written, and only unpinned frames are evicted. The clock hand skips
+ * frames whose bit is set, clearing it on the way. Dirty victims are written
+ * back under the pool mutex, so no one can read a stale copy from the file
+ * while the write is in flight. Pages are read in with the frame
+ * write-latched but the mutex released.
+ *
+ * Lookups crab down with read latches: each child is latched before its
+ * parent is let go. Writers do the same but write-latch the leaf, and most
+ * writes fit in it. A write that would split the leaf starts over. The
+ * second time down it write-latches the whole path, letting go of the
+ * ancestors at every node that has room for one more entry. A split then
+ * only involves pages it already holds. Removes never merge pages: a leaf
+ * that empties stays in place and is reused by later adds to its key range.
+ *
+ * The file is only consistent after a clean shutdown, which marks it so in
+ * page 0. A file that was not closed cleanly is started over.
+ */
+
+#define BT_PAGE 4096
+#define BT_MAGIC 0x31454552544270ull  // "pBTREE1"
+#define BT_ROOT 1
+#define BT_MIN_POOL 16
+#define BT_MAX_DEPTH 32
+#define BT_KEY_MAX 255
+#define BT_INNER_MAX (5 + BT_KEY_MAX)  // largest inner cell
+
+// page 0
+typedef struct meta {
+    uint64_t magic;
+    uint32_t page_size;
+    uint32_t pages;
+    uint32_t clean;
+} meta_t;
+
+typedef struct page_hdr {
+    uint8_t level;  // 0 for leaves
+    uint8_t unused;
+    uint16_t nkeys;
+    uint16_t upper;  // where the cells start
+    uint16_t frag;   // bytes of dead cells above upper
+    uint32_t link;   // leaf: next leaf (0 if none); inner: leftmost child
+} page_hdr_t;
+
+typedef struct frame {
+    pthread_rwlock_t latch;
+    unsigned char *data;
+    uint32_t page;  // 0 while the frame is empty
+    int pins;
+    int ref;
+    int dirty;
+    int next;  // page table chain
+} frame_t;
+
+typedef struct btree {
+    int fd;
+    uint32_t pages;  // in the file, including ones only in the pool so far
+    pthread_mutex_t pool_lock;
+    frame_t *frames;
+    int nframes;
+    int *table;  // page table buckets, heads of chains through frame.next
+    int nbuckets;
+    int hand;  // clock hand
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long hits;
+    unsigned long misses;
+} btree_t;
+
+// a key and what goes with it: a value in a leaf, a child in an inner page
+typedef struct entry {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+    uint32_t child;
+} entry_t;
+
+#define BT_DEFAULT_PATH "btree.db"
+#define BT_DEFAULT_POOL 1024
+
+static const char *bt_path = BT_DEFAULT_PATH;
+static long bt_pool_pages = BT_DEFAULT_POOL;
+
+void btree_config(const char *path, long pool_pages) {
+    bt_path = path != NULL ? path : BT_DEFAULT_PATH;
+    bt_pool_pages = pool_pages > 0 ? pool_pages : BT_DEFAULT_POOL;
+}
+
+static inline void lock(int write, pthread_rwlock_t *lk) {
+    int err = write ? pthread_rwlock_wrlock(lk) : pthread_rwlock_rdlock(lk);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_lock");
+    }
+}
+
+static inline void unlock(pthread_rwlock_t *lk) {
+    int err = pthread_rwlock_unlock(lk);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+/* Pages */
+
+#define HDR(p) ((page_hdr_t *)(p))
+#define SLOTS(p) ((uint16_t *)((p) + sizeof(page_hdr_t)))
+
+static inline unsigned char *cell(unsigned char *p, int i) {
+    return p + SLOTS(p)[i];
+}
+
+static inline size_t cell_size(unsigned char *p, unsigned char *c) {
+    return HDR(p)->level == 0 ? 2 + c[0] + c[1] : 5 + c[0];
+}
+
+static inline const char *cell_key(unsigned char *p, unsigned char *c) {
+    return (const char *)c + (HDR(p)->level == 0 ? 2 : 5);
+}
+
+static inline uint32_t cell_child(unsigned char *c) {
+    uint32_t child;
+    memcpy(&child, c + 1, sizeof(child));
+    return child;
+}
+
+static inline const char *cell_value(unsigned char *c) {
+    return (const char *)c + 2 + c[0];
+}
+
+static inline size_t page_free(unsigned char *p) {
+    return HDR(p)->upper - sizeof(page_hdr_t) - 2 * HDR(p)->nkeys +
+           HDR(p)->frag;
+}
+
+static inline size_t entry_size(unsigned char *p, entry_t *e) {
+    return HDR(p)->level == 0 ? 2 + e->key_len + e->value_len
+                              : 5 + e->key_len;
+}
+
+static void page_init(unsigned char *p, int level) {
+    page_hdr_t *h = HDR(p);
+    h->level = level;
+    h->nkeys = 0;
+    h->upper = BT_PAGE;
+    h->frag = 0;
+    h->link = 0;
+}
+
+// index of the first key >= key; *found tells if it is equal
+static int page_find(unsigned char *p, const char *key, size_t len,
+                     int *found) {
+    int lo = 0, hi = HDR(p)->nkeys;
+    *found = 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        unsigned char *c = cell(p, mid);
+        int cmp = key_cmp(cell_key(p, c), c[0], key, len);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+            if (cmp == 0) *found = 1;
+        }
+    }
+    return lo;
+}
+
+// the child of inner page p to look for key in
+static uint32_t page_child(unsigned char *p, const char *key, size_t len) {
+    int found;
+    int i = page_find(p, key, len, &found);
+    if (found) return cell_child(cell(p, i));
+    return i == 0 ? HDR(p)->link : cell_child(cell(p, i - 1));
+}
+
+// moves the live cells together at the end of the page
+static void page_compact(unsigned char *p) {
+    unsigned char tmp[BT_PAGE];
+    page_hdr_t *h = HDR(p);
+    size_t upper = BT_PAGE;
+    for (int i = 0; i < h->nkeys; i++) {
+        unsigned char *c = cell(p, i);
+        size_t size = cell_size(p, c);
+        upper -= size;
+        memcpy(tmp + upper, c, size);
+        SLOTS(p)[i] = upper;
+    }
+    memcpy(p + upper, tmp + upper, BT_PAGE - upper);
+    h->upper = upper;
+    h->frag = 0;
+}
+
+// puts the cell for e at slot i; the caller has checked there is room
+static void page_insert(unsigned char *p, int i, entry_t *e) {
+    page_hdr_t *h = HDR(p);
+    size_t size = entry_size(p, e);
+    if (h->upper - sizeof(page_hdr_t) - 2 * h->nkeys < size + 2) {
+        page_compact(p);
+    }
+    h->upper -= size;
+    unsigned char *c = p + h->upper;
+    c[0] = e->key_len;
+    if (h->level == 0) {
+        c[1] = e->value_len;
+        memcpy(c + 2, e->key, e->key_len);
+        memcpy(c + 2 + e->key_len, e->value, e->value_len);
+    } else {
+        memcpy(c + 1, &e->child, sizeof(e->child));
+        memcpy(c + 5, e->key, e->key_len);
+    }
+    memmove(&SLOTS(p)[i + 1], &SLOTS(p)[i], (h->nkeys - i) * 2);
+    SLOTS(p)[i] = h->upper;
+    h->nkeys++;
+}
+
+static void page_delete(unsigned char *p, int i) {
+    page_hdr_t *h = HDR(p);
+    h->frag += cell_size(p, cell(p, i));
+    memmove(&SLOTS(p)[i], &SLOTS(p)[i + 1], (h->nkeys - i - 1) * 2);
+    h->nkeys--;
+}
+
+// stores e at slot i (replacing the key there if found); returns 0, leaving
+// the page alone, if it does not fit
+static int page_put(unsigned char *p, int i, int found, entry_t *e) {
+    size_t need = entry_size(p, e) + (found ? 0 : 2);
+    size_t room = page_free(p);
+    if (found) {
+        unsigned char *c = cell(p, i);
+        if (c[1] == e->value_len) {
+            memcpy((char *)cell_value(c), e->value, e->value_len);
+            return 1;
+        }
+        room += cell_size(p, c);
+    }
+    if (need > room) return 0;
+    if (found) page_delete(p, i);
+    page_insert(p, i, e);
+    return 1;
+}
+
+/* The buffer pool */
+
+// reads or writes a page, through the server's ring under -i uring
+static void page_io(btree_t *bt, int write, uint32_t page, unsigned char *buf) {
+    off_t off = (off_t)page * BT_PAGE;
+    ssize_t n = write ? comm_pwrite(bt->fd, buf, BT_PAGE, off)
+                      : comm_pread(bt->fd, buf, BT_PAGE, off);
+    if (n < 0) {
+        perror(write ? "pwrite" : "pread");
+        exit(1);
+    }
+    if (!write && n < BT_PAGE) {
+        // allocated, but never written back before a shutdown
+        memset(buf + n, 0, BT_PAGE - n);
+    }
+    __atomic_add_fetch(write ? &bt->writes : &bt->reads, 1, __ATOMIC_RELAXED);
+}
+
+// the next unpinned frame without its reference bit; called with the pool
+// mutex held
+static frame_t *clock_victim(btree_t *bt) {
+    for (int scanned = 0;; scanned++) {
+        frame_t *f = &bt->frames[bt->hand];
+        bt->hand = (bt->hand + 1) % bt->nframes;
+        if (__atomic_load_n(&f->pins, __ATOMIC_ACQUIRE) > 0) {
+            // every frame pinned: let their holders finish
+            if (scanned > 2 * bt->nframes) {
+                pthread_mutex_unlock(&bt->pool_lock);
+                sched_yield();
+                pthread_mutex_lock(&bt->pool_lock);
+                scanned = 0;
+            }
+            continue;
+        }
+        if (f->ref) {
+            f->ref = 0;
+            continue;
+        }
+        return f;
+    }
+}
+
+// returns page pinned; a new page comes zeroed instead of being read
+static frame_t *fetch(btree_t *bt, uint32_t page, int new) {
+    unsigned b = page % bt->nbuckets;
+    pthread_mutex_lock(&bt->pool_lock);
+    for (int i = bt->table[b]; i >= 0; i = bt->frames[i].next) {
+        frame_t *f = &bt->frames[i];
+        if (f->page == page) {
+            __atomic_add_fetch(&f->pins, 1, __ATOMIC_ACQUIRE);
+            f->ref = 1;
+            pthread_mutex_unlock(&bt->pool_lock);
+            __atomic_add_fetch(&bt->hits, 1, __ATOMIC_RELAXED);
+            return f;
+        }
+    }
+    frame_t *f = clock_victim(bt);
+    int idx = f - bt->frames;
+    if (f->page != 0) {
+        int *pi = &bt->table[f->page % bt->nbuckets];
+        while (*pi != idx) pi = &bt->frames[*pi].next;
+        *pi = f->next;
+        if (f->dirty) page_io(bt, 1, f->page, f->data);
+    }
+    f->page = page;
+    f->pins = 1;
+    f->ref = 1;
+    f->dirty = new;
+    f->next = bt->table[b];
+    bt->table[b] = idx;
+    // nobody holds an unpinned frame's latch, so this does not wait; anyone
+    // who finds the page before it is read waits for it here
+    lock(1, &f->latch);
+    pthread_mutex_unlock(&bt->pool_lock);
+    __atomic_add_fetch(&bt->misses, 1, __ATOMIC_RELAXED);
+    if (new) {
+        memset(f->data, 0, BT_PAGE);
+    } else {
+        page_io(bt, 0, page, f->data);
+    }
+    unlock(&f->latch);
+    return f;
+}
+
+static inline void unpin(frame_t *f) {
+    __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+}
+
+static inline void release(frame_t *f) {
+    unlock(&f->latch);
+    unpin(f);
+}
+
+// fetches and latches page
+static inline frame_t *latch(btree_t *bt, uint32_t page, int write) {
+    frame_t *f = fetch(bt, page, 0);
+    lock(write, &f->latch);
+    return f;
+}
+
+// a new page, pinned and write-latched
+static frame_t *page_alloc(btree_t *bt, int level) {
+    uint32_t page = __atomic_fetch_add(&bt->pages, 1, __ATOMIC_RELAXED);
+    frame_t *f = fetch(bt, page, 1);
+    lock(1, &f->latch);
+    page_init(f->data, level);
+    return f;
+}
+
+/* Descending */
+
+// the leaf for key, read-latched
+static frame_t *leaf_read(btree_t *bt, const char *key, size_t len) {
+    frame_t *f = latch(bt, BT_ROOT, 0);
+    while (HDR(f->data)->level > 0) {
+        frame_t *c = latch(bt, page_child(f->data, key, len), 0);
+        release(f);
+        f = c;
+    }
+    return f;
+}
+
+// the leaf for key, write-latched, with only read latches above it
+static frame_t *leaf_write(btree_t *bt, const char *key, size_t len) {
+    frame_t *f;
+    while (1) {
+        f = latch(bt, BT_ROOT, 0);
+        if (HDR(f->data)->level > 0) break;
+        // the root is the only leaf
+        unlock(&f->latch);
+        lock(1, &f->latch);
+        if (HDR(f->data)->level == 0) return f;
+        release(f);
+    }
+    while (HDR(f->data)->level > 0) {
+        int leaves = HDR(f->data)->level == 1;
+        frame_t *c = latch(bt, page_child(f->data, key, len), leaves);
+        release(f);
+        f = c;
+    }
+    return f;
+}
+
+// write-latches the path to key's leaf, from the lowest page that cannot be
+// split by putting e (need bytes in the leaf) below it; returns its length
+static int path_write(btree_t *bt, const char *key, size_t len, size_t need,
+                      frame_t **path) {
+    int n = 0;
+    frame_t *f = latch(bt, BT_ROOT, 1);
+    path[n++] = f;
+    while (HDR(f->data)->level > 0) {
+        f = latch(bt, page_child(f->data, key, len), 1);
+        size_t room = HDR(f->data)->level > 0 ? BT_INNER_MAX + 2 : need;
+        if (page_free(f->data) >= room) {
+            while (n > 0) release(path[--n]);
+        }
+        path[n++] = f;
+    }
+    return n;
+}
+
+// moves about half of full page p's keys to the new page q; copies the key
+// that separates them into sep and returns its length
+static size_t page_split(unsigned char *p, frame_t *qf, char *sep) {
+    unsigned char *q = qf->data;
+    page_hdr_t *h = HDR(p);
+    size_t total = 0, acc = 0;
+    int leaf = h->level == 0;
+    int m;
+
+    for (int i = 0; i < h->nkeys; i++) total += cell_size(p, cell(p, i)) + 2;
+    for (m = 0; m < h->nkeys - 1 && acc < total / 2; m++) {
+        acc += cell_size(p, cell(p, m)) + 2;
+    }
+    if (m == 0) m = 1;
+
+    unsigned char *mc = cell(p, m);
+    size_t sep_len = mc[0];
+    memcpy(sep, cell_key(p, mc), sep_len);
+    // an inner page's middle key moves up, and its child becomes q's first
+    int from = leaf ? m : m + 1;
+    if (leaf) {
+        HDR(q)->link = h->link;
+        h->link = qf->page;
+    } else {
+        HDR(q)->link = cell_child(mc);
+    }
+    for (int i = from; i < h->nkeys; i++) {
+        unsigned char *c = cell(p, i);
+        size_t size = cell_size(p, c);
+        HDR(q)->upper -= size;
+        memcpy(q + HDR(q)->upper, c, size);
+        SLOTS(q)[HDR(q)->nkeys++] = HDR(q)->upper;
+    }
+    h->nkeys = m;
+    page_compact(p);
+    return sep_len;
+}
+
+// stores e in path[i], splitting it, and the pages above it as needed
+static void put_split(btree_t *bt, frame_t **path, int i, entry_t *e) {
+    frame_t *f = path[i];
+    int found;
+    int at = page_find(f->data, e->key, e->key_len, &found);
+    char sep[BT_KEY_MAX];
+    size_t sep_len;
+
+    f->dirty = 1;
+    if (page_put(f->data, at, found, e)) return;
+
+    int level = HDR(f->data)->level;
+    frame_t *left = f;
+    frame_t *right = page_alloc(bt, level);
+    if (f->page == BT_ROOT) {
+        // the root's contents move down so that it stays page 1
+        left = page_alloc(bt, level);
+        memcpy(left->data, f->data, BT_PAGE);
+    }
+    sep_len = page_split(left->data, right, sep);
+    frame_t *dest = key_cmp(e->key, e->key_len, sep, sep_len) < 0 ? left : right;
+    at = page_find(dest->data, e->key, e->key_len, &found);
+    page_put(dest->data, at, found, e);
+
+    entry_t up = {sep, sep_len, NULL, 0, right->page};
+    if (f->page == BT_ROOT) {
+        page_init(f->data, level + 1);
+        HDR(f->data)->link = left->page;
+        page_insert(f->data, 0, &up);
+        left->dirty = 1;
+        release(left);
+        release(right);
+    } else {
+        release(right);
+        put_split(bt, path, i - 1, &up);
+    }
+}
+
+/* Engine functions */
+
+// fills result from the leaf cell c; returns the value's full length
+static int copy_value(unsigned char *c, char *result, int len) {
+    size_t n = c[1] < (size_t)len - 1 ? c[1] : (size_t)len - 1;
+    memcpy(result, cell_value(c), n);
+    result[n] = '\0';
+    return c[1];
+}
+
+static int bt_query(void *store, char *name, char *result, int len) {
+    btree_t *bt = (btree_t *)store;
+    size_t key_len = strlen(name);
+    int found, n = 0;
+    if (key_len > BT_KEY_MAX) return 0;
+    frame_t *f = leaf_read(bt, name, key_len);
+    int i = page_find(f->data, name, key_len, &found);
+    if (found) n = copy_value(cell(f->data, i), result, len) + 1;
+    release(f);
+    return n;
+}
+
+// decides what to store for e's key in leaf p: value if fn is NULL and the
+// key is absent, else what fn makes of the key's value (in out); sets e's
+// value and the key's slot, and returns 0 if nothing is to be stored
+static int decide(unsigned char *p, entry_t *e, char *value, db_update_fn fn,
+                  void *arg, char *out, int *i, int *found) {
+    char cur[BT_KEY_MAX + 1];
+    *i = page_find(p, e->key, e->key_len, found);
+    if (fn == NULL) {
+        if (*found) return 0;
+        e->value = value;
+    } else {
+        if (*found) copy_value(cell(p, *i), cur, sizeof(cur));
+        if (!fn(*found ? cur : NULL, out, DB_UPDATE_LEN, arg)) return 0;
+        e->value = out;
+    }
+    return (e->value_len = strlen(e->value)) <= BT_KEY_MAX;
+}
+
+// stores value for name if it is absent (fn NULL), or what fn makes of its
+// value; returns 1 if something was stored
+static int put(btree_t *bt, char *name, char *value, db_update_fn fn,
+               void *arg) {
+    char out[DB_UPDATE_LEN];
+    frame_t *path[BT_MAX_DEPTH];
+    entry_t e = {name, strlen(name), NULL, 0, 0};
+    int i, found, n, ret;
+
+    if (e.key_len > BT_KEY_MAX) return 0;
+    // first try with only the leaf write-latched
+    frame_t *f = leaf_write(bt, name, e.key_len);
+    if (!decide(f->data, &e, value, fn, arg, out, &i, &found)) {
+        release(f);
+        return 0;
+    }
+    if (page_put(f->data, i, found, &e)) {
+        f->dirty = 1;
+        release(f);
+        return 1;
+    }
+    size_t need = entry_size(f->data, &e) + 2;
+    release(f);
+
+    // the leaf has to split: go down again holding what may split with it
+    n = path_write(bt, name, e.key_len, need, path);
+    ret = decide(path[n - 1]->data, &e, value, fn, arg, out, &i, &found);
+    if (ret) put_split(bt, path, n - 1, &e);
+    while (n > 0) release(path[--n]);
+    return ret;
+}
+
+static int bt_add(void *store, char *name, char *value) {
+    return put((btree_t *)store, name, value, NULL, NULL);
+}
+
+static int bt_update(void *store, char *name, db_update_fn fn, void *arg) {
+    return put((btree_t *)store, name, NULL, fn, arg);
+}
+
+static int bt_remove(void *store, char *name) {
+    btree_t *bt = (btree_t *)store;
+    size_t key_len = strlen(name);
+    int found;
+    if (key_len > BT_KEY_MAX) return 0;
+    frame_t *f = leaf_write(bt, name, key_len);
+    int i = page_find(f->data, name, key_len, &found);
+    if (found) {
+        page_delete(f->data, i);
+        f->dirty = 1;
+    }
+    release(f);
+    return found;
+}
+
+// calls fn for every key, crabbing right along the leaves
+static void bt_scan(void *store, db_scan_fn fn, void *arg) {
+    btree_t *bt = (btree_t *)store;
+    char name[BT_KEY_MAX + 1], value[BT_KEY_MAX + 1];
+    frame_t *f = latch(bt, BT_ROOT, 0);
+    while (HDR(f->data)->level > 0) {
+        frame_t *c = latch(bt, HDR(f->data)->link, 0);
+        release(f);
+        f = c;
+    }
+    while (1) {
+        for (int i = 0; i < HDR(f->data)->nkeys; i++) {
+            unsigned char *c = cell(f->data, i);
+            memcpy(name, cell_key(f->data, c), c[0]);
+            name[c[0]] = '\0';
+            copy_value(c, value, sizeof(value));
+            fn(name, value, arg);
+        }
+        uint32_t next = HDR(f->data)->link;
+        if (next == 0) break;
+        frame_t *c = latch(bt, next, 0);
+        release(f);
+        f = c;
+    }
+    release(f);
+}
+
+static void print_entry(const char *name, const char *value, void *arg) {
+    fprintf((FILE *)arg, "%s %s\n", name, value);
+}
+
+// prints the keys in order, one per line, after the pool's statistics
+static void bt_print(void *store, FILE *out) {
+    btree_t *bt = (btree_t *)store;
+    unsigned long hits = __atomic_load_n(&bt->hits, __ATOMIC_RELAXED);
+    unsigned long misses = __atomic_load_n(&bt->misses, __ATOMIC_RELAXED);
+    fprintf(out,
+            "(btree of %u pages, %d in the pool: %.1f%% hits, %lu reads, "
+            "%lu writes)\n",
+            __atomic_load_n(&bt->pages, __ATOMIC_RELAXED), bt->nframes,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+            __atomic_load_n(&bt->reads, __ATOMIC_RELAXED),
+            __atomic_load_n(&bt->writes, __ATOMIC_RELAXED));
+    bt_scan(store, print_entry, out);
+}
+
+static void write_meta(btree_t *bt, int clean) {
+    unsigned char page[BT_PAGE] = {0};
+    meta_t m = {BT_MAGIC, BT_PAGE, bt->pages, clean};
+    memcpy(page, &m, sizeof(m));
+    page_io(bt, 1, 0, page);
+}
+
+// opens the file given to btree_config, or starts a new one
+static void *bt_open(void) {
+    btree_t *bt = calloc(1, sizeof(btree_t));
+    unsigned char page[BT_PAGE];
+    meta_t m;
+    if (bt == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if ((bt->fd = open(bt_path, O_RDWR | O_CREAT, 0644)) < 0) {
+        perror(bt_path);
+        exit(1);
+    }
+
+    bt->nframes = bt_pool_pages < BT_MIN_POOL ? BT_MIN_POOL : bt_pool_pages;
+    bt->nbuckets = bt->nframes * 2;
+    bt->frames = calloc(bt->nframes, sizeof(frame_t));
+    bt->table = malloc(bt->nbuckets * sizeof(int));
+    if (bt->frames == NULL || bt->table == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < bt->nbuckets; i++) bt->table[i] = -1;
+    for (int i = 0; i < bt->nframes; i++) {
+        int err = pthread_rwlock_init(&bt->frames[i].latch, 0);
+        if (err != 0) {
+            handle_error_en(err, "pthread_rwlock_init");
+        }
+        if (posix_memalign((void **)&bt->frames[i].data, BT_PAGE, BT_PAGE)) {
+            perror("posix_memalign");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&bt->pool_lock, 0);
+
+    memset(page, 0, sizeof(page));
+    if (comm_pread(bt->fd, page, BT_PAGE, 0) < 0) {
+        perror("pread");
+        exit(1);
+    }
+    memcpy(&m, page, sizeof(m));
+    if (m.magic == BT_MAGIC && m.page_size == BT_PAGE && m.clean) {
+        bt->pages = m.pages;
+    } else {
+        if (m.magic == BT_MAGIC) {
+            fprintf(stderr, "%s was not closed cleanly, starting empty\n",
+                    bt_path);
+        }
+        if (ftruncate(bt->fd, 0) < 0) {
+            perror("ftruncate");
+            exit(1);
+        }
+        bt->pages = BT_ROOT;
+        release(page_alloc(bt, 0));
+    }
+    write_meta(bt, 0);
+    return bt;
+}
+
+// writes back every dirty page and marks the file clean
+static void bt_cleanup(void *store) {
+    btree_t *bt = (btree_t *)store;
+    for (int i = 0; i < bt->nframes; i++) {
+        frame_t *f = &bt->frames[i];
+        if (f->page != 0 && f->dirty) page_io(bt, 1, f->page, f->data);
+        pthread_rwlock_destroy(&f->latch);
+        free(f->data);
+    }
+    write_meta(bt, 1);
+    if (fsync(bt->fd) < 0) perror("fsync");
+    close(bt->fd);
+    pthread_mutex_destroy(&bt->pool_lock);
+    free(bt->frames);
+    free(bt->table);
+    free(bt);
+}
+
+const db_engine_t btree_engine = {"btree",   bt_open,   bt_query,
+                                  bt_add,    bt_remove, bt_update,
+                                  bt_scan,   bt_print,  bt_cleanup};
@@ -0,0 +1,363 @@
+#include "./cache.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./hash.h"
+#include "./place.h"
+
+/*
+ * The cache is split into shards by key hash, each a set-associative table
+ * of fixed-size entries with its own admission sketch and statistics, so
+ * threads looking up different keys rarely touch the same cache lines.
+ *
+ * An entry is filled under its sequence count (odd while being written) and
+ * readers copy it out and check the count afterwards. It holds the version
+ * its key had before the engine was read, and is only returned while the
+ * key still has that version. Writers bump the version on both sides of
+ * their change, so a lookup that sees the version it needs started before
+ * the change did. Versions live in a table indexed by hash, so keys that
+ * share a slot also invalidate each other.
+ *
+ * Admission follows TinyLFU: every lookup is counted in a count-min sketch
+ * whose counters saturate at 15 and are halved periodically, and a
+ * missed key only replaces the least frequent entry of its set if it was
+ * looked up more often. Empty and stale entries are replaced first. A key's
+ * counters all lie in one 64-byte block, so counting costs one cache miss.
+ *
+ * With per-node placement (-n shard) every NUMA node has its own copy of the
+ * shards in its own memory, and threads only look in their node's copy.
+ * Versions stay shared, so each copy is invalidated by every write.
+ */
+
+#define CACHE_SHARDS 16
+#define CACHE_WAYS 4
+#define CACHE_VERSIONS (1 << 16)
+#define CACHE_DATA 110    // bytes for the key and value of an entry
+#define CACHE_SAMPLE 64   // one lookup in this many is timed, and a timed hit
+                          // is also looked up in the engine for comparison
+#define SKETCH_ROWS 4     // counters per key, one in each 16-byte row
+#define SKETCH_MAX 15     // counters saturate here
+#define SKETCH_RESET 10   // counters are halved after this many lookups
+                          // per entry of the shard
+#define MAXLEN 256
+
+typedef struct centry {
+    unsigned seq;
+    unsigned version;    // the key's version when its value was read
+    uint64_t hash;       // 0 if the entry is empty
+    unsigned char key_len;
+    unsigned char value_len;
+    char data[CACHE_DATA];  // the key, then the value
+} __attribute__((aligned(64))) centry_t;
+
+typedef struct shard {
+    centry_t *sets;
+    unsigned char *sketch;  // blocks of 64 counters
+    unsigned long block_mask;
+    unsigned long reset_at;
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long admitted;
+    unsigned long rejected;
+    unsigned long hit_ns;
+    unsigned long hit_engine_ns;  // what the timed hits took in the engine
+    unsigned long hit_timed;
+    unsigned long miss_ns;
+    unsigned long miss_timed;
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t *shards;  // copies * CACHE_SHARDS
+static int copies = 1;
+static unsigned long set_mask;
+static unsigned *versions;
+static __thread uint32_t sample_seed;
+
+static void *cache_alloc(size_t size) {
+    void *p;
+    if (posix_memalign(&p, 64, size) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+// memory for node n's copy of the shards
+static void *shard_alloc(int n, size_t size) {
+    return copies > 1 ? place_region(n, size) : cache_alloc(size);
+}
+
+static void shard_free(void *p, size_t size) {
+    if (copies > 1) {
+        place_region_free(p, size);
+    } else {
+        free(p);
+    }
+}
+
+static unsigned long pow2_at_least(unsigned long n) {
+    unsigned long p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+void cache_init(long entries) {
+    unsigned long nsets;
+    if (entries <= 0) return;
+    nsets = pow2_at_least((entries + CACHE_SHARDS * CACHE_WAYS - 1) /
+                          (CACHE_SHARDS * CACHE_WAYS));
+    set_mask = nsets - 1;
+    copies = place_mode() == PLACE_SHARD ? place_nodes() : 1;
+    versions = cache_alloc(CACHE_VERSIONS * sizeof(unsigned));
+    shards = cache_alloc(copies * CACHE_SHARDS * sizeof(shard_t));
+    for (int i = 0; i < copies * CACHE_SHARDS; i++) {
+        shard_t *s = &shards[i];
+        // 8 counters per entry, as TinyLFU suggests
+        unsigned long blocks = pow2_at_least(nsets * CACHE_WAYS / 8 + 1);
+        s->sets = shard_alloc(i / CACHE_SHARDS,
+                              nsets * CACHE_WAYS * sizeof(centry_t));
+        s->sketch = shard_alloc(i / CACHE_SHARDS, blocks * 64);
+        s->block_mask = blocks - 1;
+        s->reset_at = SKETCH_RESET * nsets * CACHE_WAYS;
+    }
+}
+
+void cache_shutdown(void) {
+    if (shards == NULL) return;
+    for (int i = 0; i < copies * CACHE_SHARDS; i++) {
+        shard_free(shards[i].sets,
+                   (set_mask + 1) * CACHE_WAYS * sizeof(centry_t));
+        shard_free(shards[i].sketch, (shards[i].block_mask + 1) * 64);
+    }
+    free(shards);
+    free(versions);
+    shards = NULL;
+    versions = NULL;
+}
+
+static uint64_t hash_of(const char *name, int len) {
+    uint64_t h = hash_mem(name, len);
+    return h != 0 ? h : 1;
+}
+
+static inline unsigned *version_of(uint64_t h) {
+    return &versions[(h >> 32) & (CACHE_VERSIONS - 1)];
+}
+
+/* Admission sketch */
+
+// the bits of h that pick shards and sets are remixed, so that keys of one
+// set do not share counters
+static inline unsigned char *counter(shard_t *s, uint64_t h, int row) {
+    h = hash_mix(h);
+    unsigned char *block = &s->sketch[((h >> 16) & s->block_mask) * 64];
+    return &block[row * 16 + ((h >> (4 * row)) & 15)];
+}
+
+static unsigned sketch_estimate(shard_t *s, uint64_t h) {
+    unsigned min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        unsigned c = __atomic_load_n(counter(s, h, row), __ATOMIC_RELAXED);
+        if (c < min) min = c;
+    }
+    return min;
+}
+
+// counts a lookup; racing increments may be lost, which only blurs counts
+static void sketch_add(shard_t *s, uint64_t h, unsigned long n) {
+    unsigned min = sketch_estimate(s, h);
+    if (min < SKETCH_MAX) {
+        // conservative update: only the smallest counters grow
+        for (int row = 0; row < SKETCH_ROWS; row++) {
+            unsigned char *c = counter(s, h, row);
+            if (__atomic_load_n(c, __ATOMIC_RELAXED) == min) {
+                __atomic_store_n(c, min + 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (n % s->reset_at == 0) {
+        // age the counts so that keys which were hot give way
+        for (unsigned long i = 0; i < (s->block_mask + 1) * 64; i++) {
+            unsigned char c = __atomic_load_n(&s->sketch[i], __ATOMIC_RELAXED);
+            __atomic_store_n(&s->sketch[i], c >> 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Entries */
+
+// copies the value cached for name at version v into result; 1 if found,
+// else result may have been overwritten
+static int lookup(centry_t *set, uint64_t h, const char *name, int key_len,
+                  unsigned v, char *result, int len) {
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        centry_t *e = &set[w];
+        unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || __atomic_load_n(&e->hash, __ATOMIC_RELAXED) != h) {
+            continue;
+        }
+        int value_len = e->value_len;
+        int match = e->key_len == key_len && e->version == v &&
+                    key_len + value_len <= CACHE_DATA && value_len < len &&
+                    memcmp(e->data, name, key_len) == 0;
+        if (match) {
+            memcpy(result, e->data + key_len, value_len);
+            result[value_len] = '\0';
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return match && __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq;
+    }
+    return 0;
+}
+
+// offers name's value, read at version v, a place in its set
+static void admit(shard_t *s, centry_t *set, uint64_t h, const char *name,
+                  int key_len, const char *value, unsigned v) {
+    int value_len = strlen(value);
+    centry_t *victim = NULL;
+    unsigned victim_freq = SKETCH_MAX + 1;
+    if (key_len + value_len > CACHE_DATA) return;
+
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        centry_t *e = &set[w];
+        uint64_t eh = __atomic_load_n(&e->hash, __ATOMIC_RELAXED);
+        if (eh == h || eh == 0 ||
+            e->version != __atomic_load_n(version_of(eh), __ATOMIC_RELAXED)) {
+            victim = e;
+            victim_freq = 0;
+            break;
+        }
+        unsigned f = sketch_estimate(s, eh);
+        if (f < victim_freq) {
+            victim = e;
+            victim_freq = f;
+        }
+    }
+    if (victim_freq > 0 && sketch_estimate(s, h) <= victim_freq) {
+        __atomic_add_fetch(&s->rejected, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // a filler already at work on the entry wins
+    unsigned seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) ||
+        !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&victim->hash, h, __ATOMIC_RELAXED);
+    victim->version = v;
+    victim->key_len = key_len;
+    victim->value_len = value_len;
+    memcpy(victim->data, name, key_len);
+    memcpy(victim->data + key_len, value, value_len);
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->admitted, 1, __ATOMIC_RELAXED);
+}
+
+static long elapsed_ns(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000000L +
+           (end.tv_nsec - start->tv_nsec);
+}
+
+/* Interface */
+
+int cache_query(const db_engine_t *engine, void *store, char *name,
+                char *result, int len) {
+    struct timespec start;
+    int key_len;
+    uint64_t h;
+    if (shards == NULL) return engine->query(store, name, result, len);
+
+    // sampled at random, since workloads can be periodic
+    sample_seed = sample_seed * 1103515245 + 12345;
+    int timed = (sample_seed >> 16) % CACHE_SAMPLE == 0;
+    if (timed) clock_gettime(CLOCK_MONOTONIC, &start);
+    key_len = strnlen(name, MAXLEN);
+    h = hash_of(name, key_len);
+    shard_t *s = &shards[place_node() % copies * CACHE_SHARDS +
+                         (h & (CACHE_SHARDS - 1))];
+    centry_t *set = &s->sets[((h >> 4) & set_mask) * CACHE_WAYS];
+    unsigned *version = version_of(h);
+    sketch_add(s, h, __atomic_add_fetch(&s->lookups, 1, __ATOMIC_RELAXED));
+
+    unsigned v = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    if (lookup(set, h, name, key_len, v, result, len)) {
+        __atomic_add_fetch(&s->hits, 1, __ATOMIC_RELAXED);
+        if (timed) {
+            char scratch[MAXLEN];
+            __atomic_add_fetch(&s->hit_ns, elapsed_ns(&start), __ATOMIC_RELAXED);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            engine->query(store, name, scratch, sizeof(scratch));
+            __atomic_add_fetch(&s->hit_engine_ns, elapsed_ns(&start),
+                               __ATOMIC_RELAXED);
+            __atomic_add_fetch(&s->hit_timed, 1, __ATOMIC_RELAXED);
+        }
+        return 1;
+    }
+
+    int found = engine->query(store, name, result, len);
+    // a write that began since v was read may not be in result
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (found && __atomic_load_n(version, __ATOMIC_RELAXED) == v) {
+        admit(s, set, h, name, key_len, result, v);
+    }
+    if (timed) {
+        __atomic_add_fetch(&s->miss_ns, elapsed_ns(&start), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->miss_timed, 1, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+unsigned cache_write_begin(const char *name) {
+    unsigned slot;
+    if (versions == NULL) return 0;
+    slot = version_of(hash_of(name, strnlen(name, MAXLEN))) - versions;
+    __atomic_add_fetch(&versions[slot], 1, __ATOMIC_SEQ_CST);
+    return slot;
+}
+
+void cache_write_end(unsigned slot) {
+    if (versions == NULL) return;
+    __atomic_add_fetch(&versions[slot], 1, __ATOMIC_RELEASE);
+}
+
+void cache_report(FILE *out) {
+    unsigned long lookups = 0, hits = 0, admitted = 0, rejected = 0;
+    unsigned long hit_ns = 0, hit_engine_ns = 0, hit_timed = 0;
+    unsigned long miss_ns = 0, miss_timed = 0;
+    if (shards == NULL) {
+        fprintf(out, "cache off\n");
+        return;
+    }
+    for (int i = 0; i < copies * CACHE_SHARDS; i++) {
+        shard_t *s = &shards[i];
+        lookups += __atomic_load_n(&s->lookups, __ATOMIC_RELAXED);
+        hits += __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+        admitted += __atomic_load_n(&s->admitted, __ATOMIC_RELAXED);
+        rejected += __atomic_load_n(&s->rejected, __ATOMIC_RELAXED);
+        hit_ns += __atomic_load_n(&s->hit_ns, __ATOMIC_RELAXED);
+        hit_engine_ns += __atomic_load_n(&s->hit_engine_ns, __ATOMIC_RELAXED);
+        hit_timed += __atomic_load_n(&s->hit_timed, __ATOMIC_RELAXED);
+        miss_ns += __atomic_load_n(&s->miss_ns, __ATOMIC_RELAXED);
+        miss_timed += __atomic_load_n(&s->miss_timed, __ATOMIC_RELAXED);
+    }
+    double hit_avg = hit_timed ? (double)hit_ns / hit_timed : 0;
+    double engine_avg = hit_timed ? (double)hit_engine_ns / hit_timed : 0;
+    double miss_avg = miss_timed ? (double)miss_ns / miss_timed : 0;
+    fprintf(out,
+            "cache of %lu entries%s: %lu lookups, %lu hits (%.1f%%), "
+            "%lu admitted, %lu rejected\n",
+            (set_mask + 1) * CACHE_WAYS * CACHE_SHARDS,
+            copies > 1 ? " per node" : "", lookups, hits,
+            lookups ? 100.0 * hits / lookups : 0.0, admitted, rejected);
+    fprintf(out,
+            "  hit %.0f ns (%.0f ns in the engine), miss %.0f ns (1 in %d "
+            "timed); hits saved about %.1f ms\n",
+            hit_avg, engine_avg, miss_avg, CACHE_SAMPLE,
+            hits * (engine_avg - hit_avg) / 1e6);
+}
@@ -0,0 +1,47 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdio.h>
+#include "./engine.h"
+
+/*
+ * Read cache of hot keys in front of the storage engine. Lookups take no
+ * locks: a cached value is only returned while its key's version is the one
+ * it was read at, and every write to the engine bumps that version before and
+ * after it changes the key. A TinyLFU sketch of recent lookups decides which
+ * keys are worth a place, so keys read once do not push out hot ones.
+ */
+
+/**
+ * cache_init() sets up a cache of about entries keys. With 0 the cache is off
+ * and the functions below go straight to the engine.
+ */
+void cache_init(long entries);
+
+/**
+ * cache_shutdown() frees the cache. No other thread may be using it.
+ */
+void cache_shutdown(void);
+
+/**
+ * cache_query() copies name's value into result, from the cache or else from
+ * engine's query, and returns 1 if found.
+ */
+int cache_query(const db_engine_t *engine, void *store, char *name,
+                char *result, int len);
+
+/**
+ * cache_write_begin() and cache_write_end() bracket every change to the
+ * engine's value for name. cache_write_begin() returns the slot of name's
+ * version to pass to cache_write_end().
+ */
+unsigned cache_write_begin(const char *name);
+void cache_write_end(unsigned slot);
+
+/**
+ * cache_report() prints the hit ratio and the time hits saved over going to
+ * the engine.
+ */
+void cache_report(FILE *out);
+
+#endif  // CACHE_H_
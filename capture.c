@@ -0,0 +1,161 @@
+#include "./capture.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+#include "./threadrec.h"
+
+/*
+ * A ring has one producer, the thread that claimed it, which only moves its
+ * tail, and one consumer, the writer, which only moves its head; a record is
+ * copied in before the tail is published past it. Rings are never freed:
+ * when a thread exits its ring is given up, with whatever the writer has not
+ * taken yet, and the next thread to note something claims it (threadrec.h).
+ */
+
+#define CAPTURE_RING (64 * 1024)  // bytes per thread; a power of two
+#define CAPTURE_FLUSH_MS 10
+
+typedef struct ring {
+    thread_rec_t rec;
+    uint64_t head __attribute__((aligned(64)));  // next byte to write out
+    uint64_t tail __attribute__((aligned(64)));  // next byte to fill
+    unsigned long recorded;
+    unsigned long dropped;
+    char data[CAPTURE_RING];
+} ring_t;
+
+static int capturing;
+static int stopping;
+static uint64_t start_ns;
+static const char *capture_path;
+static FILE *capture_file;
+static unsigned long written;  // bytes
+static pthread_t writer;
+static thread_recs_t rings = THREAD_RECS(ring_t, 64, NULL, NULL);
+static __thread ring_t *my_ring = NULL;
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// returns the calling thread's ring, claiming or allocating one on first use
+static ring_t *ring_get(void) {
+    if (my_ring == NULL) my_ring = (ring_t *)thread_rec_get(&rings);
+    return my_ring;
+}
+
+// copies len bytes into r at position pos, wrapping around its end
+static void ring_put(ring_t *r, uint64_t pos, const void *src, size_t len) {
+    size_t off = pos & (CAPTURE_RING - 1);
+    size_t first = CAPTURE_RING - off < len ? CAPTURE_RING - off : len;
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, (const char *)src + first, len - first);
+}
+
+void capture_note(uint32_t conn, capture_type_t type, const char *text) {
+    if (!__atomic_load_n(&capturing, __ATOMIC_ACQUIRE)) return;
+    ring_t *r = ring_get();
+    capture_record_t rec;
+    size_t len = text != NULL ? strnlen(text, BUFLEN) : 0;
+    rec.ts = now_ns(CLOCK_MONOTONIC) - start_ns;
+    rec.conn = conn;
+    rec.type = type;
+    rec.len = len;
+
+    uint64_t tail = r->tail;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (CAPTURE_RING - (tail - head) < sizeof(rec) + len) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring_put(r, tail, &rec, sizeof(rec));
+    ring_put(r, tail + sizeof(rec), text, len);
+    __atomic_store_n(&r->recorded, r->recorded + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->tail, tail + sizeof(rec) + len, __ATOMIC_RELEASE);
+}
+
+// moves everything in the rings to the file
+static void drain(void) {
+    for (thread_rec_t *t = thread_recs_first(&rings); t != NULL; t = t->next) {
+        ring_t *r = (ring_t *)t;
+        uint64_t head = r->head;
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) continue;
+        size_t off = head & (CAPTURE_RING - 1);
+        size_t len = tail - head;
+        size_t first = CAPTURE_RING - off < len ? CAPTURE_RING - off : len;
+        fwrite(r->data + off, 1, first, capture_file);
+        fwrite(r->data, 1, len - first, capture_file);
+        __atomic_store_n(&r->head, tail, __ATOMIC_RELEASE);
+        __atomic_store_n(&written, written + len, __ATOMIC_RELAXED);
+    }
+    fflush(capture_file);
+}
+
+static void *write_loop(void *arg) {
+    struct timespec ts = {0, CAPTURE_FLUSH_MS * 1000000L};
+    (void)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+        drain();
+    }
+    return NULL;
+}
+
+int capture_start(const char *path) {
+    if ((capture_file = comm_fopen(path, "w")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    capture_header_t h;
+    memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+    h.start = now_ns(CLOCK_REALTIME);
+    start_ns = now_ns(CLOCK_MONOTONIC);
+    if (fwrite(&h, sizeof(h), 1, capture_file) != 1) {
+        perror(path);
+        fclose(capture_file);
+        return -1;
+    }
+    capture_path = path;
+    int err = pthread_create(&writer, 0, write_loop, NULL);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    __atomic_store_n(&capturing, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void capture_stop(void) {
+    if (capture_file == NULL) return;
+    __atomic_store_n(&capturing, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    int err = pthread_join(writer, NULL);
+    if (err != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    drain();
+    if (ferror(capture_file) || fclose(capture_file) != 0) {
+        perror(capture_path);
+    }
+    capture_file = NULL;
+}
+
+void capture_report(FILE *out) {
+    unsigned long recorded = 0, dropped = 0;
+    if (capture_path == NULL) {
+        fprintf(out, "capture off\n");
+        return;
+    }
+    for (thread_rec_t *t = thread_recs_first(&rings); t != NULL; t = t->next) {
+        ring_t *r = (ring_t *)t;
+        recorded += __atomic_load_n(&r->recorded, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "capture to %s: %lu records, %lu dropped, %lu bytes written\n",
+            capture_path, recorded, dropped,
+            __atomic_load_n(&written, __ATOMIC_RELAXED));
+}
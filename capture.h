@@ -0,0 +1,64 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Capture of the commands clients send, for the replay tool. comm_serve()
+ * notes each command as it arrives and each response as it leaves, and the
+ * listener notes each connection as it opens; a note goes into a ring owned
+ * by the calling thread, without locks, and a writer thread moves the rings'
+ * contents to the capture file. A note that finds its ring full is dropped
+ * and counted rather than waited for.
+ *
+ * The file is a capture_header_t followed by records, each a
+ * capture_record_t and its len bytes of command. Records are in time order
+ * for each thread but not across threads.
+ */
+
+#define CAPTURE_MAGIC "dbcap001"
+
+typedef struct capture_header {
+    char magic[8];
+    uint64_t start;  // wall-clock time of the first record's 0, in ns
+} capture_header_t;
+
+typedef enum capture_type {
+    CAPTURE_OPEN,     // a connection was accepted
+    CAPTURE_COMMAND,  // a command arrived
+    CAPTURE_DONE,     // its response is being sent
+    CAPTURE_CLOSE,    // the connection was closed
+} capture_type_t;
+
+typedef struct capture_record {
+    uint64_t ts;  // ns since the capture started
+    uint32_t conn;
+    uint16_t type;
+    uint16_t len;
+} capture_record_t;
+
+/**
+ * capture_start() starts capturing to the file at path. Returns -1 if it
+ * cannot be created.
+ */
+int capture_start(const char *path);
+
+/**
+ * capture_note() records an event of a connection; text is the command of a
+ * CAPTURE_COMMAND and NULL otherwise. Does nothing unless capturing.
+ */
+void capture_note(uint32_t conn, capture_type_t type, const char *text);
+
+/**
+ * capture_stop() writes out what is left in the rings and closes the file.
+ * Threads may still call capture_note(), which then does nothing.
+ */
+void capture_stop(void);
+
+/**
+ * capture_report() prints how many records were written and dropped.
+ */
+void capture_report(FILE *out);
+
+#endif  // CAPTURE_H_
@@ -9,61 +9,53 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "./shm.h"
+#include "./sock.h"
 
 #define BUFSIZE 1024
 
 /*
- * Helper that opens a TCP socket representing the server.
- * Returns the file descriptor on success, -1 on failure.
+ * Runs the script over shared-memory rings offered on the Unix-domain
+ * socket sock, instead of the socket itself.
  */
-int get_socket(const char *server, const char *port) {
-    // setup for getaddrinfo
-    int sock;
-    struct addrinfo hints;
-    struct addrinfo *result;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    int err;
-    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
-        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
-        return -1;
+void run_shm(int sock, FILE *infile) {
+    shm_cx_t *shm;
+    if ((shm = shm_create(sock)) == NULL || shm_offer(shm) < 0) {
+        fprintf(stderr, "No connection!\n");
+        exit(1);
     }
 
-    // find the right interface
-    struct addrinfo *res;
-    for (res = result; res != NULL; res = res->ai_next) {
-        if ((sock = socket(res->ai_family, res->ai_socktype,
-                           res->ai_protocol)) < 0) {
-            continue;
+    char rbuf[BUFSIZE], qbuf[BUFSIZE];
+    while (fgets(qbuf, sizeof(qbuf), infile) != NULL) {
+        if (shm_send(shm, qbuf, strlen(qbuf)) < 0) {
+            fprintf(stderr, "No connection!\n");
+            exit(1);
         }
-        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
-            break;
+        if (shm_recv(shm, rbuf, sizeof(rbuf)) < 0) {
+            fprintf(stderr, "Connection terminated.\n");
+            exit(1);
         }
-        close(sock);
+        printf("%s\n", rbuf);
     }
-
-    freeaddrinfo(result);
-
-    if (res == NULL) {
-        fprintf(stderr, "Failed to connect to '%s'!\n", server);
-        return -1;
-    }
-
-    return sock;
+    shm_close(shm);
+    shm_detach(shm);
+    close(sock);
+    fclose(infile);
+    printf("Client terminated cleanly.\n");
+    exit(0);
 }
 
 /*
  * Forks off a process that attempts to connect to the server, and then run the
- * script in the file provided.
+ * script in the file provided. If path is given, the server is reached through
+ * its Unix-domain socket there, and with shm, through shared-memory rings.
  * Returns the pid of the child process.
  */
-pid_t create_occurence(const char *server, const char *port,
-                       const char *script) {
+pid_t create_occurence(const char *server, const char *port, const char *path,
+                       int shm, const char *script) {
     pid_t pid;
 
     // create a process for the client
@@ -81,9 +73,17 @@ pid_t create_occurence(const char *server, const char *port,
 
         // Step 3: set up a new connection to the server
         int sock;
-        if ((sock = get_socket(server, port)) == -1) {
+        if (path != NULL) {
+            sock = get_local_socket(path);
+        } else {
+            sock = get_socket(server, port);
+        }
+        if (sock == -1) {
             exit(1);
         }
+        if (shm) {
+            run_shm(sock, infile);
+        }
 
         // Step 4: loop, sending queries and printing responses
         FILE *cxn = fdopen(sock, "w+");
@@ -128,13 +128,15 @@ pid_t create_occurence(const char *server, const char *port,
 void usage_error(const char *cmd) {
     fprintf(stderr,
             "Usage: %s <servername> <port> "
-            "[<script> <occurences>]\n",
-            cmd);
+            "[<script> <occurences>]\n"
+            "       %s -u <socket-path> [-m] [<script> <occurences>]\n",
+            cmd, cmd);
 }
 
 /*
  * The arguments to the client should be servername, port number,
- * [script-file, number of occurences].
+ * [script-file, number of occurences], or -u and the server's Unix-domain
+ * socket instead of servername and port, with -m to use shared memory.
  *
  * Step 1: fork to create as many clients as number of occurences argument
  *
@@ -147,24 +149,52 @@ void usage_error(const char *cmd) {
  */
 int main(int argc, const char *argv[]) {
     // parse args
-    if (argc != 3 && argc != 5) {
+    int opt, shm = 0;
+    const char *path = NULL;
+    while ((opt = getopt(argc, (char *const *)argv, "u:m")) != -1) {
+        switch (opt) {
+            case 'u':
+                path = optarg;
+                break;
+            case 'm':
+                shm = 1;
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+    const char **args = argv + optind;
+    int nargs = argc - optind;
+
+    const char *server = NULL;
+    const char *port = NULL;
+    if (path == NULL) {
+        if (shm || nargs < 2) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        server = args[0];
+        port = args[1];
+        args += 2;
+        nargs -= 2;
+    }
+    if (nargs != 0 && nargs != 2) {
         usage_error(argv[0]);
         return 1;
     }
 
     int i, occurences = 1;
     const char *script = NULL;
-    const char *server = argv[1];
-    const char *port = argv[2];
 
-    if (argc == 5) {
-        script = argv[3];
-        occurences = atoi(argv[4]);
+    if (nargs == 2) {
+        script = args[0];
+        occurences = atoi(args[1]);
     }
 
     // Step 1: create clients, they'll do the rest
     for (i = 0; i < occurences; i++) {
-        if (create_occurence(server, port, script) == -1) {
+        if (create_occurence(server, port, path, shm, script) == -1) {
             perror("Error forking off process");
             return 1;
         }
@@ -1,24 +1,75 @@
+#define _GNU_SOURCE
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include "./admit.h"
+#include "./capture.h"
+#include "./place.h"
+#include "./shm.h"
+#include "./trace.h"
+#include "./uring.h"
 
 /* Serverside I/O functions */
 
+#define RING_FILE_BUFSIZE (64 * 1024)
+
+struct comm_cx {
+    FILE *stream;     // stdio engine: commands
+    FILE *out;        // and responses, on a dup of stream's socket
+    uring_cx_t *ucx;  // io_uring engine
+    shm_cx_t *shm;    // shared-memory rings, over stream's local socket
+    int hello;        // a local connection that may still offer rings
+    uint32_t id;      // in the capture
+};
+
+// a file whose reads and writes are carried by the ring
+typedef struct ring_file {
+    int fd;
+    off_t off;
+} ring_file_t;
+
 int lsock;
 
-static void *listener(void (*server)(FILE *));
+static void *listener(void (*server)(comm_cx_t *));
 
 static int comm_port;
+static const char *comm_path;  // of the Unix-domain socket, if any
+static comm_engine_t comm_engine = comm_stdio;
+static void (*comm_server)(comm_cx_t *);
+static uint32_t comm_ids;  // connections so far
+
+// numbers a new connection and notes it in the capture
+static void cx_opened(comm_cx_t *cx) {
+    cx->id = __atomic_add_fetch(&comm_ids, 1, __ATOMIC_RELAXED);
+    capture_note(cx->id, CAPTURE_OPEN, NULL);
+}
+
+comm_engine_t comm_init(comm_engine_t engine) {
+    if (engine == comm_uring && uring_init() < 0) {
+        fprintf(stderr, "io_uring unavailable, falling back to stdio\n");
+        engine = comm_stdio;
+    }
+    comm_engine = engine;
+    return engine;
+}
 
-pthread_t start_listener(int port, void (*server)(FILE *)) {
+void comm_local(const char *path) { comm_path = path; }
+
+void comm_pipeline(int commands) { uring_pipeline(commands); }
+
+pthread_t start_listener(int port, void (*server)(comm_cx_t *)) {
     comm_port = port;
     pthread_t tid;
     int err;
@@ -30,7 +81,148 @@ pthread_t start_listener(int port, void (*server)(FILE *)) {
     return tid;
 }
 
-void *listener(void (*server)(FILE *)) {
+// wraps connections accepted by the io_uring engine
+static void uring_server(uring_cx_t *ucx) {
+    comm_cx_t *cx = malloc(sizeof(comm_cx_t));
+    if (cx == NULL) {
+        perror("malloc");
+        uring_shutdown(ucx);
+        admit_session_end();
+        return;
+    }
+    cx->stream = NULL;
+    cx->out = NULL;
+    cx->ucx = ucx;
+    cx->shm = NULL;
+    cx->hello = 0;
+    cx_opened(cx);
+    comm_server(cx);
+}
+
+// accepts connections on sock for the stdio engine, forever
+static void accept_loop(int sock, int local, void (*server)(comm_cx_t *)) {
+    while (1) {
+        int csock;
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        if ((csock = accept(sock, (struct sockaddr *)&client_addr,
+                            &client_len)) < 0) {
+            perror("accept");
+            continue;
+        }
+
+        if (local) {
+            fprintf(stderr, "received local connection\n");
+        } else {
+            fprintf(stderr, "received connection from %s#%hu\n",
+                    inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+        }
+        if (admit_session() < 0) {
+            admit_refuse(csock);
+            continue;
+        }
+        // a stream apiece for the two directions: on a single one, a
+        // response written while pipelined commands are still buffered
+        // makes stdio seek the socket, which fails
+        FILE *cxstr, *out = NULL;
+        int osock = dup(csock);
+        if (!(cxstr = fdopen(csock, "r")) || osock < 0 ||
+            !(out = fdopen(osock, "w"))) {
+            perror("fdopen");
+            if (cxstr != NULL) {
+                fclose(cxstr);
+            } else if (close(csock) < 0) {
+                perror("close");
+            }
+            if (osock >= 0 && close(osock) < 0) perror("close");
+            admit_session_end();
+            continue;
+        }
+
+        comm_cx_t *cx = malloc(sizeof(comm_cx_t));
+        if (cx == NULL) {
+            perror("malloc");
+            if (fclose(out) < 0) perror("fclose");
+            if (fclose(cxstr) < 0) perror("fclose");
+            admit_session_end();
+            continue;
+        }
+        cx->stream = cxstr;
+        cx->out = out;
+        cx->ucx = NULL;
+        cx->shm = NULL;
+        cx->hello = local;
+        cx_opened(cx);
+        server(cx);
+    }
+}
+
+typedef struct local_listener {
+    pthread_t thread;
+    int sock;
+    void (*server)(comm_cx_t *);
+} local_listener_t;
+
+static void *local_listen(void *arg) {
+    local_listener_t *ll = arg;
+    place_thread(0);
+    accept_loop(ll->sock, 1, ll->server);
+    return NULL;
+}
+
+// listens on comm_path in a thread of its own; its connections always use
+// the stdio engine, which can receive a memfd with them
+static local_listener_t *start_local(void (*server)(comm_cx_t *)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(comm_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", comm_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, comm_path);
+
+    local_listener_t *ll = malloc(sizeof(local_listener_t));
+    if (ll == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    ll->server = server;
+    if ((ll->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    // a socket left by an earlier server
+    unlink(comm_path);
+    if (bind(ll->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(ll->sock, 100) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    fprintf(stderr, "listening on %s\n", comm_path);
+
+    int err = pthread_create(&ll->thread, 0, local_listen, ll);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    return ll;
+}
+
+// cancels the local listener along with the listener thread
+static void stop_local(void *arg) {
+    local_listener_t *ll = arg;
+    if (ll == NULL) return;
+    pthread_cancel(ll->thread);
+    pthread_join(ll->thread, NULL);
+    if (close(ll->sock) < 0) perror("close");
+    unlink(comm_path);
+    free(ll);
+}
+
+void *listener(void (*server)(comm_cx_t *)) {
+    // also the io_uring engine's completion thread
+    place_thread(0);
     if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
@@ -56,50 +248,226 @@ void *listener(void (*server)(FILE *)) {
 
     fprintf(stderr, "listening on port %d\n", comm_port);
 
-    while (1) {
-        int csock;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-
-        if ((csock = accept(lsock, (struct sockaddr *)&client_addr,
-                            &client_len)) < 0) {
-            perror("accept");
-            continue;
-        }
-
-        fprintf(stderr, "received connection from %s#%hu\n",
-                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+    local_listener_t *ll = comm_path != NULL ? start_local(server) : NULL;
+    pthread_cleanup_push(stop_local, ll);
+    if (comm_engine == comm_uring) {
+        comm_server = server;
+        uring_run(lsock, uring_server);
+    }
+    accept_loop(lsock, 0, server);
+    pthread_cleanup_pop(1);
 
-        FILE *cxstr;
-        if (!(cxstr = fdopen(csock, "w+"))) {
-            perror("fdopen");
-            if (close(csock) < 0) perror("close");
-            continue;
-        }
+    return NULL;
+}
 
-        server(cxstr);
+void comm_shutdown(comm_cx_t *cxstr) {
+    capture_note(cxstr->id, CAPTURE_CLOSE, NULL);
+    if (cxstr->shm != NULL) shm_detach(cxstr->shm);
+    if (cxstr->ucx != NULL) {
+        uring_shutdown(cxstr->ucx);
+    } else {
+        if (fclose(cxstr->out) < 0) perror("fclose");
+        if (fclose(cxstr->stream) < 0) perror("fclose");
     }
+    free(cxstr);
+    admit_session_end();
+}
 
-    return NULL;
+void comm_interrupt(comm_cx_t *cx) {
+    shm_cx_t *shm = __atomic_load_n(&cx->shm, __ATOMIC_ACQUIRE);
+    if (shm != NULL) shm_close(shm);
+    if (cx->ucx != NULL) {
+        uring_interrupt(cx->ucx);
+    } else if (shutdown(fileno(cx->stream), SHUT_RDWR) < 0 &&
+               errno != ENOTCONN) {
+        perror("shutdown");
+    }
 }
 
-void comm_shutdown(FILE *cxstr) {
-    if (fclose(cxstr) < 0) perror("fclose");
+// reads the first byte of a local connection, which is SHM_HELLO with a memfd
+// if the client wants the rings; any other byte is the start of a command.
+// Returns -1 if the connection is gone.
+static int take_hello(comm_cx_t *cx) {
+    int sock = fileno(cx->stream);
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cx->hello = 0;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+
+    int memfd = -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c != NULL && c->cmsg_level == SOL_SOCKET &&
+        c->cmsg_type == SCM_RIGHTS) {
+        memcpy(&memfd, CMSG_DATA(c), sizeof(int));
+    }
+    if (byte != SHM_HELLO) {
+        if (memfd >= 0) close(memfd);
+        return ungetc(byte, cx->stream) == EOF ? -1 : 0;
+    }
+    if (memfd < 0) return -1;
+    shm_cx_t *shm = shm_attach(memfd, sock);
+    if (shm == NULL) return -1;
+    __atomic_store_n(&cx->shm, shm, __ATOMIC_RELEASE);
+    return 0;
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
+// sends response and reads the next command, on whichever transport cx uses
+static int serve(comm_cx_t *cx, char *response, char *command) {
+    if (cx->ucx != NULL) {
+        return uring_serve(cx->ucx, response, command);
+    }
+
+    if (cx->hello && take_hello(cx) < 0) {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+
+    if (cx->shm != NULL) {
+        if (strlen(response) > 0 &&
+            shm_send(cx->shm, response, strlen(response)) < 0) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+        TRACE_END(write);
+        trace_request_end();
+        if (shm_recv(cx->shm, command, BUFLEN) < 0) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+        return 0;
+    }
+
     if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+        if (fputs(response, cx->out) == EOF || fputc('\n', cx->out) == EOF ||
+            fflush(cx->out) == EOF) {
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
     }
+    TRACE_END(write);
+    trace_request_end();
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
+    if (fgets(command, BUFLEN, cx->stream) == NULL) {
         fprintf(stderr, "client connection terminated\n");
         return -1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int comm_serve(comm_cx_t *cx, char *response, char *command) {
+    if (response[0] != '\0') {
+        capture_note(cx->id, CAPTURE_DONE, NULL);
+        TRACE_BEGIN(write);
+    }
+    if (serve(cx, response, command) < 0) return -1;
+    capture_note(cx->id, CAPTURE_COMMAND, command);
+    trace_request_begin(command);
+    return 0;
+}
+
+ssize_t comm_pread(int fd, void *buf, size_t len, off_t off) {
+    if (comm_engine == comm_uring) return uring_pread(fd, buf, len, off);
+    return pread(fd, buf, len, off);
+}
+
+ssize_t comm_pwrite(int fd, const void *buf, size_t len, off_t off) {
+    if (comm_engine == comm_uring) return uring_pwrite(fd, buf, len, off);
+    return pwrite(fd, buf, len, off);
+}
+
+static ssize_t ring_file_read(void *cookie, char *buf, size_t size) {
+    ring_file_t *rf = cookie;
+    ssize_t n = uring_pread(rf->fd, buf, size, rf->off);
+    if (n > 0) rf->off += n;
+    return n;
+}
+
+static ssize_t ring_file_write(void *cookie, const char *buf, size_t size) {
+    ring_file_t *rf = cookie;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = uring_pwrite(rf->fd, buf + done, size - done, rf->off);
+        if (n <= 0) return done > 0 ? (ssize_t)done : -1;
+        rf->off += n;
+        done += n;
+    }
+    return done;
+}
+
+static int ring_file_seek(void *cookie, off64_t *offset, int whence) {
+    ring_file_t *rf = cookie;
+    struct stat st;
+    switch (whence) {
+        case SEEK_SET:
+            rf->off = *offset;
+            break;
+        case SEEK_CUR:
+            rf->off += *offset;
+            break;
+        case SEEK_END:
+            if (fstat(rf->fd, &st) < 0) return -1;
+            rf->off = st.st_size + *offset;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    *offset = rf->off;
+    return 0;
+}
+
+static int ring_file_close(void *cookie) {
+    ring_file_t *rf = cookie;
+    int ret = close(rf->fd);
+    free(rf);
+    return ret;
+}
+
+FILE *comm_fopen(const char *path, const char *mode) {
+    // append mode relies on O_APPEND positioning, which explicit offsets
+    // would defeat, so leave it to stdio
+    if (comm_engine != comm_uring || strchr(mode, 'a') != NULL) {
+        return fopen(path, mode);
+    }
+
+    int flags;
+    int rw = strchr(mode, '+') != NULL;
+    if (mode[0] == 'r') {
+        flags = rw ? O_RDWR : O_RDONLY;
+    } else if (mode[0] == 'w') {
+        flags = (rw ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+    } else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ring_file_t *rf = malloc(sizeof(ring_file_t));
+    if (rf == NULL) return NULL;
+    if ((rf->fd = open(path, flags | O_CLOEXEC, 0666)) < 0) {
+        free(rf);
+        return NULL;
+    }
+    rf->off = 0;
+
+    cookie_io_functions_t funcs = {ring_file_read, ring_file_write,
+                                   ring_file_seek, ring_file_close};
+    FILE *f = fopencookie(rf, mode, funcs);
+    if (f == NULL) {
+        ring_file_close(rf);
+        return NULL;
+    }
+    // fewer, larger writes through the ring
+    setvbuf(f, NULL, _IOFBF, RING_FILE_BUFSIZE);
+    return f;
+}
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define BUFLEN 256
 #define handle_error_en(en, msg) \
@@ -13,8 +14,61 @@
         exit(EXIT_FAILURE);      \
     } while (0)
 
-pthread_t start_listener(int port, void (*serve_func)(FILE *));
-void comm_shutdown(FILE *cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+// I/O engines the server can run its sockets and files through
+typedef enum comm_engine { comm_stdio, comm_uring } comm_engine_t;
+
+// a client connection, whichever engine it belongs to
+typedef struct comm_cx comm_cx_t;
+
+/**
+ * comm_init() selects the I/O engine. If io_uring is requested but the kernel
+ * does not support it, the stdio engine is used instead. Returns the engine
+ * actually selected. Must be called before start_listener().
+ */
+comm_engine_t comm_init(comm_engine_t engine);
+
+/**
+ * comm_local() makes start_listener() also listen on a Unix-domain socket at
+ * path, replacing any socket already there. Its connections use the stdio
+ * engine, or the shared-memory rings of shm.h if the client offers them.
+ */
+void comm_local(const char *path);
+
+/**
+ * comm_pipeline() limits how many commands a client may send ahead of its
+ * answers: once that many are waiting, the server stops reading from the
+ * connection until it has answered some, and the client's sends block once
+ * the socket's buffer is full. Only the io_uring engine needs it, as it reads
+ * whatever arrives; a stdio thread reads a command only when it has answered
+ * the last, so it is already limited by the socket's buffer. 0, the default,
+ * sets no limit. Must be called before start_listener().
+ */
+void comm_pipeline(int commands);
+
+pthread_t start_listener(int port, void (*serve_func)(comm_cx_t *));
+void comm_shutdown(comm_cx_t *cxstr);
+int comm_serve(comm_cx_t *cxstr, char *resp, char *cmd);
+
+/**
+ * comm_interrupt() shuts down a connection's socket with shutdown(2), so
+ * that a thread blocked reading or writing it wakes up and its comm_serve()
+ * fails. The connection is still freed by comm_shutdown().
+ */
+void comm_interrupt(comm_cx_t *cxstr);
+
+/**
+ * comm_fopen() opens a file like fopen(), except that under the io_uring
+ * engine its reads and writes go through the server's ring. Used for
+ * db_print output and any other files the server writes.
+ */
+FILE *comm_fopen(const char *path, const char *mode);
+
+/**
+ * comm_pread() and comm_pwrite() are pread(2) and pwrite(2), except that
+ * under the io_uring engine they go through the server's ring. Used for
+ * files the server reads and writes by offset, such as the B+tree's pages.
+ */
+ssize_t comm_pread(int fd, void *buf, size_t len, off_t off);
+ssize_t comm_pwrite(int fd, const void *buf, size_t len, off_t off);
 
 #endif  // COMM_H_
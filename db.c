@@ -6,18 +6,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "./cache.h"
+#include "./engine.h"
+#include "./filter.h"
+#include "./keyspace.h"
+#include "./mvcc.h"
+#include "./place.h"
+#include "./rebal.h"
+#include "./repl.h"
+#include "./simd.h"
+#include "./trace.h"
+#include "./vindex.h"
 
 #define MAXLEN 256
+#define CLEANUP_SUBTREES 64  // the BST is split into this many to free it
+#define CLEANUP_THREADS 16
 
 // The root node of the binary tree, unlike all
 // other nodes in the tree, this one is never
 // freed (it's allocated in the data region).
 pthread_rwlock_t root_lock = PTHREAD_RWLOCK_INITIALIZER;
-node_t head = {"", "", 0, 0, &root_lock};
+node_t head = {"", "", 0, 0, 0, &root_lock};
+
+// the storage engine selected by db_init, and its store
+static const db_engine_t *engine = &bst_engine;
+static void *store = &head;
+
+static const db_engine_t *engines[] = {
+    &bst_engine,        &skiplist_engine,         &art_engine,
+    &btree_engine,      &lsm_engine,              &bst_rwlock_engine,
+    &bst_fixed_rwlock_engine, &bst_fixed_optimistic_engine, &bst_nolock_engine,
+    &bst_vlog_engine};
+
+// levels the calling thread's last search() went down, for the rebalancer
+static __thread int search_depth;
+
+// called between the commands of the calling thread's scripts
+// (db_set_checkpoint)
+static __thread int (*checkpoint)(void *arg);
+static __thread void *checkpoint_arg;
 
 // function for locking a node rwlock and error-checking
 static inline void lock(locktype_t lt, pthread_rwlock_t *lk) {
     int err;
+    TRACE_BEGIN(lock);
     if (lt == l_read) {
         err = pthread_rwlock_rdlock(lk);
         if (err != 0) {
@@ -29,6 +62,7 @@ static inline void lock(locktype_t lt, pthread_rwlock_t *lk) {
             handle_error_en(err, "pthread_rwlock_wrlock");
         }
     }
+    TRACE_END(lock);
 }
 
 // function for unlocking a node rwlock and error-checking
@@ -41,48 +75,49 @@ static inline void unlock(pthread_rwlock_t *lk) {
 }
 
 // function for creating a node given field values
-node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
-                         node_t *arg_right) {
+static node_t *node_build(char *arg_name, char *arg_value, node_t *arg_left,
+                          node_t *arg_right) {
     size_t name_len = strlen(arg_name);
     size_t val_len = strlen(arg_value);
 
     if (name_len > MAXLEN || val_len > MAXLEN) return 0;
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+    node_t *new_node = (node_t *)place_alloc(sizeof(node_t));
 
     if (new_node == 0) return 0;
 
-    if ((new_node->name = (char *)malloc(name_len + 1)) == 0) {
-        free(new_node);
+    if ((new_node->name = (char *)place_alloc(name_len + 1)) == 0) {
+        place_free(new_node);
         return 0;
     }
 
-    if ((new_node->value = (char *)malloc(val_len + 1)) == 0) {
-        free(new_node->name);
-        free(new_node);
+    if ((new_node->value = (char *)place_alloc(val_len + 1)) == 0) {
+        place_free(new_node->name);
+        place_free(new_node);
         return 0;
     }
 
-    if ((new_node->lock =
-             (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t))) == 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
+    if ((new_node->lock = (pthread_rwlock_t *)place_alloc(
+             sizeof(pthread_rwlock_t))) == 0) {
+        place_free(new_node->value);
+        place_free(new_node->name);
+        place_free(new_node);
         return 0;
     }
 
     if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
+        place_free(new_node->value);
+        place_free(new_node->name);
+        place_free(new_node);
         return 0;
     } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
+        place_free(new_node->value);
+        place_free(new_node->name);
+        place_free(new_node);
         return 0;
     }
 
+    new_node->name_len = name_len;
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
     int err = pthread_rwlock_init(new_node->lock, 0);
@@ -92,6 +127,14 @@ node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
     return new_node;
 }
 
+node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
+                         node_t *arg_right) {
+    TRACE_BEGIN(alloc);
+    node_t *new_node = node_build(arg_name, arg_value, arg_left, arg_right);
+    TRACE_END(alloc);
+    return new_node;
+}
+
 // function for destroying a node. Unlocks and destroys rwlock before freeing node
 void node_destructor(node_t *node) {
     unlock(node->lock);
@@ -99,73 +142,93 @@ void node_destructor(node_t *node) {
     if (err != 0) {
         handle_error_en(err, "pthread_rwlock_destroy");
     }
-    if (node->name != 0) free(node->name);
-    if (node->value != 0) free(node->value);
-    if (node->lock != 0) free(node->lock);
-    free(node);
+    if (node->name != 0) place_free(node->name);
+    if (node->value != 0) place_free(node->value);
+    if (node->lock != 0) place_free(node->lock);
+    place_free(node);
+}
+
+// tells the rebalancer how deep the calling thread's last search() went, if
+// it was in the store the rebalancer looks after
+static inline void note_depth(node_t *root, int delta) {
+    if (root == &head) rebal_note(search_depth, delta);
 }
 
 // function for returning a node value if it exists given a node name
-void db_query(char *name, char *result, int len) {
-    // TODO: Make this thread-safe!
+static int bst_query(void *root, char *name, char *result, int len) {
     node_t *target;
-    lock(l_read, head.lock);
-    target = search(name, &head, 0, l_read);
+    node_t *rnode = (node_t *)root;
+    lock(l_read, rnode->lock);
+    search_depth = 0;
+    target = search(name, strlen(name), rnode, 0, l_read);
+    note_depth(rnode, 0);
 
     if (target == 0) {
-        snprintf(result, len, "not found");
-        return;
+        return 0;
     } else {
-        snprintf(result, len, "%s", target->value);
+        int n = snprintf(result, len, "%s", target->value);
         unlock(target->lock);
-        return;
+        return n + 1;
     }
 }
 
 // function for adding a node value to the BST if it isn't in the BST
-int db_add(char *name, char *value) {
-    // TODO: Make this thread-safe!
+static int bst_add(void *root, char *name, char *value) {
     node_t *parent;
     node_t *target;
     node_t *newnode;
+    node_t *rnode = (node_t *)root;
+    size_t len = strlen(name);
 
-    lock(l_write, head.lock);
-    if ((target = search(name, &head, &parent, l_write)) != 0) {
+    lock(l_write, rnode->lock);
+    search_depth = 0;
+    if ((target = search(name, len, rnode, &parent, l_write)) != 0) {
         unlock(target->lock);
         unlock(parent->lock);
+        note_depth(rnode, 0);
         return (0);
     }
 
-    newnode = node_constructor(name, value, 0, 0);
+    if ((newnode = node_constructor(name, value, 0, 0)) == 0) {
+        // longer than MAXLEN
+        unlock(parent->lock);
+        note_depth(rnode, 0);
+        return (0);
+    }
 
-    if (strcmp(name, parent->name) < 0)
+    if (key_cmp(name, len, parent->name, parent->name_len) < 0)
         parent->lchild = newnode;
     else
         parent->rchild = newnode;
     unlock(parent->lock);
+    note_depth(rnode, 1);
     return (1);
 }
 
-int db_remove(char *name) {
-    // TODO: Make this thread-safe!
+static int bst_remove(void *root, char *name) {
     node_t *parent;
     node_t *dnode;
     node_t *next;
+    node_t *rnode = (node_t *)root;
 
     // first, find the node to be removed
-    lock(l_write, head.lock);
-    if ((dnode = search(name, &head, &parent, l_write)) == 0) {
+    lock(l_write, rnode->lock);
+    search_depth = 0;
+    if ((dnode = search(name, strlen(name), rnode, &parent, l_write)) == 0) {
         // it's not there
         unlock(parent->lock);
+        note_depth(rnode, 0);
         return (0);
     }
+    note_depth(rnode, -1);
 
     // We found it, if the node has no
     // right child, then we can merely replace its parent's pointer to
     // it with the node's left child.
 
     if (dnode->rchild == 0) {
-        if (strcmp(dnode->name, parent->name) < 0)
+        if (key_cmp(dnode->name, dnode->name_len, parent->name,
+                    parent->name_len) < 0)
             parent->lchild = dnode->lchild;
         else
             parent->rchild = dnode->lchild;
@@ -175,7 +238,8 @@ int db_remove(char *name) {
         node_destructor(dnode);
     } else if (dnode->lchild == 0) {
         // ditto if the node had no left child
-        if (strcmp(dnode->name, parent->name) < 0)
+        if (key_cmp(dnode->name, dnode->name_len, parent->name,
+                    parent->name_len) < 0)
             parent->lchild = dnode->rchild;
         else
             parent->rchild = dnode->rchild;
@@ -202,11 +266,12 @@ int db_remove(char *name) {
             next = nextl;
         }
 
-        dnode->name = realloc(dnode->name, strlen(next->name) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
+        dnode->name = place_realloc(dnode->name, next->name_len + 1);
+        dnode->value = place_realloc(dnode->value, strlen(next->value) + 1);
 
         snprintf(dnode->name, MAXLEN, "%s", next->name);
         snprintf(dnode->value, MAXLEN, "%s", next->value);
+        dnode->name_len = next->name_len;
         *pnext = next->rchild;
         node_destructor(next);
         unlock(dnode->lock);
@@ -216,9 +281,44 @@ int db_remove(char *name) {
     return (1);
 }
 
+// Replaces the value of name with what fn makes of it. Only the node holding
+// name is write-locked, and its value buffer is reused when the new value
+// fits. An absent name is added through bst_add.
+static int bst_update(void *root, char *name, db_update_fn fn, void *arg) {
+    node_t *rnode = (node_t *)root;
+    size_t len = strlen(name);
+    char value[DB_UPDATE_LEN];
+
+    while (1) {
+        lock(l_read, rnode->lock);
+        search_depth = 0;
+        node_t *target = search(name, len, rnode, 0, l_target);
+        note_depth(rnode, 0);
+        if (target != 0) {
+            int ret = fn(target->value, value, sizeof(value), arg);
+            if (ret) {
+                size_t val_len = strlen(value);
+                if (val_len > strlen(target->value) &&
+                    (target->value = place_realloc(target->value,
+                                                   val_len + 1)) == 0) {
+                    perror("realloc");
+                    exit(1);
+                }
+                memcpy(target->value, value, val_len + 1);
+            }
+            unlock(target->lock);
+            return ret;
+        }
+        if (!fn(0, value, sizeof(value), arg)) return 0;
+        if (bst_add(root, name, value)) return 1;
+        // added by someone else in the meantime; update theirs
+    }
+}
+
 // function for searching through the BST, returns the node if it exists and also
 // stores the parent of the node if the caller wants the parent
-node_t *search(char *name, node_t *parent, node_t **parentpp, locktype_t lt) {
+node_t *search(char *name, size_t len, node_t *parent, node_t **parentpp,
+               locktype_t lt) {
     // Search the tree, starting at parent, for a node containing
     // name (the "target node").  Return a pointer to the node,
     // if found, otherwise return 0.  If parentpp is not 0, then it points
@@ -232,17 +332,23 @@ node_t *search(char *name, node_t *parent, node_t **parentpp, locktype_t lt) {
     node_t *next;
     node_t *result;
 
-    if (strcmp(name, parent->name) < 0) {
+    search_depth++;
+    if (key_cmp(name, len, parent->name, parent->name_len) < 0) {
         next = parent->lchild;
         if (next == NULL) {
             result = NULL;
         } else {
-            lock(lt, next->lock);
-            if (strcmp(name, next->name) == 0) {
+            lock(lt == l_write ? l_write : l_read, next->lock);
+            if (key_cmp(name, len, next->name, next->name_len) == 0) {
                 result = next;
+                if (lt == l_target) {
+                    // nothing can unlink next while we hold its parent
+                    unlock(next->lock);
+                    lock(l_write, next->lock);
+                }
             } else {
                 unlock(parent->lock);
-                result = search(name, next, parentpp, lt);
+                result = search(name, len, next, parentpp, lt);
                 return result;
             }
         }
@@ -251,12 +357,16 @@ node_t *search(char *name, node_t *parent, node_t **parentpp, locktype_t lt) {
         if (next == NULL) {
             result = 0;
         } else {
-            lock(lt, next->lock);
-            if (strcmp(name, next->name) == 0) {
+            lock(lt == l_write ? l_write : l_read, next->lock);
+            if (key_cmp(name, len, next->name, next->name_len) == 0) {
                 result = next;
+                if (lt == l_target) {
+                    unlock(next->lock);
+                    lock(l_write, next->lock);
+                }
             } else {
                 unlock(parent->lock);
-                result = search(name, next, parentpp, lt);
+                result = search(name, len, next, parentpp, lt);
                 return result;
             }
         }
@@ -276,9 +386,8 @@ static inline void print_spaces(int lvl, FILE *out) {
     }
 }
 
-/* helper function for db_print */
+/* helper function for bst_print */
 void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    // TODO: Make this thread-safe!
     // print spaces to differentiate levels
     print_spaces(lvl, out);
     // print out the current node
@@ -287,7 +396,7 @@ void db_print_recurs(node_t *node, int lvl, FILE *out) {
         return;
     }
 
-    if (node == &head) {
+    if (lvl == 0) {
         fprintf(out, "(root)\n");
     } else {
         fprintf(out, "%s %s\n", node->name, node->value);
@@ -308,12 +417,192 @@ void db_print_recurs(node_t *node, int lvl, FILE *out) {
     unlock(node->lock);
 }
 
-// function for printing the BST
+// in-order walk for bst_scan; node is read-locked by the caller and unlocked
+// once its subtree is done
+static void bst_scan_recurs(node_t *node, int lvl, db_scan_fn fn, void *arg) {
+    node_t *left = node->lchild;
+    node_t *right = node->rchild;
+    if (left != NULL) {
+        lock(l_read, left->lock);
+        bst_scan_recurs(left, lvl + 1, fn, arg);
+    }
+    if (lvl > 0) fn(node->name, node->value, arg);
+    if (right != NULL) {
+        lock(l_read, right->lock);
+        bst_scan_recurs(right, lvl + 1, fn, arg);
+    }
+    unlock(node->lock);
+}
+
+static void bst_scan(void *root, db_scan_fn fn, void *arg) {
+    node_t *rnode = (node_t *)root;
+    lock(l_read, rnode->lock);
+    bst_scan_recurs(rnode, 0, fn, arg);
+}
+
+// function for printing the BST, locks the root before calling db_print_recurs
+static void bst_print(void *root, FILE *out) {
+    node_t *rnode = (node_t *)root;
+    lock(l_read, rnode->lock);
+    db_print_recurs(rnode, 0, out);
+}
+
+/* Destroys node and all its children. Left children are rotated up until
+ * there are none, so a skewed tree needs no stack. */
+void db_cleanup_recurs(node_t *node) {
+    while (node != NULL) {
+        node_t *left = node->lchild;
+        if (left != NULL) {
+            node->lchild = left->rchild;
+            left->rchild = node;
+            node = left;
+        } else {
+            node_t *right = node->rchild;
+            node_destructor(node);
+            node = right;
+        }
+    }
+}
+
+// subtrees that cleanup threads take in turn
+typedef struct cleanup_work {
+    node_t **roots;
+    int n;
+    int next;
+} cleanup_work_t;
+
+static void *cleanup_worker(void *arg) {
+    cleanup_work_t *w = (cleanup_work_t *)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->n) {
+        db_cleanup_recurs(w->roots[i]);
+    }
+    return NULL;
+}
+
+// cleans up the BST. With NUMA placement every node lives in the arenas,
+// which are dropped whole. Otherwise the nodes near the top go first,
+// breadth first, until there are CLEANUP_SUBTREES subtrees under them, which
+// threads then free.
+static void bst_cleanup(void *root) {
+    node_t *rnode = (node_t *)root;
+    node_t *roots[8 * CLEANUP_SUBTREES + 2];  // two per step at most
+    int first = 0, n = 0, steps = 0;
+    if (rnode->lchild != 0) roots[n++] = rnode->lchild;
+    if (rnode->rchild != 0) roots[n++] = rnode->rchild;
+    rnode->lchild = 0;
+    rnode->rchild = 0;
+    if (rnode == &head) {
+        rebal_stop();
+        if (place_reset() == 0) return;
+    } else {
+        node_destructor(rnode);
+    }
+    // a skewed top only yields one subtree per step, so give up on it
+    while (first < n && n - first < CLEANUP_SUBTREES &&
+           steps++ < 4 * CLEANUP_SUBTREES) {
+        node_t *top = roots[first++];
+        if (top->lchild != 0) roots[n++] = top->lchild;
+        if (top->rchild != 0) roots[n++] = top->rchild;
+        node_destructor(top);
+    }
+
+    cleanup_work_t work = {&roots[first], n - first, 0};
+    pthread_t threads[CLEANUP_THREADS];
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > CLEANUP_THREADS) nthreads = CLEANUP_THREADS;
+    if (nthreads > work.n) nthreads = work.n;
+    for (int i = 1; i < nthreads; i++) {
+        int err = pthread_create(&threads[i], 0, cleanup_worker, &work);
+        if (err != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    cleanup_worker(&work);
+    for (int i = 1; i < nthreads; i++) {
+        int err = pthread_join(threads[i], 0);
+        if (err != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
+}
+
+// the first store is the statically allocated head, which the rebalancer
+// looks after; later ones (library instances, kv.c) get a root of their own
+static void *bst_open(void) {
+    static int head_taken;
+    if (!__atomic_exchange_n(&head_taken, 1, __ATOMIC_ACQ_REL)) {
+        rebal_start(&head);
+        return &head;
+    }
+    node_t *root = node_constructor("", "", 0, 0);
+    if (root == 0) {
+        perror("malloc");
+        exit(1);
+    }
+    return root;
+}
+
+const db_engine_t bst_engine = {"bst",      bst_open,   bst_query,
+                                bst_add,    bst_remove, bst_update,
+                                bst_scan,   bst_print,  bst_cleanup};
+
+const db_engine_t *db_find_engine(const char *name) {
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(name, engines[i]->name) == 0) return engines[i];
+    }
+    return NULL;
+}
+
+// selects the storage engine by name and opens its store
+int db_init(const char *name) {
+    simd_init();
+    const db_engine_t *e = db_find_engine(name);
+    if (e == NULL) return -1;
+    engine = e;
+    store = engine->open();
+    mvcc_init(engine, store);
+    // only the BST's nodes come from place_alloc(), and so from an arena
+    keyspace_init(engine == &bst_engine ? engine : NULL);
+    return 0;
+}
+
+// function for returning a value if it exists given a name
+void db_query(char *name, char *result, int len) {
+    keyspace_t *ks = keyspace_current();
+    int found = ks != NULL ? keyspace_query(ks, name, result, len)
+                           : mvcc_query(name, result, len);
+    if (found < 0) {
+        snprintf(result, len, "keyspace dropped");
+    } else if (!found) {
+        snprintf(result, len, "not found");
+    }
+}
+
+// function for adding a name and value if the name isn't in the database
+int db_add(char *name, char *value) {
+    keyspace_t *ks = keyspace_current();
+    return ks != NULL ? keyspace_add(ks, name, value) : mvcc_add(name, value);
+}
+
+// function for removing a name and its value from the database
+int db_remove(char *name) {
+    keyspace_t *ks = keyspace_current();
+    return ks != NULL ? keyspace_remove(ks, name) : mvcc_remove(name);
+}
+
+// the update behind the read-modify-write commands, in the keyspace in use
+static int db_update(char *name, db_update_fn fn, void *arg) {
+    keyspace_t *ks = keyspace_current();
+    return ks != NULL ? keyspace_update(ks, name, fn, arg)
+                      : mvcc_update(name, fn, arg);
+}
+
+// function for printing the database to a file, or stdout if none is given
 int db_print(char *filename) {
     FILE *out;
-    lock(l_read, head.lock);
     if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
+        engine->print(store, stdout);
         return 0;
     }
 
@@ -323,60 +612,263 @@ int db_print(char *filename) {
     }
 
     if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
+        engine->print(store, stdout);
         return 0;
     }
 
-    if ((out = fopen(filename, "w+")) == NULL) {
+    if ((out = comm_fopen(filename, "w+")) == NULL) {
         return -1;
     }
 
-    db_print_recurs(&head, 0, out);
+    engine->print(store, out);
     fclose(out);
 
     return 0;
 }
 
-/* Recursively destroys node and all its children. */
-void db_cleanup_recurs(node_t *node) {
-    if (node == NULL) {
-        return;
+// asks the BST's rebalancer for a pass; other engines have none
+int db_rebalance(void) {
+    if (engine != &bst_engine) return -1;
+    rebal_request();
+    return 0;
+}
+
+// checks the BST; other engines have no checker
+int db_check(FILE *out) {
+    if (engine != &bst_engine) return -1;
+    rebal_check(out);
+    return 0;
+}
+
+// cleans up the database
+void db_cleanup() {
+    repl_shutdown();
+    mvcc_shutdown();
+    cache_shutdown();
+    filter_shutdown();
+    vindex_shutdown();
+    keyspace_shutdown();
+    engine->cleanup(store);
+}
+
+void db_set_checkpoint(int (*fn)(void *arg), void *arg) {
+    checkpoint = fn;
+    checkpoint_arg = arg;
+}
+
+// handles the transaction commands; returns 0 if command is not one of them
+static int txn_command(slice_t *word, char *response, int len) {
+    if (word->len == 5 && strncmp(word->ptr, "begin", 5) == 0) {
+        if (keyspace_current() != NULL) {
+            snprintf(response, len, "transactions need the %s keyspace",
+                     KEYSPACE_DEFAULT);
+        } else if (mvcc_begin() == 0) {
+            snprintf(response, len, "transaction started");
+        } else {
+            snprintf(response, len, "already in a transaction");
+        }
+    } else if (word->len == 6 && strncmp(word->ptr, "commit", 6) == 0) {
+        switch (mvcc_commit()) {
+            case 1:
+                snprintf(response, len, "committed");
+                break;
+            case 0:
+                snprintf(response, len, "conflict, transaction aborted");
+                break;
+            default:
+                snprintf(response, len, "not in a transaction");
+        }
+    } else if (word->len == 5 && strncmp(word->ptr, "abort", 5) == 0) {
+        if (mvcc_abort() == 0) {
+            snprintf(response, len, "aborted");
+        } else {
+            snprintf(response, len, "not in a transaction");
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int repl_command(slice_t *word, char *response, int len) {
+    if (word->len == 3 && strncmp(word->ptr, "lag", 3) == 0) {
+        repl_lag(response, len);
+        return 1;
+    }
+    return 0;
+}
+
+// handles "create", "use" and "drop"; returns 0 if command is not one of them
+static int keyspace_command(char *command, slice_t *word, char *response,
+                            int len) {
+    static const char *errors[] = {"", "keyspace exists", "no such keyspace",
+                                   "bad keyspace name",
+                                   "the storage engine has no keyspaces"};
+    slice_t args[3];
+    int ret;
+    int create = word->len == 6 && strncmp(word->ptr, "create", 6) == 0;
+    int use = word->len == 3 && strncmp(word->ptr, "use", 3) == 0;
+    int drop = word->len == 4 && strncmp(word->ptr, "drop", 4) == 0;
+    if (!create && !use && !drop) return 0;
+
+    if (split_fields(command, args, 3) != 2) {
+        snprintf(response, len, "ill-formed command");
+        return 1;
+    }
+    char *name = args[1].ptr;
+    name[args[1].len] = '\0';
+    if (create) {
+        ret = keyspace_create(name);
+    } else if (drop) {
+        ret = keyspace_drop(name);
+    } else if (mvcc_active()) {
+        snprintf(response, len, "in a transaction");
+        return 1;
+    } else {
+        ret = keyspace_use(name);
+    }
+    if (ret < 0) {
+        snprintf(response, len, "%s", errors[-ret]);
+    } else {
+        snprintf(response, len, create ? "created" : drop ? "dropped" : "ok");
     }
+    return 1;
+}
+
+/* Read-modify-write commands, run through the engine's update */
 
-    db_cleanup_recurs(node->lchild);
-    db_cleanup_recurs(node->rchild);
+typedef struct upsert_arg {
+    char *value;
+    int existed;
+} upsert_arg_t;
 
-    node_destructor(node);
+static int upsert_fn(const char *cur, char *out, int len, void *arg) {
+    upsert_arg_t *u = (upsert_arg_t *)arg;
+    u->existed = cur != NULL;
+    snprintf(out, len, "%s", u->value);
+    return 1;
 }
 
-// cleans up the database, calls db_cleanup_recur
-void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+typedef struct cas_arg {
+    char *expected;
+    char *value;
+    int found;
+    int matched;
+    char seen[MAXLEN];  // the value found, if it was not the expected one
+} cas_arg_t;
+
+static int cas_fn(const char *cur, char *out, int len, void *arg) {
+    cas_arg_t *c = (cas_arg_t *)arg;
+    c->matched = 0;
+    if (!(c->found = cur != NULL)) return 0;
+    if (strcmp(cur, c->expected) != 0) {
+        snprintf(c->seen, sizeof(c->seen), "%s", cur);
+        return 0;
+    }
+    c->matched = 1;
+    snprintf(out, len, "%s", c->value);
+    return 1;
+}
+
+typedef struct incr_arg {
+    long long delta;
+    long long result;
+    int bad;  // the current value is not a number, or the sum overflows
+} incr_arg_t;
+
+// a missing key counts as 0
+static int incr_fn(const char *cur, char *out, int len, void *arg) {
+    incr_arg_t *in = (incr_arg_t *)arg;
+    long long v = 0;
+    char *end;
+    in->bad = 0;
+    if (cur != NULL) {
+        errno = 0;
+        v = strtoll(cur, &end, 10);
+        if (end == cur || *end != '\0' || errno != 0) {
+            in->bad = 1;
+            return 0;
+        }
+    }
+    if (__builtin_add_overflow(v, in->delta, &in->result)) {
+        in->bad = 1;
+        return 0;
+    }
+    snprintf(out, len, "%lld", in->result);
+    return 1;
 }
 
 // function for interpreting client inputs to call the corresponding BST function
 // to manage the BST
 void interpret_command(char *command, char *response, int len) {
-    char value[MAXLEN];
     char ibuf[MAXLEN];
-    char name[MAXLEN];
-    int sscanf_ret;
+    FILE *finput;
+    slice_t args[3];
+    int nargs;
+    int need;
+    int ret;
 
     if (strlen(command) <= 1) {
         snprintf(response, len, "ill-formed command");
         return;
     }
 
+    if (split_fields(command, args, 1) == 1 && args[0].len > 1 &&
+        (txn_command(&args[0], response, len) ||
+         repl_command(&args[0], response, len) ||
+         keyspace_command(command, &args[0], response, len))) {
+        return;
+    }
+
+    // a replica only changes through its leader, which replicates the
+    // default keyspace only
+    if (repl_read_only() && keyspace_current() == NULL &&
+        strchr("aduci", command[0]) != NULL) {
+        snprintf(response, len, "read-only replica");
+        return;
+    }
+
+    // split out the arguments each command needs and terminate them in place
+    TRACE_BEGIN(parse);
+    switch (command[0]) {
+        case 'a':
+        case 'u':
+            nargs = need = 2;
+            break;
+        case 'c':
+            nargs = need = 3;
+            break;
+        case 'i':
+            nargs = 2;  // the delta is optional
+            need = 1;
+            break;
+        case 'v':
+            nargs = 2;  // the key to list after is optional
+            need = 1;
+            break;
+        default:
+            nargs = need = 1;
+    }
+    if ((nargs = split_fields(&command[1], args, nargs)) < need) {
+        TRACE_END(parse);
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+    for (int i = 0; i < nargs; i++) {
+        if (args[i].len >= MAXLEN) {
+            TRACE_END(parse);
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        args[i].ptr[args[i].len] = '\0';
+    }
+    TRACE_END(parse);
+    char *name = args[0].ptr;
+
     // which command is it?
     switch (command[0]) {
         case 'q':
             // Query
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
             db_query(name, response, len);
             if (strlen(response) == 0) {
                 snprintf(response, len, "not found");
@@ -386,12 +878,9 @@ void interpret_command(char *command, char *response, int len) {
 
         case 'a':
             // Add to the database
-            sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-            if (sscanf_ret < 2) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
-            if (db_add(name, value)) {
+            if ((ret = db_add(name, args[1].ptr)) < 0) {
+                snprintf(response, len, "keyspace dropped");
+            } else if (ret) {
                 snprintf(response, len, "added");
             } else {
                 snprintf(response, len, "already in database");
@@ -401,12 +890,9 @@ void interpret_command(char *command, char *response, int len) {
 
         case 'd':
             // Delete from the database
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
-            if (db_remove(name)) {
+            if ((ret = db_remove(name)) < 0) {
+                snprintf(response, len, "keyspace dropped");
+            } else if (ret) {
                 snprintf(response, len, "removed");
             } else {
                 snprintf(response, len, "not in database");
@@ -414,21 +900,100 @@ void interpret_command(char *command, char *response, int len) {
 
             return;
 
-        case 'f':
-            // process the commands in a file (silently)
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
+        case 'u': {
+            // Add, or replace the value if already present
+            upsert_arg_t u = {args[1].ptr, 0};
+            if ((ret = db_update(name, upsert_fn, &u)) < 0) {
+                snprintf(response, len, "keyspace dropped");
+            } else if (!ret) {
+                snprintf(response, len, "not updated");
+            } else if (u.existed) {
+                snprintf(response, len, "updated");
+            } else {
+                snprintf(response, len, "added");
+            }
+
+            return;
+        }
+
+        case 'c': {
+            // Compare and swap: replace the value only if it is args[1]
+            cas_arg_t c = {args[1].ptr, args[2].ptr, 0, 0, ""};
+            if ((ret = db_update(name, cas_fn, &c)) < 0) {
+                snprintf(response, len, "keyspace dropped");
+            } else if (ret) {
+                snprintf(response, len, "swapped");
+            } else if (!c.found) {
+                snprintf(response, len, "not found");
+            } else if (!c.matched) {
+                snprintf(response, len, "not swapped, value is %s", c.seen);
+            } else {
+                snprintf(response, len, "not swapped");
+            }
+
+            return;
+        }
+
+        case 'i': {
+            // Increment a numeric value by the delta (default 1)
+            incr_arg_t in = {1, 0, 0};
+            char *end;
+            if (nargs == 2) {
+                errno = 0;
+                in.delta = strtoll(args[1].ptr, &end, 10);
+                if (*end != '\0' || errno != 0) {
+                    snprintf(response, len, "ill-formed command");
+                    return;
+                }
+            }
+            if ((ret = db_update(name, incr_fn, &in)) < 0) {
+                snprintf(response, len, "keyspace dropped");
+            } else if (ret) {
+                snprintf(response, len, "%lld", in.result);
+            } else if (in.bad) {
+                snprintf(response, len, "not a number");
+            } else {
+                snprintf(response, len, "not updated");
+            }
+
+            return;
+        }
+
+        case 'v': {
+            // List the keys holding a value, a line's worth at a time; a
+            // client asks for the rest by repeating the command with the
+            // last key it got
+            static const char cont[] = " ...";
+            int more;
+            if (!vindex_enabled || keyspace_current() != NULL) {
+                snprintf(response, len, "no value index");
                 return;
             }
+            int n = vindex_keys(name, nargs == 2 ? args[1].ptr : NULL, response,
+                                len - (sizeof(cont) - 1), &more);
+            if (n == 0 && more) {
+                snprintf(response, len, "key too long to list");
+            } else if (n == 0) {
+                snprintf(response, len, "not found");
+            } else if (more) {
+                strcat(response, cont);
+            }
 
-            FILE *finput = fopen(name, "r");
-            if (!finput) {
+            return;
+        }
+
+        case 'f':
+            // process the commands in a file (silently)
+            if ((finput = fopen(name, "r")) == NULL) {
                 snprintf(response, len, "bad file name");
                 return;
             }
             while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-                pthread_testcancel();  // fgets is not a cancellation point
+                if (checkpoint != NULL && checkpoint(checkpoint_arg)) {
+                    fclose(finput);
+                    snprintf(response, len, "interrupted");
+                    return;
+                }
                 interpret_command(ibuf, response, len);
             }
             fclose(finput);
@@ -2,10 +2,13 @@
 #define DB_H_
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 
 typedef struct node {
     char *name;
     char *value;
+    size_t name_len;
     struct node *lchild;
     struct node *rchild;
     pthread_rwlock_t *lock;
@@ -13,15 +16,27 @@ typedef struct node {
 
 extern node_t head;
 
-// lock_type for locking in db.c
-typedef enum locktype { l_read, l_write } locktype_t;
+// lock_type for locking in db.c; with l_target search() read-locks the path
+// and write-locks only the node it finds
+typedef enum locktype { l_read, l_write, l_target } locktype_t;
 
-node_t *search(char *name, node_t *parent, node_t **parentp, locktype_t lt);
+node_t *search(char *name, size_t len, node_t *parent, node_t **parentp,
+               locktype_t lt);
 
 /**
- * The db_query() function calls search() to retrieve the node associated with
- * the given key. If such a node is found, the function retrieves the value
- * stored in that node and returns it.
+ * The db_init() function selects the storage engine ("bst", the default,
+ * "skiplist", "art" or one of the specialized BSTs listed in engine.h) that
+ * the functions below operate on. It must be called before any other thread
+ * uses the database. Returns 0 on success or -1 if there is
+ * no engine with the given name.
+ */
+int db_init(const char *engine);
+
+/**
+ * The db_query() function asks the storage engine for the value associated
+ * with the given key. With the default BST engine this calls search() to
+ * retrieve the node associated with the key; if such a node is found, the
+ * function retrieves the value stored in that node and returns it.
  */
 void db_query(char *name, char *result, int len);
 
@@ -31,6 +46,10 @@ void db_query(char *name, char *result, int len);
  * with the given key and value and inserts this node into the database as a
  * child of the parent node returned by search(). Returns 1 on success and 0 on
  * failure
+ *
+ * db_query(), db_add() and db_remove() work on the keyspace the calling
+ * thread uses (keyspace.h). db_add() and db_remove() return -1 if it has been
+ * dropped, and db_query() answers "keyspace dropped".
  */
 int db_add(char *name, char *value);
 
@@ -55,9 +74,18 @@ int db_remove(char *name);
 /**
  * The interpret_command() function gets called by the server to interpret a
  * command from a client, call database functions, and store the response.
+ * The key and value are used in place, so command is modified.
  */
 void interpret_command(char *command, char *response, int resp_capacity);
 
+/**
+ * db_set_checkpoint() gives the calling thread a function that its scripts
+ * ('f' commands) call with arg between commands. The function may block, to
+ * pause the script; if it returns nonzero, the script stops with the response
+ * "interrupted".
+ */
+void db_set_checkpoint(int (*fn)(void *arg), void *arg);
+
 /**
   * The db_print() function performs a pre-order traversal of the tree, printing
   each  node's representation and then recursively printing its left and right
@@ -67,9 +95,23 @@ void interpret_command(char *command, char *response, int resp_capacity);
   */
 int db_print(char *filename);
 
+/**
+ * db_rebalance() asks the "bst" engine's rebalancer (rebal.c) to rebuild the
+ * tree's skewed subtrees now; it prints what it did when done. Returns -1 if
+ * the engine has no rebalancer.
+ */
+int db_rebalance(void);
+
+/**
+ * db_check() checks the order and prints the shape and memory of the "bst"
+ * engine's tree to out (see rebal_check()). Returns -1 if the engine has no
+ * checker.
+ */
+int db_check(FILE *out);
+
 /**
  * The db_cleanup() function frees all dynamically-allocated nodes in the
- * database. This function should be used in server.c to clean up the database
+ * database, the BST's subtrees in parallel. This function should be used in server.c to clean up the database
  * before exiting. You should only do this when you are certain that no other
  * threads are currently using or will be using the database. You should check
  * the variables in the server_control_t struct located near the top of server.c
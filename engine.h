@@ -0,0 +1,78 @@
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <stdio.h>
+
+// size of the buffer an update function writes the new value into
+#define DB_UPDATE_LEN 256
+
+/*
+ * Decides a key's new value from its current one (NULL if the key is
+ * absent): writes the new value into out, which holds len bytes, and returns
+ * 1, or returns 0 to leave the key as it is. It runs under the key's lock, so
+ * it must be quick, and it may be called again if the key is added or
+ * removed concurrently; only the last call counts.
+ */
+typedef int (*db_update_fn)(const char *cur, char *out, int len, void *arg);
+
+// called by scan for every key in the store
+typedef void (*db_scan_fn)(const char *name, const char *value, void *arg);
+
+/*
+ * A storage engine behind the db.h API. db.c forwards db_query, db_add,
+ * db_remove, db_print and db_cleanup to the engine selected with db_init().
+ * Every operation must be thread-safe; cleanup is only called once no other
+ * thread is using the store.
+ */
+typedef struct db_engine {
+    const char *name;
+    // creates an empty store and returns the handle passed to the others
+    void *(*open)(void);
+    // copies the value for name into result, truncated to len bytes; returns
+    // 0 if name is absent, else 1 plus the value's full length, so a caller
+    // whose buffer was too short knows how much room the value needs
+    int (*query)(void *store, char *name, char *result, int len);
+    // returns 1 if added, 0 if name was already present
+    int (*add)(void *store, char *name, char *value);
+    // returns 1 if removed, 0 if name was not present
+    int (*remove)(void *store, char *name);
+    // replaces (or adds) name's value with the one fn makes from it in a
+    // DB_UPDATE_LEN buffer, in a single lookup where possible; returns what
+    // fn returned, or 0 if the new value could not be stored
+    int (*update)(void *store, char *name, db_update_fn fn, void *arg);
+    // calls fn for every key, in key order; concurrent writes may or may not
+    // be seen, and fn may run under the engine's locks, so it must not block
+    void (*scan)(void *store, db_scan_fn fn, void *arg);
+    void (*print)(void *store, FILE *out);
+    void (*cleanup)(void *store);
+} db_engine_t;
+
+/**
+ * db_find_engine() returns the engine with the given name, or NULL.
+ */
+const db_engine_t *db_find_engine(const char *name);
+
+extern const db_engine_t bst_engine;
+extern const db_engine_t skiplist_engine;
+extern const db_engine_t art_engine;
+
+// on-disk B+tree (btree.c); btree_config() sets its file and the number of
+// pages its buffer pool caches (NULL and 0 for the defaults), and must be
+// called before db_init()
+extern const db_engine_t btree_engine;
+void btree_config(const char *path, long pool_pages);
+
+// log-structured merge tree (lsm.c); lsm_config() sets the directory of its
+// runs (NULL for the default), and must be called before db_init()
+extern const db_engine_t lsm_engine;
+void lsm_config(const char *dir);
+
+// specialized BSTs generated from bst_tmpl.h (bstvar.c)
+extern const db_engine_t bst_rwlock_engine;
+extern const db_engine_t bst_fixed_rwlock_engine;
+extern const db_engine_t bst_fixed_optimistic_engine;
+extern const db_engine_t bst_nolock_engine;
+// its values in a value log (vlog.h); vlog_config() sets the log's directory
+extern const db_engine_t bst_vlog_engine;
+
+#endif  // ENGINE_H_
@@ -0,0 +1,125 @@
+#include "./epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "./threadrec.h"
+
+// how many retirements a thread makes before it tries to advance the epoch
+#define RETIRE_BATCH 64
+
+typedef struct retired {
+    struct retired *next;
+    void *ptr;
+    void (*free_fn)(void *);
+} retired_t;
+
+/*
+ * Per-thread reclamation state. Records are never freed: when a thread exits
+ * its record (and whatever it still has in limbo) is left for the next thread
+ * to claim.
+ */
+typedef struct epoch_rec {
+    thread_rec_t rec;
+    unsigned long state;  // (epoch << 1) | 1 inside a critical section, else 0
+    unsigned long seen;   // last global epoch this record observed
+    retired_t *limbo[3];  // retired in an epoch congruent to the index
+    int nretired;
+} epoch_rec_t;
+
+static unsigned long global_epoch = 2;
+static __thread epoch_rec_t *my_rec = NULL;
+
+static void free_list(retired_t *item) {
+    while (item != NULL) {
+        retired_t *next = item->next;
+        item->free_fn(item->ptr);
+        free(item);
+        item = next;
+    }
+}
+
+static void rec_init(thread_rec_t *rec) {
+    ((epoch_rec_t *)rec)->seen =
+        __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+// called when a thread exits: leave the critical section
+static void rec_release(thread_rec_t *rec) {
+    __atomic_store_n(&((epoch_rec_t *)rec)->state, 0, __ATOMIC_RELEASE);
+}
+
+static thread_recs_t recs =
+    THREAD_RECS(epoch_rec_t, 0, rec_init, rec_release);
+
+// returns the calling thread's record, claiming or allocating one on first use
+static epoch_rec_t *rec_get(void) {
+    if (my_rec == NULL) my_rec = (epoch_rec_t *)thread_rec_get(&recs);
+    return my_rec;
+}
+
+// frees whatever this record retired at least two epochs before e
+static void reclaim(epoch_rec_t *r, unsigned long e) {
+    if (e - r->seen >= 2) {
+        for (int i = 0; i < 3; i++) {
+            free_list(r->limbo[i]);
+            r->limbo[i] = NULL;
+        }
+    } else {
+        free_list(r->limbo[(e + 1) % 3]);
+        r->limbo[(e + 1) % 3] = NULL;
+    }
+    r->seen = e;
+}
+
+// moves the global epoch forward if every active thread has caught up to it
+static void try_advance(void) {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (thread_rec_t *t = thread_recs_first(&recs); t != NULL; t = t->next) {
+        epoch_rec_t *r = (epoch_rec_t *)t;
+        unsigned long s = __atomic_load_n(&r->state, __ATOMIC_SEQ_CST);
+        if ((s & 1) && (s >> 1) != e) return;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST,
+                                __ATOMIC_RELAXED);
+}
+
+void epoch_enter(void) {
+    epoch_rec_t *r = rec_get();
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->state, (e << 1) | 1, __ATOMIC_SEQ_CST);
+    if (r->seen != e) reclaim(r, e);
+}
+
+void epoch_exit(void) {
+    __atomic_store_n(&my_rec->state, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    epoch_rec_t *r = rec_get();
+    retired_t *item = malloc(sizeof(retired_t));
+    if (item == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    if (r->seen != e) reclaim(r, e);
+    item->next = r->limbo[e % 3];
+    r->limbo[e % 3] = item;
+
+    if (++r->nretired >= RETIRE_BATCH) {
+        r->nretired = 0;
+        try_advance();
+    }
+}
+
+void epoch_barrier(void) {
+    for (thread_rec_t *t = thread_recs_first(&recs); t != NULL; t = t->next) {
+        epoch_rec_t *r = (epoch_rec_t *)t;
+        for (int i = 0; i < 3; i++) {
+            free_list(r->limbo[i]);
+            r->limbo[i] = NULL;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch-based reclamation for structures that are read without locks. A
+ * thread brackets every access with epoch_enter()/epoch_exit(); memory
+ * unlinked by a writer is handed to epoch_retire() and only freed once every
+ * thread that could still hold a pointer to it has left its critical section.
+ */
+
+/**
+ * epoch_enter() marks the calling thread as reading shared nodes. Sections
+ * must not nest.
+ */
+void epoch_enter(void);
+
+/**
+ * epoch_exit() ends the critical section started by epoch_enter().
+ */
+void epoch_exit(void);
+
+/**
+ * epoch_retire() schedules ptr to be released with free_fn once no thread
+ * can reach it anymore. ptr must already be unlinked.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/**
+ * epoch_barrier() frees everything retired so far. It may only be called
+ * when no other thread is inside a critical section, e.g. from db_cleanup().
+ */
+void epoch_barrier(void);
+
+#endif  // EPOCH_H_
@@ -0,0 +1,149 @@
+#include "./filter.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./hash.h"
+#include "./mvcc.h"
+
+/*
+ * The filter is blocked: a key's FILTER_PROBES counters all lie in one
+ * 64-byte block of 128 4-bit counters, so checking a key costs one cache
+ * miss. Counters are updated with a compare-and-swap on their byte and stick
+ * once they reach 15, since an overflowed count can no longer be decremented
+ * safely; with 4 bits that takes 15 keys on one counter, which is rare.
+ */
+
+#define FILTER_COUNTERS 12  // counters per expected key
+#define FILTER_PROBES 6     // counters per key
+#define FILTER_MAX 15
+
+int filter_enabled;
+
+static unsigned char *blocks;
+static unsigned long nblocks;
+static long keys;             // counted now
+static unsigned long checks;
+static unsigned long ruled_out;
+static unsigned long false_positives;
+
+static void update(const char *name, int delta);
+
+static void count_key(const char *name, const char *value, void *arg) {
+    update(name, 1);
+}
+
+void filter_init(long expected) {
+    if (expected <= 0) return;
+    // 128 counters per block
+    nblocks = (expected * FILTER_COUNTERS + 127) / 128;
+    if (posix_memalign((void **)&blocks, 64, nblocks * 64) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(blocks, 0, nblocks * 64);
+    filter_enabled = 1;
+    // a store opened from a file may hold keys already
+    mvcc_scan(count_key, NULL);
+}
+
+void filter_shutdown(void) {
+    if (!filter_enabled) return;
+    filter_enabled = 0;
+    free(blocks);
+    blocks = NULL;
+}
+
+// hashes name and returns its block; *probes has 7 bits per counter
+static unsigned char *block_of(const char *name, uint64_t *probes) {
+    uint64_t h = hash_mix(hash_str(name));
+    // the block is picked by the top bits (scaled without a division), the
+    // counters in it by the low ones
+    *probes = h;
+    return &blocks[((h >> 32) * nblocks >> 32) * 64];
+}
+
+static inline unsigned counter_get(unsigned char *block, unsigned i) {
+    unsigned char b = __atomic_load_n(&block[i >> 1], __ATOMIC_ACQUIRE);
+    return (b >> ((i & 1) * 4)) & 15;
+}
+
+static void counter_add(unsigned char *block, unsigned i, int delta) {
+    unsigned char *byte = &block[i >> 1];
+    int shift = (i & 1) * 4;
+    unsigned char old = __atomic_load_n(byte, __ATOMIC_RELAXED);
+    unsigned char new;
+    do {
+        unsigned c = (old >> shift) & 15;
+        if (c == FILTER_MAX || (delta < 0 && c == 0)) return;
+        new = (old & ~(15 << shift)) | ((c + delta) << shift);
+    } while (!__atomic_compare_exchange_n(byte, &old, new, 1, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+}
+
+static void update(const char *name, int delta) {
+    uint64_t probes;
+    unsigned char *block = block_of(name, &probes);
+    for (int i = 0; i < FILTER_PROBES; i++, probes >>= 7) {
+        counter_add(block, probes & 127, delta);
+    }
+    __atomic_add_fetch(&keys, delta, __ATOMIC_RELAXED);
+}
+
+int filter_check(const char *name) {
+    uint64_t probes;
+    unsigned char *block;
+    if (!filter_enabled) return 1;
+    block = block_of(name, &probes);
+    __atomic_add_fetch(&checks, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < FILTER_PROBES; i++, probes >>= 7) {
+        if (counter_get(block, probes & 127) == 0) {
+            __atomic_add_fetch(&ruled_out, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void filter_false_positive(void) {
+    if (filter_enabled) {
+        __atomic_add_fetch(&false_positives, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void filter_add(const char *name) {
+    if (filter_enabled) update(name, 1);
+}
+
+void filter_remove(const char *name) {
+    if (filter_enabled) update(name, -1);
+}
+
+void filter_report(FILE *out) {
+    unsigned long counters, used = 0, stuck = 0;
+    double expected = 100;
+    if (!filter_enabled) {
+        fprintf(out, "filter off\n");
+        return;
+    }
+    counters = nblocks * 128;
+    for (unsigned long i = 0; i < counters; i++) {
+        unsigned c = counter_get(&blocks[(i / 128) * 64], i % 128);
+        used += c != 0;
+        stuck += c == FILTER_MAX;
+    }
+    // an absent key passes if all its counters are in use
+    for (int i = 0; i < FILTER_PROBES; i++) expected *= (double)used / counters;
+    long n = __atomic_load_n(&keys, __ATOMIC_RELAXED);
+    unsigned long ruled = __atomic_load_n(&ruled_out, __ATOMIC_RELAXED);
+    unsigned long fp = __atomic_load_n(&false_positives, __ATOMIC_RELAXED);
+    fprintf(out,
+            "filter of %.1f KB for %ld keys (%.1f bits per key), %lu "
+            "counters in use, %lu stuck\n",
+            counters / 2048.0, n, n > 0 ? counters * 4.0 / n : 0.0, used,
+            stuck);
+    fprintf(out,
+            "  %lu checks, %lu ruled out; %lu false positives (%.2f%% of "
+            "absent keys), about %.2f%% expected\n",
+            __atomic_load_n(&checks, __ATOMIC_RELAXED), ruled, fp,
+            ruled + fp ? 100.0 * fp / (ruled + fp) : 0.0, expected);
+}
@@ -0,0 +1,49 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdio.h>
+
+/*
+ * Counting Bloom filter of the keys in the engine, consulted before it so
+ * that lookups of keys that are definitely absent need not search it. Keys
+ * are counted before they are added and uncounted after they are removed,
+ * so the filter never rules out a key the engine holds.
+ */
+
+// set once filter_init() has built a filter
+extern int filter_enabled;
+
+/**
+ * filter_init() sizes the filter for about keys keys and counts the ones
+ * the store already holds, so it must follow db_init(). With 0 there is no
+ * filter and filter_check() always answers maybe.
+ */
+void filter_init(long keys);
+
+/**
+ * filter_shutdown() frees the filter. No other thread may be using it.
+ */
+void filter_shutdown(void);
+
+/**
+ * filter_check() returns 0 if name is definitely not in the engine, else 1.
+ * A caller that then finds name absent reports it with
+ * filter_false_positive(), for the statistics.
+ */
+int filter_check(const char *name);
+void filter_false_positive(void);
+
+/**
+ * filter_add() counts name before it is added to the engine; filter_remove()
+ * uncounts it after it is removed, or when the add did not happen.
+ */
+void filter_add(const char *name);
+void filter_remove(const char *name);
+
+/**
+ * filter_report() prints the filter's memory, the lookups it answered and
+ * its false-positive rate, measured and estimated from its occupancy.
+ */
+void filter_report(FILE *out);
+
+#endif  // FILTER_H_
@@ -0,0 +1,40 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The hash of keys and values for the in-memory tables and filters: 64-bit
+ * FNV-1a, whose low bits are fine for picking a bucket or a stripe. Users
+ * that take the high bits or several probes from one hash mix it first.
+ */
+
+/**
+ * hash_str() hashes a NUL-terminated string, hash_mem() len bytes.
+ */
+static inline uint64_t hash_str(const char *s) {
+    uint64_t h = 14695981039346656037ull;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        h = (h ^ *p) * 1099511628211ull;
+    }
+    return h;
+}
+
+static inline uint64_t hash_mem(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * hash_mix() spreads h's bits over the whole word (murmur3's finalizer).
+ */
+static inline uint64_t hash_mix(uint64_t h) {
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+    return h ^ (h >> 33);
+}
+
+#endif  // HASH_H_
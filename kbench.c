@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./simd.h"
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+/*
+ * Microbenchmark for the kernels in simd.c. Each command of a script is
+ * parsed (sscanf vs split_fields) and its key looked up by binary search over
+ * the script's sorted keys (strcmp vs key_cmp), which does the same number of
+ * comparisons as a descent of a balanced tree. Prints cycles per command.
+ */
+
+#define MAXLEN 256
+#define MAXLINES 1000000
+
+typedef struct key {
+    char *name;
+    size_t len;
+} bkey_t;
+
+static char *lines[MAXLINES];
+static size_t line_lens[MAXLINES];
+static bkey_t keys[MAXLINES];
+static int nlines, nkeys;
+static volatile long sink;
+
+static uint64_t now(void) {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((bkey_t *)a)->name, ((bkey_t *)b)->name);
+}
+
+static int lookup_libc(char *name) {
+    int lo = 0, hi = nkeys - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(name, keys[mid].name);
+        if (c == 0) return mid;
+        if (c < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return -1;
+}
+
+static int lookup_simd(char *name, size_t len) {
+    int lo = 0, hi = nkeys - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = key_cmp(name, len, keys[mid].name, keys[mid].len);
+        if (c == 0) return mid;
+        if (c < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return -1;
+}
+
+// one pass over the script; parse and/or look up each command
+static uint64_t run(int simd, int parse, int look) {
+    char buf[MAXLEN];
+    char name[MAXLEN];
+    char value[MAXLEN];
+    slice_t args[2];
+    uint64_t start = now();
+    for (int i = 0; i < nlines; i++) {
+        memcpy(buf, lines[i], line_lens[i] + 1);
+        char *key = NULL;
+        size_t len = 0;
+        if (!simd) {
+            if (parse && sscanf(&buf[1], "%255s %255s", name, value) < 1) {
+                continue;
+            }
+            key = parse ? name : keys[i % nkeys].name;
+            if (look) sink += lookup_libc(key);
+        } else {
+            if (parse) {
+                int nargs = split_fields(&buf[1], args, 2);
+                if (nargs < 1) continue;
+                for (int j = 0; j < nargs; j++) args[j].ptr[args[j].len] = '\0';
+                key = args[0].ptr;
+                len = args[0].len;
+            } else {
+                key = keys[i % nkeys].name;
+                len = keys[i % nkeys].len;
+            }
+            if (look) sink += lookup_simd(key, len);
+        }
+    }
+    return now() - start;
+}
+
+static double best(int simd, int parse, int look, int rounds) {
+    uint64_t min = UINT64_MAX;
+    for (int r = 0; r < rounds; r++) {
+        uint64_t t = run(simd, parse, look);
+        if (t < min) min = t;
+    }
+    return (double)min / nlines;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "scripts/adict.txt";
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    char buf[MAXLEN];
+    char name[MAXLEN];
+    FILE *in;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (nlines < MAXLINES && fgets(buf, sizeof(buf), in) != NULL) {
+        if ((lines[nlines] = strdup(buf)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        line_lens[nlines] = strlen(buf);
+        if (sscanf(&buf[1], "%255s", name) == 1) {
+            if ((keys[nkeys].name = strdup(name)) == NULL) {
+                perror("strdup");
+                exit(1);
+            }
+            keys[nkeys].len = strlen(name);
+            nkeys++;
+        }
+        nlines++;
+    }
+    fclose(in);
+    if (nkeys == 0) {
+        fprintf(stderr, "%s: no commands\n", path);
+        exit(1);
+    }
+    qsort(keys, nkeys, sizeof(keys[0]), by_name);
+    simd_init();
+
+    printf("%s: %d commands, %s per command\n", path, nlines,
+#ifdef __x86_64__
+           "cycles"
+#else
+           "ns"
+#endif
+    );
+    printf("%-16s %10s %10s\n", "", "libc", "simd");
+    printf("%-16s %10.1f %10.1f\n", "parse", best(0, 1, 0, rounds),
+           best(1, 1, 0, rounds));
+    printf("%-16s %10.1f %10.1f\n", "compare", best(0, 0, 1, rounds),
+           best(1, 0, 1, rounds));
+    printf("%-16s %10.1f %10.1f\n", "parse+compare", best(0, 1, 1, rounds),
+           best(1, 1, 1, rounds));
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include "./keyspace.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+#include "./place.h"
+
+/*
+ * The keyspaces are a list under list_lock, which only create, use, drop and
+ * the report take; commands hold the keyspace itself. A keyspace is
+ * referenced by the list and by each thread using it, and is freed with its
+ * last reference, so a thread can go on holding one that was dropped. Every
+ * command read-locks it and puts its arena in use, so the engine's
+ * allocations land there. A drop first marks it dropped, so no further
+ * command locks it, then write-locks it to wait for those in progress before
+ * unmapping the arena.
+ */
+
+struct keyspace {
+    char name[KEYSPACE_NAMELEN + 1];
+    void *store;
+    place_arena_t *arena;
+    pthread_rwlock_t lock;
+    int dropped;
+    unsigned long refs;
+    long keys;
+    struct keyspace *next;
+};
+
+static const db_engine_t *engine;
+static keyspace_t *list;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread keyspace_t *current;
+
+static inline void list_enter(void) {
+    int err = pthread_mutex_lock(&list_lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void list_exit(void) {
+    int err = pthread_mutex_unlock(&list_lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// called with list_lock held
+static keyspace_t *find(const char *name, keyspace_t ***prevp) {
+    keyspace_t **prev = &list;
+    for (; *prev != NULL; prev = &(*prev)->next) {
+        if (strcmp((*prev)->name, name) == 0) break;
+    }
+    if (prevp != NULL) *prevp = prev;
+    return *prev;
+}
+
+static void unref(keyspace_t *ks) {
+    if (__atomic_sub_fetch(&ks->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    int err = pthread_rwlock_destroy(&ks->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_destroy");
+    }
+    free(ks);
+}
+
+// called when a thread exits: give up the keyspace it used
+static void thread_release(void *arg) { unref((keyspace_t *)arg); }
+
+static void thread_key_init(void) {
+    int err = pthread_key_create(&thread_key, thread_release);
+    if (err != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+static inline void unlock(keyspace_t *ks) {
+    int err = pthread_rwlock_unlock(&ks->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+// frees ks's keys; called once it is out of the list
+static void drop(keyspace_t *ks) {
+    __atomic_store_n(&ks->dropped, 1, __ATOMIC_SEQ_CST);
+    int err = pthread_rwlock_wrlock(&ks->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+    place_arena_free(ks->arena);
+    ks->arena = NULL;
+    ks->store = NULL;
+    unlock(ks);
+    unref(ks);
+}
+
+void keyspace_init(const db_engine_t *e) { engine = e; }
+
+void keyspace_shutdown(void) {
+    list_enter();
+    while (list != NULL) {
+        keyspace_t *ks = list;
+        list = ks->next;
+        drop(ks);
+    }
+    list_exit();
+}
+
+int keyspace_create(const char *name) {
+    keyspace_t *ks;
+    size_t len = strlen(name);
+    if (engine == NULL) return keyspace_unsupported;
+    if (len == 0 || len > KEYSPACE_NAMELEN) return keyspace_bad_name;
+    if (strcmp(name, KEYSPACE_DEFAULT) == 0) return keyspace_exists;
+
+    list_enter();
+    if (find(name, NULL) != NULL) {
+        list_exit();
+        return keyspace_exists;
+    }
+    if ((ks = calloc(1, sizeof(keyspace_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memcpy(ks->name, name, len + 1);
+    int err = pthread_rwlock_init(&ks->lock, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_init");
+    }
+    ks->arena = place_arena_new();
+    place_use(ks->arena);
+    ks->store = engine->open();
+    place_use(NULL);
+    ks->refs = 1;
+    ks->next = list;
+    list = ks;
+    list_exit();
+    return 0;
+}
+
+int keyspace_use(const char *name) {
+    keyspace_t *ks = NULL;
+    if (strcmp(name, KEYSPACE_DEFAULT) != 0) {
+        list_enter();
+        if ((ks = find(name, NULL)) != NULL) {
+            __atomic_add_fetch(&ks->refs, 1, __ATOMIC_RELAXED);
+        }
+        list_exit();
+        if (ks == NULL) return keyspace_missing;
+    }
+
+    pthread_once(&thread_once, thread_key_init);
+    keyspace_t *old = current;
+    current = ks;
+    int err = pthread_setspecific(thread_key, ks);
+    if (err != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    if (old != NULL) unref(old);
+    return 0;
+}
+
+int keyspace_drop(const char *name) {
+    keyspace_t **prev;
+    keyspace_t *ks;
+    list_enter();
+    if ((ks = find(name, &prev)) == NULL) {
+        list_exit();
+        return keyspace_missing;
+    }
+    *prev = ks->next;
+    list_exit();
+    drop(ks);
+    return 0;
+}
+
+keyspace_t *keyspace_current(void) { return current; }
+
+// read-locks ks for a command and puts its arena in use; returns 0 if it
+// has been dropped
+static int enter(keyspace_t *ks) {
+    if (__atomic_load_n(&ks->dropped, __ATOMIC_ACQUIRE)) return 0;
+    int err = pthread_rwlock_rdlock(&ks->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+    if (ks->dropped) {
+        unlock(ks);
+        return 0;
+    }
+    place_use(ks->arena);
+    return 1;
+}
+
+static void leave(keyspace_t *ks) {
+    place_use(NULL);
+    unlock(ks);
+}
+
+int keyspace_query(keyspace_t *ks, char *name, char *result, int len) {
+    if (!enter(ks)) return -1;
+    int found = engine->query(ks->store, name, result, len) > 0;
+    leave(ks);
+    return found;
+}
+
+int keyspace_add(keyspace_t *ks, char *name, char *value) {
+    if (!enter(ks)) return -1;
+    int ret = engine->add(ks->store, name, value);
+    if (ret) __atomic_add_fetch(&ks->keys, 1, __ATOMIC_RELAXED);
+    leave(ks);
+    return ret;
+}
+
+int keyspace_remove(keyspace_t *ks, char *name) {
+    if (!enter(ks)) return -1;
+    int ret = engine->remove(ks->store, name);
+    if (ret) __atomic_sub_fetch(&ks->keys, 1, __ATOMIC_RELAXED);
+    leave(ks);
+    return ret;
+}
+
+// an update function, and whether the key was absent the last time the
+// engine called it
+typedef struct counted {
+    db_update_fn fn;
+    void *arg;
+    int absent;
+} counted_t;
+
+static int counted_fn(const char *cur, char *out, int len, void *arg) {
+    counted_t *c = (counted_t *)arg;
+    c->absent = cur == NULL;
+    return c->fn(cur, out, len, c->arg);
+}
+
+int keyspace_update(keyspace_t *ks, char *name, db_update_fn fn, void *arg) {
+    counted_t c = {fn, arg, 0};
+    if (!enter(ks)) return -1;
+    int ret = engine->update(ks->store, name, counted_fn, &c);
+    if (ret && c.absent) __atomic_add_fetch(&ks->keys, 1, __ATOMIC_RELAXED);
+    leave(ks);
+    return ret;
+}
+
+void keyspace_report(FILE *out) {
+    int n = 0;
+    if (engine == NULL) {
+        fprintf(out, "the storage engine has no keyspaces\n");
+        return;
+    }
+    list_enter();
+    for (keyspace_t *ks = list; ks != NULL; ks = ks->next) n++;
+    fprintf(out, "%d keyspace%s besides %s\n", n, n == 1 ? "" : "s",
+            KEYSPACE_DEFAULT);
+    for (keyspace_t *ks = list; ks != NULL; ks = ks->next) {
+        // the list's reference is not a connection's
+        fprintf(out, "  %s: %ld keys, %.1f MB of arena, %lu connections\n",
+                ks->name, __atomic_load_n(&ks->keys, __ATOMIC_RELAXED),
+                place_arena_size(ks->arena) / 1048576.0,
+                __atomic_load_n(&ks->refs, __ATOMIC_RELAXED) - 1);
+    }
+    list_exit();
+}
@@ -0,0 +1,75 @@
+#ifndef KEYSPACE_H_
+#define KEYSPACE_H_
+
+#include <stdio.h>
+#include "./engine.h"
+
+/*
+ * Named keyspaces beside the default store, for the "create", "use" and
+ * "drop" commands. Each is an instance of the engine with its own root and
+ * its own arena (place.h), which all of its nodes come from, so a drop frees
+ * them by unmapping the arena rather than one by one. A connection works on
+ * one keyspace at a time. Commands on a named one go straight to its
+ * instance: transactions, the read cache, the key filter, the value index
+ * and replication all cover the default store only.
+ */
+
+#define KEYSPACE_NAMELEN 63
+#define KEYSPACE_DEFAULT "default"
+
+typedef struct keyspace keyspace_t;
+
+// why keyspace_create(), keyspace_use() or keyspace_drop() failed
+typedef enum keyspace_err {
+    keyspace_exists = -1,
+    keyspace_missing = -2,
+    keyspace_bad_name = -3,
+    keyspace_unsupported = -4,  // the engine has no keyspaces
+} keyspace_err_t;
+
+/**
+ * keyspace_init() makes keyspaces instances of engine, whose nodes must come
+ * from place_alloc(); with NULL there are none.
+ */
+void keyspace_init(const db_engine_t *engine);
+
+/**
+ * keyspace_shutdown() frees every keyspace. No other thread may be using
+ * them.
+ */
+void keyspace_shutdown(void);
+
+/**
+ * keyspace_create() creates an empty keyspace. keyspace_use() makes the
+ * calling thread's commands work on the named keyspace, or on the default
+ * store for KEYSPACE_DEFAULT. keyspace_drop() frees a keyspace and its keys
+ * once the commands in progress on it are done. Each returns 0 or a
+ * keyspace_err_t.
+ */
+int keyspace_create(const char *name);
+int keyspace_use(const char *name);
+int keyspace_drop(const char *name);
+
+/**
+ * keyspace_current() returns the keyspace the calling thread uses, or NULL
+ * for the default store.
+ */
+keyspace_t *keyspace_current(void);
+
+/**
+ * keyspace_query(), keyspace_add(), keyspace_remove() and keyspace_update()
+ * are the engine's operations on ks, except that a query returns 1 rather
+ * than the value's length if name is present. Each returns -1 if ks has been
+ * dropped, which its users see until they use another.
+ */
+int keyspace_query(keyspace_t *ks, char *name, char *result, int len);
+int keyspace_add(keyspace_t *ks, char *name, char *value);
+int keyspace_remove(keyspace_t *ks, char *name);
+int keyspace_update(keyspace_t *ks, char *name, db_update_fn fn, void *arg);
+
+/**
+ * keyspace_report() prints each keyspace's keys, arena and connections.
+ */
+void keyspace_report(FILE *out);
+
+#endif  // KEYSPACE_H_
@@ -0,0 +1,282 @@
+#include "./kv.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "./engine.h"
+#include "./simd.h"
+#include "./vlog.h"
+
+/*
+ * A view points into a block, which holds the reference count for every view
+ * in it. kv_get() allocates the block, the view and the value together; the
+ * engine's query fills a stack buffer first and says how long the value
+ * really is, so only values longer than KV_INLINE are looked up twice.
+ * kv_get_batch() puts its views in one block and the values after one
+ * another in a buffer that grows as they are read, so the whole batch costs
+ * two allocations.
+ *
+ * btree_config(), lsm_config() and vlog_config() are process-wide, so
+ * kv_open() holds open_lock from setting them until the engine has opened
+ * its file. Their defaults would be shared by every instance opened without
+ * a path, so a btree or lsm instance gets a file or directory made for it
+ * instead (a value log's segments have unique names already).
+ */
+
+#define KV_INLINE 256
+#define KV_BATCH_VALUE 64  // room reserved for each value of a batch
+
+struct kv {
+    const db_engine_t *engine;
+    void *store;
+    char *path;
+    int made;  // path was made by kv_open(), and goes at kv_close()
+};
+
+typedef struct kv_block {
+    unsigned long refs;
+    char *values;  // of a batch; NULL if they follow the views
+} kv_block_t;
+
+struct kv_view {
+    kv_block_t *block;
+    const char *data;
+    size_t len;
+};
+
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static int simd_ready;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+// makes a new file for a btree instance, or a directory for an lsm one;
+// returns its name, or NULL
+static char *make_path(const db_engine_t *e) {
+    char *path = strdup(e == &lsm_engine ? "lsm-XXXXXX" : "btree-XXXXXX");
+    if (path == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    if (e == &lsm_engine) {
+        if (mkdtemp(path) != NULL) return path;
+    } else {
+        int fd = mkstemp(path);
+        if (fd >= 0) {
+            close(fd);
+            return path;
+        }
+    }
+    perror(path);
+    free(path);
+    return NULL;
+}
+
+kv_t *kv_open(const char *engine, const char *path) {
+    const db_engine_t *e = db_find_engine(engine);
+    if (e == NULL) return NULL;
+    kv_t *kv = xmalloc(sizeof(kv_t));
+    kv->engine = e;
+    kv->path = NULL;
+    kv->made = 0;
+    if (path != NULL) {
+        if ((kv->path = strdup(path)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+    } else if (e == &btree_engine || e == &lsm_engine) {
+        if ((kv->path = make_path(e)) == NULL) {
+            free(kv);
+            return NULL;
+        }
+        kv->made = 1;
+    }
+    pthread_mutex_lock(&open_lock);
+    if (!simd_ready) {
+        simd_init();
+        simd_ready = 1;
+    }
+    btree_config(kv->path, 0);
+    lsm_config(kv->path);
+    vlog_config(kv->path);
+    kv->store = e->open();
+    pthread_mutex_unlock(&open_lock);
+    return kv;
+}
+
+void kv_close(kv_t *kv) {
+    kv->engine->cleanup(kv->store);
+    // an lsm deletes its runs at cleanup, leaving the directory empty
+    if (kv->made && (kv->engine == &lsm_engine ? rmdir(kv->path)
+                                               : unlink(kv->path)) < 0) {
+        perror(kv->path);
+    }
+    free(kv->path);
+    free(kv);
+}
+
+// a view with room for a value of len bytes, in a block of its own
+static kv_view_t *view_new(size_t len) {
+    kv_block_t *b = xmalloc(sizeof(kv_block_t) + sizeof(kv_view_t) + len + 1);
+    kv_view_t *v = (kv_view_t *)(b + 1);
+    b->refs = 1;
+    b->values = NULL;
+    v->block = b;
+    v->data = (char *)(v + 1);
+    v->len = len;
+    return v;
+}
+
+kv_view_t *kv_get(kv_t *kv, const char *key) {
+    char buf[KV_INLINE];
+    int n = kv->engine->query(kv->store, (char *)key, buf, sizeof(buf));
+    if (n == 0) return NULL;
+    if ((size_t)n <= sizeof(buf)) {
+        kv_view_t *v = view_new(n - 1);
+        memcpy((char *)v->data, buf, n);
+        return v;
+    }
+    // too long for buf: read it again, into a view of the right size
+    while (1) {
+        kv_view_t *v = view_new(n - 1);
+        int m = kv->engine->query(kv->store, (char *)key, (char *)v->data, n);
+        if (m <= n) {
+            if (m == 0) {
+                free(v->block);
+                return NULL;
+            }
+            v->len = m - 1;
+            return v;
+        }
+        // it grew in between
+        free(v->block);
+        n = m;
+    }
+}
+
+// the value for KV_PUT, written over the current one
+static int put_fn(const char *cur, char *out, int len, void *arg) {
+    const char *value = (const char *)arg;
+    (void)cur;
+    if (strlen(value) >= (size_t)len) return 0;
+    strcpy(out, value);
+    return 1;
+}
+
+int kv_add(kv_t *kv, const char *key, const char *value) {
+    return kv->engine->add(kv->store, (char *)key, (char *)value) == 1;
+}
+
+int kv_put(kv_t *kv, const char *key, const char *value) {
+    return kv->engine->update(kv->store, (char *)key, put_fn,
+                              (void *)value) == 1;
+}
+
+int kv_remove(kv_t *kv, const char *key) {
+    return kv->engine->remove(kv->store, (char *)key) == 1;
+}
+
+const char *kv_view_data(const kv_view_t *view) { return view->data; }
+
+size_t kv_view_len(const kv_view_t *view) { return view->len; }
+
+kv_view_t *kv_view_retain(kv_view_t *view) {
+    __atomic_add_fetch(&view->block->refs, 1, __ATOMIC_RELAXED);
+    return view;
+}
+
+void kv_view_release(kv_view_t *view) {
+    kv_block_t *b = view->block;
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(b->values);
+        free(b);
+    }
+}
+
+// grows a batch's values to hold at least need bytes
+static char *grow(char *values, size_t *cap, size_t need) {
+    *cap = *cap * 2 > need ? *cap * 2 : need;
+    if ((values = realloc(values, *cap)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return values;
+}
+
+size_t kv_get_batch(kv_t *kv, size_t n, const char *const *keys,
+                    kv_view_t **views) {
+    kv_block_t *b = xmalloc(sizeof(kv_block_t) + n * sizeof(kv_view_t));
+    kv_view_t *v = (kv_view_t *)(b + 1);
+    size_t cap = n * KV_BATCH_VALUE + 1, used = 0, found = 0;
+    char *values = xmalloc(cap);
+
+    for (size_t i = 0; i < n; i++) {
+        int r;
+        while (1) {
+            if (cap - used < KV_BATCH_VALUE) {
+                values = grow(values, &cap, used + KV_BATCH_VALUE);
+            }
+            r = kv->engine->query(kv->store, (char *)keys[i], values + used,
+                                  cap - used);
+            if ((size_t)r <= cap - used) break;
+            // truncated: make room for all of it and read it again
+            values = grow(values, &cap, used + r);
+        }
+        views[i] = r == 0 ? NULL : &v[i];
+        v[i].len = r == 0 ? 0 : r - 1;
+        used += r;
+        found += r != 0;
+    }
+    if (found == 0) {
+        free(values);
+        free(b);
+        return 0;
+    }
+
+    // values no longer moves; the found ones lie one after another
+    b->refs = found;
+    b->values = values;
+    char *p = values;
+    for (size_t i = 0; i < n; i++) {
+        if (views[i] == NULL) continue;
+        v[i].block = b;
+        v[i].data = p;
+        p += v[i].len + 1;
+    }
+    return found;
+}
+
+size_t kv_write_batch(kv_t *kv, kv_write_t *writes, size_t n) {
+    size_t changed = 0;
+    for (size_t i = 0; i < n; i++) {
+        kv_write_t *w = &writes[i];
+        switch (w->op) {
+            case KV_ADD:
+                w->result = kv_add(kv, w->key, w->value);
+                break;
+            case KV_PUT:
+                w->result = kv_put(kv, w->key, w->value);
+                break;
+            case KV_REMOVE:
+                w->result = kv_remove(kv, w->key);
+                break;
+            default:
+                w->result = 0;
+        }
+        changed += w->result;
+    }
+    return changed;
+}
+
+void kv_scan(kv_t *kv, void (*fn)(const char *key, const char *value,
+                                  void *arg),
+             void *arg) {
+    kv->engine->scan(kv->store, fn, arg);
+}
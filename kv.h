@@ -0,0 +1,110 @@
+#ifndef KV_H_
+#define KV_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The store as a library (libkv.a, libkv.so), for programs that want it in
+ * their own process. Each kv_t is a separate instance of one of the storage
+ * engines of engine.h, and every call is thread-safe (except on "bst-nolock",
+ * which serves one thread at a time). Calls go straight to the engine: there
+ * is no command parsing, and the transactions, read cache, key filter and
+ * replication of the server are not involved.
+ *
+ * Keys and values are NUL-terminated strings of any length the engine can
+ * store (256 bytes for the BSTs, 31 for the bst-fixed ones, 255 for btree
+ * and lsm). Values come back as views: read-only, reference-counted copies
+ * that stay valid until released, however the key changes in the meantime
+ * and even after kv_close().
+ */
+
+typedef struct kv kv_t;
+typedef struct kv_view kv_view_t;
+
+/**
+ * kv_open() creates an instance of the named engine ("bst", "skiplist",
+ * "art", "btree", "lsm", ...). path is the file of a "btree" instance, the
+ * directory of an "lsm" one's runs or of a "bst-vlog" one's value log, and
+ * ignored by the others. A btree's file or an lsm's directory must not be
+ * shared with another instance; with a NULL path, each gets a new one in the
+ * current directory, which kv_close() removes. Returns NULL if there is no
+ * such engine, or if that file or directory could not be made.
+ */
+kv_t *kv_open(const char *engine, const char *path);
+
+/**
+ * kv_close() frees the instance and its contents. No other thread may be
+ * using it, but its views remain valid.
+ */
+void kv_close(kv_t *kv);
+
+/**
+ * kv_get() looks up key. Returns a view of its value, or NULL if it is
+ * absent.
+ */
+kv_view_t *kv_get(kv_t *kv, const char *key);
+
+/**
+ * kv_add() adds key with value if key is absent. kv_put() sets key to value
+ * whether or not it is present, in one step; its values are limited to 255
+ * bytes. kv_remove() removes key. Each returns 1 if the store changed and 0
+ * otherwise.
+ */
+int kv_add(kv_t *kv, const char *key, const char *value);
+int kv_put(kv_t *kv, const char *key, const char *value);
+int kv_remove(kv_t *kv, const char *key);
+
+/**
+ * kv_view_data() and kv_view_len() give a view's value and its length (the
+ * value is also NUL-terminated). kv_view_retain() takes another reference
+ * to the view, and kv_view_release() drops one, freeing the view with the
+ * last.
+ */
+const char *kv_view_data(const kv_view_t *view);
+size_t kv_view_len(const kv_view_t *view);
+kv_view_t *kv_view_retain(kv_view_t *view);
+void kv_view_release(kv_view_t *view);
+
+/**
+ * kv_get_batch() looks up n keys, setting views[i] to a view of keys[i]'s
+ * value or to NULL. The views share one allocation, which is freed once all
+ * of them are released. Returns the number of keys found.
+ */
+size_t kv_get_batch(kv_t *kv, size_t n, const char *const *keys,
+                    kv_view_t **views);
+
+// a write in a batch
+typedef enum kv_op { KV_ADD, KV_PUT, KV_REMOVE } kv_op_t;
+
+typedef struct kv_write {
+    kv_op_t op;
+    const char *key;
+    const char *value;  // ignored by KV_REMOVE
+    int result;         // set to what kv_add(), kv_put() or kv_remove() returns
+} kv_write_t;
+
+/**
+ * kv_write_batch() applies n writes in order. Each is atomic on its own, but
+ * other threads may see some of them before the rest. Returns the number of
+ * writes that changed the store.
+ */
+size_t kv_write_batch(kv_t *kv, kv_write_t *writes, size_t n);
+
+/**
+ * kv_scan() calls fn for every key and value, in key order. Concurrent
+ * writes may or may not be seen, and fn may run under the engine's locks,
+ * so it must not block or call into the same instance.
+ */
+void kv_scan(kv_t *kv, void (*fn)(const char *key, const char *value,
+                                  void *arg),
+             void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // KV_H_
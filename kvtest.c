@@ -0,0 +1,259 @@
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./kv.h"
+
+/*
+ * Tests for the library (kv.h), run on every engine: "make check" builds
+ * them against libkv.a and runs them. Each engine gets two instances opened
+ * without a path, which must not see each other's keys, views that must
+ * survive later writes and kv_close(), long values, batches with misses, a
+ * scan, and four threads adding, reading and removing keys of their own.
+ * Prints a line per engine and exits non-zero if any check failed.
+ */
+
+#define THREADS 4
+#define THREAD_KEYS 20000
+#define BATCH 200
+
+typedef struct engine {
+    const char *name;
+    int max_value;  // longest value the engine stores
+    int threads;    // safe to use from more than one thread
+} engine_t;
+
+static const engine_t engines[] = {
+    {"bst", 250, 1},
+    {"skiplist", 250, 1},
+    {"art", 250, 1},
+    {"btree", 250, 1},
+    {"lsm", 250, 1},
+    {"bst-rwlock", 250, 1},
+    {"bst-fixed-rwlock", 31, 1},
+    {"bst-fixed-optimistic", 31, 1},
+    {"bst-nolock", 250, 0},
+    {"bst-vlog", 250, 1},
+};
+
+static int failures;
+
+#define CHECK(cond)                                                      \
+    do {                                                                 \
+        if (!(cond)) {                                                   \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__,   \
+                    __LINE__, current, #cond);                           \
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);          \
+        }                                                                \
+    } while (0)
+
+static const char *current;  // engine under test
+
+// 1 if key's value in kv is value, or if value is NULL and key is absent
+static int holds(kv_t *kv, const char *key, const char *value) {
+    kv_view_t *v = kv_get(kv, key);
+    int ret;
+    if (v == NULL) return value == NULL;
+    ret = value != NULL && kv_view_len(v) == strlen(value) &&
+          strcmp(kv_view_data(v), value) == 0;
+    kv_view_release(v);
+    return ret;
+}
+
+// instances opened without a path are separate
+static void test_instances(void) {
+    kv_t *a = kv_open(current, NULL);
+    kv_t *b = kv_open(current, NULL);
+    CHECK(a != NULL && b != NULL);
+    if (a == NULL || b == NULL) return;
+    CHECK(kv_add(a, "k", "a") == 1);
+    CHECK(kv_add(a, "k", "again") == 0);
+    CHECK(holds(b, "k", NULL));
+    CHECK(kv_add(b, "k", "b") == 1);
+    CHECK(holds(a, "k", "a"));
+    CHECK(holds(b, "k", "b"));
+    CHECK(kv_remove(a, "k") == 1);
+    CHECK(kv_remove(a, "k") == 0);
+    CHECK(holds(a, "k", NULL));
+    CHECK(holds(b, "k", "b"));
+    kv_close(a);
+    kv_close(b);
+}
+
+// views keep their value across puts, removes and kv_close()
+static void test_views(void) {
+    kv_t *kv = kv_open(current, NULL);
+    CHECK(kv != NULL);
+    if (kv == NULL) return;
+    CHECK(kv_put(kv, "k", "one") == 1);
+    kv_view_t *v = kv_get(kv, "k");
+    CHECK(v != NULL);
+    if (v == NULL) {
+        kv_close(kv);
+        return;
+    }
+    kv_view_t *w = kv_view_retain(v);
+    CHECK(kv_put(kv, "k", "two") == 1);
+    CHECK(holds(kv, "k", "two"));
+    CHECK(strcmp(kv_view_data(v), "one") == 0);
+    CHECK(kv_remove(kv, "k") == 1);
+    kv_view_release(v);
+    kv_close(kv);
+    CHECK(kv_view_len(w) == 3 && strcmp(kv_view_data(w), "one") == 0);
+    kv_view_release(w);
+}
+
+// a value as long as the engine takes comes back whole
+static void test_long_value(int max) {
+    char value[256];
+    kv_t *kv = kv_open(current, NULL);
+    CHECK(kv != NULL);
+    if (kv == NULL) return;
+    memset(value, 'x', max);
+    value[max] = '\0';
+    CHECK(kv_add(kv, "long", value) == 1);
+    CHECK(holds(kv, "long", value));
+    kv_close(kv);
+}
+
+// what a scan saw
+typedef struct scanned {
+    int keys;
+    int ordered;  // each key came after the one before
+    char last[64];
+} scanned_t;
+
+static void count_key(const char *key, const char *value, void *arg) {
+    scanned_t *sc = (scanned_t *)arg;
+    (void)value;
+    if (sc->keys > 0 && strcmp(sc->last, key) >= 0) sc->ordered = 0;
+    sc->keys++;
+    snprintf(sc->last, sizeof(sc->last), "%s", key);
+}
+
+// batches of writes and of gets, half of which miss, and a scan
+static void test_batches(void) {
+    char keys[BATCH][16], values[BATCH][16];
+    const char *names[BATCH];
+    kv_write_t writes[BATCH / 2];
+    kv_view_t *views[BATCH];
+    scanned_t sc = {0, 1, ""};
+    kv_t *kv = kv_open(current, NULL);
+    CHECK(kv != NULL);
+    if (kv == NULL) return;
+    for (int i = 0; i < BATCH; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "b%04d", i);
+        snprintf(values[i], sizeof(values[i]), "v%d", i * 7);
+        names[i] = keys[i];
+        if (i % 2 == 0) {
+            writes[i / 2] = (kv_write_t){KV_ADD, keys[i], values[i], -1};
+        }
+    }
+    CHECK(kv_write_batch(kv, writes, BATCH / 2) == BATCH / 2);
+    CHECK(writes[0].result == 1);
+    CHECK(kv_get_batch(kv, BATCH, names, views) == BATCH / 2);
+    for (int i = 0; i < BATCH; i++) {
+        if (i % 2 == 1) {
+            CHECK(views[i] == NULL);
+            continue;
+        }
+        CHECK(views[i] != NULL);
+        if (views[i] == NULL) continue;
+        CHECK(strcmp(kv_view_data(views[i]), values[i]) == 0);
+    }
+    // the last view released frees the batch
+    for (int i = 0; i < BATCH; i += 2) {
+        if (views[i] != NULL) kv_view_release(views[i]);
+    }
+    kv_scan(kv, count_key, &sc);
+    CHECK(sc.keys == BATCH / 2 && sc.ordered);
+
+    writes[0] = (kv_write_t){KV_REMOVE, keys[0], NULL, -1};
+    writes[1] = (kv_write_t){KV_PUT, keys[2], "new", -1};
+    writes[2] = (kv_write_t){KV_ADD, keys[4], "dup", -1};
+    CHECK(kv_write_batch(kv, writes, 3) == 2);
+    CHECK(writes[2].result == 0);
+    CHECK(holds(kv, keys[0], NULL));
+    CHECK(holds(kv, keys[2], "new"));
+    CHECK(holds(kv, keys[4], values[4]));
+    kv_close(kv);
+}
+
+typedef struct worker {
+    kv_t *kv;
+    int id;
+} worker_t;
+
+// adds, reads and removes keys of its own
+static void *work(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    char key[32], value[32];
+    for (int i = 0; i < THREAD_KEYS; i++) {
+        snprintf(key, sizeof(key), "t%d-%d", w->id, i);
+        snprintf(value, sizeof(value), "%d", i);
+        CHECK(kv_add(w->kv, key, value) == 1);
+    }
+    for (int i = 0; i < THREAD_KEYS; i++) {
+        snprintf(key, sizeof(key), "t%d-%d", w->id, i);
+        snprintf(value, sizeof(value), "%d", i);
+        CHECK(holds(w->kv, key, value));
+        if (i % 2 == 0) CHECK(kv_remove(w->kv, key) == 1);
+    }
+    for (int i = 0; i < THREAD_KEYS; i++) {
+        snprintf(key, sizeof(key), "t%d-%d", w->id, i);
+        snprintf(value, sizeof(value), "%d", i);
+        CHECK(holds(w->kv, key, i % 2 == 0 ? NULL : value));
+    }
+    return NULL;
+}
+
+static void test_threads(void) {
+    pthread_t tids[THREADS];
+    worker_t workers[THREADS];
+    kv_t *kv = kv_open(current, NULL);
+    CHECK(kv != NULL);
+    if (kv == NULL) return;
+    for (int i = 0; i < THREADS; i++) {
+        workers[i] = (worker_t){kv, i};
+        if (pthread_create(&tids[i], 0, work, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < THREADS; i++) pthread_join(tids[i], NULL);
+    kv_close(kv);
+}
+
+// how many files or directories an instance without a path may have left
+static size_t leftovers(void) {
+    glob_t g;
+    size_t n = 0;
+    if (glob("lsm-??????", 0, NULL, &g) == 0) n += g.gl_pathc;
+    globfree(&g);
+    if (glob("btree-??????", 0, NULL, &g) == 0) n += g.gl_pathc;
+    globfree(&g);
+    return n;
+}
+
+int main(void) {
+    size_t before = leftovers();
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        int failed = failures;
+        current = engines[i].name;
+        test_instances();
+        test_views();
+        test_long_value(engines[i].max_value);
+        test_batches();
+        if (engines[i].threads) test_threads();
+        printf("%s: %s\n", current, failures == failed ? "ok" : "FAILED");
+    }
+    current = "kv_close";
+    CHECK(leftovers() == before);
+    CHECK(kv_open("no-such-engine", NULL) == NULL);
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
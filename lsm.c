@@ -0,0 +1,841 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./engine.h"
+#include "./epoch.h"
+#include "./hash.h"
+#include "./simd.h"
+
+/*
+ * Writes go to the memtable, a hash table with striped mutexes. It is never
+ * kept sorted: it only gets sorted when the flusher writes it out. Once it
+ * holds LSM_MEMTABLE keys a writer seals it. It then becomes the immutable
+ * memtable and a new one takes its place. The flusher waits for the writers
+ * still inside the sealed memtable, sorts it and writes it to a file as a
+ * sorted run.
+ *
+ * A run is a sequence of entries: key length, value length, flags, key,
+ * value. Removes are written as tombstones. The entries are grouped into
+ * blocks of about LSM_BLOCK bytes. In memory, a run keeps the first key of
+ * every block (the sparse index) and a Bloom filter of its keys. The file
+ * itself is mmap'd. A lookup that the filter lets through therefore reads
+ * one block.
+ *
+ * The compactor merges the newest runs once there are LSM_FANIN of similar
+ * size (size-tiered). Tombstones are dropped when the oldest run takes part,
+ * since there is nothing older left for them to hide.
+ *
+ * Which memtables and runs make up the store is an immutable version. The
+ * flusher and the compactor install a new version under a mutex and retire
+ * the old one through the epoch reclaimer. Readers therefore look up the
+ * active memtable, the sealed one and then the runs, newest first, without
+ * locks on the structure. A write takes the key's stripe in the active
+ * memtable and looks the key up below it, so writes to a key stay ordered.
+ * Across a seal they stay ordered because writes to the new memtable first
+ * wait for the writers still inside the sealed one.
+ * Writers stall when the previous memtable is still being flushed, or when
+ * compaction has fallen LSM_STALL runs behind.
+ *
+ * Runs are written with comm_fopen(), so under the io_uring engine they go
+ * through the server's ring. The memtable is not logged, so this engine
+ * starts empty. Its runs are deleted at cleanup.
+ */
+
+#define LSM_MEMTABLE 65536         // keys before the memtable is flushed
+#define LSM_BUCKETS (1 << 17)      // per memtable; a multiple of LSM_STRIPES
+#define LSM_STRIPES 256
+#define LSM_BLOCK 4096             // bytes of entries per sparse index entry
+#define LSM_BLOOM_BITS 10          // per key
+#define LSM_BLOOM_PROBES 7
+#define LSM_FANIN 4                // runs merged at a time
+#define LSM_STALL 24               // runs at which writers wait
+#define LSM_KEY_MAX 255
+#define ENTRY_HDR 3
+
+#define F_TOMB 1  // the key was removed
+
+typedef struct mem_entry {
+    struct mem_entry *next;
+    uint64_t hash;
+    char *value;  // NULL for a tombstone
+    uint8_t key_len;
+    char name[];
+} mem_entry_t;
+
+typedef struct memtable {
+    mem_entry_t **buckets;
+    pthread_mutex_t stripes[LSM_STRIPES];
+    long count;
+    int writers;  // inside the memtable right now
+    int sealed;
+    int drained;  // sealed, and its writers have all left
+} memtable_t;
+
+typedef struct run {
+    char path[64];
+    unsigned char *data;
+    size_t size;
+    long nkeys;
+    int nblocks;
+    char **first;  // first key of each block, with its length in first_len
+    uint8_t *first_len;
+    size_t *offset;  // of each block, and the end of the data
+    uint64_t *bloom;
+    unsigned long bloom_bits;
+} run_t;
+
+typedef struct version {
+    memtable_t *active;
+    memtable_t *sealed;  // being flushed, or NULL
+    int nruns;
+    run_t *runs[];  // newest first
+} version_t;
+
+typedef struct lsm {
+    version_t *current;
+    pthread_mutex_t lock;  // serializes installing versions
+    pthread_cond_t changed;
+    pthread_t flusher;
+    pthread_t compactor;
+    int stop;
+    unsigned long next_run;
+    unsigned long flushes;
+    unsigned long compactions;
+    unsigned long stalls;
+    unsigned long bytes_in;       // written by clients, in entries
+    unsigned long bytes_written;  // to runs
+    const char *dir;              // of the runs, as configured at open
+} lsm_t;
+
+// a position in a sorted sequence of entries
+typedef struct cursor {
+    const unsigned char *p;
+    const unsigned char *end;
+} cursor_t;
+
+// what a write does with the key's current value
+typedef enum op { OP_ADD, OP_REMOVE, OP_UPDATE } op_t;
+
+static const char *lsm_dir = "lsm";
+
+void lsm_config(const char *dir) { lsm_dir = dir != NULL ? dir : "lsm"; }
+
+static uint64_t hash(const char *name, size_t len) {
+    return hash_mix(hash_mem(name, len));
+}
+
+static inline size_t entry_size(const unsigned char *e) {
+    return ENTRY_HDR + e[0] + e[1];
+}
+
+static inline const char *entry_key(const unsigned char *e) {
+    return (const char *)e + ENTRY_HDR;
+}
+
+static inline const char *entry_value(const unsigned char *e) {
+    return (const char *)e + ENTRY_HDR + e[0];
+}
+
+static size_t put_entry(unsigned char *p, const char *key, size_t key_len,
+                        const char *value, size_t value_len, int flags) {
+    p[0] = key_len;
+    p[1] = value_len;
+    p[2] = flags;
+    memcpy(p + ENTRY_HDR, key, key_len);
+    memcpy(p + ENTRY_HDR + key_len, value, value_len);
+    return ENTRY_HDR + key_len + value_len;
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void *xrealloc(void *p, size_t size) {
+    if ((p = realloc(p, size)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+/* Memtables */
+
+static memtable_t *mem_new(void) {
+    memtable_t *m = xmalloc(sizeof(memtable_t));
+    if ((m->buckets = calloc(LSM_BUCKETS, sizeof(mem_entry_t *))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < LSM_STRIPES; i++) {
+        int err = pthread_mutex_init(&m->stripes[i], 0);
+        if (err != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    m->count = 0;
+    m->writers = 0;
+    m->sealed = 0;
+    m->drained = 0;
+    return m;
+}
+
+static void mem_free(void *arg) {
+    memtable_t *m = (memtable_t *)arg;
+    for (long b = 0; b < LSM_BUCKETS; b++) {
+        mem_entry_t *e = m->buckets[b];
+        while (e != NULL) {
+            mem_entry_t *next = e->next;
+            free(e->value);
+            free(e);
+            e = next;
+        }
+    }
+    for (int i = 0; i < LSM_STRIPES; i++) pthread_mutex_destroy(&m->stripes[i]);
+    free(m->buckets);
+    free(m);
+}
+
+static inline pthread_mutex_t *stripe(memtable_t *m, uint64_t h) {
+    return &m->stripes[(h % LSM_BUCKETS) % LSM_STRIPES];
+}
+
+// called with the key's stripe held
+static mem_entry_t *mem_find(memtable_t *m, const char *name, size_t len,
+                             uint64_t h) {
+    for (mem_entry_t *e = m->buckets[h % LSM_BUCKETS]; e != NULL;
+         e = e->next) {
+        if (e->hash == h && e->key_len == len &&
+            memcmp(e->name, name, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// 1 if m has a value for name (copied to out), -1 if it has a tombstone,
+// 0 if it does not know the key
+static int mem_get(memtable_t *m, const char *name, size_t len, uint64_t h,
+                   char *out) {
+    int ret = 0;
+    pthread_mutex_lock(stripe(m, h));
+    mem_entry_t *e = mem_find(m, name, len, h);
+    if (e != NULL) {
+        ret = e->value != NULL ? 1 : -1;
+        if (ret == 1) strcpy(out, e->value);
+    }
+    pthread_mutex_unlock(stripe(m, h));
+    return ret;
+}
+
+static int entry_cmp(const void *a, const void *b, void *arg) {
+    const unsigned char *buf = (const unsigned char *)arg;
+    const unsigned char *ea = buf + *(const size_t *)a;
+    const unsigned char *eb = buf + *(const size_t *)b;
+    return key_cmp(entry_key(ea), ea[0], entry_key(eb), eb[0]);
+}
+
+// copies m's entries, sorted by key, to a buffer of run entries; each stripe
+// is locked while its buckets are copied
+static unsigned char *mem_sorted(memtable_t *m, size_t *size) {
+    size_t cap = 1 << 16, used = 0, n = 0, ncap = 1024;
+    unsigned char *buf = xmalloc(cap);
+    size_t *at = xmalloc(ncap * sizeof(size_t));
+
+    for (int s = 0; s < LSM_STRIPES; s++) {
+        pthread_mutex_lock(&m->stripes[s]);
+        for (long b = s; b < LSM_BUCKETS; b += LSM_STRIPES) {
+            for (mem_entry_t *e = m->buckets[b]; e != NULL; e = e->next) {
+                size_t vlen = e->value != NULL ? strlen(e->value) : 0;
+                if (used + ENTRY_HDR + e->key_len + vlen > cap) {
+                    buf = xrealloc(buf, cap *= 2);
+                }
+                if (n == ncap) at = xrealloc(at, (ncap *= 2) * sizeof(size_t));
+                at[n++] = used;
+                used += put_entry(buf + used, e->name, e->key_len,
+                                  e->value != NULL ? e->value : "", vlen,
+                                  e->value != NULL ? 0 : F_TOMB);
+            }
+        }
+        pthread_mutex_unlock(&m->stripes[s]);
+    }
+    qsort_r(at, n, sizeof(size_t), entry_cmp, buf);
+    unsigned char *sorted = xmalloc(used + 1);
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t size = entry_size(buf + at[i]);
+        memcpy(sorted + off, buf + at[i], size);
+        off += size;
+    }
+    free(buf);
+    free(at);
+    *size = used;
+    return sorted;
+}
+
+// waits for the writers that got into m before it was sealed
+static void wait_writers(memtable_t *m) {
+    if (__atomic_load_n(&m->drained, __ATOMIC_ACQUIRE)) return;
+    while (__atomic_load_n(&m->writers, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    __atomic_store_n(&m->drained, 1, __ATOMIC_RELEASE);
+}
+
+/* Runs */
+
+static void bloom_add(run_t *r, uint64_t h) {
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    for (int i = 0; i < LSM_BLOOM_PROBES; i++) {
+        unsigned long bit = (h1 + (uint64_t)i * h2) % r->bloom_bits;
+        r->bloom[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+static int bloom_test(run_t *r, uint64_t h) {
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    for (int i = 0; i < LSM_BLOOM_PROBES; i++) {
+        unsigned long bit = (h1 + (uint64_t)i * h2) % r->bloom_bits;
+        if (!(r->bloom[bit / 64] & (1ull << (bit % 64)))) return 0;
+    }
+    return 1;
+}
+
+// 1 if run r has a value for name (copied to out), -1 if it has a
+// tombstone, 0 if it does not have the key
+static int run_get(run_t *r, const char *name, size_t len, uint64_t h,
+                   char *out) {
+    if (!bloom_test(r, h)) return 0;
+    // the last block starting at or before name
+    int lo = 0, hi = r->nblocks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (key_cmp(r->first[mid], r->first_len[mid], name, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) return 0;
+    const unsigned char *p = r->data + r->offset[lo - 1];
+    const unsigned char *end = r->data + r->offset[lo];
+    for (; p < end; p += entry_size(p)) {
+        int cmp = key_cmp(entry_key(p), p[0], name, len);
+        if (cmp > 0) break;
+        if (cmp == 0) {
+            if (p[2] & F_TOMB) return -1;
+            memcpy(out, entry_value(p), p[1]);
+            out[p[1]] = '\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void run_free(void *arg) {
+    run_t *r = (run_t *)arg;
+    if (r->data != NULL) munmap(r->data, r->size);
+    for (int i = 0; i < r->nblocks; i++) free(r->first[i]);
+    free(r->first);
+    free(r->first_len);
+    free(r->offset);
+    free(r->bloom);
+    free(r);
+}
+
+// writes the merge of n sorted sources, newest first, to a new run sized
+// for about expected keys. The newest entry for a key wins; tombstones are
+// left out if drop is set. Returns NULL if nothing was left to write.
+static run_t *run_write(lsm_t *l, cursor_t *src, int n, long expected,
+                        int drop) {
+    run_t *r = calloc(1, sizeof(run_t));
+    int cap = 64;
+    size_t block_used = 0;
+    FILE *f;
+    if (r == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    // the flusher and the compactor both write runs
+    snprintf(r->path, sizeof(r->path), "%s/run-%06lu", l->dir,
+             __atomic_fetch_add(&l->next_run, 1, __ATOMIC_RELAXED));
+    // through the server's ring under -i uring
+    if ((f = comm_fopen(r->path, "w")) == NULL) {
+        perror(r->path);
+        exit(1);
+    }
+    r->bloom_bits = (expected > 0 ? expected : 1) * LSM_BLOOM_BITS;
+    r->bloom_bits = (r->bloom_bits + 63) / 64 * 64;
+    if ((r->bloom = calloc(r->bloom_bits / 64, sizeof(uint64_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    r->first = xmalloc(cap * sizeof(char *));
+    r->first_len = xmalloc(cap);
+    r->offset = xmalloc((cap + 1) * sizeof(size_t));
+
+    while (1) {
+        // the smallest key; on a tie the newest source has it
+        int min = -1;
+        for (int i = 0; i < n; i++) {
+            if (src[i].p >= src[i].end) continue;
+            if (min < 0 || key_cmp(entry_key(src[i].p), src[i].p[0],
+                                   entry_key(src[min].p), src[min].p[0]) < 0) {
+                min = i;
+            }
+        }
+        if (min < 0) break;
+        const unsigned char *e = src[min].p;
+        size_t size = entry_size(e);
+        for (int i = 0; i < n; i++) {
+            if (i != min && src[i].p < src[i].end &&
+                key_cmp(entry_key(src[i].p), src[i].p[0], entry_key(e),
+                        e[0]) == 0) {
+                src[i].p += entry_size(src[i].p);
+            }
+        }
+        src[min].p += size;
+        if (drop && (e[2] & F_TOMB)) continue;
+
+        if (r->nblocks == 0 || block_used + size > LSM_BLOCK) {
+            if (r->nblocks == cap) {
+                cap *= 2;
+                r->first = xrealloc(r->first, cap * sizeof(char *));
+                r->first_len = xrealloc(r->first_len, cap);
+                r->offset = xrealloc(r->offset, (cap + 1) * sizeof(size_t));
+            }
+            r->first[r->nblocks] = xmalloc(e[0] + 1);
+            memcpy(r->first[r->nblocks], entry_key(e), e[0]);
+            r->first_len[r->nblocks] = e[0];
+            r->offset[r->nblocks++] = r->size;
+            block_used = 0;
+        }
+        if (fwrite(e, 1, size, f) != size) {
+            perror("fwrite");
+            exit(1);
+        }
+        bloom_add(r, hash(entry_key(e), e[0]));
+        block_used += size;
+        r->size += size;
+        r->nkeys++;
+    }
+    r->offset[r->nblocks] = r->size;
+    if (fclose(f) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+    __atomic_add_fetch(&l->bytes_written, r->size, __ATOMIC_RELAXED);
+    if (r->nkeys == 0) {
+        unlink(r->path);
+        run_free(r);
+        return NULL;
+    }
+    int fd = open(r->path, O_RDONLY);
+    if (fd < 0) {
+        perror(r->path);
+        exit(1);
+    }
+    r->data = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (r->data == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    return r;
+}
+
+/* Versions */
+
+static version_t *version_new(version_t *from, int nruns) {
+    version_t *v = xmalloc(sizeof(version_t) + nruns * sizeof(run_t *));
+    v->active = from->active;
+    v->sealed = from->sealed;
+    v->nruns = nruns;
+    return v;
+}
+
+// called with l->lock held
+static void install(lsm_t *l, version_t *v) {
+    version_t *old = l->current;
+    __atomic_store_n(&l->current, v, __ATOMIC_RELEASE);
+    epoch_retire(old, free);
+    pthread_cond_broadcast(&l->changed);
+}
+
+// looks name up below the active memtable of v
+static int get_below(version_t *v, const char *name, size_t len, uint64_t h,
+                     char *out) {
+    int ret;
+    if (v->sealed != NULL && (ret = mem_get(v->sealed, name, len, h, out))) {
+        return ret;
+    }
+    for (int i = 0; i < v->nruns; i++) {
+        if ((ret = run_get(v->runs[i], name, len, h, out)) != 0) return ret;
+    }
+    return 0;
+}
+
+/* Background threads */
+
+static void *flusher(void *arg) {
+    lsm_t *l = (lsm_t *)arg;
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        while (!l->stop && l->current->sealed == NULL) {
+            pthread_cond_wait(&l->changed, &l->lock);
+        }
+        if (l->stop) break;
+        memtable_t *m = l->current->sealed;
+        int drop = l->current->nruns == 0;
+        pthread_mutex_unlock(&l->lock);
+
+        wait_writers(m);
+        size_t size;
+        unsigned char *buf = mem_sorted(m, &size);
+        cursor_t src = {buf, buf + size};
+        run_t *r = run_write(l, &src, 1, m->count, drop);
+        free(buf);
+
+        pthread_mutex_lock(&l->lock);
+        version_t *cur = l->current;
+        version_t *v = version_new(cur, cur->nruns + (r != NULL));
+        v->sealed = NULL;
+        if (r != NULL) v->runs[0] = r;
+        memcpy(&v->runs[r != NULL], cur->runs, cur->nruns * sizeof(run_t *));
+        install(l, v);
+        l->flushes++;
+        pthread_mutex_unlock(&l->lock);
+        epoch_retire(m, mem_free);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+// how many of the newest runs to merge: a run joins while it is no bigger
+// than twice the ones before it together, and LSM_FANIN are needed (or all
+// of them once writers are close to stalling)
+static int pick(version_t *v) {
+    if (v->nruns < LSM_FANIN) return 0;
+    size_t total = v->runs[0]->size;
+    int k = 1;
+    while (k < v->nruns && v->runs[k]->size <= 2 * total) {
+        total += v->runs[k++]->size;
+    }
+    if (k < LSM_FANIN && v->nruns >= LSM_STALL / 2) return v->nruns;
+    return k >= LSM_FANIN ? k : 0;
+}
+
+static void *compactor(void *arg) {
+    lsm_t *l = (lsm_t *)arg;
+    run_t *in[LSM_STALL + 1];
+    cursor_t src[LSM_STALL + 1];
+    int k;
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        while (!l->stop && (k = pick(l->current)) == 0) {
+            pthread_cond_wait(&l->changed, &l->lock);
+        }
+        if (l->stop) break;
+        // only this thread removes runs, so these stay valid
+        int all = k == l->current->nruns;
+        long keys = 0;
+        for (int i = 0; i < k; i++) {
+            in[i] = l->current->runs[i];
+            src[i] = (cursor_t){in[i]->data, in[i]->data + in[i]->size};
+            keys += in[i]->nkeys;
+        }
+        pthread_mutex_unlock(&l->lock);
+
+        run_t *r = run_write(l, src, k, keys, all);
+
+        pthread_mutex_lock(&l->lock);
+        version_t *cur = l->current;
+        int at = 0;  // runs flushed in the meantime come first
+        while (cur->runs[at] != in[0]) at++;
+        version_t *v = version_new(cur, cur->nruns - k + (r != NULL));
+        memcpy(v->runs, cur->runs, at * sizeof(run_t *));
+        if (r != NULL) v->runs[at] = r;
+        memcpy(&v->runs[at + (r != NULL)], &cur->runs[at + k],
+               (cur->nruns - at - k) * sizeof(run_t *));
+        install(l, v);
+        l->compactions++;
+        pthread_mutex_unlock(&l->lock);
+        for (int i = 0; i < k; i++) {
+            unlink(in[i]->path);
+            epoch_retire(in[i], run_free);
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+// seals m, once the previous memtable is flushed and compaction keeps up
+static void rotate(lsm_t *l, memtable_t *m) {
+    pthread_mutex_lock(&l->lock);
+    while (!l->stop && l->current->active == m &&
+           (l->current->sealed != NULL || l->current->nruns >= LSM_STALL)) {
+        l->stalls++;
+        pthread_cond_wait(&l->changed, &l->lock);
+    }
+    if (l->current->active == m) {
+        // writers that see this go to the new memtable. It is set before the
+        // new memtable is installed, so a writer that gets into m after one
+        // in the new memtable has waited for m's writers sees it.
+        __atomic_store_n(&m->sealed, 1, __ATOMIC_SEQ_CST);
+        version_t *v = version_new(l->current, l->current->nruns);
+        memcpy(v->runs, l->current->runs, v->nruns * sizeof(run_t *));
+        v->active = mem_new();
+        v->sealed = m;
+        install(l, v);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Engine functions */
+
+static int lsm_query(void *store, char *name, char *result, int len) {
+    lsm_t *l = (lsm_t *)store;
+    char value[LSM_KEY_MAX + 1];
+    size_t key_len = strlen(name);
+    uint64_t h = hash(name, key_len);
+    int ret;
+    if (key_len > LSM_KEY_MAX) return 0;
+    epoch_enter();
+    version_t *v = __atomic_load_n(&l->current, __ATOMIC_ACQUIRE);
+    if ((ret = mem_get(v->active, name, key_len, h, value)) == 0) {
+        ret = get_below(v, name, key_len, h, value);
+    }
+    epoch_exit();
+    return ret == 1 ? snprintf(result, len, "%s", value) + 1 : 0;
+}
+
+// applies op to name in the active memtable, under name's stripe
+static int lsm_write(lsm_t *l, char *name, op_t op, char *value,
+                     db_update_fn fn, void *arg) {
+    char cur[LSM_KEY_MAX + 1], out[DB_UPDATE_LEN];
+    size_t key_len = strlen(name);
+    uint64_t h = hash(name, key_len);
+    version_t *v;
+    memtable_t *m;
+    int found, ret = 1;
+    long count = 0;
+
+    if (key_len > LSM_KEY_MAX) return 0;
+    epoch_enter();
+    while (1) {
+        v = __atomic_load_n(&l->current, __ATOMIC_ACQUIRE);
+        m = v->active;
+        __atomic_add_fetch(&m->writers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&m->sealed, __ATOMIC_SEQ_CST)) break;
+        __atomic_sub_fetch(&m->writers, 1, __ATOMIC_SEQ_CST);
+    }
+    // a writer still in the sealed memtable may be deciding on the same key
+    // without seeing this memtable, so it goes first
+    if (v->sealed != NULL) wait_writers(v->sealed);
+    pthread_mutex_lock(stripe(m, h));
+    mem_entry_t *e = mem_find(m, name, key_len, h);
+    if (e != NULL) {
+        if ((found = e->value != NULL)) strcpy(cur, e->value);
+    } else {
+        found = get_below(v, name, key_len, h, cur) == 1;
+    }
+    switch (op) {
+        case OP_ADD:
+            ret = !found;
+            break;
+        case OP_REMOVE:
+            ret = found;
+            value = NULL;
+            break;
+        case OP_UPDATE:
+            ret = fn(found ? cur : NULL, out, sizeof(out), arg);
+            value = out;
+            break;
+    }
+    if (ret && value != NULL && strlen(value) > LSM_KEY_MAX) ret = 0;
+    if (ret) {
+        char *copy = NULL;
+        if (value != NULL && (copy = strdup(value)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        if (e == NULL) {
+            e = xmalloc(sizeof(mem_entry_t) + key_len);
+            e->hash = h;
+            e->key_len = key_len;
+            memcpy(e->name, name, key_len);
+            e->value = NULL;
+            e->next = m->buckets[h % LSM_BUCKETS];
+            m->buckets[h % LSM_BUCKETS] = e;
+            count = __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+        }
+        free(e->value);
+        e->value = copy;
+        __atomic_add_fetch(&l->bytes_in,
+                           ENTRY_HDR + key_len + (copy ? strlen(copy) : 0),
+                           __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(stripe(m, h));
+    __atomic_sub_fetch(&m->writers, 1, __ATOMIC_SEQ_CST);
+    epoch_exit();
+    if (count >= LSM_MEMTABLE) rotate(l, m);
+    return ret;
+}
+
+static int lsm_add(void *store, char *name, char *value) {
+    return lsm_write((lsm_t *)store, name, OP_ADD, value, NULL, NULL);
+}
+
+static int lsm_remove(void *store, char *name) {
+    return lsm_write((lsm_t *)store, name, OP_REMOVE, NULL, NULL, NULL);
+}
+
+static int lsm_update(void *store, char *name, db_update_fn fn, void *arg) {
+    return lsm_write((lsm_t *)store, name, OP_UPDATE, NULL, fn, arg);
+}
+
+// merges the memtables with the runs; the memtables are copied first
+static void lsm_scan(void *store, db_scan_fn fn, void *arg) {
+    lsm_t *l = (lsm_t *)store;
+    char name[LSM_KEY_MAX + 1], value[LSM_KEY_MAX + 1];
+    unsigned char *mem[2] = {NULL, NULL};
+    size_t size;
+    int n = 0;
+
+    epoch_enter();
+    version_t *v = __atomic_load_n(&l->current, __ATOMIC_ACQUIRE);
+    cursor_t *src = xmalloc((v->nruns + 2) * sizeof(cursor_t));
+    mem[0] = mem_sorted(v->active, &size);
+    src[n++] = (cursor_t){mem[0], mem[0] + size};
+    if (v->sealed != NULL) {
+        mem[1] = mem_sorted(v->sealed, &size);
+        src[n++] = (cursor_t){mem[1], mem[1] + size};
+    }
+    for (int i = 0; i < v->nruns; i++) {
+        src[n++] = (cursor_t){v->runs[i]->data,
+                              v->runs[i]->data + v->runs[i]->size};
+    }
+    while (1) {
+        int min = -1;
+        for (int i = 0; i < n; i++) {
+            if (src[i].p >= src[i].end) continue;
+            if (min < 0 || key_cmp(entry_key(src[i].p), src[i].p[0],
+                                   entry_key(src[min].p), src[min].p[0]) < 0) {
+                min = i;
+            }
+        }
+        if (min < 0) break;
+        const unsigned char *e = src[min].p;
+        for (int i = 0; i < n; i++) {
+            if (i != min && src[i].p < src[i].end &&
+                key_cmp(entry_key(src[i].p), src[i].p[0], entry_key(e),
+                        e[0]) == 0) {
+                src[i].p += entry_size(src[i].p);
+            }
+        }
+        src[min].p += entry_size(e);
+        if (e[2] & F_TOMB) continue;
+        memcpy(name, entry_key(e), e[0]);
+        name[e[0]] = '\0';
+        memcpy(value, entry_value(e), e[1]);
+        value[e[1]] = '\0';
+        fn(name, value, arg);
+    }
+    epoch_exit();
+    free(mem[0]);
+    free(mem[1]);
+    free(src);
+}
+
+static void print_entry(const char *name, const char *value, void *arg) {
+    fprintf((FILE *)arg, "%s %s\n", name, value);
+}
+
+// prints the keys in order, one per line, after the runs and how much was
+// written to them so far
+static void lsm_print(void *store, FILE *out) {
+    lsm_t *l = (lsm_t *)store;
+    pthread_mutex_lock(&l->lock);
+    version_t *v = l->current;
+    fprintf(out, "(lsm: %ld keys in the memtable, %d runs:", v->active->count,
+            v->nruns);
+    for (int i = 0; i < v->nruns; i++) {
+        fprintf(out, " %ld", v->runs[i]->nkeys);
+    }
+    fprintf(out,
+            "; %lu flushes, %lu compactions, %lu stalls; %.1f MB of runs "
+            "written for %.1f MB of writes)\n",
+            l->flushes, l->compactions, l->stalls,
+            __atomic_load_n(&l->bytes_written, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&l->bytes_in, __ATOMIC_RELAXED) / 1e6);
+    pthread_mutex_unlock(&l->lock);
+    lsm_scan(store, print_entry, out);
+}
+
+static void *lsm_open(void) {
+    lsm_t *l = calloc(1, sizeof(lsm_t));
+    if (l == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (mkdir(lsm_dir, 0755) < 0 && errno != EEXIST) {
+        perror(lsm_dir);
+        exit(1);
+    }
+    l->dir = lsm_dir;
+    l->current = xmalloc(sizeof(version_t));
+    l->current->active = mem_new();
+    l->current->sealed = NULL;
+    l->current->nruns = 0;
+    pthread_mutex_init(&l->lock, 0);
+    pthread_cond_init(&l->changed, 0);
+    int err = pthread_create(&l->flusher, 0, flusher, l);
+    if (err == 0) err = pthread_create(&l->compactor, 0, compactor, l);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    return l;
+}
+
+static void lsm_cleanup(void *store) {
+    lsm_t *l = (lsm_t *)store;
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_broadcast(&l->changed);
+    pthread_mutex_unlock(&l->lock);
+    int err = pthread_join(l->flusher, 0);
+    if (err == 0) err = pthread_join(l->compactor, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    epoch_barrier();
+    version_t *v = l->current;
+    mem_free(v->active);
+    if (v->sealed != NULL) mem_free(v->sealed);
+    for (int i = 0; i < v->nruns; i++) {
+        unlink(v->runs[i]->path);
+        run_free(v->runs[i]);
+    }
+    free(v);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->changed);
+    free(l);
+}
+
+const db_engine_t lsm_engine = {"lsm",      lsm_open,   lsm_query,
+                                lsm_add,    lsm_remove, lsm_update,
+                                lsm_scan,   lsm_print,  lsm_cleanup};
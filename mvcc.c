@@ -0,0 +1,686 @@
+#include "./mvcc.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "./cache.h"
+#include "./comm.h"
+#include "./filter.h"
+#include "./hash.h"
+#include "./repl.h"
+#include "./threadrec.h"
+#include "./vindex.h"
+
+/*
+ * Keys written while transactions are open get an entry holding their
+ * versions, newest first, each stamped with the commit timestamp that made
+ * it. The first version of an entry is the value the engine held before
+ * (timestamp 0). The engine itself always holds the newest committed value,
+ * so a key without an entry reads the same at every snapshot. Entries and
+ * versions are only reachable under their bucket's mutex, which is held
+ * just long enough to copy a value out; committing writers own the keys they
+ * write, so two writers only wait on each other for the same key.
+ *
+ * Commits take timestamps from clock_ts and become visible in timestamp
+ * order through visible_ts, which is what new snapshots read. When no
+ * transaction is open the collector switches versioning off, waits for
+ * writers already past the check and drops every entry; beginning a
+ * transaction switches it back on the same way.
+ *
+ * On a replication leader every write is also logged (repl.c): while its
+ * owner holds the key when versioning, and between repl_begin() and
+ * repl_end(), which take no lock, when not.
+ *
+ * Reads of the engine first ask the filter (filter.c) whether the key can be
+ * there at all, then the read cache (cache.c). Writes count a key in the
+ * filter before it can appear in the engine and uncount it once it is gone.
+ * With a value index (vindex.c) they also move the key between values while
+ * it is held, by a vindex_lock stripe when not versioning.
+ */
+
+#define MV_BUCKETS (1 << 14)
+#define MV_GC_INTERVAL 100000  // usecs between collector passes
+#define MAXLEN 256
+
+typedef struct version {
+    unsigned long ts;  // commit timestamp, 0 for the value found in the engine
+    char *value;       // NULL if the key was absent
+    struct version *older;
+} version_t;
+
+typedef struct entry {
+    char *name;
+    struct mv_thread *owner;  // writer committing this key, if any
+    version_t *versions;      // NULL until the owner has read the engine
+    struct entry *next;
+} entry_t;
+
+typedef struct bucket {
+    pthread_mutex_t lock;
+    entry_t *entries;
+} bucket_t;
+
+typedef struct write {
+    char *name;
+    char *value;  // NULL to remove
+} write_t;
+
+// per-thread state; records are reused after their thread exits
+typedef struct mv_thread {
+    thread_rec_t rec;
+    int writing;          // inside a non-transactional write
+    unsigned long snap;   // snapshot of the open transaction, or 0
+    write_t *writes;      // buffered writes of the open transaction
+    int nwrites;
+    int cap;
+} mv_thread_t;
+
+static const db_engine_t *engine;
+static void *store;
+static bucket_t *buckets;
+
+static unsigned long clock_ts = 1;    // last commit timestamp handed out
+static unsigned long visible_ts = 1;  // every commit up to here is installed
+static int versioning;
+static int active_txns;
+static pthread_mutex_t mode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread mv_thread_t *self;
+
+static pthread_t gc_thread;
+static int gc_stop;
+
+static inline void mv_lock(pthread_mutex_t *m) {
+    int err = pthread_mutex_lock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void mv_unlock(pthread_mutex_t *m) {
+    int err = pthread_mutex_unlock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static char *mv_strdup(const char *s) {
+    char *p;
+    if (s == NULL) return NULL;
+    if ((p = strdup(s)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    return p;
+}
+
+/* Transactions and thread records */
+
+static void txn_end(mv_thread_t *t) {
+    for (int i = 0; i < t->nwrites; i++) {
+        free(t->writes[i].name);
+        free(t->writes[i].value);
+    }
+    t->nwrites = 0;
+    __atomic_store_n(&t->snap, 0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&active_txns, 1, __ATOMIC_SEQ_CST);
+}
+
+// thread exit: abort its transaction
+static void thread_release(thread_rec_t *rec) {
+    mv_thread_t *t = (mv_thread_t *)rec;
+    if (t->snap != 0) txn_end(t);
+}
+
+static thread_recs_t threads =
+    THREAD_RECS(mv_thread_t, 0, NULL, thread_release);
+
+static mv_thread_t *thread_get(void) {
+    if (self == NULL) self = (mv_thread_t *)thread_rec_get(&threads);
+    return self;
+}
+
+// waits for non-transactional writes that may have missed a mode change
+static void wait_writers(void) {
+    for (thread_rec_t *r = thread_recs_first(&threads); r != NULL;
+         r = r->next) {
+        mv_thread_t *t = (mv_thread_t *)r;
+        while (__atomic_load_n(&t->writing, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+    }
+}
+
+/* Entries and versions */
+
+static bucket_t *bucket_of(const char *name) {
+    return &buckets[hash_str(name) & (MV_BUCKETS - 1)];
+}
+
+static entry_t *find(bucket_t *b, const char *name) {
+    for (entry_t *e = b->entries; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) return e;
+    }
+    return NULL;
+}
+
+static void versions_free(version_t *v) {
+    while (v != NULL) {
+        version_t *older = v->older;
+        free(v->value);
+        free(v);
+        v = older;
+    }
+}
+
+static version_t *version_new(unsigned long ts, const char *value) {
+    version_t *v = malloc(sizeof(version_t));
+    if (v == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    v->ts = ts;
+    v->value = mv_strdup(value);
+    v->older = NULL;
+    return v;
+}
+
+// reads the engine's value of name, unless the filter rules it out
+static int engine_query(char *name, char *result, int len) {
+    if (!filter_check(name)) return 0;
+    if (cache_query(engine, store, name, result, len)) return 1;
+    filter_false_positive();
+    return 0;
+}
+
+// reads name straight from the engine, for repl_end()
+static int engine_get(const char *name, char *result, int len) {
+    return engine->query(store, (char *)name, result, len);
+}
+
+// copies the value of name as of snapshot ts into result; 1 if present
+static int read_at(char *name, unsigned long ts, char *result, int len) {
+    bucket_t *b = bucket_of(name);
+    int found;
+    mv_lock(&b->lock);
+    entry_t *e = find(b, name);
+    if (e == NULL || e->versions == NULL) {
+        // nobody has changed the engine's value since the oldest snapshot
+        found = engine_query(name, result, len);
+    } else {
+        version_t *v = e->versions;
+        while (v->ts > ts) v = v->older;
+        if ((found = v->value != NULL)) snprintf(result, len, "%s", v->value);
+    }
+    mv_unlock(&b->lock);
+    return found;
+}
+
+// makes t the owner of name's entry, creating it if needed
+static entry_t *acquire(mv_thread_t *t, char *name) {
+    bucket_t *b = bucket_of(name);
+    entry_t *e;
+    while (1) {
+        mv_lock(&b->lock);
+        if ((e = find(b, name)) == NULL) {
+            if ((e = calloc(1, sizeof(entry_t))) == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+            e->name = mv_strdup(name);
+            e->next = b->entries;
+            b->entries = e;
+        }
+        if (e->owner == NULL) {
+            e->owner = t;
+            mv_unlock(&b->lock);
+            break;
+        }
+        mv_unlock(&b->lock);
+        sched_yield();
+    }
+
+    if (e->versions == NULL) {
+        char value[MAXLEN];
+        int found = engine->query(store, name, value, sizeof(value));
+        version_t *base = version_new(0, found ? value : NULL);
+        mv_lock(&b->lock);
+        e->versions = base;
+        mv_unlock(&b->lock);
+    }
+    return e;
+}
+
+static void release(entry_t *e) {
+    bucket_t *b = bucket_of(e->name);
+    mv_lock(&b->lock);
+    e->owner = NULL;
+    mv_unlock(&b->lock);
+}
+
+static int set_value(const char *cur, char *out, int len, void *arg) {
+    snprintf(out, len, "%s", (char *)arg);
+    return 1;
+}
+
+// installs value as the version of owned entry e committed at ts and
+// applies it to the engine
+static void install(entry_t *e, unsigned long ts, char *value) {
+    bucket_t *b = bucket_of(e->name);
+    int existed = e->versions->value != NULL;
+    char old[MAXLEN];
+    // once superseded, the old version is the collector's to free
+    if (existed && vindex_enabled) {
+        snprintf(old, sizeof(old), "%s", e->versions->value);
+    }
+    version_t *v = version_new(ts, value);
+    mv_lock(&b->lock);
+    v->older = e->versions;
+    e->versions = v;
+    mv_unlock(&b->lock);
+
+    unsigned slot = cache_write_begin(e->name);
+    if (value == NULL) {
+        if (existed) {
+            engine->remove(store, e->name);
+            filter_remove(e->name);
+        }
+    } else if (existed) {
+        engine->update(store, e->name, set_value, value);
+    } else {
+        filter_add(e->name);
+        engine->add(store, e->name, value);
+    }
+    cache_write_end(slot);
+    vindex_change(e->name, existed ? old : NULL, value);
+}
+
+// makes commit ts visible once every earlier commit is
+static void publish(unsigned long ts) {
+    while (__atomic_load_n(&visible_ts, __ATOMIC_ACQUIRE) != ts - 1) {
+        sched_yield();
+    }
+    __atomic_store_n(&visible_ts, ts, __ATOMIC_RELEASE);
+}
+
+// a non-transactional add (value), remove (NULL) or update (fn) while
+// versioning
+static int write_versioned(mv_thread_t *t, char *name, char *value,
+                           db_update_fn fn, void *arg) {
+    char out[DB_UPDATE_LEN];
+    entry_t *e = acquire(t, name);
+    int existed = e->versions->value != NULL;
+    int ret;
+    if (fn != NULL) {
+        ret = fn(e->versions->value, out, sizeof(out), arg);
+        value = out;
+    } else {
+        ret = value != NULL ? !existed : existed;
+    }
+    if (ret) {
+        unsigned long ts = __atomic_add_fetch(&clock_ts, 1, __ATOMIC_SEQ_CST);
+        install(e, ts, value);
+        if (repl_leading) repl_log(name, value);
+        publish(ts);
+    }
+    release(e);
+    return ret;
+}
+
+// what the last call of an update function saw and made, for the filter,
+// the log and the value index
+typedef struct seen {
+    db_update_fn fn;
+    void *arg;
+    int absent;                 // the key was absent
+    char old[DB_UPDATE_LEN];    // the value it saw, when indexing
+    char value[DB_UPDATE_LEN];  // the value it made, when leading or indexing
+} seen_t;
+
+static int seen_fn(const char *cur, char *out, int len, void *arg) {
+    seen_t *sn = (seen_t *)arg;
+    int ret = sn->fn(cur, out, len, sn->arg);
+    sn->absent = cur == NULL;
+    if (ret && (repl_leading || vindex_enabled)) {
+        size_t n = strnlen(out, sizeof(sn->value) - 1);
+        memcpy(sn->value, out, n);
+        sn->value[n] = '\0';
+        if (vindex_enabled && cur != NULL) {
+            snprintf(sn->old, sizeof(sn->old), "%s", cur);
+        }
+    }
+    return ret;
+}
+
+// a write while not versioning: straight to the engine
+static int write_unversioned(char *name, char *value, db_update_fn fn,
+                             void *arg) {
+    char current[MAXLEN];
+    seen_t sn;
+    repl_write_t rw;
+    unsigned vstripe = 0;
+    unsigned slot;
+    int ret;
+    if (fn == NULL && value == NULL) {
+        if (!filter_check(name)) return 0;
+    } else if (fn == NULL && filter_enabled) {
+        // a key the filter has seen is probably a duplicate: look for it
+        // without the engine's write locks
+        if (engine_query(name, current, sizeof(current))) return 0;
+    }
+    if (repl_leading) rw = repl_begin(name);
+    if (vindex_enabled) vstripe = vindex_lock(name);
+    if (fn != NULL) {
+        sn.fn = fn;
+        sn.arg = arg;
+        filter_add(name);
+        slot = cache_write_begin(name);
+        ret = engine->update(store, name, seen_fn, &sn);
+        // keep the count only if the key was added
+        if (!(ret && sn.absent)) filter_remove(name);
+        value = sn.value;
+        if (ret) vindex_change(name, sn.absent ? NULL : sn.old, value);
+    } else if (value != NULL) {
+        filter_add(name);
+        slot = cache_write_begin(name);
+        if (!(ret = engine->add(store, name, value))) filter_remove(name);
+        if (ret) vindex_change(name, NULL, value);
+    } else {
+        slot = cache_write_begin(name);
+        // the index needs the value being removed; the stripe keeps it
+        int found = vindex_enabled &&
+                    engine->query(store, name, current, sizeof(current));
+        if ((ret = engine->remove(store, name))) {
+            filter_remove(name);
+            if (found) vindex_change(name, current, NULL);
+        }
+    }
+    cache_write_end(slot);
+    if (vindex_enabled) vindex_unlock(vstripe);
+    if (repl_leading) repl_end(&rw, name, value, ret, engine_get);
+    return ret;
+}
+
+static int write_direct(char *name, char *value, db_update_fn fn,
+                        void *arg) {
+    mv_thread_t *t = thread_get();
+    int ret;
+    int state;
+
+    // once a timestamp is taken the commit must be published
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    __atomic_store_n(&t->writing, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&versioning, __ATOMIC_SEQ_CST)) {
+        ret = write_unversioned(name, value, fn, arg);
+    } else {
+        ret = write_versioned(t, name, value, fn, arg);
+    }
+    __atomic_store_n(&t->writing, 0, __ATOMIC_RELEASE);
+    pthread_setcancelstate(state, NULL);
+    return ret;
+}
+
+/* Collector */
+
+static void drop_all(void) {
+    for (int i = 0; i < MV_BUCKETS; i++) {
+        entry_t *e = buckets[i].entries;
+        while (e != NULL) {
+            entry_t *next = e->next;
+            versions_free(e->versions);
+            free(e->name);
+            free(e);
+            e = next;
+        }
+        buckets[i].entries = NULL;
+    }
+}
+
+// Drops versions no snapshot can see: everything older than the newest
+// version at or before the oldest snapshot, and whole entries whose newest
+// version is that old, since the engine holds the same value.
+static void gc_pass(void) {
+    mv_lock(&mode_lock);
+    if (!versioning) {
+        mv_unlock(&mode_lock);
+        return;
+    }
+    if (__atomic_load_n(&active_txns, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_store_n(&versioning, 0, __ATOMIC_SEQ_CST);
+        wait_writers();
+        drop_all();
+        mv_unlock(&mode_lock);
+        return;
+    }
+    unsigned long oldest = __atomic_load_n(&visible_ts, __ATOMIC_ACQUIRE);
+    for (thread_rec_t *r = thread_recs_first(&threads); r != NULL;
+         r = r->next) {
+        mv_thread_t *t = (mv_thread_t *)r;
+        unsigned long s = __atomic_load_n(&t->snap, __ATOMIC_ACQUIRE);
+        if (s != 0 && s < oldest) oldest = s;
+    }
+    mv_unlock(&mode_lock);
+
+    for (int i = 0; i < MV_BUCKETS; i++) {
+        bucket_t *b = &buckets[i];
+        if (__atomic_load_n(&b->entries, __ATOMIC_RELAXED) == NULL) continue;
+        mv_lock(&b->lock);
+        entry_t **pe = &b->entries;
+        while (*pe != NULL) {
+            entry_t *e = *pe;
+            version_t *v = e->versions;
+            if (e->owner != NULL || v == NULL) {
+                pe = &e->next;
+                continue;
+            }
+            while (v->ts > oldest) v = v->older;
+            versions_free(v->older);
+            v->older = NULL;
+            if (v == e->versions) {
+                *pe = e->next;
+                versions_free(e->versions);
+                free(e->name);
+                free(e);
+            } else {
+                pe = &e->next;
+            }
+        }
+        mv_unlock(&b->lock);
+    }
+}
+
+static void *gc_loop(void *arg) {
+    while (!__atomic_load_n(&gc_stop, __ATOMIC_ACQUIRE)) {
+        usleep(MV_GC_INTERVAL);
+        gc_pass();
+    }
+    return NULL;
+}
+
+/* Interface */
+
+void mvcc_init(const db_engine_t *eng, void *st) {
+    engine = eng;
+    store = st;
+    if ((buckets = calloc(MV_BUCKETS, sizeof(bucket_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < MV_BUCKETS; i++) {
+        int err = pthread_mutex_init(&buckets[i].lock, 0);
+        if (err != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    int err = pthread_create(&gc_thread, 0, gc_loop, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+}
+
+void mvcc_shutdown(void) {
+    __atomic_store_n(&gc_stop, 1, __ATOMIC_RELEASE);
+    int err = pthread_join(gc_thread, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    drop_all();
+    for (int i = 0; i < MV_BUCKETS; i++) {
+        pthread_mutex_destroy(&buckets[i].lock);
+    }
+    free(buckets);
+}
+
+int mvcc_begin(void) {
+    mv_thread_t *t = thread_get();
+    if (t->snap != 0) return -1;
+
+    mv_lock(&mode_lock);
+    __atomic_add_fetch(&active_txns, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&versioning, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&versioning, 1, __ATOMIC_SEQ_CST);
+        wait_writers();
+    }
+    __atomic_store_n(&t->snap, __atomic_load_n(&visible_ts, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+    mv_unlock(&mode_lock);
+    return 0;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((write_t *)a)->name, ((write_t *)b)->name);
+}
+
+int mvcc_commit(void) {
+    mv_thread_t *t = thread_get();
+    int n = t->nwrites;
+    int ok = 1;
+    int state;
+    if (t->snap == 0) return -1;
+    if (n == 0) {
+        txn_end(t);
+        return 1;
+    }
+
+    entry_t **entries = malloc(n * sizeof(entry_t *));
+    if (entries == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+    // own every key in name order, so that committers cannot deadlock
+    qsort(t->writes, n, sizeof(write_t), by_name);
+    for (int i = 0; i < n; i++) {
+        entries[i] = acquire(t, t->writes[i].name);
+        if (entries[i]->versions->ts > t->snap) ok = 0;
+    }
+    if (ok) {
+        unsigned long ts = __atomic_add_fetch(&clock_ts, 1, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < n; i++) {
+            install(entries[i], ts, t->writes[i].value);
+        }
+        if (repl_leading) {
+            // followers apply the commit as a whole
+            size_t size = 0;
+            for (int i = 0; i < n; i++) {
+                size += repl_size(t->writes[i].name, t->writes[i].value);
+            }
+            unsigned long pos = repl_reserve(size);
+            for (int i = 0; i < n; i++) {
+                pos = repl_put(pos, t->writes[i].name, t->writes[i].value,
+                               i < n - 1);
+            }
+        }
+        publish(ts);
+    }
+    for (int i = 0; i < n; i++) {
+        release(entries[i]);
+    }
+    txn_end(t);
+    pthread_setcancelstate(state, NULL);
+    free(entries);
+    return ok;
+}
+
+int mvcc_abort(void) {
+    mv_thread_t *t = thread_get();
+    if (t->snap == 0) return -1;
+    txn_end(t);
+    return 0;
+}
+
+int mvcc_active(void) { return self != NULL && self->snap != 0; }
+
+static write_t *own_write(mv_thread_t *t, char *name) {
+    for (int i = 0; i < t->nwrites; i++) {
+        if (strcmp(t->writes[i].name, name) == 0) return &t->writes[i];
+    }
+    return NULL;
+}
+
+// buffers a write (value, or NULL to remove) in the open transaction
+static void buffer_write(mv_thread_t *t, char *name, char *value) {
+    write_t *w = own_write(t, name);
+    if (w == NULL) {
+        if (t->nwrites == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 8;
+            if ((t->writes = realloc(t->writes, t->cap * sizeof(write_t))) ==
+                NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        w = &t->writes[t->nwrites++];
+        w->name = mv_strdup(name);
+    } else {
+        free(w->value);
+    }
+    w->value = mv_strdup(value);
+}
+
+int mvcc_query(char *name, char *result, int len) {
+    mv_thread_t *t = thread_get();
+    if (t->snap == 0) return engine_query(name, result, len);
+
+    write_t *w = own_write(t, name);
+    if (w != NULL) {
+        if (w->value == NULL) return 0;
+        snprintf(result, len, "%s", w->value);
+        return 1;
+    }
+    return read_at(name, t->snap, result, len);
+}
+
+int mvcc_add(char *name, char *value) {
+    char current[MAXLEN];
+    mv_thread_t *t = thread_get();
+    if (t->snap == 0) return write_direct(name, value, NULL, NULL);
+    if (mvcc_query(name, current, sizeof(current))) return 0;
+    buffer_write(t, name, value);
+    return 1;
+}
+
+int mvcc_remove(char *name) {
+    char current[MAXLEN];
+    mv_thread_t *t = thread_get();
+    if (t->snap == 0) return write_direct(name, NULL, NULL, NULL);
+    if (!mvcc_query(name, current, sizeof(current))) return 0;
+    buffer_write(t, name, NULL);
+    return 1;
+}
+
+int mvcc_update(char *name, db_update_fn fn, void *arg) {
+    char current[MAXLEN];
+    char value[DB_UPDATE_LEN];
+    mv_thread_t *t = thread_get();
+    if (t->snap == 0) return write_direct(name, NULL, fn, arg);
+    int found = mvcc_query(name, current, sizeof(current));
+    if (!fn(found ? current : NULL, value, sizeof(value), arg)) return 0;
+    buffer_write(t, name, value);
+    return 1;
+}
+
+void mvcc_scan(db_scan_fn fn, void *arg) { engine->scan(store, fn, arg); }
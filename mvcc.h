@@ -0,0 +1,73 @@
+#ifndef MVCC_H_
+#define MVCC_H_
+
+#include "./engine.h"
+
+/*
+ * Snapshot-isolated transactions over a storage engine. Outside a
+ * transaction every operation goes straight to the engine. While any
+ * transaction is open, writes also record versions of the keys they change,
+ * so that a transaction reads the database as of its begin and its buffered
+ * writes are applied atomically at commit, unless another writer committed
+ * one of the same keys first. Transactions belong to the calling thread.
+ */
+
+/**
+ * mvcc_init() puts the layer in front of engine and its store and starts the
+ * background thread that garbage-collects stale versions.
+ */
+void mvcc_init(const db_engine_t *engine, void *store);
+
+/**
+ * mvcc_shutdown() stops the collector and frees all versions. No other thread
+ * may be using the database.
+ */
+void mvcc_shutdown(void);
+
+/**
+ * mvcc_begin() starts a transaction with a snapshot of the committed state.
+ * Returns 0, or -1 if the thread is already in a transaction.
+ */
+int mvcc_begin(void);
+
+/**
+ * mvcc_commit() applies the transaction's writes. Returns 1 if it committed,
+ * 0 if it was aborted because a key it wrote was committed by someone else
+ * after its snapshot, or -1 if the thread is not in a transaction.
+ */
+int mvcc_commit(void);
+
+/**
+ * mvcc_abort() discards the transaction. Returns 0, or -1 if the thread is
+ * not in a transaction.
+ */
+int mvcc_abort(void);
+
+/**
+ * mvcc_active() returns 1 if the calling thread is in a transaction.
+ */
+int mvcc_active(void);
+
+/**
+ * mvcc_query(), mvcc_add() and mvcc_remove() behave like the engine
+ * operations. In a transaction they read its snapshot (and its own writes)
+ * and buffer writes until commit.
+ */
+int mvcc_query(char *name, char *result, int len);
+int mvcc_add(char *name, char *value);
+int mvcc_remove(char *name);
+
+/**
+ * mvcc_update() replaces name's value with the one fn makes from it, as the
+ * engine's update does. In a transaction fn sees the snapshot's value and the
+ * result is buffered like any other write.
+ */
+int mvcc_update(char *name, db_update_fn fn, void *arg);
+
+/**
+ * mvcc_scan() calls fn for every key with its newest committed value, as the
+ * engine's scan does.
+ */
+void mvcc_scan(db_scan_fn fn, void *arg);
+
+#endif  // MVCC_H_
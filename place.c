@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include "./place.h"
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./comm.h"
+
+/*
+ * The nodes are the online ones in /sys/devices/system/node that have CPUs
+ * this process may run on. Memory is bound with mbind() and set_mempolicy()
+ * called directly, as MPOL_PREFERRED: a full node spills over instead of
+ * failing, and a kernel without NUMA support simply ignores the calls.
+ *
+ * Each node's arena has a pool per size class (32 to 512 bytes, header
+ * included), each with its own mutex, a free list and the rest of its
+ * newest 1MB chunk. The header before a block records its node and class, so
+ * a block freed by a thread of another node still goes back to its own
+ * node's free list.
+ *
+ * An arena of its own (place_arena_new()) is built the same way, but is
+ * no node's: its chunks come from the node of the thread that fills it, and
+ * its blocks go back to it while the thread freeing them has it in use.
+ * Blocks come with a header even when placement is off, so the arena in use
+ * is what tells place_free() whether a block has one.
+ */
+
+#define PLACE_MAX_NODES 64
+#define PLACE_CHUNK (1 << 20)
+#define PLACE_CLASSES 5  // blocks of 32 << class bytes; this class is malloc
+#define PLACE_HDR 16     // keeps blocks 16-byte aligned
+
+typedef struct header {
+    uint16_t node;
+    uint8_t class;
+} header_t;
+
+// a free block, linked through its header
+typedef struct block {
+    struct block *next;
+} block_t;
+
+typedef struct pool {
+    pthread_mutex_t lock;
+    block_t *free;
+    char *bump;  // the unused rest of the newest chunk
+    char *end;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long remote_frees;  // by threads of another node
+} __attribute__((aligned(64))) pool_t;
+
+typedef struct arena {
+    pool_t pools[PLACE_CLASSES];
+    int id;  // the node's number in sysfs
+    cpu_set_t cpus;
+    char cpulist[64];
+    void *chunks;  // linked through each chunk's first word
+    unsigned long mapped;
+    unsigned long threads;
+} arena_t;
+
+static place_mode_t mode = PLACE_OFF;
+static arena_t *arenas;
+static int nnodes = 1;
+static unsigned next_node;
+static __thread int my_node;
+static __thread arena_t *my_arena;  // place_use()
+
+// reads a sysfs list such as "0-3,8" into set, and its text into text
+static int read_list(const char *path, cpu_set_t *set, char *text,
+                     size_t len) {
+    char buf[4096], *save, *s;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    if (fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    if (text != NULL) {
+        size_t n = strnlen(buf, len - 1);  // cut to fit, as for a long list
+        memcpy(text, buf, n);
+        text[n] = '\0';
+    }
+    CPU_ZERO(set);
+    for (s = strtok_r(buf, ",", &save); s != NULL;
+         s = strtok_r(NULL, ",", &save)) {
+        int lo, hi, n = sscanf(s, "%d-%d", &lo, &hi);
+        if (n < 1) continue;
+        if (n == 1) hi = lo;
+        for (int i = lo; i <= hi && i < CPU_SETSIZE; i++) CPU_SET(i, set);
+    }
+    return 0;
+}
+
+static void init_arena(arena_t *a, int id) {
+    a->id = id;
+    for (int c = 0; c < PLACE_CLASSES; c++) {
+        int err = pthread_mutex_init(&a->pools[c].lock, 0);
+        if (err != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+}
+
+void place_init(place_mode_t m) {
+    cpu_set_t allowed, online;
+    char path[64];
+    mode = m;
+    if (mode == PLACE_OFF) return;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        exit(1);
+    }
+    if (posix_memalign((void **)&arenas, 64,
+                       PLACE_MAX_NODES * sizeof(arena_t)) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(arenas, 0, PLACE_MAX_NODES * sizeof(arena_t));
+
+    nnodes = 0;
+    if (read_list("/sys/devices/system/node/online", &online, NULL, 0) == 0) {
+        for (int id = 0; id < PLACE_MAX_NODES; id++) {
+            arena_t *a = &arenas[nnodes];
+            if (!CPU_ISSET(id, &online)) continue;
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/node/node%d/cpulist", id);
+            if (read_list(path, &a->cpus, a->cpulist, sizeof(a->cpulist))) {
+                continue;
+            }
+            // a memory-only node, or one we may not run on
+            CPU_AND(&a->cpus, &a->cpus, &allowed);
+            if (CPU_COUNT(&a->cpus) == 0) continue;
+            init_arena(a, id);
+            nnodes++;
+        }
+    }
+    if (nnodes == 0) {
+        arenas[0].cpus = allowed;
+        snprintf(arenas[0].cpulist, sizeof(arenas[0].cpulist), "all");
+        init_arena(&arenas[0], 0);
+        nnodes = 1;
+    }
+}
+
+// empties a's pools and unmaps its chunks
+static void reset_arena(arena_t *a) {
+    for (int c = 0; c < PLACE_CLASSES; c++) {
+        pool_t *pool = &a->pools[c];
+        pthread_mutex_lock(&pool->lock);
+        pool->free = NULL;
+        pool->bump = NULL;
+        pool->end = NULL;
+        pool->allocs = 0;
+        pool->frees = 0;
+        pool->remote_frees = 0;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    void *chunk = __atomic_exchange_n(&a->chunks, NULL, __ATOMIC_ACQUIRE);
+    while (chunk != NULL) {
+        void *next = *(void **)chunk;
+        munmap(chunk, PLACE_CHUNK);
+        chunk = next;
+    }
+    __atomic_store_n(&a->mapped, 0, __ATOMIC_RELAXED);
+}
+
+int place_reset(void) {
+    if (mode == PLACE_OFF) return -1;
+    for (int n = 0; n < nnodes; n++) reset_arena(&arenas[n]);
+    return 0;
+}
+
+place_arena_t *place_arena_new(void) {
+    arena_t *a;
+    if (posix_memalign((void **)&a, 64, sizeof(arena_t)) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(a, 0, sizeof(arena_t));
+    init_arena(a, -1);
+    return a;
+}
+
+void place_arena_free(place_arena_t *a) {
+    reset_arena(a);
+    for (int c = 0; c < PLACE_CLASSES; c++) {
+        pthread_mutex_destroy(&a->pools[c].lock);
+    }
+    free(a);
+}
+
+size_t place_arena_size(place_arena_t *a) {
+    return __atomic_load_n(&a->mapped, __ATOMIC_RELAXED);
+}
+
+void place_use(place_arena_t *a) { my_arena = a; }
+
+void place_shutdown(void) {
+    if (place_reset() < 0) return;
+    for (int n = 0; n < nnodes; n++) {
+        for (int c = 0; c < PLACE_CLASSES; c++) {
+            pthread_mutex_destroy(&arenas[n].pools[c].lock);
+        }
+    }
+    free(arenas);
+    arenas = NULL;
+    mode = PLACE_OFF;
+    nnodes = 1;
+}
+
+place_mode_t place_mode(void) { return mode; }
+
+int place_nodes(void) { return nnodes; }
+
+int place_node(void) { return my_node; }
+
+// makes p's pages, or the calling thread's allocations if p is NULL, prefer
+// node's memory
+static void prefer(int node, void *p, size_t size) {
+    unsigned long mask = 1ul << arenas[node].id;
+    if (p != NULL) {
+        syscall(__NR_mbind, p, size, MPOL_PREFERRED, &mask,
+                PLACE_MAX_NODES + 1, 0);
+    } else {
+        syscall(__NR_set_mempolicy, MPOL_PREFERRED, &mask,
+                PLACE_MAX_NODES + 1);
+    }
+}
+
+int place_thread(int node) {
+    if (mode == PLACE_OFF) return 0;
+    if (node < 0) {
+        node = __atomic_fetch_add(&next_node, 1, __ATOMIC_RELAXED) % nnodes;
+    }
+    node %= nnodes;
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                     &arenas[node].cpus);
+    if (err != 0) {
+        handle_error_en(err, "pthread_setaffinity_np");
+    }
+    prefer(node, NULL, 0);
+    my_node = node;
+    __atomic_add_fetch(&arenas[node].threads, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+void *place_region(int node, size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (mode != PLACE_OFF) prefer(node % nnodes, p, size);
+    return p;
+}
+
+void place_region_free(void *p, size_t size) {
+    if (p != NULL) munmap(p, size);
+}
+
+// called with pool's lock held; the chunk is on node's memory
+static void refill(arena_t *a, pool_t *pool, int node) {
+    char *chunk = place_region(node, PLACE_CHUNK);
+    void *head = __atomic_load_n(&a->chunks, __ATOMIC_RELAXED);
+    do {
+        *(void **)chunk = head;
+    } while (!__atomic_compare_exchange_n(&a->chunks, &head, chunk, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&a->mapped, PLACE_CHUNK, __ATOMIC_RELAXED);
+    pool->bump = chunk + PLACE_HDR;
+    pool->end = chunk + PLACE_CHUNK;
+}
+
+void *place_alloc(size_t size) {
+    char *p;
+    int c = 0;
+    arena_t *a = my_arena;
+    if (a == NULL) {
+        if (mode == PLACE_OFF) return malloc(size);
+        a = &arenas[my_node];
+    }
+    while (c < PLACE_CLASSES && (32ul << c) < size + PLACE_HDR) c++;
+    if (c == PLACE_CLASSES) {
+        if ((p = malloc(size + PLACE_HDR)) == NULL) return NULL;
+    } else {
+        pool_t *pool = &a->pools[c];
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free != NULL) {
+            p = (char *)pool->free;
+            pool->free = pool->free->next;
+        } else {
+            if (pool->bump == NULL || pool->bump + (32 << c) > pool->end) {
+                refill(a, pool, a == my_arena ? my_node : a - arenas);
+            }
+            p = pool->bump;
+            pool->bump += 32 << c;
+        }
+        pool->allocs++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    ((header_t *)p)->node = my_node;
+    ((header_t *)p)->class = c;
+    return p + PLACE_HDR;
+}
+
+void place_free(void *ptr) {
+    if (mode == PLACE_OFF && my_arena == NULL) {
+        free(ptr);
+        return;
+    }
+    if (ptr == NULL) return;
+    char *p = (char *)ptr - PLACE_HDR;
+    header_t h = *(header_t *)p;
+    if (h.class == PLACE_CLASSES) {
+        free(p);
+        return;
+    }
+    arena_t *a = my_arena != NULL ? my_arena : &arenas[h.node];
+    pool_t *pool = &a->pools[h.class];
+    pthread_mutex_lock(&pool->lock);
+    ((block_t *)p)->next = pool->free;
+    pool->free = (block_t *)p;
+    pool->frees++;
+    if (h.node != my_node) pool->remote_frees++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *place_realloc(void *ptr, size_t size) {
+    if (mode == PLACE_OFF && my_arena == NULL) return realloc(ptr, size);
+    if (ptr == NULL) return place_alloc(size);
+    char *p = (char *)ptr - PLACE_HDR;
+    header_t h = *(header_t *)p;
+    if (h.class == PLACE_CLASSES) {
+        if ((p = realloc(p, size + PLACE_HDR)) == NULL) return NULL;
+        return p + PLACE_HDR;
+    }
+    size_t room = (32ul << h.class) - PLACE_HDR;
+    if (size <= room) return ptr;
+    void *q = place_alloc(size);
+    if (q == NULL) return NULL;
+    memcpy(q, ptr, room);
+    place_free(ptr);
+    return q;
+}
+
+void place_report(FILE *out) {
+    if (mode == PLACE_OFF) {
+        fprintf(out, "placement off\n");
+        return;
+    }
+    fprintf(out, "placement over %d node%s: threads pinned%s\n", nnodes,
+            nnodes > 1 ? "s" : "",
+            mode == PLACE_SHARD ? ", cache shards per node" : "");
+    for (int n = 0; n < nnodes; n++) {
+        arena_t *a = &arenas[n];
+        unsigned long used = 0, remote = 0;
+        for (int c = 0; c < PLACE_CLASSES; c++) {
+            pool_t *pool = &a->pools[c];
+            pthread_mutex_lock(&pool->lock);
+            used += pool->allocs - pool->frees;
+            remote += pool->remote_frees;
+            pthread_mutex_unlock(&pool->lock);
+        }
+        fprintf(out,
+                "  node %d (cpus %s): %lu threads, %.1f MB of arena, %lu "
+                "blocks in use, %lu freed from other nodes\n",
+                a->id, a->cpulist,
+                __atomic_load_n(&a->threads, __ATOMIC_RELAXED),
+                __atomic_load_n(&a->mapped, __ATOMIC_RELAXED) / 1048576.0,
+                used, remote);
+    }
+}
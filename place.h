@@ -0,0 +1,101 @@
+#ifndef PLACE_H_
+#define PLACE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * NUMA placement. Threads are pinned to the CPUs of one node and prefer its
+ * memory; BST nodes come from an arena of the allocating thread's node; and
+ * with PLACE_SHARD, each node gets its own copy of the read cache's shards.
+ * The topology is read from sysfs, so fake NUMA (numa=fake=N) can stand in
+ * for a multi-socket host.
+ */
+
+typedef enum place_mode {
+    PLACE_OFF,   // no pinning; place_alloc() is malloc()
+    PLACE_PIN,   // pinned threads and per-node arenas
+    PLACE_SHARD  // as PLACE_PIN, plus per-node cache shards
+} place_mode_t;
+
+/**
+ * place_init() reads the topology and sets the mode. It must be called
+ * before anything is allocated with place_alloc().
+ */
+void place_init(place_mode_t mode);
+
+/**
+ * place_shutdown() unmaps the arenas. Nothing allocated from them may be
+ * used afterwards.
+ */
+void place_shutdown(void);
+
+place_mode_t place_mode(void);
+
+/**
+ * place_nodes() returns the number of nodes threads are spread over (1 when
+ * placement is off).
+ */
+int place_nodes(void);
+
+/**
+ * place_thread() pins the calling thread to the CPUs of node, or of the next
+ * node in turn if node is negative, and makes it prefer that node's memory.
+ * Returns the node. Does nothing (and returns 0) when placement is off.
+ */
+int place_thread(int node);
+
+/**
+ * place_node() returns the node the calling thread was pinned to, or 0.
+ */
+int place_node(void);
+
+/**
+ * place_alloc() returns size bytes from the arena of the calling thread's
+ * node. place_free() returns them to the node they came from, whichever
+ * thread frees them, and place_realloc() works like realloc(). Blocks over
+ * 512 bytes come from malloc().
+ */
+void *place_alloc(size_t size);
+void *place_realloc(void *p, size_t size);
+void place_free(void *p);
+
+/**
+ * place_reset() frees every block of every arena at once, by unmapping
+ * their chunks. Nothing allocated with place_alloc() may be used afterwards.
+ * Returns 0, or -1 if placement is off and blocks came from malloc().
+ */
+int place_reset(void);
+
+/**
+ * place_arena_new() creates an arena of its own, for blocks that are all
+ * freed together: place_arena_free() unmaps its chunks at once, and so frees
+ * every block in it of up to 512 bytes. It works whether or not placement is
+ * on. place_arena_size() returns the bytes it has mapped.
+ */
+typedef struct arena place_arena_t;
+place_arena_t *place_arena_new(void);
+void place_arena_free(place_arena_t *a);
+size_t place_arena_size(place_arena_t *a);
+
+/**
+ * place_use() makes place_alloc(), place_realloc() and place_free() on the
+ * calling thread work on a, or on its node's arena again if a is NULL. A
+ * block must be reallocated and freed with the arena it came from in use.
+ */
+void place_use(place_arena_t *a);
+
+/**
+ * place_region() returns size zeroed, page-aligned bytes on node's memory;
+ * place_region_free() releases them.
+ */
+void *place_region(int node, size_t size);
+void place_region_free(void *p, size_t size);
+
+/**
+ * place_report() prints each node's CPUs, threads and arena use, and how
+ * many blocks were freed by threads of another node.
+ */
+void place_report(FILE *out);
+
+#endif  // PLACE_H_
@@ -0,0 +1,791 @@
+#include "./rebal.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./simd.h"
+
+/*
+ * A pass first walks the tree in key order and records each node's depth.
+ * Like a scan, the walk read-locks the path to the node it is at, but it lets
+ * go after a slice of nodes and resumes after the last key it recorded, so
+ * writers are never held up for long. In key order, a node's subtree is the
+ * run of deeper nodes around it, which gives every subtree's size and height
+ * without keeping statistics in the nodes. A subtree is rebuilt if it is much
+ * taller than a balanced tree of its size and lopsided by weight. Only the
+ * topmost such subtrees are picked, since each rebuild fixes everything under
+ * it.
+ *
+ * A rebuild is DSW. It first rotates the subtree into a vine of right
+ * children. Then, in passes, it left-rotates every other vine node until the
+ * subtree is balanced. Each rotation write-locks the node whose child pointer
+ * changes and the two nodes rotated, top-down as a search would. So only the
+ * part of the subtree being rotated is locked, and clients keep using the
+ * rest. Every REBAL_SLICE rotations the rebalancer lets go and finds its place
+ * again by key. Rotations keep the keys in order, so the tree is a valid BST
+ * throughout. Concurrent adds and removes only make the result less than
+ * perfectly balanced. If the node the rebuild stopped at is removed in the
+ * meantime, the rebuild is abandoned and left to a later pass.
+ *
+ * A check walks the tree the same way, so it never stops the clients for more
+ * than a slice either, and there is no snapshot of the whole tree to check.
+ * Instead each node is compared with the ancestors that bound it while the
+ * path to it is locked, so every violation reported is real. The keys in the
+ * top levels split the tree into ranges, which threads walk in parallel; the
+ * ranges' shapes, put back together, are measured as a pass would. Counts are
+ * exact when no writes overlap the check. The order check is the one
+ * support/tree_checker makes on a db_print dump; that checker comes only as
+ * a binary, which reads the dump serially, so it could not be extended.
+ */
+
+#define REBAL_SLICE 1024   // nodes walked or rotations between pauses
+#define REBAL_MIN 32       // smaller subtrees are left alone
+#define REBAL_SLACK 4      // levels tolerated over the bounds below
+#define REBAL_DEEP 3       // a search this many times log2(n) deep triggers
+#define REBAL_POLL 100000  // usecs between checks for work
+#define REBAL_COOLDOWN 1   // secs after an automatic pass before the next
+#define CHECK_LEVELS 4     // a check splits the tree at these top levels
+#define CHECK_THREADS 4
+#define CHECK_SHOW 4  // violations named in a check's report
+#define MAXLEN 256
+
+static node_t *root;  // the head
+static pthread_t rebal_thread;
+static int running;
+static int stop;
+static long nodes;
+static int wanted;  // 1 if a deep search asked for a pass, 2 the console
+
+// a node on the walk's path
+typedef struct frame {
+    node_t *node;
+    int fresh;   // after the key the walk resumed from
+    int state;   // 0: left subtree next, 1: the node itself, 2: done
+    node_t *lo;  // the nearest ancestors it must sort after and before
+    node_t *hi;
+} frame_t;
+
+// the tree as the walk saw it, in key order. A check walks one range of
+// keys, keeps no names and checks every node against its ancestors.
+typedef struct shape {
+    long n;
+    long cap;
+    int *depth;
+    char **names;
+    int max_depth;
+    double total_depth;
+    int check;
+    const char *from;       // the range: keys after from (NULL: from the start)
+    const char *until;      // up to and including until (NULL: to the end)
+    char last[MAXLEN + 1];  // the last key recorded
+    size_t key_bytes;
+    size_t value_bytes;
+    long violations;
+    char *violation[CHECK_SHOW];
+} shape_t;
+
+// where a rebuild has got to: holder is write-locked and slot is its child
+// pointer to the part still to do
+typedef struct cursor {
+    node_t *holder;
+    node_t **slot;
+    int moved;  // holder is no longer the subtree's parent
+} cursor_t;
+
+static inline void lock(locktype_t lt, pthread_rwlock_t *lk) {
+    int err = lt == l_read ? pthread_rwlock_rdlock(lk)
+                           : pthread_rwlock_wrlock(lk);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_lock");
+    }
+}
+
+static inline void unlock(pthread_rwlock_t *lk) {
+    int err = pthread_rwlock_unlock(lk);
+    if (err != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+static inline int log2_floor(unsigned long x) {
+    return 63 - __builtin_clzl(x | 1);
+}
+
+// lets blocked clients through between slices; returns 1 if we should stop
+static int pause_slice(void) {
+    sched_yield();
+    return __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
+}
+
+/* The walk */
+
+// node (read-locked) is out of order
+static void violation(shape_t *s, node_t *node) {
+    if (s->violations < CHECK_SHOW &&
+        (s->violation[s->violations] = strdup(node->name)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    s->violations++;
+}
+
+static void record(shape_t *s, node_t *node, int depth) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 4096;
+        s->depth = realloc(s->depth, s->cap * sizeof(int));
+        if (!s->check) s->names = realloc(s->names, s->cap * sizeof(char *));
+        if (s->depth == NULL || (!s->check && s->names == NULL)) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->depth[s->n] = depth;
+    if (!s->check && (s->names[s->n] = strdup(node->name)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    memcpy(s->last, node->name, node->name_len + 1);
+    s->n++;
+    if (depth > s->max_depth) s->max_depth = depth;
+    s->total_depth += depth;
+    if (s->check) {
+        s->key_bytes += node->name_len + 1;
+        s->value_bytes += strlen(node->value) + 1;
+    }
+}
+
+static void shape_free(shape_t *s) {
+    if (s->names != NULL) {
+        for (long i = 0; i < s->n; i++) free(s->names[i]);
+    }
+    free(s->names);
+    free(s->depth);
+    for (long i = 0; i < s->violations && i < CHECK_SHOW; i++) {
+        free(s->violation[i]);
+    }
+}
+
+// walks the tree in order from just after the last key recorded, holding the
+// path read-locked, until it has recorded a slice of nodes; returns 1 once
+// the walk is complete. A check also compares each node with the ancestors
+// that bound it while they are locked, so what it finds is no artefact of
+// concurrent writes.
+static int walk_slice(shape_t *s, frame_t **stack, long *cap) {
+    char after[MAXLEN + 1];
+    size_t after_len = 0;
+    int resume = s->n > 0 || s->from != NULL;
+    int past = 0;  // the walk has left the range
+    long budget = REBAL_SLICE;
+    long top = 0;
+
+    if (resume) {
+        after_len = strlen(s->n > 0 ? s->last : s->from);
+        memcpy(after, s->n > 0 ? s->last : s->from, after_len + 1);
+    }
+    lock(l_read, root->lock);
+    (*stack)[0] = (frame_t){root, 0, 0, NULL, NULL};
+    while (top >= 0) {
+        frame_t *f = &(*stack)[top];
+        node_t *next = NULL;
+        if (f->state == 0) {
+            // keys left of a node already recorded were recorded too
+            f->state = 1;
+            if (f->fresh) next = f->node->lchild;
+        } else if (f->state == 1) {
+            f->state = 2;
+            if (f->fresh) {
+                if (s->until != NULL &&
+                    key_cmp(f->node->name, f->node->name_len, s->until,
+                            strlen(s->until)) > 0) {
+                    past = 1;
+                    break;
+                }
+                record(s, f->node, top);
+                if (--budget == 0) break;
+            }
+            next = f->node->rchild;
+        } else {
+            unlock(f->node->lock);
+            top--;
+            continue;
+        }
+        if (next == NULL) continue;
+        lock(l_read, next->lock);
+        if (++top == *cap) {
+            *cap *= 2;
+            if ((*stack = realloc(*stack, *cap * sizeof(frame_t))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            f = &(*stack)[top - 1];
+        }
+        int fresh = !resume ||
+                    key_cmp(next->name, next->name_len, after, after_len) > 0;
+        // pay for getting back to where we were with a longer slice
+        if (!fresh) budget++;
+        frame_t *nf = &(*stack)[top];
+        *nf = (frame_t){next, fresh, 0, f->lo, f->hi};
+        if (next == f->node->lchild) {
+            nf->hi = f->node;
+        } else {
+            nf->lo = f->node;
+        }
+        if (s->check &&
+            ((nf->lo != NULL && key_cmp(next->name, next->name_len,
+                                        nf->lo->name, nf->lo->name_len) <= 0) ||
+             (nf->hi != NULL &&
+              key_cmp(next->name, next->name_len, nf->hi->name,
+                      nf->hi->name_len) >= 0))) {
+            violation(s, next);
+        }
+    }
+    if (top < 0) return 1;
+    for (; top >= 0; top--) unlock((*stack)[top].node->lock);
+    return past;
+}
+
+// records the shape of the whole tree, or of the range of a check, into s,
+// which the caller has zeroed; returns 0 if told to stop first
+static int walk(shape_t *s) {
+    long cap = 256;
+    frame_t *stack = malloc(cap * sizeof(frame_t));
+    if (stack == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    while (!walk_slice(s, &stack, &cap)) {
+        if (pause_slice()) {
+            free(stack);
+            return 0;
+        }
+    }
+    free(stack);
+    return 1;
+}
+
+/* Picking subtrees */
+
+static int skewed(long size, int height, long heaviest_child) {
+    return size >= REBAL_MIN &&
+           height > 2 * (log2_floor(size) + 1) + REBAL_SLACK &&
+           heaviest_child * 4 > size * 3;
+}
+
+// works out from the depths in key order each node's parent (-1 for the
+// head), the size and height of its subtree and the size of its heavier
+// child's subtree, and stores the nodes sorted by depth in order
+static void measure(shape_t *s, long *parent, long *size, int *height,
+                    long *heaviest, long *order) {
+    long n = s->n;
+    long *stack = malloc(n * sizeof(long));
+    long *first = calloc(s->max_depth + 2, sizeof(long));
+    long sp;
+    if (stack == NULL || first == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // a node's parent is the deeper of the nearest shallower nodes on
+    // either side of it
+    sp = 0;
+    for (long i = 0; i < n; i++) {
+        while (sp > 0 && s->depth[stack[sp - 1]] >= s->depth[i]) sp--;
+        parent[i] = sp > 0 ? stack[sp - 1] : -1;
+        stack[sp++] = i;
+    }
+    sp = 0;
+    for (long i = n - 1; i >= 0; i--) {
+        while (sp > 0 && s->depth[stack[sp - 1]] >= s->depth[i]) sp--;
+        if (sp > 0 && (parent[i] < 0 ||
+                       s->depth[stack[sp - 1]] > s->depth[parent[i]])) {
+            parent[i] = stack[sp - 1];
+        }
+        stack[sp++] = i;
+    }
+
+    // sort by depth, then add up subtrees from the bottom
+    for (long i = 0; i < n; i++) first[s->depth[i] + 1]++;
+    for (int d = 1; d <= s->max_depth + 1; d++) first[d] += first[d - 1];
+    for (long i = 0; i < n; i++) order[first[s->depth[i]]++] = i;
+    for (long i = 0; i < n; i++) {
+        size[i] = 1;
+        height[i] = 1;
+        heaviest[i] = 0;
+    }
+    for (long k = n - 1; k >= 0; k--) {
+        long i = order[k], p = parent[i];
+        if (p < 0) continue;
+        size[p] += size[i];
+        if (height[i] + 1 > height[p]) height[p] = height[i] + 1;
+        if (size[i] > heaviest[p]) heaviest[p] = size[i];
+    }
+    free(stack);
+    free(first);
+}
+
+// finds the topmost skewed subtrees; stores their roots' indices in targets,
+// the indices of their parents (-1 for the head) in parent and their sizes
+// in size, and returns how many there are
+static long pick(shape_t *s, long *targets, long *parent, long *size) {
+    long n = s->n;
+    long *order = malloc(n * sizeof(long));
+    long *heaviest = malloc(n * sizeof(long));
+    int *height = malloc(n * sizeof(int));
+    char *mark = malloc(n);
+    long picked = 0;
+    if (order == NULL || heaviest == NULL || height == NULL || mark == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    measure(s, parent, size, height, heaviest, order);
+    for (long k = 0; k < n; k++) {
+        long i = order[k], p = parent[i];
+        if (p >= 0 && mark[p]) {
+            mark[i] = 1;  // inside a subtree already picked
+        } else if (skewed(size[i], height[i], heaviest[i])) {
+            mark[i] = 1;
+            targets[picked++] = i;
+        } else {
+            mark[i] = 0;
+        }
+    }
+    free(order);
+    free(heaviest);
+    free(height);
+    free(mark);
+    return picked;
+}
+
+/* Rebuilding */
+
+// write-locks the node called name (the head if NULL) and points the cursor
+// at its child on side (1 for right); returns 0 if it has gone
+static int cursor_lock(cursor_t *c, char *name, int side) {
+    if (name == NULL) {
+        lock(l_write, root->lock);
+        c->holder = root;
+    } else {
+        lock(l_read, root->lock);
+        c->holder = search(name, strlen(name), root, NULL, l_target);
+        if (c->holder == NULL) return 0;
+    }
+    c->slot = side ? &c->holder->rchild : &c->holder->lchild;
+    return 1;
+}
+
+// moves the cursor down to node, the write-locked child in its slot
+static void cursor_advance(cursor_t *c, node_t *node) {
+    unlock(c->holder->lock);
+    c->holder = node;
+    c->slot = &node->rchild;
+    c->moved = 1;
+}
+
+// ends a slice and finds the cursor's place again; returns 0 if the rebuild
+// has to stop
+static int cursor_pause(cursor_t *c, char *anchor, int side) {
+    char key[MAXLEN + 1];
+    if (c->moved) {
+        memcpy(key, c->holder->name, c->holder->name_len + 1);
+    }
+    unlock(c->holder->lock);
+    if (pause_slice()) return 0;
+    return c->moved ? cursor_lock(c, key, 1) : cursor_lock(c, anchor, side);
+}
+
+// rotates the subtree on side of anchor into a vine of right children;
+// returns its length, or -1 if the rebuild had to stop
+static long to_vine(char *anchor, int side) {
+    cursor_t c = {NULL, NULL, 0};
+    long len = 0;
+    node_t *x;
+
+    if (!cursor_lock(&c, anchor, side)) return -1;
+    for (long steps = 1; (x = *c.slot) != NULL; steps++) {
+        lock(l_write, x->lock);
+        node_t *l = x->lchild;
+        if (l != NULL) {
+            // rotate right: l takes x's place and x becomes its right child
+            lock(l_write, l->lock);
+            x->lchild = l->rchild;
+            l->rchild = x;
+            *c.slot = l;
+            unlock(l->lock);
+            unlock(x->lock);
+        } else {
+            cursor_advance(&c, x);
+            len++;
+        }
+        if (steps % REBAL_SLICE == 0 && !cursor_pause(&c, anchor, side)) {
+            return -1;
+        }
+    }
+    unlock(c.holder->lock);
+    return len;
+}
+
+// left-rotates count alternate nodes down the vine on side of anchor;
+// returns 0 if the rebuild had to stop
+static int compress(char *anchor, int side, long count) {
+    cursor_t c = {NULL, NULL, 0};
+
+    if (!cursor_lock(&c, anchor, side)) return 0;
+    for (long i = 1; i <= count; i++) {
+        node_t *x = *c.slot;
+        if (x == NULL) break;
+        lock(l_write, x->lock);
+        node_t *r = x->rchild;
+        if (r == NULL) {
+            unlock(x->lock);
+            break;
+        }
+        // rotate left: r takes x's place and x becomes its left child
+        lock(l_write, r->lock);
+        x->rchild = r->lchild;
+        r->lchild = x;
+        *c.slot = r;
+        unlock(x->lock);
+        cursor_advance(&c, r);
+        if (i % REBAL_SLICE == 0 && !cursor_pause(&c, anchor, side)) {
+            return 0;
+        }
+    }
+    unlock(c.holder->lock);
+    return 1;
+}
+
+// rebuilds the subtree on side of anchor; returns 0 if it had to stop
+static int rebuild(char *anchor, int side) {
+    long n = to_vine(anchor, side);
+    if (n < 0) return 0;
+    long leaves = n + 1 - (1L << log2_floor(n + 1));
+    if (!compress(anchor, side, leaves)) return 0;
+    for (n -= leaves; n > 1;) {
+        n /= 2;
+        if (!compress(anchor, side, n)) return 0;
+    }
+    return 1;
+}
+
+/* Checking */
+
+// collects the keys of the top CHECK_LEVELS levels in order; node is
+// read-locked by the caller and unlocked here
+static void split_keys(node_t *node, int depth, char **keys, int *n) {
+    node_t *left = node->lchild;
+    node_t *right = node->rchild;
+    if (depth < CHECK_LEVELS && left != NULL) {
+        lock(l_read, left->lock);
+        split_keys(left, depth + 1, keys, n);
+    }
+    if (depth > 0 && (keys[(*n)++] = strdup(node->name)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    if (depth < CHECK_LEVELS && right != NULL) {
+        lock(l_read, right->lock);
+        split_keys(right, depth + 1, keys, n);
+    }
+    unlock(node->lock);
+}
+
+typedef struct check_work {
+    shape_t *ranges;
+    int nranges;
+    int next;  // the next range to walk
+    int stopped;
+} check_work_t;
+
+static void *check_worker(void *arg) {
+    check_work_t *w = (check_work_t *)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) <
+           w->nranges) {
+        if (!walk(&w->ranges[i])) {
+            __atomic_store_n(&w->stopped, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// prints how many nodes are at each depth, in at most 16 bands of levels
+static void print_depths(FILE *out, shape_t *s) {
+    long *count = calloc(s->max_depth + 1, sizeof(long));
+    if (count == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (long i = 0; i < s->n; i++) count[s->depth[i]]++;
+    int band = (s->max_depth + 15) / 16;
+    fprintf(out, "  depth:");
+    for (int d = 1; d <= s->max_depth; d += band) {
+        long c = 0;
+        int last = d + band - 1 < s->max_depth ? d + band - 1 : s->max_depth;
+        for (int e = d; e <= last; e++) c += count[e];
+        if (last > d) {
+            fprintf(out, " %d-%d:%ld", d, last, c);
+        } else {
+            fprintf(out, " %d:%ld", d, c);
+        }
+    }
+    fprintf(out, "\n");
+    free(count);
+}
+
+/* The rebalancer thread */
+
+static double ms_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void pass(int report) {
+    shape_t s = {0}, after = {0};
+    struct timespec start;
+    long picked, done = 0, rebuilt = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!walk(&s)) {
+        shape_free(&s);
+        return;
+    }
+    long *targets = malloc((s.n + 1) * sizeof(long));
+    long *parent = malloc((s.n + 1) * sizeof(long));
+    long *size = malloc((s.n + 1) * sizeof(long));
+    if (targets == NULL || parent == NULL || size == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    picked = pick(&s, targets, parent, size);
+    for (long k = 0; k < picked; k++) {
+        long i = targets[k], p = parent[i];
+        // every key is right of the head's empty name
+        int side = p < 0 || strcmp(s.names[i], s.names[p]) > 0;
+        if (rebuild(p < 0 ? NULL : s.names[p], side)) {
+            done++;
+            rebuilt += size[i];
+        }
+        if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) break;
+    }
+
+    if (report) {
+        if (picked == 0) {
+            printf("no skewed subtrees in %ld nodes (depth max %d, avg %.1f)\n",
+                   s.n, s.max_depth, s.n ? s.total_depth / s.n : 0.0);
+        } else if (walk(&after)) {
+            printf(
+                "rebuilt %ld of %ld skewed subtrees (%ld nodes) in %.1f ms; "
+                "depth max %d avg %.1f, now max %d avg %.1f\n",
+                done, picked, rebuilt, ms_since(&start), s.max_depth,
+                s.total_depth / s.n, after.max_depth,
+                after.n ? after.total_depth / after.n : 0.0);
+            shape_free(&after);
+        }
+        fflush(stdout);
+    }
+    free(targets);
+    free(parent);
+    free(size);
+    shape_free(&s);
+}
+
+static void *rebal_loop(void *arg) {
+    time_t next_auto = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        usleep(REBAL_POLL);
+        int w = __atomic_load_n(&wanted, __ATOMIC_ACQUIRE);
+        if (w == 0 || (w == 1 && time(NULL) < next_auto)) continue;
+        __atomic_store_n(&wanted, 0, __ATOMIC_RELAXED);
+        pass(w == 2);
+        // searches that went deep during the pass were most likely into what
+        // it was rebuilding
+        int deep = 1;
+        __atomic_compare_exchange_n(&wanted, &deep, 0, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+        next_auto = time(NULL) + REBAL_COOLDOWN;
+    }
+    return NULL;
+}
+
+/* Interface */
+
+void rebal_start(node_t *r) {
+    root = r;
+    int err = pthread_create(&rebal_thread, 0, rebal_loop, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    running = 1;
+}
+
+void rebal_stop(void) {
+    if (!running) return;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    int err = pthread_join(rebal_thread, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+    running = 0;
+}
+
+void rebal_note(int depth, int delta) {
+    long n = delta != 0 ? __atomic_add_fetch(&nodes, delta, __ATOMIC_RELAXED)
+                        : __atomic_load_n(&nodes, __ATOMIC_RELAXED);
+    if (depth > REBAL_DEEP * (log2_floor(n + 1) + 1) + REBAL_SLACK &&
+        __atomic_load_n(&wanted, __ATOMIC_RELAXED) == 0) {
+        int none = 0;
+        __atomic_compare_exchange_n(&wanted, &none, 1, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+    }
+}
+
+void rebal_request(void) { __atomic_store_n(&wanted, 2, __ATOMIC_RELEASE); }
+
+void rebal_check(FILE *out) {
+    char *keys[1 << CHECK_LEVELS];
+    int nkeys = 0;
+    struct timespec start;
+    pthread_t threads[CHECK_THREADS];
+    int err;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock(l_read, root->lock);
+    split_keys(root, 0, keys, &nkeys);
+    check_work_t w = {NULL, nkeys + 1, 0, 0};
+    if ((w.ranges = calloc(w.nranges, sizeof(shape_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < w.nranges; i++) {
+        w.ranges[i].check = 1;
+        w.ranges[i].from = i > 0 ? keys[i - 1] : NULL;
+        w.ranges[i].until = i < nkeys ? keys[i] : NULL;
+    }
+    for (int t = 0; t < CHECK_THREADS; t++) {
+        if ((err = pthread_create(&threads[t], 0, check_worker, &w)) != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    for (int t = 0; t < CHECK_THREADS; t++) {
+        if ((err = pthread_join(threads[t], 0)) != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
+
+    // the ranges' depths one after another are the whole tree's in key order
+    shape_t s = {0};
+    long violations = 0;
+    for (int i = 0; i < w.nranges; i++) s.n += w.ranges[i].n;
+    if ((s.depth = malloc((s.n + 1) * sizeof(int))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    s.n = 0;
+    for (int i = 0; i < w.nranges; i++) {
+        shape_t *r = &w.ranges[i];
+        memcpy(s.depth + s.n, r->depth, r->n * sizeof(int));
+        s.n += r->n;
+        if (r->max_depth > s.max_depth) s.max_depth = r->max_depth;
+        s.total_depth += r->total_depth;
+        s.key_bytes += r->key_bytes;
+        s.value_bytes += r->value_bytes;
+        violations += r->violations;
+    }
+    long n = s.n;
+    fprintf(out, "checked %ld nodes in %.1f ms, in %d ranges on %d threads%s\n",
+            n, ms_since(&start), w.nranges, CHECK_THREADS,
+            w.stopped ? ", stopped early" : "");
+    if (violations == 0) {
+        fprintf(out, "  order: ok\n");
+    } else {
+        fprintf(out, "  order: %ld nodes out of order:", violations);
+        for (int i = 0; i < w.nranges; i++) {
+            for (long k = 0; k < w.ranges[i].violations && k < CHECK_SHOW;
+                 k++) {
+                fprintf(out, " %s", w.ranges[i].violation[k]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+
+    if (n > 0) {
+        long *parent = malloc(n * sizeof(long));
+        long *size = malloc(n * sizeof(long));
+        long *heaviest = malloc(n * sizeof(long));
+        long *order = malloc(n * sizeof(long));
+        long *targets = malloc(n * sizeof(long));
+        int *height = malloc(n * sizeof(int));
+        int *left = calloc(n, sizeof(int));  // heights of the children
+        int *right = calloc(n, sizeof(int));
+        if (parent == NULL || size == NULL || heaviest == NULL ||
+            order == NULL || targets == NULL || height == NULL ||
+            left == NULL || right == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        measure(&s, parent, size, height, heaviest, order);
+        for (long i = 0; i < n; i++) {
+            if (parent[i] < 0) continue;
+            if (i < parent[i]) {
+                left[parent[i]] = height[i];
+            } else {
+                right[parent[i]] = height[i];
+            }
+        }
+        long balance[7] = {0}, off = 0;
+        for (long i = 0; i < n; i++) {
+            int b = left[i] - right[i];
+            if (b < -1 || b > 1) off++;
+            balance[(b < -3 ? -3 : b > 3 ? 3 : b) + 3]++;
+        }
+
+        fprintf(out, "  height %d (%d if balanced), average depth %.1f\n",
+                s.max_depth, log2_floor(n) + 1, s.total_depth / n);
+        print_depths(out, &s);
+        fprintf(out,
+                "  balance (left - right height): <=-3:%ld -2:%ld -1:%ld "
+                "0:%ld 1:%ld 2:%ld >=3:%ld; %ld nodes off by more than 1\n",
+                balance[0], balance[1], balance[2], balance[3], balance[4],
+                balance[5], balance[6], off);
+        fprintf(out, "  top subtrees in key order (nodes, height, balance):\n");
+        for (long i = 0; i < n; i++) {
+            if (s.depth[i] > 3) continue;
+            fprintf(out, "    %*s%ld, %d, %+d\n", 2 * (s.depth[i] - 1), "",
+                    size[i], height[i], left[i] - right[i]);
+        }
+        long picked = pick(&s, targets, parent, size), skewed_nodes = 0;
+        for (long k = 0; k < picked; k++) skewed_nodes += size[targets[k]];
+        fprintf(out,
+                "  skewed: a rebalance (\"o\") would rebuild %ld subtrees of "
+                "%ld nodes\n",
+                picked, skewed_nodes);
+        free(parent);
+        free(size);
+        free(heaviest);
+        free(order);
+        free(targets);
+        free(height);
+        free(left);
+        free(right);
+    }
+
+    double mb = 1024 * 1024;
+    size_t nodes_bytes = n * sizeof(node_t);
+    size_t lock_bytes = n * sizeof(pthread_rwlock_t);
+    fprintf(out,
+            "  memory: %.1f MB = %.1f MB of nodes + %.1f MB of locks + %.1f "
+            "MB of keys + %.1f MB of values\n",
+            (nodes_bytes + lock_bytes + s.key_bytes + s.value_bytes) / mb,
+            nodes_bytes / mb, lock_bytes / mb, s.key_bytes / mb,
+            s.value_bytes / mb);
+    fflush(out);
+    shape_free(&s);
+    for (int i = 0; i < w.nranges; i++) shape_free(&w.ranges[i]);
+    free(w.ranges);
+    for (int i = 0; i < nkeys; i++) free(keys[i]);
+}
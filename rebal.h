@@ -0,0 +1,42 @@
+#ifndef REBAL_H_
+#define REBAL_H_
+
+#include "./db.h"
+
+/*
+ * Background rebalancer for the "bst" engine. Operations report how deep
+ * their search went; one that goes far deeper than the node count warrants
+ * wakes a thread that measures the tree and rebuilds its skewed subtrees,
+ * Day-Stout-Warren style, with rotations under at most three node locks.
+ * It also checks the tree on demand.
+ */
+
+/**
+ * rebal_start() starts the rebalancer of the tree under root (the head);
+ * rebal_stop() stops it, abandoning a rebuild in progress. The tree stays a
+ * valid BST either way.
+ */
+void rebal_start(node_t *root);
+void rebal_stop(void);
+
+/**
+ * rebal_note() is called after every BST operation with the number of nodes
+ * its search visited and the change it made to the node count (1 for an add,
+ * -1 for a remove, otherwise 0).
+ */
+void rebal_note(int depth, int delta);
+
+/**
+ * rebal_request() asks for a rebalancing pass now; its result is printed to
+ * stdout when done.
+ */
+void rebal_request(void);
+
+/**
+ * rebal_check() walks the tree in parallel, checks that its keys are in
+ * order and prints its shape: depths, balance factors, the sizes of the top
+ * subtrees, the memory it holds and the subtrees a pass would rebuild.
+ */
+void rebal_check(FILE *out);
+
+#endif  // REBAL_H_
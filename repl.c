@@ -0,0 +1,772 @@
+#include "./repl.h"
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./hash.h"
+#include "./mvcc.h"
+
+/*
+ * The log is a byte ring addressed by position (bytes logged so far). A
+ * writer claims space for its record with one atomic add and copies it in;
+ * the record's first word is set to 2 * pos + 2 last, so a sender knows the
+ * record at pos is complete. Every other aligned word a record writes has a
+ * nonzero top byte (keys and values contain no NULs, padding is 0xff and the
+ * header carries a check byte), so stale bytes from an earlier lap are never
+ * mistaken for a finished record. A sender detects that the writers have
+ * lapped it by comparing its position with the ring head after copying.
+ * Writers never wait for or wake senders; a sender that finds nothing new
+ * sleeps for REPL_IDLE. The compact layout matters: fixed slots big enough
+ * for any record made each append a cache miss.
+ *
+ * Records hold the key's new state rather than the operation, so applying
+ * one twice is harmless. That lets a follower that fell off the ring (or
+ * follows a restarted leader) take a snapshot made by scanning the store
+ * while writes continue, then replay the ring from where the scan started.
+ *
+ * Writes to a key are not serialized for the log: the log position orders
+ * them, and since followers apply records in position order, the last record
+ * for a key wins. That is right as long as the last record holds the key's
+ * final value. A writer reserves its record only after its write, so the
+ * last record was reserved after the last write, and it is enough that a
+ * record holds what the key held at some point after its reservation. A
+ * writer's own value does, unless another write to the key came between its
+ * write and its reservation. Per-stripe counters of writes begun and in
+ * progress tell a writer when that may have happened; it then reads the key
+ * back after reserving and logs what it finds. If that is a different size,
+ * it fills the reserved record as a skip, which followers only step over, and
+ * reserves again.
+ *
+ * Messages between leader and follower have their fields in little-endian
+ * order.
+ */
+
+#define REPL_RING (1 << 24)      // bytes; a power of two
+#define REPL_STRIPES 256         // counters of writes in progress, by key
+#define REPL_IDLE 1000           // usecs a caught-up sender sleeps
+#define REPL_HEARTBEAT 100       // msecs between heartbeats and acks
+#define REPL_RETRY 1             // secs between follower reconnects
+#define REPL_SNDBUF (64 * 1024)  // sender stdio buffer
+#define MAXLEN 256
+
+#define F_MORE 1  // more records of the same group follow
+#define F_DEL 2   // the key was removed
+#define F_SKIP 4  // reserved but not used: no key to apply
+
+#define BEGUN (1ull << 32)  // a write begun, in a stripe's count
+
+#define REC_CHECK 0xa5
+
+// a record in the ring; key and value follow, padded to a multiple of 8
+typedef struct rec {
+    uint64_t mark;  // 2 * pos + 2 once the record at pos is complete
+    uint32_t time;  // ms, coarse wall clock, when logged (mod 2^32)
+    uint8_t flags;
+    uint8_t key_len;
+    uint8_t value_len;
+    uint8_t check;  // REC_CHECK
+} rec_t;
+
+// messages between leader and follower, each followed by key and value
+typedef enum msg_type {
+    MSG_HELLO,       // follower: pos is the next position it needs, arg the
+                     // generation of the leader it last followed
+    MSG_ACK,         // follower: pos is the next position it will apply
+    MSG_RECORD,      // leader: the record at pos, logged at time arg
+    MSG_SNAP_BEGIN,  // leader: a snapshot follows, then the log from pos
+    MSG_SNAP_ENTRY,  // leader: one key of the snapshot
+    MSG_SNAP_END,    // leader: arg is the leader's generation
+    MSG_HEARTBEAT    // leader: pos is the end of the log
+} msg_type_t;
+
+// as sent: pos and arg are little-endian
+typedef struct msg {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t key_len;
+    uint8_t value_len;
+    uint32_t pad;
+    uint64_t pos;
+    uint64_t arg;
+} msg_t;
+
+typedef struct follower {
+    int fd;
+    char addr[64];
+    unsigned long sent;   // next position to send
+    unsigned long acked;  // next position the follower will apply
+    int snapshots;
+    struct follower *next;
+} follower_t;
+
+// the writes to the keys of a stripe: how many have begun (mod 2^32) in the
+// top half, and how many are in progress in the bottom half
+typedef struct stripe {
+    uint64_t count;
+} __attribute__((aligned(64))) stripe_t;
+
+int repl_leading;
+static int stopping;
+
+/* Leader state */
+
+static char *ring;
+static unsigned long ring_head;  // next position to hand out
+static uint64_t generation;
+static stripe_t stripes[REPL_STRIPES];
+
+static int repl_lsock = -1;
+static int lead_port;
+static pthread_t accept_thread;
+static follower_t *followers;
+static pthread_mutex_t followers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t followers_gone = PTHREAD_COND_INITIALIZER;
+
+/* Follower state */
+
+static int following;
+static char *leader_host;
+static int leader_port;
+static pthread_t follow_thread;
+static int follow_fd = -1;
+static pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;
+static int connected;
+static uint64_t follow_gen;         // 0 until a snapshot has been applied
+static unsigned long applied;       // next position to apply
+static unsigned long leader_head;   // end of the leader's log, as last heard
+static uint32_t applied_time;       // when the last applied record was logged
+
+static inline void repl_mutex_lock(pthread_mutex_t *m) {
+    int err = pthread_mutex_lock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void repl_mutex_unlock(pthread_mutex_t *m) {
+    int err = pthread_mutex_unlock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static unsigned long now_ms(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* The log */
+
+static inline size_t rec_size(int key_len, int value_len) {
+    return sizeof(rec_t) + ((key_len + value_len + 7) & ~7);
+}
+
+size_t repl_size(const char *name, const char *value) {
+    return rec_size(strnlen(name, MAXLEN - 1),
+                    value == NULL ? 0 : strnlen(value, MAXLEN - 1));
+}
+
+unsigned long repl_reserve(size_t size) {
+    // a writer's write happens before what a later reservation reads back
+    unsigned long pos = __atomic_fetch_add(&ring_head, size, __ATOMIC_ACQ_REL);
+    // a sender that sees these bytes change must also see the new head
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return pos;
+}
+
+// copies len bytes to the ring at pos, wrapping around its end
+static void ring_write(unsigned long pos, const void *src, size_t len) {
+    size_t off = pos & (REPL_RING - 1);
+    size_t first = len < REPL_RING - off ? len : REPL_RING - off;
+    memcpy(ring + off, src, first);
+    memcpy(ring, (const char *)src + first, len - first);
+}
+
+static void ring_copy(unsigned long pos, void *dst, size_t len) {
+    size_t off = pos & (REPL_RING - 1);
+    size_t first = len < REPL_RING - off ? len : REPL_RING - off;
+    memcpy(dst, ring + off, first);
+    memcpy((char *)dst + first, ring, len - first);
+}
+
+// writes the record at pos; flags are F_MORE or F_SKIP, and F_DEL is added
+// if value is NULL. A skip's value_len bytes are padding.
+static unsigned long put(unsigned long pos, const char *name, int key_len,
+                         const char *value, int value_len, int flags) {
+    char data[2 * MAXLEN + 8];
+    rec_t h;
+    size_t size = rec_size(key_len, value_len);
+    size_t data_len = size - sizeof(rec_t);
+
+    memcpy(data, name, key_len);
+    memset(data + key_len, 0xff, data_len - key_len);
+    if (value != NULL) memcpy(data + key_len, value, value_len);
+    h.time = now_ms(CLOCK_REALTIME_COARSE);
+    h.flags = flags | (value == NULL ? F_DEL : 0);
+    h.key_len = key_len;
+    h.value_len = value_len;
+    h.check = REC_CHECK;
+    // only the mark needs to be a single aligned word; the rest may wrap
+    ring_write(pos + 8, (char *)&h + 8, sizeof(rec_t) - 8);
+    ring_write(pos + sizeof(rec_t), data, data_len);
+    __atomic_store_n((uint64_t *)(ring + (pos & (REPL_RING - 1))), 2 * pos + 2,
+                     __ATOMIC_RELEASE);
+    return pos + size;
+}
+
+unsigned long repl_put(unsigned long pos, const char *name, const char *value,
+                       int more) {
+    return put(pos, name, strnlen(name, MAXLEN - 1), value,
+               value == NULL ? 0 : strnlen(value, MAXLEN - 1),
+               more ? F_MORE : 0);
+}
+
+void repl_log(const char *name, const char *value) {
+    int key_len = strnlen(name, MAXLEN - 1);
+    int value_len = value == NULL ? 0 : strnlen(value, MAXLEN - 1);
+    put(repl_reserve(rec_size(key_len, value_len)), name, key_len, value,
+        value_len, 0);
+}
+
+repl_write_t repl_begin(const char *name) {
+    repl_write_t w;
+    w.stripe = hash_str(name) & (REPL_STRIPES - 1);
+    uint64_t old = __atomic_fetch_add(&stripes[w.stripe].count, BEGUN + 1,
+                                      __ATOMIC_SEQ_CST);
+    w.begun = old >> 32;
+    w.alone = (uint32_t)old == 0;
+    return w;
+}
+
+void repl_end(repl_write_t *w, const char *name, const char *value,
+              int changed, repl_get_fn get) {
+    uint64_t *count = &stripes[w->stripe].count;
+    char cur[MAXLEN];
+    __atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+    if (!changed) return;
+
+    int key_len = strnlen(name, MAXLEN - 1);
+    int value_len = value == NULL ? 0 : strnlen(value, MAXLEN - 1);
+    unsigned long pos = repl_reserve(rec_size(key_len, value_len));
+    // no write was in progress when this one began, and none has begun
+    // since, so the key still holds value
+    if (w->alone && (uint32_t)(__atomic_load_n(count, __ATOMIC_SEQ_CST) >>
+                               32) == (uint32_t)(w->begun + 1)) {
+        put(pos, name, key_len, value, value_len, 0);
+        return;
+    }
+    while (1) {
+        const char *now = get(name, cur, sizeof(cur)) > 0 ? cur : NULL;
+        int now_len = now == NULL ? 0 : strnlen(now, MAXLEN - 1);
+        if (rec_size(key_len, now_len) == rec_size(key_len, value_len)) {
+            put(pos, name, key_len, now, now_len, 0);
+            return;
+        }
+        put(pos, name, key_len, NULL, value_len, F_SKIP);
+        value_len = now_len;
+        pos = repl_reserve(rec_size(key_len, value_len));
+    }
+}
+
+// Copies the record at pos into h and data; returns its size, or 0 if it
+// has not been written yet, or -1 if the writers have lapped pos.
+static long ring_read(unsigned long pos, rec_t *h, char *data) {
+    uint64_t *mark = (uint64_t *)(ring + (pos & (REPL_RING - 1)));
+    unsigned long head;
+    long size = 0;
+    if (__atomic_load_n(mark, __ATOMIC_ACQUIRE) == 2 * pos + 2) {
+        ring_copy(pos + 8, (char *)h + 8, sizeof(rec_t) - 8);
+        if (h->check == REC_CHECK) {
+            size = rec_size(h->key_len, h->value_len);
+            ring_copy(pos + sizeof(rec_t), data, h->key_len + h->value_len);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    return head - pos > REPL_RING ? -1 : size;
+}
+
+/* Leader */
+
+static void put_msg(FILE *out, msg_type_t type, int flags, unsigned long pos,
+                    uint64_t arg, const char *key, int key_len,
+                    const char *value, int value_len) {
+    msg_t m = {type, flags, key_len, value_len, 0, htole64(pos), htole64(arg)};
+    fwrite(&m, sizeof(m), 1, out);
+    fwrite(key, 1, key_len, out);
+    fwrite(value, 1, value_len, out);
+}
+
+static void snapshot_entry(const char *name, const char *value, void *arg) {
+    put_msg((FILE *)arg, MSG_SNAP_ENTRY, 0, 0, 0, name,
+            strnlen(name, MAXLEN - 1), value, strnlen(value, MAXLEN - 1));
+}
+
+// Sends the store as it is now and returns the position to stream the log
+// from. The scan goes to memory first, so that a slow follower does not hold
+// the engine's locks.
+static unsigned long send_snapshot(follower_t *f, FILE *out) {
+    char *buf;
+    size_t size;
+    FILE *mem = open_memstream(&buf, &size);
+    if (mem == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    unsigned long start = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    put_msg(mem, MSG_SNAP_BEGIN, 0, start, 0, "", 0, "", 0);
+    mvcc_scan(snapshot_entry, mem);
+    put_msg(mem, MSG_SNAP_END, 0, start, generation, "", 0, "", 0);
+    fclose(mem);
+    fwrite(buf, 1, size, out);
+    free(buf);
+    f->snapshots++;
+    return start;
+}
+
+// reads whatever acks have arrived; returns -1 once the follower is gone
+static int read_acks(follower_t *f) {
+    msg_t m;
+    ssize_t n;
+    while ((n = recv(f->fd, &m, sizeof(m), MSG_DONTWAIT)) > 0) {
+        if (n < (ssize_t)sizeof(m) &&
+            recv_all(f->fd, (char *)&m + n, sizeof(m) - n) < 0) {
+            return -1;
+        }
+        if (m.type == MSG_ACK) {
+            __atomic_store_n(&f->acked, le64toh(m.pos), __ATOMIC_RELAXED);
+        }
+    }
+    return n == 0 ? -1 : 0;
+}
+
+static void *sender(void *arg) {
+    follower_t *f = (follower_t *)arg;
+    char data[2 * MAXLEN];
+    rec_t r;
+    msg_t hello;
+    FILE *out = NULL;
+
+    if (recv_all(f->fd, &hello, sizeof(hello)) < 0 ||
+        hello.type != MSG_HELLO || (out = fdopen(f->fd, "w")) == NULL) {
+        goto done;
+    }
+    setvbuf(out, NULL, _IOFBF, REPL_SNDBUF);
+
+    unsigned long pos = le64toh(hello.pos);
+    unsigned long head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    if (le64toh(hello.arg) != generation || pos > head ||
+        head - pos > REPL_RING) {
+        pos = send_snapshot(f, out);
+    }
+    unsigned long beat = 0;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int sent = 0;
+        head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        while (pos < head) {
+            long size = ring_read(pos, &r, data);
+            if (size == 0) break;
+            if (size < 0) {
+                // lapped by the writers
+                pos = send_snapshot(f, out);
+                break;
+            }
+            put_msg(out, MSG_RECORD, r.flags, pos, r.time, data, r.key_len,
+                    data + r.key_len, r.value_len);
+            pos += size;
+            sent++;
+        }
+        __atomic_store_n(&f->sent, pos, __ATOMIC_RELAXED);
+        unsigned long now = now_ms(CLOCK_MONOTONIC);
+        if (now - beat >= REPL_HEARTBEAT) {
+            put_msg(out, MSG_HEARTBEAT, 0, head, 0, "", 0, "", 0);
+            beat = now;
+        }
+        if (fflush(out) == EOF || read_acks(f) < 0) break;
+        if (!sent) usleep(REPL_IDLE);
+    }
+
+done:
+    repl_mutex_lock(&followers_lock);
+    for (follower_t **pf = &followers; *pf != NULL; pf = &(*pf)->next) {
+        if (*pf == f) {
+            *pf = f->next;
+            break;
+        }
+    }
+    if (out != NULL)
+        fclose(out);
+    else
+        close(f->fd);
+    fprintf(stderr, "follower %s disconnected\n", f->addr);
+    free(f);
+    pthread_cond_broadcast(&followers_gone);
+    repl_mutex_unlock(&followers_lock);
+    return NULL;
+}
+
+static void *acceptor(void *arg) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(repl_lsock, (struct sockaddr *)&addr, &addr_len);
+        if (fd < 0) {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) return NULL;
+            perror("accept");
+            continue;
+        }
+        follower_t *f = calloc(1, sizeof(follower_t));
+        if (f == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        f->fd = fd;
+        char host[INET_ADDRSTRLEN] = "?";
+        getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host),
+                    NULL, 0, NI_NUMERICHOST);
+        snprintf(f->addr, sizeof(f->addr), "%s#%hu", host,
+                 ntohs(addr.sin_port));
+        fprintf(stderr, "follower %s connected\n", f->addr);
+
+        repl_mutex_lock(&followers_lock);
+        f->next = followers;
+        followers = f;
+        repl_mutex_unlock(&followers_lock);
+
+        pthread_t tid;
+        int err = pthread_create(&tid, 0, sender, f);
+        if (err != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+        err = pthread_detach(tid);
+        if (err != 0) {
+            handle_error_en(err, "pthread_detach");
+        }
+    }
+}
+
+void repl_lead(int port) {
+    if ((ring = malloc(REPL_RING)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    // touch every page now rather than on the writers' first lap
+    memset(ring, 0, REPL_RING);
+    // distinguishes this run's log positions from a previous run's
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    generation = ((uint64_t)ts.tv_sec << 32 ^ ts.tv_nsec ^ getpid()) | 1;
+
+    if ((repl_lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(repl_lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(repl_lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(repl_lsock, 16) < 0) {
+        perror("replication listener");
+        exit(1);
+    }
+    lead_port = port;
+    fprintf(stderr, "accepting followers on port %d\n", port);
+    repl_leading = 1;
+
+    int err = pthread_create(&accept_thread, 0, acceptor, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+}
+
+/* Follower */
+
+static int set_value(const char *cur, char *out, int len, void *arg) {
+    snprintf(out, len, "%s", (char *)arg);
+    return 1;
+}
+
+typedef struct names {
+    char **names;
+    int n;
+    int cap;
+} names_t;
+
+static void collect_name(const char *name, const char *value, void *arg) {
+    names_t *ns = (names_t *)arg;
+    if (ns->n == ns->cap) {
+        ns->cap = ns->cap ? ns->cap * 2 : 1024;
+        if ((ns->names = realloc(ns->names, ns->cap * sizeof(char *))) ==
+            NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if ((ns->names[ns->n++] = strdup(name)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+}
+
+// empties the store before a snapshot is applied
+static void clear_store(void) {
+    names_t ns = {NULL, 0, 0};
+    mvcc_scan(collect_name, &ns);
+    for (int i = 0; i < ns.n; i++) {
+        mvcc_remove(ns.names[i]);
+        free(ns.names[i]);
+    }
+    free(ns.names);
+}
+
+static int connect_leader(void) {
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char port[16];
+    int fd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", leader_port);
+    if (getaddrinfo(leader_host, port, &hints, &res) != 0) return -1;
+    if ((fd = socket(res->ai_family, res->ai_socktype, 0)) >= 0 &&
+        connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// applies the stream from one connection until it drops
+static void follow_stream(int fd) {
+    char key[MAXLEN];
+    char value[MAXLEN];
+    int in_group = 0;
+    msg_t m;
+
+    FILE *in = fdopen(fd, "r");
+    if (in == NULL) {
+        close(fd);
+        return;
+    }
+    msg_t hello = {MSG_HELLO, 0, 0, 0, 0, htole64(applied),
+                   htole64(follow_gen)};
+    if (send_all(fd, &hello, sizeof(hello)) < 0) goto done;
+    __atomic_store_n(&connected, 1, __ATOMIC_RELEASE);
+
+    while (fread(&m, sizeof(m), 1, in) == 1 &&
+           fread(key, 1, m.key_len, in) == m.key_len &&
+           fread(value, 1, m.value_len, in) == m.value_len) {
+        key[m.key_len] = '\0';
+        value[m.value_len] = '\0';
+        m.pos = le64toh(m.pos);
+        m.arg = le64toh(m.arg);
+        switch (m.type) {
+            case MSG_RECORD:
+                if (m.pos < applied) break;  // already applied
+                if (m.flags & F_SKIP) {
+                    __atomic_store_n(&applied,
+                                     m.pos + rec_size(m.key_len, m.value_len),
+                                     __ATOMIC_RELEASE);
+                    break;
+                }
+                if ((m.flags & F_MORE) && !in_group) {
+                    // apply the group as one transaction
+                    mvcc_begin();
+                    in_group = 1;
+                }
+                if (m.flags & F_DEL)
+                    mvcc_remove(key);
+                else
+                    mvcc_update(key, set_value, value);
+                if (!(m.flags & F_MORE)) {
+                    if (in_group) mvcc_commit();
+                    in_group = 0;
+                    __atomic_store_n(&applied_time, m.arg, __ATOMIC_RELAXED);
+                    __atomic_store_n(&applied,
+                                     m.pos + rec_size(m.key_len, m.value_len),
+                                     __ATOMIC_RELEASE);
+                }
+                break;
+            case MSG_SNAP_BEGIN:
+                if (in_group) {
+                    // the snapshot includes what the group would have done
+                    mvcc_abort();
+                    in_group = 0;
+                }
+                // a connection dropped mid-snapshot must start over
+                follow_gen = 0;
+                clear_store();
+                break;
+            case MSG_SNAP_ENTRY:
+                mvcc_update(key, set_value, value);
+                break;
+            case MSG_SNAP_END:
+                follow_gen = m.arg;
+                __atomic_store_n(&applied_time,
+                                 (uint32_t)now_ms(CLOCK_REALTIME_COARSE),
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(&applied, m.pos, __ATOMIC_RELEASE);
+                break;
+            case MSG_HEARTBEAT: {
+                __atomic_store_n(&leader_head, m.pos, __ATOMIC_RELAXED);
+                msg_t ack = {MSG_ACK, 0, 0, 0, 0, htole64(applied), 0};
+                if (send_all(fd, &ack, sizeof(ack)) < 0) goto done;
+                break;
+            }
+        }
+    }
+
+done:
+    if (in_group) mvcc_abort();  // applied still points at the group
+    __atomic_store_n(&connected, 0, __ATOMIC_RELEASE);
+    repl_mutex_lock(&follow_lock);
+    follow_fd = -1;
+    repl_mutex_unlock(&follow_lock);
+    fclose(in);
+}
+
+static void *follow_loop(void *arg) {
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int fd = connect_leader();
+        if (fd >= 0) {
+            repl_mutex_lock(&follow_lock);
+            follow_fd = fd;
+            repl_mutex_unlock(&follow_lock);
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                shutdown(fd, SHUT_RDWR);
+            }
+            fprintf(stderr, "following %s:%d\n", leader_host, leader_port);
+            follow_stream(fd);
+            fprintf(stderr, "lost leader %s:%d\n", leader_host, leader_port);
+        }
+        if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) sleep(REPL_RETRY);
+    }
+    return NULL;
+}
+
+void repl_follow(const char *host, int port) {
+    if ((leader_host = strdup(host)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    leader_port = port;
+    following = 1;
+    int err = pthread_create(&follow_thread, 0, follow_loop, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+}
+
+/* Control */
+
+void repl_shutdown(void) {
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    if (following) {
+        repl_mutex_lock(&follow_lock);
+        if (follow_fd >= 0) shutdown(follow_fd, SHUT_RDWR);
+        repl_mutex_unlock(&follow_lock);
+        int err = pthread_join(follow_thread, NULL);
+        if (err != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
+    if (repl_lsock >= 0) {
+        // wakes the acceptor
+        shutdown(repl_lsock, SHUT_RDWR);
+        int err = pthread_join(accept_thread, NULL);
+        if (err != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+        close(repl_lsock);
+        repl_mutex_lock(&followers_lock);
+        for (follower_t *f = followers; f != NULL; f = f->next) {
+            shutdown(f->fd, SHUT_RDWR);
+        }
+        while (followers != NULL) {
+            pthread_cond_wait(&followers_gone, &followers_lock);
+        }
+        repl_mutex_unlock(&followers_lock);
+    }
+}
+
+int repl_read_only(void) { return following; }
+
+void repl_lag(char *response, int len) {
+    if (!following) {
+        snprintf(response, len, "not a replica");
+        return;
+    }
+    unsigned long next = __atomic_load_n(&applied, __ATOMIC_ACQUIRE);
+    unsigned long head = __atomic_load_n(&leader_head, __ATOMIC_RELAXED);
+    unsigned long behind = head > next ? head - next : 0;
+    int32_t ms = 0;
+    if (behind > 0) {
+        // both times are ms mod 2^32
+        ms = (uint32_t)now_ms(CLOCK_REALTIME_COARSE) -
+             __atomic_load_n(&applied_time, __ATOMIC_RELAXED);
+        if (ms < 0) ms = 0;
+    }
+    snprintf(response, len, "%s, lag %lu bytes of log, %d ms",
+             __atomic_load_n(&connected, __ATOMIC_ACQUIRE) ? "connected"
+                                                           : "disconnected",
+             behind, ms);
+}
+
+void repl_report(FILE *out) {
+    char lag[MAXLEN];
+    if (following) {
+        repl_lag(lag, sizeof(lag));
+        fprintf(out, "following %s:%d: %s\n", leader_host, leader_port, lag);
+    }
+    if (!repl_leading) {
+        if (!following) fprintf(out, "replication off\n");
+        return;
+    }
+    unsigned long head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    fprintf(out, "leading on port %d: log at byte %lu\n", lead_port, head);
+    repl_mutex_lock(&followers_lock);
+    for (follower_t *f = followers; f != NULL; f = f->next) {
+        unsigned long acked = __atomic_load_n(&f->acked, __ATOMIC_RELAXED);
+        fprintf(out, "  %s: sent %lu, applied %lu, lag %lu bytes, snapshots %d\n",
+                f->addr, __atomic_load_n(&f->sent, __ATOMIC_RELAXED), acked,
+                head > acked ? head - acked : 0, f->snapshots);
+    }
+    repl_mutex_unlock(&followers_lock);
+}
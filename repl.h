@@ -0,0 +1,89 @@
+#ifndef REPL_H_
+#define REPL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Asynchronous primary/replica replication. A leader appends the result of
+ * every write (the key's new value, or its removal) to its log, an in-memory
+ * ring whose positions count bytes. One thread per follower streams the log
+ * over TCP, or a snapshot of the store when the follower is too far behind to
+ * be served from it. Followers apply the stream in order and serve reads
+ * only.
+ */
+
+// set while this server is a leader; the write path checks it
+extern int repl_leading;
+
+/**
+ * repl_lead() makes this server a leader accepting followers on port.
+ * Must be called before any client thread writes.
+ */
+void repl_lead(int port);
+
+/**
+ * repl_follow() makes this server a read-only follower of the leader at
+ * host:port, reconnecting whenever the connection drops.
+ */
+void repl_follow(const char *host, int port);
+
+/**
+ * repl_shutdown() stops the replication threads. Called by db_cleanup before
+ * the store goes away.
+ */
+void repl_shutdown(void);
+
+// reads name's current value into value, which holds len bytes; returns 0
+// if name is absent (as an engine's query does)
+typedef int (*repl_get_fn)(const char *name, char *value, int len);
+
+// a write between repl_begin() and repl_end()
+typedef struct repl_write {
+    unsigned stripe;
+    unsigned long begun;  // writes to the stripe begun before this one
+    int alone;            // none of them was still in progress
+} repl_write_t;
+
+/**
+ * repl_begin() and repl_end() bracket a write by a writer that does not
+ * exclude the other writers of name. repl_begin() is called before the write
+ * reaches the store, and repl_end() after it. If the write changed name,
+ * repl_end() logs its new value (NULL if it was removed), or, if another
+ * write to name may have come in between, whatever get finds name holds now.
+ * Neither waits for other writers.
+ */
+repl_write_t repl_begin(const char *name);
+void repl_end(repl_write_t *w, const char *name, const char *value,
+              int changed, repl_get_fn get);
+
+/**
+ * repl_log() appends the new value of name (NULL if it was removed) to the
+ * log, for a writer that holds name against other writers. A group of records that followers must apply atomically is appended
+ * by reserving the sum of their repl_size()s with repl_reserve() and putting
+ * each with repl_put() at the position the previous one returned, with more
+ * set on all but the last.
+ */
+void repl_log(const char *name, const char *value);
+size_t repl_size(const char *name, const char *value);
+unsigned long repl_reserve(size_t size);
+unsigned long repl_put(unsigned long pos, const char *name, const char *value,
+                       int more);
+
+/**
+ * repl_read_only() is 1 on a follower, whose clients may not write.
+ */
+int repl_read_only(void);
+
+/**
+ * repl_lag() describes how far this follower is behind its leader.
+ */
+void repl_lag(char *response, int len);
+
+/**
+ * repl_report() prints the replication state: the followers of a leader and
+ * how far behind each is, or the lag of a follower.
+ */
+void repl_report(FILE *out);
+
+#endif  // REPL_H_
@@ -0,0 +1,430 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "./admit.h"
+#include "./capture.h"
+#include "./shm.h"
+#include "./sock.h"
+
+/*
+ * Replays a capture written by the server's -w option against a server. Each
+ * captured connection gets a thread and a connection of its own, which it
+ * opens, sends its commands on and closes at the times they were captured,
+ * relative to the start of the replay, so the server sees the same
+ * concurrency and pacing; with -f each connection sends its commands back to
+ * back from the start instead. A command is sent once the previous response
+ * is back, as a client would, so a slower server makes commands late rather
+ * than piling them up.
+ *
+ * The report compares the replay's throughput and round-trip latencies with
+ * the capture's throughput and service times (from a command's arrival to
+ * its response, so without the network). Commands the server sheds under
+ * admission control are counted apart, and left out of the latencies.
+ */
+
+#define BUFSIZE 1024
+#define REPLAY_LATE_NS 1000000  // behind schedule by this much counts as late
+
+typedef struct command {
+    uint64_t ts;       // when it arrived, in ns into the capture
+    uint64_t service;  // until its response left; 0 if not captured
+    const char *text;
+    size_t len;
+} command_t;
+
+typedef struct conn {
+    uint64_t open;
+    uint64_t close;
+    command_t *cmds;
+    size_t ncmds;
+    size_t cap;
+
+    // filled in by the replay
+    pthread_t thread;
+    uint64_t *rtt;  // of each command served, in ns
+    size_t done;
+    size_t served;
+    size_t late;
+    uint64_t first;  // when its first command was sent
+    uint64_t last;   // when its last response came back
+} conn_t;
+
+// a record of the capture, and its place in the file
+typedef struct event {
+    const capture_record_t *rec;
+    size_t seq;
+} event_t;
+
+static int fast;
+static const char *server;
+static const char *port;
+static const char *path;
+static int use_shm;
+static uint64_t base;  // when the replay started
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// sleeps until ts ns into the replay, unless replaying as fast as possible
+static void wait_until(uint64_t ts) {
+    uint64_t t = base + ts;
+    if (fast || now_ns() >= t) return;
+    struct timespec until = {t / 1000000000ULL, t % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)) {
+    }
+}
+
+// reads the whole file at name
+static char *load(const char *name, size_t *size) {
+    FILE *f = fopen(name, "r");
+    if (f == NULL) {
+        perror(name);
+        exit(1);
+    }
+    size_t cap = 1 << 20, len = 0, n;
+    char *buf = xmalloc(cap);
+    while ((n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap && (buf = realloc(buf, cap *= 2)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if (ferror(f)) {
+        perror(name);
+        exit(1);
+    }
+    fclose(f);
+    *size = len;
+    return buf;
+}
+
+static int event_cmp(const void *a, const void *b) {
+    const event_t *x = a, *y = b;
+    if (x->rec->ts != y->rec->ts) return x->rec->ts < y->rec->ts ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// the connection numbered id, created on first sight
+static conn_t *conn_get(conn_t ***conns, size_t *nconns, uint32_t id,
+                        uint64_t ts) {
+    if (id >= *nconns) {
+        size_t n = *nconns * 2 > id ? *nconns * 2 : (size_t)id + 1;
+        if ((*conns = realloc(*conns, n * sizeof(conn_t *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(*conns + *nconns, 0, (n - *nconns) * sizeof(conn_t *));
+        *nconns = n;
+    }
+    if ((*conns)[id] == NULL) {
+        conn_t *c = xmalloc(sizeof(conn_t));
+        memset(c, 0, sizeof(conn_t));
+        c->open = ts;
+        (*conns)[id] = c;
+    }
+    return (*conns)[id];
+}
+
+// parses the capture in buf into connections, indexed by their numbers
+static conn_t **parse(char *buf, size_t size, size_t *nconns) {
+    if (size < sizeof(capture_header_t) ||
+        memcmp(buf, CAPTURE_MAGIC, sizeof(((capture_header_t *)0)->magic))) {
+        fprintf(stderr, "not a capture file\n");
+        exit(1);
+    }
+    size_t nevents = 0, cap = 1024;
+    event_t *events = xmalloc(cap * sizeof(event_t));
+    size_t off = sizeof(capture_header_t);
+    while (off + sizeof(capture_record_t) <= size) {
+        capture_record_t *rec = (capture_record_t *)(buf + off);
+        if (off + sizeof(*rec) + rec->len > size) break;
+        if (nevents == cap &&
+            (events = realloc(events, (cap *= 2) * sizeof(event_t))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        events[nevents].rec = rec;
+        events[nevents].seq = nevents;
+        nevents++;
+        off += sizeof(*rec) + rec->len;
+    }
+    if (off != size) fprintf(stderr, "capture truncated\n");
+    // each thread's records are in order, but the threads' are interleaved
+    qsort(events, nevents, sizeof(event_t), event_cmp);
+
+    conn_t **conns = NULL;
+    *nconns = 0;
+    for (size_t i = 0; i < nevents; i++) {
+        const capture_record_t *rec = events[i].rec;
+        conn_t *c = conn_get(&conns, nconns, rec->conn, rec->ts);
+        command_t *cmd;
+        switch (rec->type) {
+            case CAPTURE_COMMAND:
+                if (c->ncmds == c->cap) {
+                    c->cap = c->cap ? c->cap * 2 : 64;
+                    c->cmds = realloc(c->cmds, c->cap * sizeof(command_t));
+                    if (c->cmds == NULL) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                cmd = &c->cmds[c->ncmds++];
+                cmd->ts = rec->ts;
+                cmd->service = 0;
+                cmd->text = (const char *)(rec + 1);
+                cmd->len = rec->len;
+                break;
+            case CAPTURE_DONE:
+                if (c->ncmds > 0 && c->cmds[c->ncmds - 1].service == 0) {
+                    cmd = &c->cmds[c->ncmds - 1];
+                    cmd->service = rec->ts - cmd->ts;
+                }
+                break;
+            case CAPTURE_CLOSE:
+                c->close = rec->ts;
+                break;
+        }
+    }
+    free(events);
+    return conns;
+}
+
+// a connection to the server, over whichever transport was asked for
+typedef struct link {
+    FILE *stream;
+    shm_cx_t *shm;
+    int sock;
+} link_t;
+
+static int link_open(link_t *l) {
+    l->stream = NULL;
+    l->shm = NULL;
+    l->sock = path != NULL ? get_local_socket(path) : get_socket(server, port);
+    if (l->sock < 0) return -1;
+    if (use_shm) {
+        if ((l->shm = shm_create(l->sock)) == NULL || shm_offer(l->shm) < 0) {
+            if (l->shm != NULL) shm_detach(l->shm);
+            close(l->sock);
+            return -1;
+        }
+    } else if ((l->stream = fdopen(l->sock, "w+")) == NULL) {
+        perror("fdopen");
+        close(l->sock);
+        return -1;
+    }
+    return 0;
+}
+
+// sends a command and waits for its response. Returns 1 if the server shed
+// it, 0 if it served it and -1 if the connection is gone.
+static int link_exchange(link_t *l, const command_t *cmd) {
+    char rbuf[BUFSIZE];
+    if (l->shm != NULL) {
+        if (shm_send(l->shm, cmd->text, cmd->len) < 0 ||
+            shm_recv(l->shm, rbuf, sizeof(rbuf)) < 0) {
+            return -1;
+        }
+        return strcmp(rbuf, ADMIT_BUSY) == 0;
+    }
+    // a command cut short by the client hanging up still needs its newline
+    if (fwrite(cmd->text, 1, cmd->len, l->stream) != cmd->len ||
+        ((cmd->len == 0 || cmd->text[cmd->len - 1] != '\n') &&
+         fputc('\n', l->stream) == EOF) ||
+        fflush(l->stream) == EOF || fgets(rbuf, BUFSIZE, l->stream) == NULL) {
+        return -1;
+    }
+    return strcmp(rbuf, ADMIT_BUSY "\n") == 0;
+}
+
+static void link_close(link_t *l) {
+    if (l->shm != NULL) {
+        shm_close(l->shm);
+        shm_detach(l->shm);
+        close(l->sock);
+    } else {
+        fclose(l->stream);
+    }
+}
+
+static void *replay_conn(void *arg) {
+    conn_t *c = arg;
+    link_t l;
+    wait_until(c->open);
+    if (link_open(&l) < 0) return NULL;
+    for (size_t i = 0; i < c->ncmds; i++) {
+        wait_until(c->cmds[i].ts);
+        uint64_t t = now_ns();
+        if (!fast && t - base > c->cmds[i].ts + REPLAY_LATE_NS) c->late++;
+        if (i == 0) c->first = t;
+        int busy = link_exchange(&l, &c->cmds[i]);
+        if (busy < 0) {
+            fprintf(stderr, "connection terminated\n");
+            break;
+        }
+        c->last = now_ns();
+        c->done++;
+        if (!busy) c->rtt[c->served++] = c->last - t;
+    }
+    if (c->close > 0) wait_until(c->close);
+    link_close(&l);
+    return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// prints the median, 99th percentile and maximum of the n latencies in v
+static void print_latency(const char *what, uint64_t *v, size_t n) {
+    if (n == 0) {
+        printf("          no %s\n", what);
+        return;
+    }
+    qsort(v, n, sizeof(uint64_t), u64_cmp);
+    printf("          %s p50 %.1f us, p99 %.1f us, max %.1f us\n", what,
+           v[n / 2] / 1e3, v[n * 99 / 100] / 1e3, v[n - 1] / 1e3);
+}
+
+static void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-f] <capture> <servername> <port>\n"
+            "       %s [-f] -u <socket-path> [-m] <capture>\n",
+            cmd, cmd);
+    exit(1);
+}
+
+/*
+ * The arguments are the capture and the server, given as for the client, with
+ * -f to replay as fast as possible.
+ */
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "fu:m")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = 1;
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            case 'm':
+                use_shm = 1;
+                break;
+            default:
+                usage_error(argv[0]);
+        }
+    }
+    if (argc - optind != (path != NULL ? 1 : 3) || (use_shm && path == NULL)) {
+        usage_error(argv[0]);
+    }
+    if (path == NULL) {
+        server = argv[optind + 1];
+        port = argv[optind + 2];
+    }
+
+    size_t size, nconns, n = 0, ncmds = 0, nservice = 0;
+    char *buf = load(argv[optind], &size);
+    conn_t **conns = parse(buf, size, &nconns);
+    uint64_t cap_first = UINT64_MAX, cap_last = 0;
+    for (size_t i = 0; i < nconns; i++) {
+        conn_t *c = conns[i];
+        if (c == NULL) continue;
+        conns[n++] = c;
+        ncmds += c->ncmds;
+        c->rtt = xmalloc((c->ncmds + 1) * sizeof(uint64_t));
+        if (c->ncmds == 0) continue;
+        command_t *end = &c->cmds[c->ncmds - 1];
+        if (c->cmds[0].ts < cap_first) cap_first = c->cmds[0].ts;
+        if (end->ts + end->service > cap_last) {
+            cap_last = end->ts + end->service;
+        }
+    }
+    uint64_t *service = xmalloc((ncmds + 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < conns[i]->ncmds; j++) {
+            if (conns[i]->cmds[j].service > 0) {
+                service[nservice++] = conns[i]->cmds[j].service;
+            }
+        }
+    }
+
+    // replay; the first connection opens now. The default timer slack of
+    // 50 us would delay most commands more than their gaps.
+    prctl(PR_SET_TIMERSLACK, 1);
+    uint64_t t0 = UINT64_MAX;
+    for (size_t i = 0; i < n; i++) {
+        if (conns[i]->open < t0) t0 = conns[i]->open;
+    }
+    base = now_ns() - (n > 0 ? t0 : 0);
+    for (size_t i = 0; i < n; i++) {
+        int err = pthread_create(&conns[i]->thread, 0, replay_conn, conns[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    size_t done = 0, served = 0, late = 0;
+    uint64_t first = UINT64_MAX, last = 0;
+    for (size_t i = 0; i < n; i++) {
+        pthread_join(conns[i]->thread, NULL);
+    }
+    uint64_t *rtt = xmalloc((ncmds + 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        conn_t *c = conns[i];
+        memcpy(rtt + served, c->rtt, c->served * sizeof(uint64_t));
+        served += c->served;
+        done += c->done;
+        late += c->late;
+        if (c->done == 0) continue;
+        if (c->first < first) first = c->first;
+        if (c->last > last) last = c->last;
+    }
+
+    double cap_s = cap_last > cap_first ? (cap_last - cap_first) / 1e9 : 0;
+    double rep_s = last > first ? (last - first) / 1e9 : 0;
+    double cap_rate = cap_s > 0 ? ncmds / cap_s : 0;
+    double rep_rate = rep_s > 0 ? done / rep_s : 0;
+    printf("captured: %zu connections, %zu commands over %.3f s (%.0f/s)\n", n,
+           ncmds, cap_s, cap_rate);
+    print_latency("service", service, nservice);
+    printf("replayed: %zu commands over %.3f s (%.0f/s, %+.1f%%)%s\n", done,
+           rep_s, rep_rate,
+           cap_rate > 0 ? (rep_rate - cap_rate) * 100 / cap_rate : 0.0,
+           fast ? ", as fast as possible" : "");
+    print_latency("round trip", rtt, served);
+    if (served > 0 && nservice > 0) {
+        printf("          p50 %+.1f us, p99 %+.1f us over the service times\n",
+               ((double)rtt[served / 2] - service[nservice / 2]) / 1e3,
+               ((double)rtt[served * 99 / 100] - service[nservice * 99 / 100]) /
+                   1e3);
+    }
+    if (served < done) {
+        printf("          %zu answered %s\n", done - served, ADMIT_BUSY);
+    }
+    if (!fast) {
+        printf("          %zu commands sent over 1 ms late\n", late);
+    }
+    if (done < ncmds) {
+        printf("          %zu commands not replayed\n", ncmds - done);
+    }
+    return done < ncmds;
+}
@@ -0,0 +1,82 @@
+#!/bin/bash
+
+# Runs each scripts/<name>.txt that has a scripts/<name>.out against a fresh
+# server and compares the answers with the .out file, then has the server
+# print its tree and checks it with cs0330_db_check. A command goes to
+# connection 1 unless its line starts with another connection's number
+# ("2 a key value"), so a test can interleave clients step by step. Run from
+# the top directory, after make.
+
+DIR="$(dirname "$(readlink -f "$0")")"
+TOP="$(dirname "$DIR")"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+# runs test $1 (a .txt file) on a server at port $2; prints the answers
+run_test() {
+	local script="$1" port="$2" conns=() pids=() line n cmd answer
+	while IFS= read -r line; do
+		if [[ "$line" =~ ^([1-9])\ (.*)$ ]]; then
+			n="${BASH_REMATCH[1]}"
+			cmd="${BASH_REMATCH[2]}"
+		else
+			n=1
+			cmd="$line"
+		fi
+		if [ -z "${conns[$n]}" ]; then
+			mkfifo "$WORK/in$n" "$WORK/out$n"
+			stdbuf -oL "$TOP/client" localhost "$port" \
+				< "$WORK/in$n" > "$WORK/out$n" &
+			pids+=($!)
+			exec {w}> "$WORK/in$n"
+			exec {r}< "$WORK/out$n"
+			conns[$n]="$w $r"
+		fi
+		read -r w r <<< "${conns[$n]}"
+		echo "$cmd" >&"$w"
+		read -r answer <&"$r"
+		echo "$answer"
+	done < "$script"
+	for n in "${!conns[@]}"; do
+		read -r w r <<< "${conns[$n]}"
+		exec {w}>&- {r}<&-
+		rm -f "$WORK/in$n" "$WORK/out$n"
+	done
+	wait "${pids[@]}"
+}
+
+for out in "$DIR"/*.out; do
+	name="$(basename "$out" .out)"
+	port=$((20000 + RANDOM % 20000))
+	mkfifo "$WORK/console"
+	"$TOP/server" -v 1024 "$port" < "$WORK/console" > "$WORK/log" 2>&1 &
+	server=$!
+	exec {console}> "$WORK/console"
+	tries=0
+	until (exec 3<> "/dev/tcp/127.0.0.1/$port") 2> /dev/null; do
+		if [ $((tries += 1)) -gt 50 ]; then
+			cat "$WORK/log"
+			echo "$name: the server did not start"
+			exit 1
+		fi
+		sleep 0.1
+	done
+
+	run_test "$DIR/$name.txt" "$port" > "$WORK/answers"
+	echo "p $WORK/tree" >&"$console"
+	exec {console}>&-
+	wait "$server"
+	rm -f "$WORK/console"
+
+	if ! diff -u "$out" "$WORK/answers"; then
+		echo "$name: FAILED"
+		failed=1
+	elif ! "$TOP/cs0330_db_check" "$WORK/tree"; then
+		echo "$name: FAILED (tree)"
+		failed=1
+	else
+		echo "$name: ok"
+	fi
+done
+exit $failed
@@ -6,13 +6,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/membarrier.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include "./admit.h"
+#include "./cache.h"
+#include "./capture.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./engine.h"
+#include "./filter.h"
+#include "./keyspace.h"
+#include "./place.h"
+#include "./repl.h"
+#include "./trace.h"
+#include "./vindex.h"
+#include "./vlog.h"
 
 /*
  * Use the variables in this struct to synchronize your main thread with client
@@ -28,12 +41,22 @@ typedef struct server_control {
 
 /*
  * Controls when the clients in the client thread list should be stopped and
- * let go.
+ * let go. Running clients only read stopped; go_mutex is taken by a client
+ * only once it has seen stopped set.
+ *
+ * A client marks itself busy before it reads stopped and clears busy once its
+ * command is done. client_control_stop() sets stopped and then issues
+ * membarrier(), which runs a full barrier on every thread of the server, so a
+ * client that still read stopped as clear is seen busy afterwards, and
+ * client_control_quiesce() waits for it. Without membarrier() the clients
+ * issue the barrier themselves.
  */
 typedef struct client_control {
     pthread_mutex_t go_mutex;
     pthread_cond_t go;
+    pthread_cond_t drained;  // a busy client finished while stopped
     int stopped;
+    int membarrier;  // the stopper orders the clients' busy flags
 } client_control_t;
 
 /*
@@ -42,7 +65,10 @@ typedef struct client_control {
  */
 typedef struct client {
     pthread_t thread;
-    FILE *cxstr;  // File stream for input and output
+    comm_cx_t *cxstr;  // Connection for input and output
+    int closing;       // set by delete_all; the thread leaves after its
+                       // current command
+    int busy;          // in a command, as far as client_control_stop knows
 
     // For client list
     struct client *prev;
@@ -65,29 +91,76 @@ server_control_t s_controller = {PTHREAD_MUTEX_INITIALIZER,
                                  PTHREAD_COND_INITIALIZER, 0, 1};
 
 client_control_t c_controller = {PTHREAD_MUTEX_INITIALIZER,
-                                 PTHREAD_COND_INITIALIZER, 0};
+                                 PTHREAD_COND_INITIALIZER,
+                                 PTHREAD_COND_INITIALIZER, 0, 0};
 
 void *run_client(void *arg);
 void *monitor_signal(void *arg);
 void thread_cleanup(void *arg);
 
-// Called by client threads to wait until progress is permitted
-void client_control_wait() {
-    // TODO: Block the calling thread until the main thread calls
-    // client_control_release(). See the client_control_t struct.
+// how long main waits for clients to drain before cancelling them
+#define DRAIN_TIMEOUT_MS 2000
+
+// Called by client threads after each command, and before they block
+void client_control_done(client_t *c) {
+    __atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
+    if (!__atomic_load_n(&c_controller.stopped, __ATOMIC_ACQUIRE)) return;
     int err = pthread_mutex_lock(&c_controller.go_mutex);
     if (err != 0) {
         handle_error_en(err, "pthread_mutex_lock");
     }
-    pthread_cleanup_push((void(*))pthread_mutex_unlock,
-                         &(c_controller.go_mutex));
-    while (c_controller.stopped == 1) {
-        pthread_cond_wait(&c_controller.go, &c_controller.go_mutex);
+    err = pthread_cond_broadcast(&c_controller.drained);
+    if (err != 0) {
+        handle_error_en(err, "pthread_cond_broadcast");
+    }
+    err = pthread_mutex_unlock(&c_controller.go_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// Called by client threads before each command, to wait until progress is
+// permitted, or until client c is closed. Unless c is closed, the client is
+// busy on return, until client_control_done().
+void client_control_wait(client_t *c) {
+    while (1) {
+        __atomic_store_n(&c->busy, 1, __ATOMIC_RELAXED);
+        // orders the store before the load, unless membarrier() does
+        if (c_controller.membarrier) {
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        } else {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+        if (!__atomic_load_n(&c_controller.stopped, __ATOMIC_ACQUIRE)) return;
+
+        client_control_done(c);
+        int err = pthread_mutex_lock(&c_controller.go_mutex);
         if (err != 0) {
-            handle_error_en(err, "pthread_cond_wait");
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        pthread_cleanup_push((void(*))pthread_mutex_unlock,
+                             &(c_controller.go_mutex));
+        while (c_controller.stopped == 1 &&
+               !__atomic_load_n(&c->closing, __ATOMIC_ACQUIRE)) {
+            err = pthread_cond_wait(&c_controller.go, &c_controller.go_mutex);
+            if (err != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
         }
+        pthread_cleanup_pop(1);
+        if (__atomic_load_n(&c->closing, __ATOMIC_ACQUIRE)) return;
     }
-    pthread_cleanup_pop(1);
+}
+
+// Called by scripts between their commands: pauses them like
+// client_control_wait, and stops them once client c is closed
+static int client_checkpoint(void *arg) {
+    client_t *c = (client_t *)arg;
+    if (__atomic_load_n(&c_controller.stopped, __ATOMIC_ACQUIRE)) {
+        client_control_done(c);
+        client_control_wait(c);
+    }
+    return __atomic_load_n(&c->closing, __ATOMIC_ACQUIRE);
 }
 
 // Called by main thread to stop client threads
@@ -98,7 +171,7 @@ void client_control_stop() {
     if (err != 0) {
         handle_error_en(err, "pthread_mutex_lock");
     }
-    c_controller.stopped = 1;
+    __atomic_store_n(&c_controller.stopped, 1, __ATOMIC_SEQ_CST);
     err = fprintf(stderr, "stopping all clients\n");
     if (err < 0) {
         perror("fprintf");
@@ -107,6 +180,60 @@ void client_control_stop() {
     if (err != 0) {
         handle_error_en(err, "pthread_mutex_unlock");
     }
+    // clients that read stopped before it was set are now seen busy
+    if (c_controller.membarrier &&
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) < 0) {
+        perror("membarrier");
+        exit(1);
+    }
+}
+
+// Called by main thread to stop client threads and wait until none of them is
+// in the middle of a command, e.g. to take a consistent backup. Returns how
+// many clients were busy when they were stopped.
+int client_control_quiesce() {
+    int err, busy, waited = -1;
+    client_control_stop();
+    err = pthread_mutex_lock(&c_controller.go_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    while (1) {
+        busy = 0;
+        err = pthread_mutex_lock(&thread_list_mutex);
+        if (err != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        for (client_t *client = thread_list_head; client != NULL;
+             client = client->next) {
+            busy += __atomic_load_n(&client->busy, __ATOMIC_ACQUIRE);
+        }
+        err = pthread_mutex_unlock(&thread_list_mutex);
+        if (err != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (waited < 0) waited = busy;
+        if (busy == 0) break;
+        // a client's broadcast can come before its busy flag is seen clear,
+        // so the wait is bounded
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        err = pthread_cond_timedwait(&c_controller.drained,
+                                     &c_controller.go_mutex, &ts);
+        if (err != 0 && err != ETIMEDOUT) {
+            handle_error_en(err, "pthread_cond_timedwait");
+        }
+    }
+    err = pthread_mutex_unlock(&c_controller.go_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return waited;
 }
 
 // Called by main thread to resume client threads
@@ -118,7 +245,7 @@ void client_control_release() {
     if (err != 0) {
         handle_error_en(err, "pthread_mutex_lock");
     }
-    c_controller.stopped = 0;
+    __atomic_store_n(&c_controller.stopped, 0, __ATOMIC_RELEASE);
     err = fprintf(stderr, "releasing all clients\n");
     if (err < 0) {
         perror("fprintf");
@@ -134,7 +261,7 @@ void client_control_release() {
 }
 
 // Called by listener (in comm.c) to create a new client thread
-void client_constructor(FILE *cxstr) {
+void client_constructor(comm_cx_t *cxstr) {
     // You should create a new client_t struct here and initialize ALL
     // of its fields. Remember that these initializations should be
     // error-checked.
@@ -148,6 +275,8 @@ void client_constructor(FILE *cxstr) {
         exit(1);
     }
     p->cxstr = cxstr;
+    p->closing = 0;
+    p->busy = 0;
     p->prev = NULL;
     p->next = NULL;
     // Step 2: Create the new client thread running the run_client routine.
@@ -174,50 +303,74 @@ void client_destructor(client_t *client) {
 // Code executed by a client thread
 void *run_client(void *arg) {
     // TODO:
-    // Step 1: Make sure that the server is still accepting clients.
+    // Step 1: Make sure that the server is still accepting clients. main
+    // closes the server under thread_list_mutex, so a client either gets
+    // into the list before the final delete_all() or sees it closed.
     struct client *c = (struct client *)arg;
-    if (s_controller.is_open) {
-        int err;
-        // Step 2: Add client to the client list and push thread_cleanup to
-        // remove it if the thread is canceled.
-
-        c->prev = NULL;
-        err = pthread_mutex_lock(&thread_list_mutex);
-        if (err != 0) {
-            handle_error_en(err, "pthread_mutex_lock");
-        }
-        c->next = thread_list_head;
-        if (thread_list_head != NULL) {
-            thread_list_head->prev = c;
-        }
-        thread_list_head = c;
+    int err;
+    // clients are spread over the NUMA nodes in turn
+    place_thread(-1);
+    err = pthread_mutex_lock(&thread_list_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (!s_controller.is_open) {
         err = pthread_mutex_unlock(&thread_list_mutex);
         if (err != 0) {
             handle_error_en(err, "pthread_mutex_unlock");
         }
+        client_destructor(c);
+        pthread_exit(0);
+    }
+    // Step 2: Add client to the client list and push thread_cleanup to
+    // remove it when the thread exits. It is counted before the list is
+    // unlocked, so main never sees no threads while one is listed.
+    c->prev = NULL;
+    c->next = thread_list_head;
+    if (thread_list_head != NULL) {
+        thread_list_head->prev = c;
+    }
+    thread_list_head = c;
+    err = pthread_mutex_lock(&s_controller.server_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    s_controller.num_client_threads++;
+    err = pthread_mutex_unlock(&s_controller.server_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    err = pthread_mutex_unlock(&thread_list_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
 
-        err = pthread_mutex_lock(&s_controller.server_mutex);
-        if (err != 0) {
-            handle_error_en(err, "pthread_mutex_lock");
-        }
-        s_controller.num_client_threads++;
-        err = pthread_mutex_unlock(&s_controller.server_mutex);
-        if (err != 0) {
-            handle_error_en(err, "pthread_mutex_unlock");
-        }
-
-        pthread_cleanup_push(thread_cleanup, c);
-        // Step 3: Loop comm_serve (in comm.c) to receive commands and output
-        //       responses. Execute commands using interpret_command (in db.c)
-        char response[256];
-        char command[256];
-        response[0] = 0;
-        while (comm_serve(c->cxstr, response, command) == 0) {
-            client_control_wait();
+    pthread_cleanup_push(thread_cleanup, c);
+    // Step 3: Loop comm_serve (in comm.c) to receive commands and output
+    //       responses. Execute commands using interpret_command (in db.c)
+    char response[256];
+    char command[256];
+    response[0] = 0;
+    db_set_checkpoint(client_checkpoint, c);
+    while (comm_serve(c->cxstr, response, command) == 0) {
+        int oldstate;
+        client_control_wait(c);
+        // once closed, commands already received are dropped
+        if (__atomic_load_n(&c->closing, __ATOMIC_ACQUIRE)) break;
+        // a cancel from cancel_all() must not land inside the engine, where
+        // it would leave its locks held for db_cleanup(), so it waits for
+        // comm_serve() or the next client_control_wait()
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        if (admit_enter() == 0) {
             interpret_command(command, response, 256);
+            admit_exit();
+        } else {
+            snprintf(response, 256, ADMIT_BUSY);
         }
-        pthread_cleanup_pop(1);
+        client_control_done(c);
+        pthread_setcancelstate(oldstate, NULL);
     }
+    pthread_cleanup_pop(1);
     // Step 4: When the client is done sending commands, exit the thread
     //       cleanly.
     pthread_exit(0);
@@ -226,10 +379,43 @@ void *run_client(void *arg) {
     return NULL;
 }
 
-// sends a cancellation signal to each thread in the thread list
+// closes every client in the thread list: its socket is shut down with
+// shutdown(2), waking the thread if it is blocked on it, and the thread
+// leaves after its current command, dropping any it has queued
 void delete_all() {
-    // TODO: Cancel every thread in the client thread list with the
-    // pthread_cancel function.
+    int err;
+    err = pthread_mutex_lock(&thread_list_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    for (client_t *client = thread_list_head; client != NULL;
+         client = client->next) {
+        __atomic_store_n(&client->closing, 1, __ATOMIC_RELEASE);
+        comm_interrupt(client->cxstr);
+    }
+    err = pthread_mutex_unlock(&thread_list_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    // stopped clients wake up to leave
+    err = pthread_mutex_lock(&c_controller.go_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    err = pthread_cond_broadcast(&c_controller.go);
+    if (err != 0) {
+        handle_error_en(err, "pthread_cond_broadcast");
+    }
+    err = pthread_mutex_unlock(&c_controller.go_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// sends a cancellation signal to each thread in the thread list, for clients
+// that did not leave after delete_all(). It takes effect only where a client
+// is blocked on its connection or stopped, never during a command.
+static void cancel_all() {
     int err;
     err = pthread_mutex_lock(&thread_list_mutex);
     if (err != 0) {
@@ -313,7 +499,7 @@ void *monitor_signal(void *arg) {
         if (err != 0) {
             exit(1);
         }
-        fprintf(stdout, "SIGINT received, cancelling all clients\n");
+        fprintf(stdout, "SIGINT received, closing all clients\n");
         delete_all();
     }
     return NULL;
@@ -360,25 +546,169 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     free(sighandler);
 }
 
-// The arguments to the server should be the port number.
+// prints a usage tip and exits
+static void usage_error(void) {
+    fprintf(stderr,
+            "Usage: [-i stdio|uring] [-e bst|skiplist|art|btree|lsm|bst-rwlock|"
+            "bst-fixed-rwlock|bst-fixed-optimistic|bst-nolock|bst-vlog] "
+            "[-d btree-file|lsm-dir|vlog-dir] [-m btree-pool-pages] "
+            "[-n pin|shard] [-c cache-entries] [-b filter-keys] "
+            "[-v index-values] "
+            "[-l replication-port | -f leader-host:port] "
+            "[-u socket-path] [-w capture-file] [-r trace-one-in] "
+            "[-s max-sessions] "
+            "[-x slots [-q queue] [-t queue-wait-ms]] [-p pipeline] port\n");
+    exit(1);
+}
+
+// The arguments to the server should be the port number, optionally preceded
+// by the I/O engine and the storage engine to use (with the file or directory
+// of the on-disk ones and the btree's buffer pool size), the NUMA placement,
+// the sizes of the read cache, the key filter and the value index, by the
+// port to accept replicas on or the leader to replicate, by a Unix-domain
+// socket to listen on as well, by a file to capture the clients' commands to,
+// by how rarely to trace a request and by the limits of admission control.
 int main(int argc, char *argv[]) {
     int err;
-    if (argc != 2) {
-        fprintf(stderr, "Usage: port\n");
-        exit(1);
+    int opt;
+    comm_engine_t io_engine = comm_stdio;
+    char *db_engine = "bst";
+    char *data_path = NULL;
+    long btree_pool = 0;
+    place_mode_t placement = PLACE_OFF;
+    long cache_entries = 0;
+    long filter_keys = 0;
+    long index_values = 0;
+    int repl_port = 0;
+    char *leader = NULL;
+    char *leader_port;
+    char *local_path = NULL;
+    char *capture_path = NULL;
+    int trace_every = 0;
+    int max_sessions = 0, slots = 0, queue = 0, wait_ms = 0, pipeline = 0;
+    const char *opts = "i:e:d:m:n:c:b:v:l:f:u:w:r:s:x:q:t:p:";
+    while ((opt = getopt(argc, argv, opts)) != -1) {
+        switch (opt) {
+            case 'i':
+                if (strcmp(optarg, "stdio") == 0) {
+                    io_engine = comm_stdio;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    io_engine = comm_uring;
+                } else {
+                    usage_error();
+                }
+                break;
+            case 'e':
+                db_engine = optarg;
+                break;
+            case 'd':
+                data_path = optarg;
+                break;
+            case 'm':
+                if ((btree_pool = atol(optarg)) <= 0) usage_error();
+                break;
+            case 'n':
+                if (strcmp(optarg, "pin") == 0) {
+                    placement = PLACE_PIN;
+                } else if (strcmp(optarg, "shard") == 0) {
+                    placement = PLACE_SHARD;
+                } else {
+                    usage_error();
+                }
+                break;
+            case 'c':
+                if ((cache_entries = atol(optarg)) <= 0) usage_error();
+                break;
+            case 'b':
+                if ((filter_keys = atol(optarg)) <= 0) usage_error();
+                break;
+            case 'v':
+                if ((index_values = atol(optarg)) <= 0) usage_error();
+                break;
+            case 'l':
+                if ((repl_port = atoi(optarg)) <= 0) usage_error();
+                break;
+            case 'f':
+                leader = optarg;
+                if ((leader_port = strrchr(leader, ':')) == NULL) {
+                    usage_error();
+                }
+                *leader_port++ = '\0';
+                break;
+            case 'u':
+                local_path = optarg;
+                break;
+            case 'w':
+                capture_path = optarg;
+                break;
+            case 'r':
+                if ((trace_every = atoi(optarg)) <= 0) usage_error();
+                break;
+            case 's':
+                if ((max_sessions = atoi(optarg)) <= 0) usage_error();
+                break;
+            case 'x':
+                if ((slots = atoi(optarg)) <= 0) usage_error();
+                break;
+            case 'q':
+                if ((queue = atoi(optarg)) <= 0) usage_error();
+                break;
+            case 't':
+                if ((wait_ms = atoi(optarg)) <= 0) usage_error();
+                break;
+            case 'p':
+                if ((pipeline = atoi(optarg)) <= 0) usage_error();
+                break;
+            default:
+                usage_error();
+        }
     }
-    int port = atoi(argv[1]);
-    // TODO:
-    // Step 1: Set up the signal handler.
+    if (argc - optind != 1 || (repl_port != 0 && leader != NULL) ||
+        (slots == 0 && (queue != 0 || wait_ms != 0))) {
+        usage_error();
+    }
+    int port = atoi(argv[optind]);
+    // Step 1: Set up the signal handler. It comes first because the engines,
+    // the garbage collector and replication start threads of their own, and
+    // every thread must inherit the blocked SIGINT, or one of them may take
+    // it and the default action kills the server.
     sig_handler_t *sh = sig_handler_constructor();
+    place_init(placement);
+    btree_config(data_path, btree_pool);
+    lsm_config(data_path);
+    vlog_config(data_path);
+    if (db_init(db_engine) < 0) {
+        fprintf(stderr, "unknown storage engine: %s\n", db_engine);
+        usage_error();
+    }
+    comm_init(io_engine);
+    if (local_path != NULL) comm_local(local_path);
+    if (pipeline != 0) comm_pipeline(pipeline);
+    admit_init(max_sessions, slots, queue, wait_ms);
+    if (capture_path != NULL && capture_start(capture_path) < 0) exit(1);
+    trace_init(trace_every);
+    cache_init(cache_entries);
+    filter_init(filter_keys);
+    vindex_init(index_values);
+    if (repl_port != 0) {
+        repl_lead(repl_port);
+    } else if (leader != NULL) {
+        repl_follow(leader, atoi(leader_port));
+    }
+    // TODO:
     // Step 2: ignore SIGPIPE so that the server does not abort when a client
     // disconnects
     signal(SIGPIPE, SIG_IGN);
 
+    // client_control_stop() orders the clients' busy flags with membarrier(),
+    // keeping barriers off their path, where the kernel has it
+    c_controller.membarrier =
+        syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED,
+                0) == 0;
+
     // Step 3: Start a listener thread for clients (see start_listener in
     //       comm.c).
-    pthread_t l_tid =
-        start_listener(port, ((void (*)(FILE *))client_constructor));
+    pthread_t l_tid = start_listener(port, client_constructor);
 
     // Step 4: Loop for command line input and handle accordingly until EOF.
     char line[256];
@@ -397,34 +727,116 @@ int main(int argc, char *argv[]) {
         char *token = strtok(dest, " \n\t");
         if (strcmp(cmd, "s") == 0) {
             client_control_stop();
+        } else if (strcmp(cmd, "q") == 0) {
+            int busy = client_control_quiesce();
+            printf("all clients stopped, %d waited for\n", busy);
+            fflush(stdout);
         } else if (strcmp(cmd, "g") == 0) {
             client_control_release();
         } else if (strcmp(cmd, "p") == 0) {
             db_print(token);
+        } else if (strcmp(cmd, "r") == 0) {
+            repl_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "c") == 0) {
+            cache_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "b") == 0) {
+            filter_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "v") == 0) {
+            vindex_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "n") == 0) {
+            place_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "a") == 0) {
+            admit_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "w") == 0) {
+            capture_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "l") == 0) {
+            vlog_report(stdout);
+            fflush(stdout);
+        } else if (strcmp(cmd, "t") == 0) {
+            // with a file, dump the traced requests to it
+            if (token == NULL) {
+                trace_report(stdout);
+            } else {
+                long n = trace_dump(token);
+                if (n >= 0) printf("%ld trace events written\n", n);
+            }
+            fflush(stdout);
+        } else if (strcmp(cmd, "o") == 0) {
+            if (db_rebalance() < 0) {
+                printf("the storage engine does not rebalance\n");
+                fflush(stdout);
+            }
+        } else if (strcmp(cmd, "k") == 0) {
+            if (db_check(stdout) < 0) {
+                printf("the storage engine has no checker\n");
+            }
+            fflush(stdout);
+        } else if (strcmp(cmd, "y") == 0) {
+            keyspace_report(stdout);
+            fflush(stdout);
         }
     }
     // Step 5: Destroy the signal handler, delete all clients, cleanup the
     //       database, cancel and join with the listener thread
     //
     sig_handler_destructor(sh);
+    err = pthread_mutex_lock(&thread_list_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    s_controller.is_open = 0;
+    err = pthread_mutex_unlock(&thread_list_mutex);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
     delete_all();
     err = pthread_mutex_lock(&s_controller.server_mutex);
     if (err != 0) {
         handle_error_en(err, "pthread_lock");
     }
-    s_controller.is_open = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += DRAIN_TIMEOUT_MS % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
     while (s_controller.num_client_threads != 0) {
-        pthread_cond_wait(&s_controller.server_cond,
-                          &s_controller.server_mutex);
+        err = pthread_cond_timedwait(&s_controller.server_cond,
+                                     &s_controller.server_mutex, &deadline);
+        if (err == ETIMEDOUT) break;
         if (err != 0) {
-            handle_error_en(err, "pthread_cond_wait");
+            handle_error_en(err, "pthread_cond_timedwait");
         }
     }
-    pthread_mutex_unlock(&s_controller.server_mutex);
+    if (s_controller.num_client_threads != 0) {
+        fprintf(stderr, "%d clients still busy, cancelling them\n",
+                s_controller.num_client_threads);
+        pthread_mutex_unlock(&s_controller.server_mutex);
+        cancel_all();
+        pthread_mutex_lock(&s_controller.server_mutex);
+        while (s_controller.num_client_threads != 0) {
+            err = pthread_cond_wait(&s_controller.server_cond,
+                                    &s_controller.server_mutex);
+            if (err != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+    }
+    err = pthread_mutex_unlock(&s_controller.server_mutex);
     if (err != 0) {
         handle_error_en(err, "pthread_unlock");
     }
     assert(thread_list_head == NULL);
+    capture_stop();
     fprintf(stdout, "exiting database\n");
     db_cleanup();
 
@@ -436,6 +848,7 @@ int main(int argc, char *argv[]) {
     if (err != 0) {
         handle_error_en(err, "pthread_join");
     }
+    place_shutdown();
     // You should ensure that the thread list is empty before cleaning up the
     // database and canceling the listener thread. Think carefully about what
     // happens in a call to delete_all() and ensure that there is no way for a
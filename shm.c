@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include "./shm.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Each ring's head is written only by its reader and its tail only by its
+ * writer, on separate cache lines. A waiting side sets its asleep word, then
+ * (after a full fence) checks the ring once more before it sleeps on that
+ * word; the other side publishes its slot, fences and wakes the sleeper only
+ * if the word is set. So a reader sleeps only on an empty ring, and the only
+ * wake-ups are for rings going from empty to non-empty (or, for a stalled
+ * writer, from full to not full).
+ *
+ * Sleeps are bounded by SHM_POLL_MS, after which the socket is polled: a
+ * peer that exits without closing the channel hangs it up.
+ */
+
+#define SHM_MAGIC 0x73686d31  // "shm1"
+#define SHM_SLOTS 64          // per ring; a power of two
+#define SHM_SPIN 128          // checks, yielding the CPU, before sleeping
+#define SHM_POLL_MS 100
+
+typedef struct shm_slot {
+    uint32_t len;
+    char data[SHM_MSG];
+} shm_slot_t;
+
+typedef struct shm_ring {
+    uint64_t head __attribute__((aligned(64)));  // next slot to read
+    uint32_t reader_asleep;
+    uint64_t tail __attribute__((aligned(64)));  // next slot to write
+    uint32_t writer_asleep;
+    shm_slot_t slots[SHM_SLOTS] __attribute__((aligned(64)));
+} shm_ring_t;
+
+typedef struct shm_area {
+    uint32_t magic;
+    uint32_t closed;
+    shm_ring_t rings[2];  // requests, then responses
+} shm_area_t;
+
+struct shm_cx {
+    shm_area_t *area;
+    shm_ring_t *tx;
+    shm_ring_t *rx;
+    int memfd;  // the client's, until it is offered
+    int sock;
+};
+
+static shm_cx_t *map(int memfd, int sock, int server) {
+    shm_area_t *area = mmap(NULL, sizeof(shm_area_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, memfd, 0);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    shm_cx_t *cx = malloc(sizeof(shm_cx_t));
+    if (cx == NULL) {
+        perror("malloc");
+        munmap(area, sizeof(shm_area_t));
+        return NULL;
+    }
+    cx->area = area;
+    cx->tx = &area->rings[server ? 1 : 0];
+    cx->rx = &area->rings[server ? 0 : 1];
+    cx->memfd = -1;
+    cx->sock = sock;
+    return cx;
+}
+
+shm_cx_t *shm_create(int sock) {
+    int memfd = memfd_create("db-shm", MFD_CLOEXEC);
+    if (memfd < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
+    if (ftruncate(memfd, sizeof(shm_area_t)) < 0) {
+        perror("ftruncate");
+        close(memfd);
+        return NULL;
+    }
+    shm_cx_t *cx = map(memfd, sock, 0);
+    if (cx == NULL) {
+        close(memfd);
+        return NULL;
+    }
+    // the pages are zeroed, which is an empty ring
+    cx->area->magic = SHM_MAGIC;
+    cx->memfd = memfd;
+    return cx;
+}
+
+int shm_offer(shm_cx_t *cx) {
+    char hello = SHM_HELLO;
+    struct iovec iov = {&hello, 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &cx->memfd, sizeof(int));
+    if (sendmsg(cx->sock, &msg, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg");
+        return -1;
+    }
+    close(cx->memfd);
+    cx->memfd = -1;
+    return 0;
+}
+
+shm_cx_t *shm_attach(int memfd, int sock) {
+    struct stat st;
+    shm_cx_t *cx = NULL;
+    if (fstat(memfd, &st) == 0 && st.st_size == sizeof(shm_area_t)) {
+        cx = map(memfd, sock, 1);
+    }
+    close(memfd);
+    if (cx != NULL &&
+        __atomic_load_n(&cx->area->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        shm_detach(cx);
+        cx = NULL;
+    }
+    return cx;
+}
+
+static int is_closed(shm_cx_t *cx) {
+    return __atomic_load_n(&cx->area->closed, __ATOMIC_ACQUIRE);
+}
+
+// whether the peer hung up the socket, or this side shut it down
+static int peer_gone(shm_cx_t *cx) {
+    struct pollfd p = {cx->sock, POLLRDHUP, 0};
+    return poll(&p, 1, 0) > 0 &&
+           (p.revents & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL));
+}
+
+static int ready(shm_ring_t *r, int writer) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return writer ? tail - head < SHM_SLOTS : tail != head;
+}
+
+// waits until r has a free slot (writer) or a message (reader); returns -1
+// once the channel is closed or the peer has gone
+static int wait_ready(shm_cx_t *cx, shm_ring_t *r, int writer) {
+    uint32_t *asleep = writer ? &r->writer_asleep : &r->reader_asleep;
+    for (int spin = 0; !ready(r, writer); spin++) {
+        if (is_closed(cx)) return -1;
+        if (spin < SHM_SPIN) {
+            sched_yield();
+            continue;
+        }
+        __atomic_store_n(asleep, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!ready(r, writer) && !is_closed(cx)) {
+            struct timespec ts = {0, SHM_POLL_MS * 1000000L};
+            syscall(SYS_futex, asleep, FUTEX_WAIT, 1, &ts, NULL, 0);
+            if (peer_gone(cx)) {
+                __atomic_store_n(asleep, 0, __ATOMIC_RELAXED);
+                return -1;
+            }
+        }
+        __atomic_store_n(asleep, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// wakes the other side of r if it is asleep
+static void wake(uint32_t *asleep) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(asleep, __ATOMIC_RELAXED)) {
+        syscall(SYS_futex, asleep, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+ssize_t shm_send(shm_cx_t *cx, const char *buf, size_t len) {
+    shm_ring_t *r = cx->tx;
+    if (len > SHM_MSG) len = SHM_MSG;
+    if (wait_ready(cx, r, 1) < 0) return -1;
+    uint64_t tail = r->tail;
+    shm_slot_t *s = &r->slots[tail & (SHM_SLOTS - 1)];
+    memcpy(s->data, buf, len);
+    s->len = len;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    wake(&r->reader_asleep);
+    return len;
+}
+
+ssize_t shm_recv(shm_cx_t *cx, char *buf, size_t cap) {
+    shm_ring_t *r = cx->rx;
+    if (wait_ready(cx, r, 0) < 0) return -1;
+    uint64_t head = r->head;
+    shm_slot_t *s = &r->slots[head & (SHM_SLOTS - 1)];
+    size_t len = s->len;
+    if (len > SHM_MSG) len = SHM_MSG;  // the peer is not trusted
+    if (len > cap - 1) len = cap - 1;
+    memcpy(buf, s->data, len);
+    buf[len] = '\0';
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    wake(&r->writer_asleep);
+    return len;
+}
+
+void shm_close(shm_cx_t *cx) {
+    __atomic_store_n(&cx->area->closed, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 2; i++) {
+        wake(&cx->area->rings[i].reader_asleep);
+        wake(&cx->area->rings[i].writer_asleep);
+    }
+}
+
+void shm_detach(shm_cx_t *cx) {
+    munmap(cx->area, sizeof(shm_area_t));
+    if (cx->memfd >= 0) close(cx->memfd);
+    free(cx);
+}
@@ -0,0 +1,65 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory transport for clients on the server's host. A channel is a
+ * memfd holding two single-producer single-consumer rings of fixed-size
+ * slots, one for requests and one for responses. The client creates it and
+ * passes the memfd over the server's Unix-domain socket, which stays open so
+ * that each side notices when the other goes away. A side that finds its ring
+ * empty (or full) spins briefly and then sleeps on a futex in the mapping;
+ * the other side only makes a system call to wake it when it is asleep.
+ */
+
+// the byte a client sends with the memfd to ask for the shared-memory rings
+#define SHM_HELLO 0x01
+
+// the longest message a slot holds
+#define SHM_MSG 508
+
+typedef struct shm_cx shm_cx_t;
+
+/**
+ * shm_create() creates a channel for the client end of the Unix-domain
+ * socket sock. Returns NULL on failure.
+ */
+shm_cx_t *shm_create(int sock);
+
+/**
+ * shm_offer() sends the channel's memfd over its socket with SHM_HELLO.
+ * Returns 0 on success and -1 on failure.
+ */
+int shm_offer(shm_cx_t *cx);
+
+/**
+ * shm_attach() maps the channel in memfd for the server end of sock, and
+ * closes memfd. Returns NULL if it is not a valid channel.
+ */
+shm_cx_t *shm_attach(int memfd, int sock);
+
+/**
+ * shm_send() puts len bytes of buf (at most SHM_MSG) in the outgoing ring,
+ * waiting for a free slot. shm_recv() takes the next message from the
+ * incoming ring, waiting for one, and stores it NUL-terminated in buf,
+ * truncated to cap - 1 bytes. Both return the message length, or -1 once
+ * the channel is closed or the peer has gone.
+ */
+ssize_t shm_send(shm_cx_t *cx, const char *buf, size_t len);
+ssize_t shm_recv(shm_cx_t *cx, char *buf, size_t cap);
+
+/**
+ * shm_close() marks the channel closed for both sides and wakes them; any
+ * thread waiting in shm_send() or shm_recv() returns -1. It does not unmap
+ * the channel, so it may be called while another thread uses it.
+ */
+void shm_close(shm_cx_t *cx);
+
+/**
+ * shm_detach() unmaps the channel and frees cx. The socket is left open.
+ */
+void shm_detach(shm_cx_t *cx);
+
+#endif  // SHM_H_
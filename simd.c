@@ -0,0 +1,182 @@
+#include "./simd.h"
+#include <stdint.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// Loads of a whole vector may read past the end of a key or line, but never
+// across a page boundary, so they cannot fault.
+#define PAGE_SIZE 4096
+#define page_safe(p, n) \
+    ((((uintptr_t)(p)) & (PAGE_SIZE - 1)) <= PAGE_SIZE - (n))
+
+// whitespace as isspace() sees it in the C locale
+#define is_ws(c) ((c) == ' ' || (unsigned char)((c) - '\t') <= '\r' - '\t')
+
+/* Scalar kernels */
+
+static int key_cmp_scalar(const char *a, size_t alen, const char *b,
+                          size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) return (unsigned char)a[i] - (unsigned char)b[i];
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+// Returns the offset of the first byte of s that ends a field (whitespace or
+// NUL) if want_ws is set, or that is not whitespace (NUL included) otherwise.
+static size_t scan_scalar(const char *s, int want_ws) {
+    size_t i = 0;
+    if (want_ws) {
+        while (s[i] != '\0' && !is_ws(s[i])) i++;
+    } else {
+        while (is_ws(s[i])) i++;
+    }
+    return i;
+}
+
+#ifdef __x86_64__
+
+/* SSE2 kernels, 16 bytes at a time */
+
+static int key_cmp_sse2(const char *a, size_t alen, const char *b,
+                        size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; i += 16) {
+        if (n - i < 16 && !(page_safe(a + i, 16) && page_safe(b + i, 16))) {
+            int c = key_cmp_scalar(a + i, n - i, b + i, n - i);
+            if (c != 0) return c;
+            break;
+        }
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+        if (diff != 0) {
+            size_t j = i + __builtin_ctz(diff);
+            if (j < n) return (unsigned char)a[j] - (unsigned char)b[j];
+            break;
+        }
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+static size_t scan_sse2(const char *s, int want_ws) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i span = _mm_set1_epi8('\r' - '\t');
+    size_t i = 0;
+    while (1) {
+        if (!page_safe(s + i, 16)) {
+            // step byte by byte up to the page boundary
+            if (want_ws ? (s[i] == '\0' || is_ws(s[i])) : !is_ws(s[i])) {
+                return i;
+            }
+            i++;
+            continue;
+        }
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i t = _mm_sub_epi8(v, tab);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                  _mm_cmpeq_epi8(_mm_min_epu8(t, span), t));
+        unsigned m = _mm_movemask_epi8(ws);
+        if (want_ws) {
+            m |= _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        } else {
+            m = ~m & 0xffff;
+        }
+        if (m != 0) return i + __builtin_ctz(m);
+        i += 16;
+    }
+}
+
+/* AVX2 kernels, 32 bytes at a time */
+
+__attribute__((target("avx2"))) static int key_cmp_avx2(const char *a,
+                                                        size_t alen,
+                                                        const char *b,
+                                                        size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; i += 32) {
+        if (n - i < 32 && !(page_safe(a + i, 32) && page_safe(b + i, 32))) {
+            int c = key_cmp_sse2(a + i, n - i, b + i, n - i);
+            if (c != 0) return c;
+            break;
+        }
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff != 0) {
+            size_t j = i + __builtin_ctz(diff);
+            if (j < n) return (unsigned char)a[j] - (unsigned char)b[j];
+            break;
+        }
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *s,
+                                                        int want_ws) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i span = _mm256_set1_epi8('\r' - '\t');
+    size_t i = 0;
+    while (1) {
+        if (!page_safe(s + i, 32)) {
+            if (want_ws ? (s[i] == '\0' || is_ws(s[i])) : !is_ws(s[i])) {
+                return i;
+            }
+            i++;
+            continue;
+        }
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i t = _mm256_sub_epi8(v, tab);
+        __m256i ws =
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(t, span), t));
+        unsigned m = _mm256_movemask_epi8(ws);
+        if (want_ws) {
+            m |= _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        } else {
+            m = ~m;
+        }
+        if (m != 0) return i + __builtin_ctz(m);
+        i += 32;
+    }
+}
+
+#endif  // __x86_64__
+
+static int (*key_cmp_fn)(const char *, size_t, const char *,
+                         size_t) = key_cmp_scalar;
+static size_t (*scan_fn)(const char *, int) = scan_scalar;
+
+void simd_init(void) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        key_cmp_fn = key_cmp_avx2;
+        scan_fn = scan_avx2;
+    } else {
+        key_cmp_fn = key_cmp_sse2;
+        scan_fn = scan_sse2;
+    }
+#endif
+}
+
+int key_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    return key_cmp_fn(a, alen, b, blen);
+}
+
+int split_fields(char *s, slice_t *fields, int max) {
+    int n = 0;
+    while (n < max) {
+        s += scan_fn(s, 0);
+        if (*s == '\0') break;
+        fields[n].ptr = s;
+        fields[n].len = scan_fn(s, 1);
+        s += fields[n++].len;
+    }
+    return n;
+}
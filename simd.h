@@ -0,0 +1,37 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <stddef.h>
+
+/*
+ * Vectorized kernels for the command path: comparing keys of known length and
+ * splitting command lines on whitespace. AVX2 or SSE2 versions are picked at
+ * run time by simd_init(); other machines use the scalar versions.
+ */
+
+// a run of bytes inside a larger buffer; not NUL-terminated
+typedef struct slice {
+    char *ptr;
+    size_t len;
+} slice_t;
+
+/**
+ * simd_init() selects the widest kernels the CPU supports. Until it is called
+ * the scalar kernels are used.
+ */
+void simd_init(void);
+
+/**
+ * key_cmp() compares a (alen bytes) with b (blen bytes) the way strcmp()
+ * would, returning a negative, zero or positive value.
+ */
+int key_cmp(const char *a, size_t alen, const char *b, size_t blen);
+
+/**
+ * split_fields() finds up to max whitespace-separated fields in the
+ * NUL-terminated string s and stores them in fields without copying them.
+ * Returns the number of fields stored.
+ */
+int split_fields(char *s, slice_t *fields, int max);
+
+#endif  // SIMD_H_
@@ -0,0 +1,339 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+#include "./engine.h"
+#include "./epoch.h"
+
+/*
+ * Lazy concurrent skip list (Herlihy, Lev, Luchangco and Shavit). Lookups
+ * and printing never lock; add and remove lock only the predecessors of the
+ * node they change (and the victim itself), validate, and retry on conflict.
+ * Unlinked nodes are freed through the epoch reclaimer, since readers may
+ * still be standing on them.
+ */
+
+#define SL_MAXLEVEL 24
+
+typedef struct sl_node {
+    char *name;  // NULL for the head sentinel
+    char *value;
+    pthread_mutex_t lock;
+    int top;     // highest level the node is linked at
+    int marked;  // logically deleted
+    int linked;  // linked at every level up to top
+    struct sl_node *next[];
+} sl_node_t;
+
+static __thread uint32_t sl_seed;
+
+static inline void sl_lock(sl_node_t *node) {
+    int err = pthread_mutex_lock(&node->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void sl_unlock(sl_node_t *node) {
+    int err = pthread_mutex_unlock(&node->lock);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// level for a new node: each level is half as likely as the one below
+static int random_level(void) {
+    if (sl_seed == 0) sl_seed = (uint32_t)(uintptr_t)&sl_seed | 1;
+    sl_seed ^= sl_seed << 13;
+    sl_seed ^= sl_seed >> 17;
+    sl_seed ^= sl_seed << 5;
+    uint32_t x = sl_seed;
+    int lvl = 0;
+    while (lvl < SL_MAXLEVEL - 1 && (x & 1)) {
+        lvl++;
+        x >>= 1;
+    }
+    return lvl;
+}
+
+static sl_node_t *sl_node_new(char *name, char *value, int top) {
+    sl_node_t *node = malloc(sizeof(sl_node_t) + (top + 1) * sizeof(node));
+    if (node == NULL) return NULL;
+    node->name = NULL;
+    node->value = NULL;
+    if ((name != NULL && (node->name = strdup(name)) == NULL) ||
+        (value != NULL && (node->value = strdup(value)) == NULL)) {
+        free(node->name);
+        free(node);
+        return NULL;
+    }
+    int err = pthread_mutex_init(&node->lock, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_init");
+    }
+    node->top = top;
+    node->marked = 0;
+    node->linked = 0;
+    for (int i = 0; i <= top; i++) {
+        node->next[i] = NULL;
+    }
+    return node;
+}
+
+static void sl_node_free(void *arg) {
+    sl_node_t *node = (sl_node_t *)arg;
+    pthread_mutex_destroy(&node->lock);
+    free(node->name);
+    free(node->value);
+    free(node);
+}
+
+// Fills in the predecessor and successor of name at every level and returns
+// the highest level name was found at, or -1.
+static int sl_find(sl_node_t *head, char *name, sl_node_t **preds,
+                   sl_node_t **succs) {
+    int found = -1;
+    sl_node_t *pred = head;
+    for (int l = SL_MAXLEVEL - 1; l >= 0; l--) {
+        sl_node_t *curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+        int cmp = 1;
+        while (curr != NULL && (cmp = strcmp(name, curr->name)) > 0) {
+            pred = curr;
+            curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+        }
+        if (found == -1 && curr != NULL && cmp == 0) found = l;
+        preds[l] = pred;
+        succs[l] = curr;
+    }
+    return found;
+}
+
+// unlocks the distinct predecessors locked at levels 0..highest
+static void sl_unlock_preds(sl_node_t **preds, int highest) {
+    for (int i = 0; i <= highest; i++) {
+        if (i == 0 || preds[i] != preds[i - 1]) sl_unlock(preds[i]);
+    }
+}
+
+static void *sl_open(void) {
+    sl_node_t *head = sl_node_new(NULL, NULL, SL_MAXLEVEL - 1);
+    if (head == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    head->linked = 1;
+    return head;
+}
+
+static int sl_query(void *store, char *name, char *result, int len) {
+    sl_node_t *preds[SL_MAXLEVEL];
+    sl_node_t *succs[SL_MAXLEVEL];
+    int ret = 0;
+
+    epoch_enter();
+    int l = sl_find((sl_node_t *)store, name, preds, succs);
+    if (l >= 0 && __atomic_load_n(&succs[l]->linked, __ATOMIC_ACQUIRE) &&
+        !__atomic_load_n(&succs[l]->marked, __ATOMIC_ACQUIRE)) {
+        ret = snprintf(result, len, "%s",
+                       __atomic_load_n(&succs[l]->value, __ATOMIC_ACQUIRE)) +
+              1;
+    }
+    epoch_exit();
+    return ret;
+}
+
+static int sl_add(void *store, char *name, char *value) {
+    sl_node_t *preds[SL_MAXLEVEL];
+    sl_node_t *succs[SL_MAXLEVEL];
+    int top = random_level();
+
+    // allocate before taking any locks
+    sl_node_t *node = sl_node_new(name, value, top);
+    if (node == NULL) return 0;
+
+    epoch_enter();
+    while (1) {
+        int l = sl_find((sl_node_t *)store, name, preds, succs);
+        if (l >= 0) {
+            sl_node_t *found = succs[l];
+            if (!__atomic_load_n(&found->marked, __ATOMIC_ACQUIRE)) {
+                // wait for a concurrent add of the same key to finish
+                while (!__atomic_load_n(&found->linked, __ATOMIC_ACQUIRE)) {
+                }
+                epoch_exit();
+                sl_node_free(node);
+                return 0;
+            }
+            continue;  // it is being removed; try again
+        }
+
+        int highest = -1;
+        int valid = 1;
+        sl_node_t *prev_pred = NULL;
+        for (int i = 0; valid && i <= top; i++) {
+            sl_node_t *pred = preds[i];
+            sl_node_t *succ = succs[i];
+            if (pred != prev_pred) {
+                sl_lock(pred);
+                highest = i;
+                prev_pred = pred;
+            }
+            valid = !pred->marked && (succ == NULL || !succ->marked) &&
+                    pred->next[i] == succ;
+        }
+        if (!valid) {
+            sl_unlock_preds(preds, highest);
+            continue;
+        }
+
+        for (int i = 0; i <= top; i++) {
+            node->next[i] = succs[i];
+        }
+        for (int i = 0; i <= top; i++) {
+            __atomic_store_n(&preds[i]->next[i], node, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&node->linked, 1, __ATOMIC_RELEASE);
+        sl_unlock_preds(preds, highest);
+        epoch_exit();
+        return 1;
+    }
+}
+
+static int sl_remove(void *store, char *name) {
+    sl_node_t *preds[SL_MAXLEVEL];
+    sl_node_t *succs[SL_MAXLEVEL];
+    sl_node_t *victim = NULL;
+    int is_marked = 0;
+    int top = -1;
+
+    epoch_enter();
+    while (1) {
+        int l = sl_find((sl_node_t *)store, name, preds, succs);
+        if (!is_marked) {
+            // only remove a fully linked node, found at its top level
+            if (l < 0 || !__atomic_load_n(&succs[l]->linked, __ATOMIC_ACQUIRE) ||
+                succs[l]->top != l ||
+                __atomic_load_n(&succs[l]->marked, __ATOMIC_ACQUIRE)) {
+                epoch_exit();
+                return 0;
+            }
+            victim = succs[l];
+            top = victim->top;
+            sl_lock(victim);
+            if (victim->marked) {
+                sl_unlock(victim);
+                epoch_exit();
+                return 0;
+            }
+            __atomic_store_n(&victim->marked, 1, __ATOMIC_RELEASE);
+            is_marked = 1;
+        }
+
+        int highest = -1;
+        int valid = 1;
+        sl_node_t *prev_pred = NULL;
+        for (int i = 0; valid && i <= top; i++) {
+            sl_node_t *pred = preds[i];
+            if (pred != prev_pred) {
+                sl_lock(pred);
+                highest = i;
+                prev_pred = pred;
+            }
+            valid = !pred->marked && pred->next[i] == victim;
+        }
+        if (!valid) {
+            sl_unlock_preds(preds, highest);
+            continue;
+        }
+
+        for (int i = top; i >= 0; i--) {
+            __atomic_store_n(&preds[i]->next[i], victim->next[i],
+                             __ATOMIC_RELEASE);
+        }
+        sl_unlock(victim);
+        sl_unlock_preds(preds, highest);
+        epoch_retire(victim, sl_node_free);
+        epoch_exit();
+        return 1;
+    }
+}
+
+// Readers never lock, so a value cannot be rewritten in place: the new one is
+// swapped in under the node's lock and the old one retired.
+static int sl_update(void *store, char *name, db_update_fn fn, void *arg) {
+    sl_node_t *preds[SL_MAXLEVEL];
+    sl_node_t *succs[SL_MAXLEVEL];
+    char value[DB_UPDATE_LEN];
+
+    while (1) {
+        epoch_enter();
+        int l = sl_find((sl_node_t *)store, name, preds, succs);
+        if (l >= 0 && __atomic_load_n(&succs[l]->linked, __ATOMIC_ACQUIRE)) {
+            sl_node_t *node = succs[l];
+            sl_lock(node);
+            if (!node->marked) {
+                int ret = fn(node->value, value, sizeof(value), arg);
+                char *copy = NULL;
+                if (ret && (copy = strdup(value)) == NULL) ret = 0;
+                if (copy != NULL) {
+                    char *old = node->value;
+                    __atomic_store_n(&node->value, copy, __ATOMIC_RELEASE);
+                    epoch_retire(old, free);
+                }
+                sl_unlock(node);
+                epoch_exit();
+                return ret;
+            }
+            sl_unlock(node);
+        }
+        epoch_exit();
+        if (!fn(NULL, value, sizeof(value), arg)) return 0;
+        if (sl_add(store, name, value)) return 1;
+        // lost a race with another add; update that node instead
+    }
+}
+
+static void sl_scan(void *store, db_scan_fn fn, void *arg) {
+    sl_node_t *head = (sl_node_t *)store;
+    epoch_enter();
+    for (sl_node_t *n = __atomic_load_n(&head->next[0], __ATOMIC_ACQUIRE);
+         n != NULL; n = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE)) {
+        if (!__atomic_load_n(&n->marked, __ATOMIC_ACQUIRE)) {
+            fn(n->name, __atomic_load_n(&n->value, __ATOMIC_ACQUIRE), arg);
+        }
+    }
+    epoch_exit();
+}
+
+// prints the keys in order, one per line
+static void sl_print(void *store, FILE *out) {
+    sl_node_t *head = (sl_node_t *)store;
+    epoch_enter();
+    fprintf(out, "(skiplist)\n");
+    for (sl_node_t *n = __atomic_load_n(&head->next[0], __ATOMIC_ACQUIRE);
+         n != NULL; n = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE)) {
+        if (!__atomic_load_n(&n->marked, __ATOMIC_ACQUIRE)) {
+            fprintf(out, "%s %s\n", n->name,
+                    __atomic_load_n(&n->value, __ATOMIC_ACQUIRE));
+        }
+    }
+    epoch_exit();
+}
+
+static void sl_cleanup(void *store) {
+    sl_node_t *head = (sl_node_t *)store;
+    sl_node_t *n = head->next[0];
+    while (n != NULL) {
+        sl_node_t *next = n->next[0];
+        sl_node_free(n);
+        n = next;
+    }
+    sl_node_free(head);
+    epoch_barrier();
+}
+
+const db_engine_t skiplist_engine = {"skiplist", sl_open,   sl_query,
+                                     sl_add,     sl_remove, sl_update,
+                                     sl_scan,    sl_print,  sl_cleanup};
@@ -0,0 +1,81 @@
+#include "./sock.h"
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Clientside connection helpers, shared by the client and the replay tool */
+
+/*
+ * Helper that opens a TCP socket representing the server.
+ * Returns the file descriptor on success, -1 on failure.
+ */
+int get_socket(const char *server, const char *port) {
+    // setup for getaddrinfo
+    int sock;
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err;
+    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    // find the right interface
+    struct addrinfo *res;
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
+            break;
+        }
+        close(sock);
+    }
+
+    freeaddrinfo(result);
+
+    if (res == NULL) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", server);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * Helper that connects to the server's Unix-domain socket at path.
+ * Returns the file descriptor on success, -1 on failure.
+ */
+int get_local_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: '%s'!\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
@@ -0,0 +1,16 @@
+#ifndef SOCK_H_
+#define SOCK_H_
+
+/**
+ * get_socket() connects to port on server over TCP. Returns the socket, or
+ * -1 after printing why it failed.
+ */
+int get_socket(const char *server, const char *port);
+
+/**
+ * get_local_socket() connects to the server's Unix-domain socket at path.
+ * Returns the socket, or -1 after printing why it failed.
+ */
+int get_local_socket(const char *path);
+
+#endif  // SOCK_H_
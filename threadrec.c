@@ -0,0 +1,81 @@
+#include "./threadrec.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+
+/*
+ * One pthread key for every registry: its value is the list of records the
+ * thread holds, linked through held_next, and its destructor gives them all
+ * up when the thread exits. A record is claimed by moving in_use from 0 to 1
+ * and new ones are pushed on the front of the list, so neither takes a lock.
+ */
+
+static pthread_key_t held_key;
+static pthread_once_t held_once = PTHREAD_ONCE_INIT;
+static __thread thread_rec_t *held;
+
+// called when a thread exits: give up its records
+static void held_release(void *arg) {
+    thread_rec_t *rec = (thread_rec_t *)arg;
+    held = NULL;
+    while (rec != NULL) {
+        thread_rec_t *next = rec->held_next;
+        if (rec->recs->release != NULL) rec->recs->release(rec);
+        __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+        rec = next;
+    }
+}
+
+static void held_key_init(void) {
+    int err = pthread_key_create(&held_key, held_release);
+    if (err != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+static thread_rec_t *rec_new(thread_recs_t *recs) {
+    thread_rec_t *rec;
+    if (recs->align == 0) {
+        if ((rec = calloc(1, recs->size)) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    } else {
+        if (posix_memalign((void **)&rec, recs->align, recs->size) != 0) {
+            perror("posix_memalign");
+            exit(1);
+        }
+        memset(rec, 0, recs->size);
+    }
+    rec->in_use = 1;
+    rec->recs = recs;
+    if (recs->init != NULL) recs->init(rec);
+    rec->next = __atomic_load_n(&recs->list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&recs->list, &rec->next, rec, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return rec;
+}
+
+thread_rec_t *thread_rec_get(thread_recs_t *recs) {
+    thread_rec_t *rec;
+    pthread_once(&held_once, held_key_init);
+    for (rec = thread_recs_first(recs); rec != NULL; rec = rec->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (rec == NULL) rec = rec_new(recs);
+
+    rec->held_next = held;
+    held = rec;
+    int err = pthread_setspecific(held_key, rec);
+    if (err != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    return rec;
+}
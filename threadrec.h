@@ -0,0 +1,47 @@
+#ifndef THREADREC_H_
+#define THREADREC_H_
+
+#include <stddef.h>
+
+/*
+ * Per-thread records kept in a registry: a thread claims one the first time
+ * it needs it, and gives it up when it exits, for the next thread to claim.
+ * Records are never freed, so a registry's list can be walked at any time
+ * without locks, whether or not each record is in use. A record type starts
+ * with a thread_rec_t; the registry allocates it zeroed.
+ */
+
+typedef struct thread_rec {
+    int in_use;
+    struct thread_rec *next;       // in the registry
+    struct thread_rec *held_next;  // next record its thread holds
+    struct thread_recs *recs;
+} thread_rec_t;
+
+typedef struct thread_recs {
+    size_t size;   // of the record type
+    size_t align;  // of the record type, or 0 for malloc()'s
+    void (*init)(thread_rec_t *rec);     // on a new record, or NULL
+    void (*release)(thread_rec_t *rec);  // when its thread exits, or NULL
+    thread_rec_t *list;
+} thread_recs_t;
+
+#define THREAD_RECS(type, align, init, release) \
+    { sizeof(type), align, init, release, NULL }
+
+/**
+ * thread_rec_get() returns the calling thread's record in recs, claiming or
+ * allocating one. Callers keep it in a __thread pointer, so this is only
+ * called on first use.
+ */
+thread_rec_t *thread_rec_get(thread_recs_t *recs);
+
+/**
+ * thread_recs_first() returns the newest record in recs, for walking the
+ * list through next.
+ */
+static inline thread_rec_t *thread_recs_first(thread_recs_t *recs) {
+    return __atomic_load_n(&recs->list, __ATOMIC_ACQUIRE);
+}
+
+#endif  // THREADREC_H_
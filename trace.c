@@ -0,0 +1,202 @@
+#include "./trace.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+#include "./threadrec.h"
+
+/*
+ * A ring is claimed by a thread the first time one of its requests is
+ * sampled, so threads that never are cost no memory, and is given up when
+ * the thread exits for the next one to claim (threadrec.h). Its thread
+ * writes an event into the slot after the last and then publishes the new
+ * count; trace_dump() copies a ring while it may still be written, and keeps
+ * only the events the count says were not overwritten meanwhile.
+ */
+
+#define TRACE_RING 4096  // events per thread; a power of two
+#define TRACE_ARG 13     // bytes of the command kept with a request
+
+typedef struct event {
+    uint64_t ts;  // ns since trace_init()
+    uint16_t stage;
+    char phase;  // 'B' or 'E', as in the JSON
+    char arg[TRACE_ARG];
+} event_t;
+
+typedef struct ring {
+    thread_rec_t rec;
+    uint64_t count;  // events ever recorded
+    unsigned long traced;
+    int id;
+    event_t events[TRACE_RING];
+} ring_t;
+
+static const char *stage_names[] = {"request", "parse", "lock", "alloc",
+                                    "write"};
+
+__thread int trace_sampled;
+
+static int every;
+static uint64_t start_ns;
+static int nrings;
+static __thread ring_t *my_ring = NULL;
+static __thread unsigned long requests;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// numbers a new ring, as a thread in the JSON
+static void ring_init(thread_rec_t *rec) {
+    ((ring_t *)rec)->id = __atomic_add_fetch(&nrings, 1, __ATOMIC_RELAXED);
+}
+
+static thread_recs_t rings = THREAD_RECS(ring_t, 0, ring_init, NULL);
+
+// returns the calling thread's ring, claiming or allocating one on first use
+static ring_t *ring_get(void) {
+    if (my_ring == NULL) my_ring = (ring_t *)thread_rec_get(&rings);
+    return my_ring;
+}
+
+static void record(trace_stage_t stage, char phase, const char *arg) {
+    ring_t *r = my_ring;
+    event_t *e = &r->events[r->count & (TRACE_RING - 1)];
+    e->ts = now_ns() - start_ns;
+    e->stage = stage;
+    e->phase = phase;
+    if (arg != NULL) {
+        strncpy(e->arg, arg, TRACE_ARG - 1);
+        e->arg[TRACE_ARG - 1] = '\0';
+        e->arg[strcspn(e->arg, "\r\n")] = '\0';
+    } else {
+        e->arg[0] = '\0';
+    }
+    __atomic_store_n(&r->count, r->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_event(trace_stage_t stage, char phase) {
+    record(stage, phase, NULL);
+}
+
+void trace_init(int n) {
+#ifdef TRACE_OFF
+    if (n > 0) fprintf(stderr, "tracepoints were compiled out\n");
+#else
+    start_ns = now_ns();
+    every = n;
+#endif
+}
+
+void trace_request_begin(const char *command) {
+    if (every == 0 || ++requests % every != 0) return;
+    ring_t *r = ring_get();
+    __atomic_store_n(&r->traced, r->traced + 1, __ATOMIC_RELAXED);
+    trace_sampled = 1;
+    record(trace_request, 'B', command);
+}
+
+void trace_request_end(void) {
+    if (!trace_sampled) return;
+    record(trace_request, 'E', NULL);
+    trace_sampled = 0;
+}
+
+// writes s as a JSON string
+static void put_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// writes r's events from its oldest request on; returns how many
+static long dump_ring(FILE *f, ring_t *r, long written) {
+    static event_t copy[TRACE_RING];
+    uint64_t count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+    uint64_t first = count > TRACE_RING ? count - TRACE_RING : 0;
+    for (uint64_t i = first; i < count; i++) {
+        copy[i & (TRACE_RING - 1)] = r->events[i & (TRACE_RING - 1)];
+    }
+    // the thread may have gone on writing, into the oldest slots
+    uint64_t now = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+    if (now >= TRACE_RING && first <= now - TRACE_RING) {
+        first = now - TRACE_RING + 1;
+    }
+
+    long n = 0;
+    int started = 0;
+    for (uint64_t i = first; i < count; i++) {
+        event_t *e = &copy[i & (TRACE_RING - 1)];
+        // begin at a request, so every end has its begin
+        if (!started && !(e->stage == trace_request && e->phase == 'B')) {
+            continue;
+        }
+        started = 1;
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,",
+                written + n > 0 ? "," : "", stage_names[e->stage], e->phase);
+        fprintf(f, "\"tid\":%d,\"ts\":%.3f", r->id, e->ts / 1000.0);
+        if (e->arg[0] != '\0') {
+            fprintf(f, ",\"args\":{\"command\":");
+            put_string(f, e->arg);
+            fputc('}', f);
+        }
+        fputc('}', f);
+        n++;
+    }
+    return n;
+}
+
+long trace_dump(const char *path) {
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+    FILE *f = comm_fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    long n = 0;
+    pthread_mutex_lock(&dump_lock);
+    fprintf(f, "{\"traceEvents\":[");
+    for (thread_rec_t *t = thread_recs_first(&rings); t != NULL; t = t->next) {
+        n += dump_ring(f, (ring_t *)t, n);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    pthread_mutex_unlock(&dump_lock);
+    if (ferror(f) || fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return n;
+}
+
+void trace_report(FILE *out) {
+    unsigned long traced = 0;
+    uint64_t events = 0;
+    if (every == 0) {
+        fprintf(out, "tracing off\n");
+        return;
+    }
+    for (thread_rec_t *t = thread_recs_first(&rings); t != NULL; t = t->next) {
+        ring_t *r = (ring_t *)t;
+        uint64_t count = __atomic_load_n(&r->count, __ATOMIC_RELAXED);
+        traced += __atomic_load_n(&r->traced, __ATOMIC_RELAXED);
+        events += count < TRACE_RING ? count : TRACE_RING;
+    }
+    fprintf(out,
+            "tracing one request in %d per thread: %lu traced, %llu events "
+            "held in %d rings\n",
+            every, traced, (unsigned long long)events,
+            __atomic_load_n(&nrings, __ATOMIC_RELAXED));
+}
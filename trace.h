@@ -0,0 +1,90 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+
+/*
+ * Tracepoints at the stages of a request: parsing (interpret_command), lock
+ * waits in the BST (search and its neighbours in db.c), node allocation
+ * (node_constructor) and sending the response (comm_serve). Each marks the
+ * beginning and the end of its stage:
+ *
+ *   - built with -DTRACE_OFF, they compile to nothing;
+ *   - built with -DTRACE_USDT, each is also a USDT probe, provider "kvdb",
+ *     named like "parse_begin", for perf, bpftrace or SystemTap to attach to
+ *     (needs <sys/sdt.h>; the probe is a nop until one does);
+ *   - otherwise each costs a test of a thread-local flag, which is set only
+ *     while the thread serves a request that was sampled (trace_init()), and
+ *     then records the stage and the time in a ring owned by the thread.
+ *
+ * The rings keep each thread's most recent events, overwriting the oldest,
+ * and trace_dump() writes them out in Chrome's trace-event JSON format, for
+ * chrome://tracing or Perfetto.
+ */
+
+typedef enum trace_stage {
+    trace_request,  // from the command arriving to its response being sent
+    trace_parse,
+    trace_lock,
+    trace_alloc,
+    trace_write,
+} trace_stage_t;
+
+// set while the calling thread's request is being traced
+extern __thread int trace_sampled;
+
+void trace_event(trace_stage_t stage, char phase);
+
+#ifdef TRACE_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE_(stage, phase) DTRACE_PROBE(kvdb, stage##_##phase)
+#else
+#define TRACE_PROBE_(stage, phase)
+#endif
+
+#ifdef TRACE_OFF
+#define TRACE_BEGIN(stage)
+#define TRACE_END(stage)
+#else
+#define TRACE_BEGIN(stage)                        \
+    do {                                          \
+        TRACE_PROBE_(stage, begin);               \
+        if (__builtin_expect(trace_sampled, 0)) { \
+            trace_event(trace_##stage, 'B');      \
+        }                                         \
+    } while (0)
+#define TRACE_END(stage)                          \
+    do {                                          \
+        TRACE_PROBE_(stage, end);                 \
+        if (__builtin_expect(trace_sampled, 0)) { \
+            trace_event(trace_##stage, 'E');      \
+        }                                         \
+    } while (0)
+#endif
+
+/**
+ * trace_init() samples one request in n on each thread; 0 samples none.
+ */
+void trace_init(int n);
+
+/**
+ * trace_request_begin() is called when a command arrives, and decides
+ * whether to trace the request; command is recorded with it.
+ * trace_request_end() is called once its response has been sent.
+ */
+void trace_request_begin(const char *command);
+void trace_request_end(void);
+
+/**
+ * trace_dump() writes the events in the rings to path as Chrome trace-event
+ * JSON. Returns how many were written, or -1 if path cannot be created.
+ */
+long trace_dump(const char *path);
+
+/**
+ * trace_report() prints how many requests were traced and how many events
+ * the rings hold.
+ */
+void trace_report(FILE *out);
+
+#endif  // TRACE_H_
@@ -0,0 +1,701 @@
+#include "./uring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./admit.h"
+#include "./comm.h"
+#include "./trace.h"
+
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define RBUF_COUNT 256  // must be a power of two
+#define RBUF_SIZE 4096
+#define RBUF_GROUP 0
+#define WAIT_NSEC 200000000  // how often the listener checks for cancellation
+
+// every submission carries a pointer to one of these as its user_data, so
+// the completion loop knows what finished
+typedef enum op_type { op_accept, op_recv, op_send, op_file } op_type_t;
+
+typedef struct uring_op {
+    op_type_t type;
+} uring_op_t;
+
+struct uring_cx {
+    uring_op_t recv_op;
+    uring_op_t send_op;
+    int fd;
+    int refs;  // client thread + armed receive + in-flight sends
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // bytes received but not yet handed out by uring_serve
+    char *ibuf;
+    size_t ilen;
+    size_t icap;
+    unsigned lines;  // newlines in ibuf, with a pipeline limit
+    int eof;
+    int paused;  // the receive is left unarmed until ibuf drains
+    int closed;  // by uring_interrupt
+
+    int sends_pending;
+    int send_err;
+    char obuf[BUFLEN];
+};
+
+// a file read or write waited on by a client or the main thread
+typedef struct file_op {
+    uring_op_t op;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    int res;
+} file_op_t;
+
+static struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_local;  // tail including entries not yet published
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t sq_mutex;
+
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    int multishot;
+} ring = {.fd = -1, .sq_mutex = PTHREAD_MUTEX_INITIALIZER, .multishot = 1};
+
+static uring_op_t accept_op = {op_accept};
+static int listen_fd;
+static void (*serve_cb)(uring_cx_t *);
+static unsigned max_lines;  // commands a connection may have waiting; 0 if any
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+                     void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int sys_register(unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, ring.fd, op, arg, nr);
+}
+
+// checks that every opcode the engine issues is known to the kernel
+static int probe_ops(void) {
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+                                 IORING_OP_SEND, IORING_OP_READ,
+                                 IORING_OP_WRITE};
+    size_t sz = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, sz);
+    if (probe == NULL) return -1;
+    if (sys_register(IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op ||
+            !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            free(probe);
+            return -1;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+// hands a receive buffer back to the kernel. Only the listener thread (and
+// uring_init, before it starts) touches the buffer ring tail.
+static void rbuf_recycle(unsigned short bid) {
+    unsigned short tail = ring.br->tail;
+    struct io_uring_buf *b = &ring.br->bufs[tail & (RBUF_COUNT - 1)];
+    b->addr = (unsigned long)(ring.bufs + (size_t)bid * RBUF_SIZE);
+    b->len = RBUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&ring.br->tail, (unsigned short)(tail + 1),
+                     __ATOMIC_RELEASE);
+}
+
+int uring_init(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = CQ_ENTRIES;
+    if ((ring.fd = sys_setup(SQ_ENTRIES, &p)) < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                    IORING_FEAT_EXT_ARG;
+    if ((p.features & need) != need || probe_ops() < 0) {
+        fprintf(stderr, "io_uring: kernel lacks required features\n");
+        goto fail;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_sz > sq_sz) sq_sz = cq_sz;
+    char *rp = mmap(0, sq_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (rp == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    ring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    ring.sq_entries = p.sq_entries;
+    ring.sq_head = (unsigned *)(rp + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(rp + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(rp + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(rp + p.sq_off.array);
+    ring.sq_local = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(rp + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(rp + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(rp + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rp + p.cq_off.cqes);
+
+    // provided buffer ring for receives
+    ring.br = mmap(0, RBUF_COUNT * sizeof(struct io_uring_buf),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.br == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring.br;
+    reg.ring_entries = RBUF_COUNT;
+    reg.bgid = RBUF_GROUP;
+    if (sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        goto fail;
+    }
+    if ((ring.bufs = malloc((size_t)RBUF_COUNT * RBUF_SIZE)) == NULL) {
+        goto fail;
+    }
+    ring.br->tail = 0;
+    for (int i = 0; i < RBUF_COUNT; i++) {
+        rbuf_recycle(i);
+    }
+    return 0;
+
+fail:
+    close(ring.fd);
+    ring.fd = -1;
+    return -1;
+}
+
+// Reserves room for n submissions. Caller holds sq_mutex.
+static int sq_reserve(unsigned n) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_local - head + n > ring.sq_entries) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the next (zeroed) submission entry. Caller holds sq_mutex and has
+// reserved room for it.
+static struct io_uring_sqe *sq_next(void) {
+    unsigned idx = ring.sq_local++ & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    return sqe;
+}
+
+// Publishes and submits everything queued so far. Returns -1 with errno set
+// if io_uring_enter fails, leaving what it did not take queued. Caller holds
+// sq_mutex.
+static int sq_submit(void) {
+    __atomic_store_n(ring.sq_tail, ring.sq_local, __ATOMIC_RELEASE);
+    unsigned n = ring.sq_local - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    while (n > 0) {
+        int ret = sys_enter(n, 0, 0, NULL, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) return -1;
+        if (ret == 0) {
+            errno = EBUSY;
+            return -1;
+        }
+        n -= ret;
+    }
+    return 0;
+}
+
+// Takes back the entry from the last sq_next() after sq_submit() failed.
+// The kernel takes entries in order, so a failed submit never took the last
+// one. Its caller can then give up on it without a completion ever naming
+// it. Caller holds sq_mutex.
+static void sq_unqueue(void) {
+    ring.sq_local--;
+    __atomic_store_n(ring.sq_tail, ring.sq_local, __ATOMIC_RELEASE);
+}
+
+static void cx_put(uring_cx_t *c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (close(c->fd) < 0) perror("close");
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond);
+    free(c->ibuf);
+    free(c);
+}
+
+static void cx_eof(uring_cx_t *c) {
+    pthread_mutex_lock(&c->mutex);
+    c->eof = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void arm_accept(void) {
+    pthread_mutex_lock(&ring.sq_mutex);
+    if (sq_reserve(1) == 0) {
+        struct io_uring_sqe *sqe = sq_next();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = ring.multishot ? IORING_ACCEPT_MULTISHOT : 0;
+        sqe->user_data = (unsigned long)&accept_op;
+        // the next enter picks it up
+        if (sq_submit() < 0) perror("io_uring_enter");
+    } else {
+        perror("io_uring accept");
+    }
+    pthread_mutex_unlock(&ring.sq_mutex);
+}
+
+// Arms a (multishot) receive that picks buffers from the provided ring.
+// Returns -1 if the ring is full or cannot be entered, in which case the
+// connection is finished.
+static int arm_recv(uring_cx_t *c) {
+    int ret = -1;
+    pthread_mutex_lock(&ring.sq_mutex);
+    if (sq_reserve(1) == 0) {
+        struct io_uring_sqe *sqe = sq_next();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c->fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RBUF_GROUP;
+        // a multishot receive cannot be paused
+        sqe->ioprio =
+            ring.multishot && max_lines == 0 ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = (unsigned long)&c->recv_op;
+        if (sq_submit() == 0) {
+            ret = 0;
+        } else {
+            perror("io_uring_enter");
+            sq_unqueue();
+        }
+    }
+    pthread_mutex_unlock(&ring.sq_mutex);
+    return ret;
+}
+
+static void on_accept(int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (res == -EINVAL && ring.multishot) {
+            fprintf(stderr, "io_uring: no multishot support, using oneshot\n");
+            ring.multishot = 0;
+        }
+        arm_accept();
+    }
+    if (res < 0) {
+        if (res != -EINVAL) {
+            errno = -res;
+            perror("accept");
+        }
+        return;
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    if (getpeername(res, (struct sockaddr *)&client_addr, &client_len) == 0) {
+        fprintf(stderr, "received connection from %s#%hu\n",
+                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+    }
+    if (admit_session() < 0) {
+        admit_refuse(res);
+        return;
+    }
+
+    uring_cx_t *c = calloc(1, sizeof(uring_cx_t));
+    if (c == NULL || (c->ibuf = malloc(BUFLEN)) == NULL) {
+        perror("malloc");
+        free(c);
+        if (close(res) < 0) perror("close");
+        admit_session_end();
+        return;
+    }
+    // a response is a small send, which Nagle would hold back
+    int one = 1;
+    if (setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+    }
+
+    c->recv_op.type = op_recv;
+    c->send_op.type = op_send;
+    c->fd = res;
+    c->refs = 2;
+    c->icap = BUFLEN;
+    pthread_mutex_init(&c->mutex, 0);
+    pthread_cond_init(&c->cond, 0);
+    if (arm_recv(c) < 0) {
+        c->eof = 1;
+        c->refs = 1;
+    }
+    serve_cb(c);
+}
+
+static void cx_append(uring_cx_t *c, const char *data, size_t len) {
+    pthread_mutex_lock(&c->mutex);
+    if (c->ilen + len > c->icap) {
+        size_t cap = c->icap;
+        while (c->ilen + len > cap) cap *= 2;
+        char *nbuf = realloc(c->ibuf, cap);
+        if (nbuf == NULL) {
+            // drop the connection rather than silently losing bytes
+            c->eof = 1;
+            pthread_cond_broadcast(&c->cond);
+            pthread_mutex_unlock(&c->mutex);
+            shutdown(c->fd, SHUT_RDWR);
+            return;
+        }
+        c->ibuf = nbuf;
+        c->icap = cap;
+    }
+    memcpy(c->ibuf + c->ilen, data, len);
+    c->ilen += len;
+    if (max_lines > 0) {
+        const char *p = data, *end = data + len;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            c->lines++;
+            p++;
+        }
+    }
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static int over_limit(uring_cx_t *c) {
+    return c->lines >= max_lines || c->ilen >= (size_t)max_lines * BUFLEN;
+}
+
+// leaves the receive unarmed while the client is max_lines commands ahead,
+// keeping its reference; cx_getline re-arms it. Returns 1 if paused.
+static int cx_pause(uring_cx_t *c) {
+    int paused = 0;
+    if (max_lines == 0) return 0;
+    pthread_mutex_lock(&c->mutex);
+    if (!c->eof && !c->closed && over_limit(c)) c->paused = paused = 1;
+    pthread_mutex_unlock(&c->mutex);
+    if (paused) admit_paused();
+    return paused;
+}
+
+static void on_recv(uring_cx_t *c, int res, unsigned flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0) cx_append(c, ring.bufs + (size_t)bid * RBUF_SIZE, res);
+        rbuf_recycle(bid);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+
+    // the receive is no longer armed: re-arm it unless the peer is gone
+    if (res == -EINVAL && ring.multishot) {
+        fprintf(stderr, "io_uring: no multishot support, using oneshot\n");
+        ring.multishot = 0;
+        res = -EAGAIN;
+    }
+    if (res > 0 || res == -ENOBUFS || res == -EAGAIN || res == -EINTR) {
+        if (cx_pause(c) || arm_recv(c) == 0) return;
+    }
+    cx_eof(c);
+    cx_put(c);
+}
+
+static void on_send(uring_cx_t *c, int res) {
+    pthread_mutex_lock(&c->mutex);
+    if (res < 0 && c->send_err == 0) c->send_err = -res;
+    if (--c->sends_pending == 0) pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    cx_put(c);
+}
+
+static void on_file(file_op_t *fop, int res) {
+    pthread_mutex_lock(&fop->mutex);
+    fop->res = res;
+    fop->done = 1;
+    pthread_cond_signal(&fop->cond);
+    pthread_mutex_unlock(&fop->mutex);
+}
+
+static void dispatch(unsigned long user_data, int res, unsigned flags) {
+    uring_op_t *op = (uring_op_t *)user_data;
+    switch (op->type) {
+        case op_accept:
+            on_accept(res, flags);
+            break;
+        case op_recv:
+            on_recv((uring_cx_t *)((char *)op - offsetof(uring_cx_t, recv_op)),
+                    res, flags);
+            break;
+        case op_send:
+            on_send((uring_cx_t *)((char *)op - offsetof(uring_cx_t, send_op)),
+                    res);
+            break;
+        case op_file:
+            on_file((file_op_t *)op, res);
+            break;
+    }
+}
+
+void uring_run(int lsock, void (*server)(uring_cx_t *)) {
+    listen_fd = lsock;
+    serve_cb = server;
+    arm_accept();
+
+    struct __kernel_timespec ts = {0, WAIT_NSEC};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&ts;
+
+    while (1) {
+        pthread_testcancel();
+        unsigned head = *ring.cq_head;
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            // nothing ready; sleep in the kernel, waking up periodically so
+            // that a pending cancellation is noticed
+            sys_enter(0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+            continue;
+        }
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            unsigned long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+            dispatch(user_data, res, flags);
+        }
+    }
+}
+
+// sends the response and its newline in one send, so that with TCP_NODELAY
+// they leave as one segment, then waits for it to complete
+static int cx_send_line(uring_cx_t *c, char *response) {
+    size_t len = strnlen(response, BUFLEN - 1);
+    int ret;
+
+    pthread_mutex_lock(&c->mutex);
+    pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &c->mutex);
+    memcpy(c->obuf, response, len);
+    c->obuf[len++] = '\n';
+    c->send_err = 0;
+
+    pthread_mutex_lock(&ring.sq_mutex);
+    if (sq_reserve(1) == 0) {
+        c->sends_pending = 1;
+        __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+
+        struct io_uring_sqe *sqe = sq_next();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long)c->obuf;
+        sqe->len = len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = (unsigned long)&c->send_op;
+        if (sq_submit() < 0) {
+            c->send_err = errno;
+            c->sends_pending = 0;
+            __atomic_sub_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+            sq_unqueue();
+        }
+    } else {
+        c->send_err = EBUSY;
+    }
+    pthread_mutex_unlock(&ring.sq_mutex);
+
+    while (c->sends_pending > 0) {
+        pthread_cond_wait(&c->cond, &c->mutex);
+    }
+    ret = c->send_err ? -1 : 0;
+    pthread_cleanup_pop(1);
+    return ret;
+}
+
+// fgets() over the received bytes: returns a line of at most size - 1
+// characters, including the newline if there is one
+static int cx_getline(uring_cx_t *c, char *command, size_t size) {
+    int ret = -1;
+    int resume = 0;
+
+    pthread_mutex_lock(&c->mutex);
+    pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &c->mutex);
+    while (1) {
+        size_t max = size - 1;
+        size_t scan = c->ilen < max ? c->ilen : max;
+        char *nl = memchr(c->ibuf, '\n', scan);
+        size_t n = 0;
+        if (nl != NULL) {
+            n = nl - c->ibuf + 1;
+        } else if (c->ilen >= max) {
+            n = max;
+        } else if (c->eof) {
+            n = c->ilen;
+        }
+        if (n > 0) {
+            memcpy(command, c->ibuf, n);
+            command[n] = '\0';
+            memmove(c->ibuf, c->ibuf + n, c->ilen - n);
+            c->ilen -= n;
+            if (max_lines > 0 && nl != NULL) c->lines--;
+            if (c->paused && !over_limit(c)) {
+                c->paused = 0;
+                resume = 1;
+            }
+            ret = 0;
+            break;
+        }
+        if (c->eof) break;
+        pthread_cond_wait(&c->cond, &c->mutex);
+    }
+    pthread_cleanup_pop(1);
+    if (resume && arm_recv(c) < 0) {
+        cx_eof(c);
+        cx_put(c);
+    }
+    return ret;
+}
+
+void uring_pipeline(int commands) { max_lines = commands; }
+
+int uring_serve(uring_cx_t *ucx, char *response, char *command) {
+    if (strlen(response) > 0) {
+        if (cx_send_line(ucx, response) < 0) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+    }
+    TRACE_END(write);
+    trace_request_end();
+
+    if (cx_getline(ucx, command, BUFLEN) < 0) {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void uring_interrupt(uring_cx_t *ucx) {
+    // wakes the armed receive; the fd is closed with the last reference
+    if (shutdown(ucx->fd, SHUT_RDWR) < 0 && errno != ENOTCONN) {
+        perror("shutdown");
+    }
+    // a paused connection has no receive to wake, so drop its reference here
+    pthread_mutex_lock(&ucx->mutex);
+    int paused = ucx->paused;
+    ucx->paused = 0;
+    ucx->closed = 1;
+    if (paused) {
+        ucx->eof = 1;
+        pthread_cond_broadcast(&ucx->cond);
+    }
+    pthread_mutex_unlock(&ucx->mutex);
+    if (paused) cx_put(ucx);
+}
+
+void uring_shutdown(uring_cx_t *ucx) {
+    uring_interrupt(ucx);
+    cx_put(ucx);
+}
+
+static ssize_t file_io(int opcode, int fd, void *buf, size_t len, off_t off) {
+    file_op_t fop;
+    int oldstate;
+    ssize_t ret;
+
+    fop.op.type = op_file;
+    fop.done = 0;
+    pthread_mutex_init(&fop.mutex, 0);
+    pthread_cond_init(&fop.cond, 0);
+
+    // fop lives on this stack until the completion arrives
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&ring.sq_mutex);
+    if (sq_reserve(1) < 0) {
+        pthread_mutex_unlock(&ring.sq_mutex);
+        ret = -1;
+        goto out;
+    }
+    struct io_uring_sqe *sqe = sq_next();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (unsigned long)&fop;
+    if (sq_submit() < 0) {
+        // no completion will come for fop
+        sq_unqueue();
+        pthread_mutex_unlock(&ring.sq_mutex);
+        ret = -1;
+        goto out;
+    }
+    pthread_mutex_unlock(&ring.sq_mutex);
+
+    pthread_mutex_lock(&fop.mutex);
+    while (!fop.done) {
+        pthread_cond_wait(&fop.cond, &fop.mutex);
+    }
+    pthread_mutex_unlock(&fop.mutex);
+    if (fop.res < 0) {
+        errno = -fop.res;
+        ret = -1;
+    } else {
+        ret = fop.res;
+    }
+
+out:
+    pthread_mutex_destroy(&fop.mutex);
+    pthread_cond_destroy(&fop.cond);
+    pthread_setcancelstate(oldstate, NULL);
+    return ret;
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t len, off_t off) {
+    return file_io(IORING_OP_WRITE, fd, (void *)buf, len, off);
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t len, off_t off) {
+    return file_io(IORING_OP_READ, fd, buf, len, off);
+}
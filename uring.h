@@ -0,0 +1,69 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * io_uring I/O engine used by comm.c. A single ring is shared by the whole
+ * server: the listener thread owns it, arms a multishot accept on the
+ * listening socket and reaps every completion. Client threads and the main
+ * thread only submit to it and then sleep until the listener hands them the
+ * result.
+ */
+
+typedef struct uring_cx uring_cx_t;
+
+/**
+ * uring_init() creates the shared ring and registers the provided buffer ring
+ * used for receives. Returns 0 on success and -1 if the kernel does not
+ * support the features the engine needs, in which case the caller should fall
+ * back to stdio.
+ */
+int uring_init(void);
+
+/**
+ * uring_run() arms a multishot accept on lsock and runs the completion loop
+ * in the calling thread. server is called for every new connection. Never
+ * returns; the loop is a cancellation point.
+ */
+void uring_run(int lsock, void (*server)(uring_cx_t *));
+
+/**
+ * uring_pipeline() sets how many commands a connection may have waiting
+ * before its receives pause; see comm_pipeline(). Must be called before
+ * uring_run().
+ */
+void uring_pipeline(int commands);
+
+/**
+ * uring_serve() is the io_uring equivalent of comm_serve(): it sends the
+ * response (if any) followed by a newline in one send, then waits for the
+ * next command line. Returns 0 on success and -1 when the connection is
+ * gone.
+ */
+int uring_serve(uring_cx_t *ucx, char *response, char *command);
+
+/**
+ * uring_shutdown() shuts down the socket so that outstanding receives
+ * complete, and drops the client's reference to the connection.
+ */
+void uring_shutdown(uring_cx_t *ucx);
+
+/**
+ * uring_interrupt() shuts down the socket, so that the client's pending and
+ * later receives and sends fail, but keeps the connection for
+ * uring_shutdown().
+ */
+void uring_interrupt(uring_cx_t *ucx);
+
+/**
+ * uring_pwrite() and uring_pread() perform a file write or read at the given
+ * offset through the shared ring and wait for it to complete. They return the
+ * number of bytes transferred, or -1 with errno set. They must not be called
+ * from the listener thread.
+ */
+ssize_t uring_pwrite(int fd, const void *buf, size_t len, off_t off);
+ssize_t uring_pread(int fd, void *buf, size_t len, off_t off);
+
+#endif  // URING_H_
@@ -0,0 +1,273 @@
+#include "./vindex.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+#include "./hash.h"
+#include "./mvcc.h"
+
+/*
+ * A hash table of values, each bucket a chain under its own mutex. A value's
+ * entry keeps its keys in a sorted array searched by halving; adding or
+ * removing a key moves the ones after it, which for the few thousand keys
+ * the commonest values have is cheaper than a tree's allocations and
+ * pointer chasing. The entry goes with its last key.
+ *
+ * Writes to one key are ordered by VINDEX_STRIPES mutexes picked by the
+ * key's hash, as repl.c orders its log.
+ */
+
+#define VINDEX_STRIPES 256
+#define VINDEX_MIN_KEYS 4  // slots of a new entry's key array
+
+typedef struct ventry {
+    char **keys;  // sorted
+    int nkeys;
+    int cap;
+    struct ventry *next;
+    char value[];
+} ventry_t;
+
+typedef struct vbucket {
+    pthread_mutex_t lock;
+    ventry_t *entries;
+} vbucket_t;
+
+int vindex_enabled;
+
+static vbucket_t *buckets;
+static unsigned long nbuckets;  // a power of two
+static pthread_mutex_t stripes[VINDEX_STRIPES];
+static long nvalues;  // indexed now
+static long nkeys;
+static unsigned long lookups;
+static unsigned long listed;  // keys returned by lookups
+
+static inline void vi_lock(pthread_mutex_t *m) {
+    int err = pthread_mutex_lock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void vi_unlock(pthread_mutex_t *m) {
+    int err = pthread_mutex_unlock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static char *vi_strdup(const char *s) {
+    char *p;
+    if ((p = strdup(s)) == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    return p;
+}
+
+static void index_key(const char *name, const char *value, void *arg) {
+    vindex_change(name, NULL, value);
+}
+
+void vindex_init(long values) {
+    int err;
+    if (values <= 0) return;
+    for (nbuckets = 1; nbuckets < (unsigned long)values; nbuckets <<= 1) {
+    }
+    if ((buckets = calloc(nbuckets, sizeof(vbucket_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (unsigned long i = 0; i < nbuckets; i++) {
+        if ((err = pthread_mutex_init(&buckets[i].lock, 0)) != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    for (int i = 0; i < VINDEX_STRIPES; i++) {
+        if ((err = pthread_mutex_init(&stripes[i], 0)) != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    vindex_enabled = 1;
+    // a store opened from a file may hold keys already
+    mvcc_scan(index_key, NULL);
+}
+
+void vindex_shutdown(void) {
+    if (!vindex_enabled) return;
+    vindex_enabled = 0;
+    for (unsigned long i = 0; i < nbuckets; i++) {
+        ventry_t *e = buckets[i].entries;
+        while (e != NULL) {
+            ventry_t *next = e->next;
+            for (int k = 0; k < e->nkeys; k++) free(e->keys[k]);
+            free(e->keys);
+            free(e);
+            e = next;
+        }
+        pthread_mutex_destroy(&buckets[i].lock);
+    }
+    free(buckets);
+    buckets = NULL;
+}
+
+unsigned vindex_lock(const char *name) {
+    unsigned h = hash_str(name) & (VINDEX_STRIPES - 1);
+    vi_lock(&stripes[h]);
+    return h;
+}
+
+void vindex_unlock(unsigned stripe) { vi_unlock(&stripes[stripe]); }
+
+static inline vbucket_t *bucket_of(const char *value) {
+    return &buckets[hash_str(value) & (nbuckets - 1)];
+}
+
+// returns the link to value's entry in b, pointing to NULL if there is none
+static ventry_t **find(vbucket_t *b, const char *value) {
+    ventry_t **pp = &b->entries;
+    while (*pp != NULL && strcmp((*pp)->value, value) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+// returns the position of the first of e's keys not before name
+static int key_pos(ventry_t *e, const char *name) {
+    int lo = 0, hi = e->nkeys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(e->keys[mid], name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void insert(const char *name, const char *value) {
+    vbucket_t *b = bucket_of(value);
+    char *key = vi_strdup(name);
+    vi_lock(&b->lock);
+    ventry_t **pp = find(b, value);
+    ventry_t *e = *pp;
+    if (e == NULL) {
+        size_t vlen = strlen(value) + 1;
+        if ((e = malloc(sizeof(ventry_t) + vlen)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        e->keys = NULL;
+        e->nkeys = e->cap = 0;
+        e->next = NULL;
+        memcpy(e->value, value, vlen);
+        *pp = e;
+        __atomic_add_fetch(&nvalues, 1, __ATOMIC_RELAXED);
+    }
+    int i = key_pos(e, name);
+    if (i < e->nkeys && strcmp(e->keys[i], name) == 0) {
+        vi_unlock(&b->lock);
+        free(key);
+        return;
+    }
+    if (e->nkeys == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : VINDEX_MIN_KEYS;
+        if ((e->keys = realloc(e->keys, e->cap * sizeof(char *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memmove(&e->keys[i + 1], &e->keys[i], (e->nkeys - i) * sizeof(char *));
+    e->keys[i] = key;
+    e->nkeys++;
+    vi_unlock(&b->lock);
+    __atomic_add_fetch(&nkeys, 1, __ATOMIC_RELAXED);
+}
+
+static void drop(const char *name, const char *value) {
+    vbucket_t *b = bucket_of(value);
+    char *key = NULL;
+    vi_lock(&b->lock);
+    ventry_t **pp = find(b, value);
+    ventry_t *e = *pp;
+    if (e == NULL) {
+        vi_unlock(&b->lock);
+        return;
+    }
+    int i = key_pos(e, name);
+    if (i < e->nkeys && strcmp(e->keys[i], name) == 0) {
+        key = e->keys[i];
+        e->nkeys--;
+        memmove(&e->keys[i], &e->keys[i + 1], (e->nkeys - i) * sizeof(char *));
+    }
+    if (e->nkeys == 0) {
+        *pp = e->next;
+    } else {
+        e = NULL;
+    }
+    vi_unlock(&b->lock);
+    if (key == NULL) return;
+    free(key);
+    __atomic_sub_fetch(&nkeys, 1, __ATOMIC_RELAXED);
+    if (e != NULL) {
+        free(e->keys);
+        free(e);
+        __atomic_sub_fetch(&nvalues, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void vindex_change(const char *name, const char *old, const char *value) {
+    if (!vindex_enabled) return;
+    if (old != NULL && value != NULL && strcmp(old, value) == 0) return;
+    if (old != NULL) drop(name, old);
+    if (value != NULL) insert(name, value);
+}
+
+int vindex_keys(const char *value, const char *after, char *out, int len,
+                int *more) {
+    vbucket_t *b = bucket_of(value);
+    int n = 0, used = 0;
+    *more = 0;
+    vi_lock(&b->lock);
+    ventry_t *e = *find(b, value);
+    if (e != NULL) {
+        int i = 0;
+        if (after != NULL) {
+            i = key_pos(e, after);
+            if (i < e->nkeys && strcmp(e->keys[i], after) == 0) i++;
+        }
+        for (; i < e->nkeys; i++) {
+            int klen = strlen(e->keys[i]);
+            // the key, a space before it unless first, and the NUL
+            if (used + (n > 0) + klen + 1 > len) {
+                *more = 1;
+                break;
+            }
+            if (n > 0) out[used++] = ' ';
+            memcpy(out + used, e->keys[i], klen);
+            used += klen;
+            n++;
+        }
+    }
+    vi_unlock(&b->lock);
+    if (len > 0) out[used] = '\0';
+    __atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&listed, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+void vindex_report(FILE *out) {
+    if (!vindex_enabled) {
+        fprintf(out, "value index off\n");
+        return;
+    }
+    long v = __atomic_load_n(&nvalues, __ATOMIC_RELAXED);
+    long k = __atomic_load_n(&nkeys, __ATOMIC_RELAXED);
+    fprintf(out,
+            "value index: %ld keys under %ld values in %lu buckets (%.1f "
+            "keys per value); %lu lookups listed %lu keys\n",
+            k, v, nbuckets, v > 0 ? (double)k / v : 0.0,
+            __atomic_load_n(&lookups, __ATOMIC_RELAXED),
+            __atomic_load_n(&listed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,59 @@
+#ifndef VINDEX_H_
+#define VINDEX_H_
+
+#include <stdio.h>
+
+/*
+ * Secondary index from values to the keys that hold them, for the 'v'
+ * command. It is kept by the layer that writes the engine (mvcc.c): each
+ * write that changes a key's value moves the key from its old value's set
+ * to its new one's, while writes to that key are held off, so the index
+ * always matches the engine once a write returns. A value's keys are kept
+ * in key order, so a lookup can resume after the last key it returned.
+ */
+
+// set once vindex_init() has built an index
+extern int vindex_enabled;
+
+/**
+ * vindex_init() sizes the index for about values distinct values and
+ * indexes the keys the store already holds, so it must follow db_init().
+ * With 0 there is no index.
+ */
+void vindex_init(long values);
+
+/**
+ * vindex_shutdown() frees the index. No other thread may be using it.
+ */
+void vindex_shutdown(void);
+
+/**
+ * vindex_lock() and vindex_unlock() bracket a write and its vindex_change()
+ * so that changes to one key reach the index in the order they reached the
+ * engine, and the old value a writer read is still the key's. Writers that
+ * already exclude each other per key need not take them. vindex_lock()
+ * returns the lock to pass to vindex_unlock().
+ */
+unsigned vindex_lock(const char *name);
+void vindex_unlock(unsigned stripe);
+
+/**
+ * vindex_change() records that name's value went from old to value, either
+ * NULL if the key was or is now absent. Does nothing without an index.
+ */
+void vindex_change(const char *name, const char *old, const char *value);
+
+/**
+ * vindex_keys() writes the keys holding value that sort after after (all of
+ * them if it is NULL) into out, separated by spaces, as many as fit in len
+ * bytes. Returns how many were written; *more is set if there are others.
+ */
+int vindex_keys(const char *value, const char *after, char *out, int len,
+                int *more);
+
+/**
+ * vindex_report() prints the index's size and how much it was used.
+ */
+void vindex_report(FILE *out);
+
+#endif  // VINDEX_H_
@@ -0,0 +1,368 @@
+#include "./vlog.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+
+/*
+ * A reference is the slot of its segment in a process-wide table (slot 0 is
+ * never used, so VLOG_NONE refers to nothing) and the record's offset in it.
+ * Appenders claim space in the current segment with one atomic add and copy
+ * the record in; the first one whose record does not fit seals the segment
+ * where the records end, and whoever then takes the log's mutex first maps
+ * the next one. A sealed segment is complete once the bytes written reach
+ * its end.
+ *
+ * Each segment counts the bytes of its records still referenced, and a
+ * record that is freed is also flagged dead, so the collector only offers
+ * the live ones to the owner. Once a segment counts none it is unmapped and
+ * its file removed. Only the collector takes segments off a log's list, and
+ * only appenders add them, at the end.
+ */
+
+#define VLOG_SEGMENT (4 << 20)  // bytes per segment file
+#define VLOG_SLOTS 4096         // segments of all logs together
+#define VLOG_GC_MS 100          // between collector passes
+#define VLOG_GC_LIVE 50         // % live under which a segment is rewritten
+
+#define REC_DEAD 1
+
+// a record; the key and the value follow, each NUL-terminated, and the
+// whole is padded to a multiple of 8 bytes
+typedef struct rec {
+    uint16_t key_len;
+    uint16_t flags;
+    uint32_t value_len;
+} rec_t;
+
+typedef struct seg {
+    char *base;
+    char *path;
+    unsigned slot;
+    int sealed;
+    uint64_t tail;     // bytes claimed; past VLOG_SEGMENT once full
+    uint64_t end;      // where the records end, once sealed
+    uint64_t written;  // bytes of complete records
+    int64_t live;      // bytes of records still referenced
+    struct seg *next;  // in its log, oldest first
+} seg_t;
+
+struct vlog {
+    vlog_relocate_fn relocate;
+    void *owner;
+    const char *dir;
+    seg_t *oldest;
+    seg_t *current;  // the newest, appended to
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    pthread_t collector;
+    unsigned long appended;   // bytes
+    unsigned long collected;  // segments dropped
+    unsigned long moved;      // records rewritten by the collector
+    struct vlog *next;        // in the list of open logs
+};
+
+static const char *vlog_dir = "vlog";
+static seg_t *slots[VLOG_SLOTS];
+static vlog_t *logs;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;  // and logs
+
+void vlog_config(const char *dir) { vlog_dir = dir != NULL ? dir : "vlog"; }
+
+static inline void vl_lock(pthread_mutex_t *m) {
+    int err = pthread_mutex_lock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static inline void vl_unlock(pthread_mutex_t *m) {
+    int err = pthread_mutex_unlock(m);
+    if (err != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static inline uint64_t rec_size(size_t key_len, size_t value_len) {
+    return (sizeof(rec_t) + key_len + value_len + 2 + 7) & ~7ULL;
+}
+
+static inline rec_t *rec_of(vlog_ref_t ref) {
+    return (rec_t *)(slots[ref >> 32]->base + (uint32_t)ref);
+}
+
+static void slot_release(unsigned slot) {
+    vl_lock(&slots_lock);
+    slots[slot] = NULL;
+    vl_unlock(&slots_lock);
+}
+
+// maps a new segment file in dir; NULL if out of slots or the file fails
+static seg_t *seg_new(const char *dir) {
+    seg_t *s = calloc(1, sizeof(seg_t));
+    if (s == NULL || (s->path = malloc(strlen(dir) + 16)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    vl_lock(&slots_lock);
+    for (unsigned i = 1; i < VLOG_SLOTS; i++) {
+        if (slots[i] == NULL) {
+            slots[i] = s;
+            s->slot = i;
+            break;
+        }
+    }
+    vl_unlock(&slots_lock);
+    if (s->slot == 0) {
+        fprintf(stderr, "value log: out of segments\n");
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+
+    sprintf(s->path, "%s/seg-XXXXXX", dir);
+    int fd = mkstemp(s->path);
+    if (fd < 0 || ftruncate(fd, VLOG_SEGMENT) < 0 ||
+        (s->base = mmap(NULL, VLOG_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0)) == MAP_FAILED) {
+        perror(s->path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(s->path);
+        }
+        slot_release(s->slot);
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+    close(fd);  // the mapping keeps the file open
+    return s;
+}
+
+static void seg_drop(seg_t *s) {
+    if (munmap(s->base, VLOG_SEGMENT) < 0) perror("munmap");
+    if (unlink(s->path) < 0) perror(s->path);
+    slot_release(s->slot);
+    free(s->path);
+    free(s);
+}
+
+// replaces the full segment s as the one appended to, unless someone has;
+// returns -1 if there is no new one
+static int roll(vlog_t *log, seg_t *s) {
+    int ret = 0;
+    vl_lock(&log->lock);
+    if (log->current == s) {
+        seg_t *n = seg_new(log->dir);
+        if (n == NULL) {
+            ret = -1;
+        } else {
+            __atomic_store_n(&s->next, n, __ATOMIC_RELEASE);
+            __atomic_store_n(&log->current, n, __ATOMIC_RELEASE);
+        }
+    }
+    vl_unlock(&log->lock);
+    return ret;
+}
+
+int vlog_append(vlog_t *log, const char *name, const char *value,
+                vlog_ref_t *ref) {
+    size_t key_len = strlen(name), value_len = strlen(value);
+    uint64_t size = rec_size(key_len, value_len);
+    if (key_len > UINT16_MAX || size > VLOG_SEGMENT) return -1;
+    while (1) {
+        seg_t *s = __atomic_load_n(&log->current, __ATOMIC_ACQUIRE);
+        uint64_t off = __atomic_fetch_add(&s->tail, size, __ATOMIC_RELAXED);
+        if (off + size <= VLOG_SEGMENT) {
+            rec_t *r = (rec_t *)(s->base + off);
+            r->key_len = key_len;
+            r->flags = 0;
+            r->value_len = value_len;
+            memcpy(r + 1, name, key_len + 1);
+            memcpy((char *)(r + 1) + key_len + 1, value, value_len + 1);
+            __atomic_add_fetch(&s->live, size, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&s->written, size, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&log->appended, size, __ATOMIC_RELAXED);
+            *ref = (uint64_t)s->slot << 32 | off;
+            return 0;
+        }
+        if (off <= VLOG_SEGMENT) {
+            // the first record that does not fit ends the segment
+            s->end = off;
+            __atomic_store_n(&s->sealed, 1, __ATOMIC_RELEASE);
+        }
+        if (roll(log, s) < 0) return -1;
+    }
+}
+
+const char *vlog_value(vlog_ref_t ref, size_t *len) {
+    rec_t *r = rec_of(ref);
+    if (len != NULL) *len = r->value_len;
+    return (const char *)(r + 1) + r->key_len + 1;
+}
+
+void vlog_free(vlog_ref_t ref) {
+    if (ref == VLOG_NONE) return;
+    seg_t *s = slots[ref >> 32];
+    rec_t *r = (rec_t *)(s->base + (uint32_t)ref);
+    __atomic_store_n(&r->flags, REC_DEAD, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&s->live, rec_size(r->key_len, r->value_len),
+                       __ATOMIC_RELEASE);
+}
+
+// offers the owner every record of s not yet dead; -1 if one failed to move
+static int collect(vlog_t *log, seg_t *s) {
+    uint64_t off = 0;
+    while (off < s->end) {
+        rec_t *r = (rec_t *)(s->base + off);
+        if (!(__atomic_load_n(&r->flags, __ATOMIC_RELAXED) & REC_DEAD)) {
+            vlog_ref_t ref = (uint64_t)s->slot << 32 | off;
+            if (log->relocate(log->owner, (char *)(r + 1), ref) < 0) {
+                return -1;
+            }
+            __atomic_add_fetch(&log->moved, 1, __ATOMIC_RELAXED);
+        }
+        off += rec_size(r->key_len, r->value_len);
+    }
+    return 0;
+}
+
+// one pass over the sealed segments, oldest first
+static void collect_pass(vlog_t *log) {
+    seg_t *prev = NULL;
+    seg_t *s = log->oldest;
+    while (s != __atomic_load_n(&log->current, __ATOMIC_ACQUIRE)) {
+        seg_t *next = __atomic_load_n(&s->next, __ATOMIC_ACQUIRE);
+        // sealed, as it is not the current one, but maybe still being filled
+        if (!__atomic_load_n(&s->sealed, __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&s->written, __ATOMIC_ACQUIRE) != s->end) {
+            break;
+        }
+        int64_t live = __atomic_load_n(&s->live, __ATOMIC_ACQUIRE);
+        if (live > 0 && live * 100 < (int64_t)s->end * VLOG_GC_LIVE) {
+            collect(log, s);
+            live = __atomic_load_n(&s->live, __ATOMIC_ACQUIRE);
+        }
+        if (live == 0) {
+            vl_lock(&log->lock);
+            if (prev == NULL) {
+                log->oldest = next;
+            } else {
+                prev->next = next;
+            }
+            vl_unlock(&log->lock);
+            seg_drop(s);
+            __atomic_add_fetch(&log->collected, 1, __ATOMIC_RELAXED);
+        } else {
+            prev = s;
+        }
+        s = next;
+    }
+}
+
+static void *collect_loop(void *arg) {
+    vlog_t *log = (vlog_t *)arg;
+    while (1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += VLOG_GC_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        vl_lock(&log->lock);
+        if (!log->stop) pthread_cond_timedwait(&log->wake, &log->lock, &ts);
+        int stop = log->stop;
+        vl_unlock(&log->lock);
+        if (stop) break;
+        collect_pass(log);
+    }
+    return NULL;
+}
+
+vlog_t *vlog_open(vlog_relocate_fn relocate, void *owner) {
+    vlog_t *log = calloc(1, sizeof(vlog_t));
+    if (log == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (mkdir(vlog_dir, 0755) < 0 && errno != EEXIST) {
+        perror(vlog_dir);
+        exit(1);
+    }
+    log->relocate = relocate;
+    log->owner = owner;
+    log->dir = vlog_dir;
+    if ((log->current = log->oldest = seg_new(log->dir)) == NULL) exit(1);
+    pthread_mutex_init(&log->lock, 0);
+    pthread_cond_init(&log->wake, 0);
+    vl_lock(&slots_lock);
+    log->next = logs;
+    logs = log;
+    vl_unlock(&slots_lock);
+    int err = pthread_create(&log->collector, 0, collect_loop, log);
+    if (err != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    return log;
+}
+
+void vlog_close(vlog_t *log) {
+    vl_lock(&log->lock);
+    log->stop = 1;
+    pthread_cond_signal(&log->wake);
+    vl_unlock(&log->lock);
+    int err = pthread_join(log->collector, 0);
+    if (err != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+
+    vl_lock(&slots_lock);
+    vlog_t **pp = &logs;
+    while (*pp != log) pp = &(*pp)->next;
+    *pp = log->next;
+    vl_unlock(&slots_lock);
+    seg_t *s = log->oldest;
+    while (s != NULL) {
+        seg_t *next = s->next;
+        seg_drop(s);
+        s = next;
+    }
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    free(log);
+}
+
+void vlog_report(FILE *out) {
+    vl_lock(&slots_lock);
+    if (logs == NULL) fprintf(out, "no value log\n");
+    for (vlog_t *log = logs; log != NULL; log = log->next) {
+        unsigned long segments = 0;
+        int64_t live = 0;
+        uint64_t used = 0;
+        vl_lock(&log->lock);
+        for (seg_t *s = log->oldest; s != NULL; s = s->next) {
+            uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+            segments++;
+            live += __atomic_load_n(&s->live, __ATOMIC_RELAXED);
+            used += tail < VLOG_SEGMENT ? tail : VLOG_SEGMENT;
+        }
+        vl_unlock(&log->lock);
+        fprintf(out,
+                "value log in %s: %lu segments of %d MB, %.1f MB used, %.1f "
+                "MB live; %.1f MB appended, %lu segments collected, %lu "
+                "records moved\n",
+                log->dir, segments, VLOG_SEGMENT >> 20, used / 1048576.0,
+                live / 1048576.0,
+                __atomic_load_n(&log->appended, __ATOMIC_RELAXED) / 1048576.0,
+                __atomic_load_n(&log->collected, __ATOMIC_RELAXED),
+                __atomic_load_n(&log->moved, __ATOMIC_RELAXED));
+    }
+    vl_unlock(&slots_lock);
+}
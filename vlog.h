@@ -0,0 +1,80 @@
+#ifndef VLOG_H_
+#define VLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Append-only value log, for engines that keep only keys and references in
+ * their index (WiscKey's key-value separation). A log is a list of
+ * fixed-size segment files mapped into memory; values are read in place
+ * from the mapping, so the kernel can page cold ones out. A background
+ * collector rewrites the records still in use out of segments that are
+ * mostly garbage, through the owner's relocate function, and then drops
+ * them.
+ *
+ * The owner must hold a reference only while it can be relocated, and read
+ * a value only under the same lock its relocate function takes: a segment
+ * is dropped once none of its records is referenced, with no grace period.
+ */
+
+// a record in the log; VLOG_NONE refers to none
+typedef uint64_t vlog_ref_t;
+#define VLOG_NONE 0
+
+typedef struct vlog vlog_t;
+
+/*
+ * Called by the collector for a record it is about to drop, with the key it
+ * was appended with. If the owner still refers to ref for name it appends
+ * the value again with vlog_append(), switches to the new reference and
+ * frees ref. Returns 0, or -1 if the record could not be moved, which leaves
+ * its segment for a later pass.
+ */
+typedef int (*vlog_relocate_fn)(void *owner, const char *name, vlog_ref_t ref);
+
+/**
+ * vlog_config() sets the directory the segments are made in (NULL for the
+ * default, "vlog"); a log uses the one set when it is opened.
+ */
+void vlog_config(const char *dir);
+
+/**
+ * vlog_open() starts an empty log and its collector, which relocates records
+ * through relocate(owner, ...).
+ */
+vlog_t *vlog_open(vlog_relocate_fn relocate, void *owner);
+
+/**
+ * vlog_close() stops the collector and deletes the log. References into it
+ * must not be used afterwards, not even freed.
+ */
+void vlog_close(vlog_t *log);
+
+/**
+ * vlog_append() appends value, with the name of its key, and stores its
+ * reference in *ref. Returns 0, or -1 if the log has no room for it.
+ */
+int vlog_append(vlog_t *log, const char *name, const char *value,
+                vlog_ref_t *ref);
+
+/**
+ * vlog_value() returns the NUL-terminated value of a record, in place in
+ * the log, and stores its length in *len unless len is NULL.
+ */
+const char *vlog_value(vlog_ref_t ref, size_t *len);
+
+/**
+ * vlog_free() marks a record as no longer referenced, so the collector can
+ * reclaim its space. VLOG_NONE is ignored.
+ */
+void vlog_free(vlog_ref_t ref);
+
+/**
+ * vlog_report() prints the size of every open log, how much of it is live
+ * and what the collector has done.
+ */
+void vlog_report(FILE *out);
+
+#endif  // VLOG_H_